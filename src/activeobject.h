@@ -46,12 +46,21 @@ struct ActiveObjectMessage
 	ActiveObjectMessage(u16 id_, bool reliable_=true, std::string data_=""):
 		id(id_),
 		reliable(reliable_),
-		datastring(data_)
+		datastring(data_),
+		skippable(false),
+		skip_seq(0)
 	{}
 
 	u16 id;
 	bool reliable;
 	std::string datastring;
+	/*
+		Position updates that clients far away may go without, because
+		a later update sets the position again. They are numbered per
+		object so that clients at the same distance get the same ones.
+	*/
+	bool skippable;
+	u32 skip_seq;
 };
 
 /*
@@ -59,7 +59,9 @@ extern gui::IGUIEnvironment* guienv;
 QueuedMeshUpdate::QueuedMeshUpdate():
 	p(-1337,-1337,-1337),
 	data(NULL),
-	ack_block_to_server(false)
+	ack_block_to_server(false),
+	urgent(false),
+	priority(0)
 {
 }
 
@@ -73,7 +75,18 @@ QueuedMeshUpdate::~QueuedMeshUpdate()
 	MeshUpdateQueue
 */
 
-MeshUpdateQueue::MeshUpdateQueue()
+static bool queued_mesh_update_less_important(QueuedMeshUpdate *a,
+		QueuedMeshUpdate *b)
+{
+	return a->priority > b->priority;
+}
+
+MeshUpdateQueue::MeshUpdateQueue():
+	m_heap_outdated(false),
+	m_camera_pos(0,0,0),
+	m_camera_dir(0,0,1),
+	m_heap_camera_block(0,0,0),
+	m_heap_camera_dir(0,0,1)
 {
 }
 
@@ -81,11 +94,12 @@ MeshUpdateQueue::~MeshUpdateQueue()
 {
 	JMutexAutoLock lock(m_mutex);
 
-	for(std::vector<QueuedMeshUpdate*>::iterator
+	// m_heap holds a subset of these
+	for(std::map<v3s16, QueuedMeshUpdate*>::iterator
 			i = m_queue.begin();
 			i != m_queue.end(); i++)
 	{
-		QueuedMeshUpdate *q = *i;
+		QueuedMeshUpdate *q = i->second;
 		delete q;
 	}
 }
@@ -101,27 +115,24 @@ void MeshUpdateQueue::addBlock(v3s16 p, MeshMakeData *data, bool ack_block_to_se
 
 	JMutexAutoLock lock(m_mutex);
 
-	if(urgent)
-		m_urgents.insert(p);
-
 	/*
 		Find if block is already in queue.
 		If it is, update the data and quit.
 	*/
-	for(std::vector<QueuedMeshUpdate*>::iterator
-			i = m_queue.begin();
-			i != m_queue.end(); i++)
+	std::map<v3s16, QueuedMeshUpdate*>::iterator i = m_queue.find(p);
+	if(i != m_queue.end())
 	{
-		QueuedMeshUpdate *q = *i;
-		if(q->p == p)
-		{
-			if(q->data)
-				delete q->data;
-			q->data = data;
-			if(ack_block_to_server)
-				q->ack_block_to_server = true;
-			return;
+		QueuedMeshUpdate *q = i->second;
+		if(q->data)
+			delete q->data;
+		q->data = data;
+		if(ack_block_to_server)
+			q->ack_block_to_server = true;
+		if(urgent && !q->urgent) {
+			q->urgent = true;
+			m_heap_outdated = true;
 		}
+		return;
 	}
 
 	/*
@@ -131,7 +142,22 @@ void MeshUpdateQueue::addBlock(v3s16 p, MeshMakeData *data, bool ack_block_to_se
 	q->p = p;
 	q->data = data;
 	q->ack_block_to_server = ack_block_to_server;
-	m_queue.push_back(q);
+	q->urgent = urgent;
+	q->priority = getPriority(p, urgent);
+	m_queue[p] = q;
+
+	/*
+		If the block is being meshed, hold the update back until that
+		is done, so that its mesh can't be finished first
+	*/
+	if(m_in_progress.find(p) != m_in_progress.end())
+		return;
+
+	m_heap.push_back(q);
+	std::push_heap(m_heap.begin(), m_heap.end(),
+			queued_mesh_update_less_important);
+
+	m_added.Post();
 }
 
 // Returned pointer must be deleted
@@ -140,19 +166,79 @@ QueuedMeshUpdate * MeshUpdateQueue::pop()
 {
 	JMutexAutoLock lock(m_mutex);
 
-	bool must_be_urgent = !m_urgents.empty();
-	for(std::vector<QueuedMeshUpdate*>::iterator
-			i = m_queue.begin();
-			i != m_queue.end(); i++)
+	if(m_heap.empty())
+		return NULL;
+
+	/*
+		Reorder if the camera has moved to another block or turned
+		noticeably since the priorities were calculated
+	*/
+	v3s16 camera_block = getNodeBlockPos(floatToInt(m_camera_pos, BS));
+	if(m_heap_outdated || camera_block != m_heap_camera_block ||
+			m_camera_dir.dotProduct(m_heap_camera_dir) < 0.9)
 	{
-		QueuedMeshUpdate *q = *i;
-		if(must_be_urgent && m_urgents.count(q->p) == 0)
-			continue;
-		m_queue.erase(i);
-		m_urgents.erase(q->p);
-		return q;
+		m_heap_camera_block = camera_block;
+		m_heap_camera_dir = m_camera_dir;
+		for(std::vector<QueuedMeshUpdate*>::iterator
+				i = m_heap.begin();
+				i != m_heap.end(); i++)
+		{
+			QueuedMeshUpdate *q = *i;
+			q->priority = getPriority(q->p, q->urgent);
+		}
+		std::make_heap(m_heap.begin(), m_heap.end(),
+				queued_mesh_update_less_important);
+		m_heap_outdated = false;
 	}
-	return NULL;
+
+	std::pop_heap(m_heap.begin(), m_heap.end(),
+			queued_mesh_update_less_important);
+	QueuedMeshUpdate *q = m_heap.back();
+	m_heap.pop_back();
+	m_queue.erase(q->p);
+	m_in_progress.insert(q->p);
+	return q;
+}
+
+void MeshUpdateQueue::done(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	m_in_progress.erase(p);
+
+	// Release an update that was held back by addBlock()
+	std::map<v3s16, QueuedMeshUpdate*>::iterator i = m_queue.find(p);
+	if(i == m_queue.end())
+		return;
+	QueuedMeshUpdate *q = i->second;
+	q->priority = getPriority(p, q->urgent);
+	m_heap.push_back(q);
+	std::push_heap(m_heap.begin(), m_heap.end(),
+			queued_mesh_update_less_important);
+
+	m_added.Post();
+}
+
+void MeshUpdateQueue::setCamera(v3f pos, v3f dir)
+{
+	JMutexAutoLock lock(m_mutex);
+	m_camera_pos = pos;
+	m_camera_dir = dir;
+}
+
+f32 MeshUpdateQueue::getPriority(v3s16 p, bool urgent)
+{
+	if(urgent)
+		return -1;
+
+	// Distance in blocks, weighted by up to two times for blocks that
+	// are off to the side of or behind the camera
+	v3f d = intToFloat(p - m_heap_camera_block, 1);
+	f32 distance = d.getLength();
+	if(distance < 0.5)
+		return 0;
+	f32 facing = m_heap_camera_dir.dotProduct(d / distance);
+	return distance * (1.5 - 0.5 * facing);
 }
 
 /*
@@ -173,16 +259,17 @@ void * MeshUpdateThread::Thread()
 
 	while(!StopRequested())
 	{
-		QueuedMeshUpdate *q = m_queue_in.pop();
+		QueuedMeshUpdate *q = m_manager->m_queue_in.pop();
 		if(q == NULL)
 		{
-			sleep_ms(3);
+			m_manager->m_queue_in.wait(100);
 			continue;
 		}
 
 		ScopeProfiler sp(g_profiler, "Client: Mesh making");
 
-		MapBlockMesh *mesh_new = new MapBlockMesh(q->data, m_camera_offset);
+		MapBlockMesh *mesh_new = new MapBlockMesh(q->data,
+				m_manager->m_camera_offset);
 		if(mesh_new->getMesh()->getMeshBufferCount() == 0)
 		{
 			delete mesh_new;
@@ -194,7 +281,11 @@ void * MeshUpdateThread::Thread()
 		r.mesh = mesh_new;
 		r.ack_block_to_server = q->ack_block_to_server;
 
-		m_queue_out.push_back(r);
+		m_manager->m_queue_out.push_back(r);
+
+		// Only now may another thread take a new update of the block, so
+		// that its result comes after this one
+		m_manager->m_queue_in.done(q->p);
 
 		delete q;
 	}
@@ -204,6 +295,64 @@ void * MeshUpdateThread::Thread()
 	return NULL;
 }
 
+/*
+	MeshUpdateManager
+*/
+
+MeshUpdateManager::MeshUpdateManager(IGameDef *gamedef):
+	m_gamedef(gamedef)
+{
+}
+
+MeshUpdateManager::~MeshUpdateManager()
+{
+	stopThreads();
+	waitThreads();
+	for(size_t i = 0; i < m_threads.size(); i++)
+		delete m_threads[i];
+}
+
+void MeshUpdateManager::startThreads()
+{
+	if(m_threads.empty()) {
+		// 0 = one less than the number of processors, at least one
+		s32 nthreads = g_settings->getU16("num_mesh_threads");
+		if(nthreads == 0)
+			nthreads = porting::getNumberOfProcessors() - 1;
+		nthreads = MYMAX(nthreads, 1);
+		infostream<<"MeshUpdateManager: using "<<nthreads
+				<<" mesh update threads"<<std::endl;
+		for(s32 i = 0; i < nthreads; i++)
+			m_threads.push_back(new MeshUpdateThread(this));
+	}
+
+	for(size_t i = 0; i < m_threads.size(); i++)
+		m_threads[i]->Start();
+}
+
+void MeshUpdateManager::stopThreads()
+{
+	for(size_t i = 0; i < m_threads.size(); i++)
+		m_threads[i]->Stop();
+	// Wake up the threads waiting for work
+	for(size_t i = 0; i < m_threads.size(); i++)
+		m_queue_in.signal();
+}
+
+void MeshUpdateManager::waitThreads()
+{
+	for(size_t i = 0; i < m_threads.size(); i++)
+		m_threads[i]->Wait();
+}
+
+bool MeshUpdateManager::isRunning()
+{
+	for(size_t i = 0; i < m_threads.size(); i++)
+		if(m_threads[i]->IsRunning())
+			return true;
+	return false;
+}
+
 /*
 	Client
 */
@@ -232,7 +381,7 @@ Client::Client(
 	m_nodedef(nodedef),
 	m_sound(sound),
 	m_event(event),
-	m_mesh_update_thread(this),
+	m_mesh_update_manager(this),
 	m_env(
 		new ClientMap(this, this, control,
 			device->getSceneManager()->getRootSceneNode(),
@@ -279,7 +428,7 @@ Client::Client(
 void Client::Stop()
 {
 	//request all client managed threads to stop
-	m_mesh_update_thread.Stop();
+	m_mesh_update_manager.stopThreads();
 	// Save local server map
 	if (m_localdb) {
 		infostream << "Local map saving ended." << std::endl;
@@ -290,7 +439,7 @@ void Client::Stop()
 bool Client::isShutdown()
 {
 
-	if (!m_mesh_update_thread.IsRunning()) return true;
+	if (!m_mesh_update_manager.isRunning()) return true;
 
 	return false;
 }
@@ -299,10 +448,10 @@ Client::~Client()
 {
 	m_con.Disconnect();
 
-	m_mesh_update_thread.Stop();
-	m_mesh_update_thread.Wait();
-	while(!m_mesh_update_thread.m_queue_out.empty()) {
-		MeshUpdateResult r = m_mesh_update_thread.m_queue_out.pop_frontNoEx();
+	m_mesh_update_manager.stopThreads();
+	m_mesh_update_manager.waitThreads();
+	while(!m_mesh_update_manager.m_queue_out.empty()) {
+		MeshUpdateResult r = m_mesh_update_manager.m_queue_out.pop_frontNoEx();
 		delete r.mesh;
 	}
 
@@ -530,10 +679,10 @@ void Client::step(float dtime)
 	*/
 	{
 		int num_processed_meshes = 0;
-		while(!m_mesh_update_thread.m_queue_out.empty())
+		while(!m_mesh_update_manager.m_queue_out.empty())
 		{
 			num_processed_meshes++;
-			MeshUpdateResult r = m_mesh_update_thread.m_queue_out.pop_frontNoEx();
+			MeshUpdateResult r = m_mesh_update_manager.m_queue_out.pop_frontNoEx();
 			MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(r.p);
 			if(block) {
 				// Delete the old mesh
@@ -562,6 +711,9 @@ void Client::step(float dtime)
 
 		if(num_processed_meshes > 0)
 			g_profiler->graphAdd("num_processed_meshes", num_processed_meshes);
+		g_profiler->avg("Client: meshes received per step", num_processed_meshes);
+		g_profiler->avg("Client: mesh update queue size",
+				m_mesh_update_manager.m_queue_in.size());
 	}
 
 	/*
@@ -1476,7 +1628,8 @@ void Client::addUpdateMeshTask(v3s16 p, bool ack_to_server, bool urgent)
 		Create a task to update the mesh of the block
 	*/
 
-	MeshMakeData *data = new MeshMakeData(this, m_cache_enable_shaders);
+	MeshMakeData *data = new MeshMakeData(this, m_cache_enable_shaders,
+			&m_mesh_update_manager.m_buffer_pool);
 
 	{
 		//TimeTaker timer("data fill");
@@ -1489,7 +1642,7 @@ void Client::addUpdateMeshTask(v3s16 p, bool ack_to_server, bool urgent)
 	}
 
 	// Add task to queue
-	m_mesh_update_thread.m_queue_in.addBlock(p, data, ack_to_server, urgent);
+	m_mesh_update_manager.m_queue_in.addBlock(p, data, ack_to_server, urgent);
 }
 
 void Client::addUpdateMeshTaskWithEdge(v3s16 blockpos, bool ack_to_server, bool urgent)
@@ -1671,9 +1824,9 @@ void Client::afterContentReceived(IrrlichtDevice *device)
 		delete[] text;
 	}
 
-	// Start mesh update thread after setting up content definitions
-	infostream<<"- Starting mesh update thread"<<std::endl;
-	m_mesh_update_thread.Start();
+	// Start mesh update threads after setting up content definitions
+	infostream<<"- Starting mesh update threads"<<std::endl;
+	m_mesh_update_manager.startThreads();
 
 	m_state = LC_Ready;
 	sendReady();
@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "environment.h"
 #include "irrlichttypes_extrabloated.h"
 #include "jthread/jmutex.h"
+#include "jthread/jsemaphore.h"
 #include <ostream>
 #include <map>
 #include <set>
@@ -35,9 +36,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "hud.h"
 #include "particles.h"
 #include "network/networkpacket.h"
+#include "mapblock_mesh.h"
 
-struct MeshMakeData;
-class MapBlockMesh;
 class IWritableTextureSource;
 class IWritableShaderSource;
 class IWritableItemDefManager;
@@ -54,6 +54,9 @@ struct QueuedMeshUpdate
 	v3s16 p;
 	MeshMakeData *data;
 	bool ack_block_to_server;
+	bool urgent;
+	// Lower is more important; see MeshUpdateQueue::getPriority()
+	f32 priority;
 
 	QueuedMeshUpdate();
 	~QueuedMeshUpdate();
@@ -66,7 +69,15 @@ enum LocalClientState {
 };
 
 /*
-	A thread-safe queue of mesh update tasks
+	A thread-safe queue of mesh update tasks.
+
+	Urgent updates are popped first. The rest are ordered by distance to
+	the camera, with blocks in front of the camera before those to the
+	side or behind it. The order is a heap that is rebuilt when the camera
+	has moved to another block or turned.
+
+	A block is meshed by one thread at a time: an update of a block that
+	is being meshed is not popped until done() is called for it.
 */
 class MeshUpdateQueue
 {
@@ -83,8 +94,27 @@ class MeshUpdateQueue
 
 	// Returned pointer must be deleted
 	// Returns NULL if queue is empty
+	// done() must be called with the position once the update is made
 	QueuedMeshUpdate * pop();
 
+	// Lets updates of p be popped again
+	void done(v3s16 p);
+
+	// Waits until something may have been added, at most time_ms
+	void wait(u32 time_ms)
+	{
+		m_added.Wait(time_ms);
+	}
+
+	// Wakes up a thread waiting in wait()
+	void signal()
+	{
+		m_added.Post();
+	}
+
+	// Camera position in world coordinates and direction
+	void setCamera(v3f pos, v3f dir);
+
 	u32 size()
 	{
 		JMutexAutoLock lock(m_mutex);
@@ -92,9 +122,23 @@ class MeshUpdateQueue
 	}
 
 private:
-	std::vector<QueuedMeshUpdate*> m_queue;
-	std::set<v3s16> m_urgents;
+	f32 getPriority(v3s16 p, bool urgent);
+
+	// All queued updates by block position
+	std::map<v3s16, QueuedMeshUpdate*> m_queue;
+	// The same updates as a heap on priority, except those of blocks
+	// in m_in_progress, which wait for done()
+	std::vector<QueuedMeshUpdate*> m_heap;
+	// Blocks that have been popped and not yet done()
+	std::set<v3s16> m_in_progress;
+	bool m_heap_outdated;
+	// Camera as of the last setCamera() and as used for m_heap
+	v3f m_camera_pos;
+	v3f m_camera_dir;
+	v3s16 m_heap_camera_block;
+	v3f m_heap_camera_dir;
 	JMutex m_mutex;
+	JSemaphore m_added;
 };
 
 struct MeshUpdateResult
@@ -111,17 +155,45 @@ struct MeshUpdateResult
 	}
 };
 
+class MeshUpdateManager;
+
 class MeshUpdateThread : public JThread
 {
 public:
 
-	MeshUpdateThread(IGameDef *gamedef):
-		m_gamedef(gamedef)
+	MeshUpdateThread(MeshUpdateManager *manager):
+		m_manager(manager)
 	{
 	}
 
 	void * Thread();
 
+private:
+	MeshUpdateManager *m_manager;
+};
+
+/*
+	Makes meshes for queued blocks on a pool of MeshUpdateThreads.
+	The setting num_mesh_threads selects the number of threads.
+*/
+class MeshUpdateManager
+{
+public:
+	MeshUpdateManager(IGameDef *gamedef);
+
+	~MeshUpdateManager();
+
+	void startThreads();
+	// Asks the threads to stop; does not wait for them
+	void stopThreads();
+	// Waits for stopped threads to finish
+	void waitThreads();
+	bool isRunning();
+
+	// Declared before m_queue_in, as the queued updates give their
+	// buffers back to it when they are deleted
+	MeshMakeBufferPool m_buffer_pool;
+
 	MeshUpdateQueue m_queue_in;
 
 	MutexedQueue<MeshUpdateResult> m_queue_out;
@@ -129,6 +201,9 @@ class MeshUpdateThread : public JThread
 	IGameDef *m_gamedef;
 
 	v3s16 m_camera_offset;
+
+private:
+	std::vector<MeshUpdateThread*> m_threads;
 };
 
 enum ClientEventType
@@ -472,7 +547,11 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	void addUpdateMeshTaskForNode(v3s16 nodepos, bool ack_to_server=false, bool urgent=false);
 
 	void updateCameraOffset(v3s16 camera_offset)
-	{ m_mesh_update_thread.m_camera_offset = camera_offset; }
+	{ m_mesh_update_manager.m_camera_offset = camera_offset; }
+
+	// Used to make meshes for blocks in view first
+	void updateCamera(v3f pos, v3f dir)
+	{ m_mesh_update_manager.m_queue_in.setCamera(pos, dir); }
 
 	// Get event from queue. CE_NONE is returned if queue is empty.
 	ClientEvent getClientEvent();
@@ -562,7 +641,7 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	MtEventManager *m_event;
 
 
-	MeshUpdateThread m_mesh_update_thread;
+	MeshUpdateManager m_mesh_update_manager;
 	ClientEnvironment m_env;
 	ParticleManager m_particle_manager;
 	con::Connection m_con;
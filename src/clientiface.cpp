@@ -32,6 +32,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serverobject.h"              // TODO this is used for cleanup of only
 #include "main.h"                      // for g_settings
 #include "log.h"
+#include "util/serialize.h"
+#include <algorithm>
+#include <limits>
 
 const char *ClientInterface::statenames[] = {
 	"Invalid",
@@ -51,6 +54,202 @@ std::string ClientInterface::state2Name(ClientState state)
 	return statenames[state];
 }
 
+ActiveObjectMessageFrame::ActiveObjectMessageFrame()
+{
+	// Everything is in tier 0 until the others are set
+	for (u8 t = 0; t < OBJECT_UPDATE_TIERS; t++) {
+		m_tier_distance[t] = t == 0 ? 0 : std::numeric_limits<f32>::max();
+		m_tier_divisor[t] = 1;
+	}
+	clear();
+}
+
+void ActiveObjectMessageFrame::setTier(u8 tier, f32 distance, u16 divisor)
+{
+	assert(tier < OBJECT_UPDATE_TIERS);
+	m_tier_distance[tier] = tier == 0 ? 0 : distance;
+	m_tier_divisor[tier] = tier == 0 ? 1 : MYMAX(divisor, 1);
+}
+
+void ActiveObjectMessageFrame::clear()
+{
+	m_messages.clear();
+	m_positions.clear();
+	m_order.clear();
+	m_reliable.clear();
+	for (u8 t = 0; t < OBJECT_UPDATE_TIERS; t++) {
+		m_unreliable[t].clear();
+		m_tier_sent[t] = 0;
+		m_tier_skipped[t] = 0;
+		m_tier_bytes[t] = 0;
+	}
+	m_objects.clear();
+}
+
+void ActiveObjectMessageFrame::add(const ActiveObjectMessage &aom,
+		v3f object_pos)
+{
+	m_order.push_back(std::make_pair(aom.id, (u32)m_messages.size()));
+	m_messages.push_back(aom);
+	m_positions.push_back(object_pos);
+}
+
+void ActiveObjectMessageFrame::encode()
+{
+	// Group by object; the index keeps the messages of an object in order
+	std::sort(m_order.begin(), m_order.end());
+
+	for (std::vector<std::pair<u16, u32> >::const_iterator
+			i = m_order.begin(); i != m_order.end(); ++i) {
+		const ActiveObjectMessage &aom = m_messages[i->second];
+		if (aom.datastring.size() > 65535)
+			throw SerializationError("String too long for serializeString");
+
+		if (m_objects.empty() || m_objects.back().id != aom.id) {
+			ObjectRange r;
+			r.id = aom.id;
+			r.position = v3f(0,0,0);
+			r.reliable_start = r.reliable_end = m_reliable.size();
+			r.skippable = 0;
+			for (u8 t = 0; t < OBJECT_UPDATE_TIERS; t++) {
+				r.unreliable_start[t] = r.unreliable_end[t] =
+						m_unreliable[t].size();
+				r.skippable_sent[t] = 0;
+			}
+			m_objects.push_back(r);
+		}
+		ObjectRange &r = m_objects.back();
+
+		// Object id, then the data as a serializeString()
+		u8 buf[4];
+		writeU16(&buf[0], aom.id);
+		writeU16(&buf[2], aom.datastring.size());
+
+		if (aom.reliable) {
+			m_reliable.append((char*)buf, 4);
+			m_reliable.append(aom.datastring);
+			r.reliable_end = m_reliable.size();
+			continue;
+		}
+
+		if (aom.skippable) {
+			r.position = m_positions[i->second];
+			r.skippable++;
+		}
+		for (u8 t = 0; t < OBJECT_UPDATE_TIERS; t++) {
+			if (aom.skippable) {
+				if (aom.skip_seq % m_tier_divisor[t] != 0)
+					continue;
+				r.skippable_sent[t]++;
+			}
+			m_unreliable[t].append((char*)buf, 4);
+			m_unreliable[t].append(aom.datastring);
+			r.unreliable_end[t] = m_unreliable[t].size();
+		}
+	}
+}
+
+void ActiveObjectMessageFrame::gather(const std::set<u16> &known_objects,
+		v3f client_pos, std::string &reliable, std::string &unreliable)
+{
+	gather(known_objects, &client_pos, reliable, unreliable);
+}
+
+void ActiveObjectMessageFrame::gather(const std::set<u16> &known_objects,
+		std::string &reliable, std::string &unreliable)
+{
+	gather(known_objects, NULL, reliable, unreliable);
+}
+
+void ActiveObjectMessageFrame::getTierStats(u8 tier, u32 &sent, u32 &skipped,
+		u32 &bytes) const
+{
+	assert(tier < OBJECT_UPDATE_TIERS);
+	sent = m_tier_sent[tier];
+	skipped = m_tier_skipped[tier];
+	bytes = m_tier_bytes[tier];
+}
+
+void ActiveObjectMessageFrame::gather(const std::set<u16> &known_objects,
+		const v3f *client_pos, std::string &reliable,
+		std::string &unreliable)
+{
+	/*
+		Objects next to each other in m_objects are next to each other
+		in the buffers, so runs of them are appended with one copy.
+	*/
+	GatherState state;
+	state.reliable_start = state.reliable_end = 0;
+	state.tier = 0;
+	state.unreliable_start = state.unreliable_end = 0;
+
+	// Look up each of the smaller set in the bigger one
+	if (m_objects.size() <= known_objects.size()) {
+		for (std::vector<ObjectRange>::const_iterator
+				i = m_objects.begin(); i != m_objects.end(); ++i) {
+			if (known_objects.find(i->id) == known_objects.end())
+				continue;
+			gatherObject(*i, client_pos, state, reliable, unreliable);
+		}
+	} else {
+		ObjectRange key;
+		for (std::set<u16>::const_iterator
+				i = known_objects.begin(); i != known_objects.end(); ++i) {
+			key.id = *i;
+			std::vector<ObjectRange>::const_iterator r = std::lower_bound(
+					m_objects.begin(), m_objects.end(), key);
+			if (r == m_objects.end() || r->id != *i)
+				continue;
+			gatherObject(*r, client_pos, state, reliable, unreliable);
+		}
+	}
+
+	reliable.append(m_reliable, state.reliable_start,
+			state.reliable_end - state.reliable_start);
+	unreliable.append(m_unreliable[state.tier], state.unreliable_start,
+			state.unreliable_end - state.unreliable_start);
+}
+
+void ActiveObjectMessageFrame::gatherObject(const ObjectRange &r,
+		const v3f *client_pos, GatherState &state,
+		std::string &reliable, std::string &unreliable)
+{
+	if (r.reliable_start != state.reliable_end) {
+		reliable.append(m_reliable, state.reliable_start,
+				state.reliable_end - state.reliable_start);
+		state.reliable_start = r.reliable_start;
+	}
+	state.reliable_end = r.reliable_end;
+
+	/*
+		Every tier has the same messages of an object without skippable
+		ones, so the current run can go on with them.
+	*/
+	u8 tier = state.tier;
+	if (r.skippable != 0) {
+		tier = 0;
+		if (client_pos != NULL) {
+			f32 d = client_pos->getDistanceFrom(r.position);
+			while (tier + 1 < OBJECT_UPDATE_TIERS &&
+					d >= m_tier_distance[tier + 1])
+				tier++;
+		}
+		m_tier_sent[tier] += r.skippable_sent[tier];
+		m_tier_skipped[tier] += r.skippable - r.skippable_sent[tier];
+		m_tier_bytes[tier] += r.unreliable_end[tier] -
+				r.unreliable_start[tier];
+	}
+
+	if (tier != state.tier ||
+			r.unreliable_start[tier] != state.unreliable_end) {
+		unreliable.append(m_unreliable[state.tier], state.unreliable_start,
+				state.unreliable_end - state.unreliable_start);
+		state.tier = tier;
+		state.unreliable_start = r.unreliable_start[tier];
+	}
+	state.unreliable_end = r.unreliable_end[tier];
+}
+
 void RemoteClient::ResendBlockIfOnWire(v3s16 p)
 {
 	// if this block is on wire, mark it for sending again as soon as possible
@@ -81,8 +280,7 @@ void RemoteClient::GetNextBlocks (
 		return;
 
 	// Won't send anything if already sending
-	if(m_blocks_sending.size() >= g_settings->getU16
-			("max_simultaneous_block_sends_per_client"))
+	if(m_blocks_sending.size() >= m_max_simul_sends.get())
 	{
 		//infostream<<"Not sending any blocks, Queue full."<<std::endl;
 		return;
@@ -106,6 +304,10 @@ void RemoteClient::GetNextBlocks (
 	camera_dir.rotateYZBy(player->getPitch());
 	camera_dir.rotateXZBy(player->getYaw());
 
+	// Let the emerge queue know which of our requests are needed first
+	emerge->updatePeerView(peer_id, center, camera_dir,
+			m_max_send_distance.get());
+
 	/*infostream<<"camera_dir=("<<camera_dir.X<<","<<camera_dir.Y<<","
 			<<camera_dir.Z<<")"<<std::endl;*/
 
@@ -136,8 +338,7 @@ void RemoteClient::GetNextBlocks (
 
 	//infostream<<"d_start="<<d_start<<std::endl;
 
-	u16 max_simul_sends_setting = g_settings->getU16
-			("max_simultaneous_block_sends_per_client");
+	u16 max_simul_sends_setting = m_max_simul_sends.get();
 	u16 max_simul_sends_usually = max_simul_sends_setting;
 
 	/*
@@ -146,8 +347,7 @@ void RemoteClient::GetNextBlocks (
 		Decrease send rate if player is building stuff.
 	*/
 	m_time_from_building += dtime;
-	if(m_time_from_building < g_settings->getFloat(
-				"full_block_send_enable_min_time_from_building"))
+	if(m_time_from_building < m_min_time_from_building.get())
 	{
 		max_simul_sends_usually
 			= LIMITED_MAX_SIMULTANEOUS_BLOCK_SENDS;
@@ -167,9 +367,9 @@ void RemoteClient::GetNextBlocks (
 	*/
 	s32 new_nearest_unsent_d = -1;
 
-	const s16 full_d_max = g_settings->getS16("max_block_send_distance");
+	const s16 full_d_max = m_max_send_distance.get();
 	s16 d_max = full_d_max;
-	s16 d_max_gen = g_settings->getS16("max_block_generate_distance");
+	s16 d_max_gen = m_max_gen_distance.get();
 
 	// Don't loop very much at a time
 	s16 max_d_increment_at_time = 2;
@@ -357,7 +557,7 @@ void RemoteClient::GetNextBlocks (
 	} else if(nearest_emergefull_d != -1){
 		new_nearest_unsent_d = nearest_emergefull_d;
 	} else {
-		if(d > g_settings->getS16("max_block_send_distance")){
+		if(d > full_d_max){
 			new_nearest_unsent_d = 0;
 			m_nothing_to_send_pause_timer = 2.0;
 		} else {
@@ -22,9 +22,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irr_v3d.h"                   // for irrlicht datatypes
 
 #include "constants.h"
+#include "activeobject.h"
 #include "serialization.h"             // for SER_FMT_VER_INVALID
 #include "jthread/jmutex.h"
 #include "network/networkpacket.h"
+#include "settings.h"
+#include "main.h"                      // for g_settings
 
 #include <list>
 #include <vector>
@@ -188,6 +191,114 @@ struct PrioritySortedBlockTransfer
 	u16 peer_id;
 };
 
+// Number of distance tiers of ActiveObjectMessageFrame
+#define OBJECT_UPDATE_TIERS 3
+
+/*
+	The active object messages of one server step, encoded once.
+
+	The encoded messages are kept grouped by object id, so that what a
+	client should get can be gathered from the objects it knows without
+	encoding anything again.
+
+	Clients far from an object get fewer of its skippable position
+	updates. Each distance tier has its own copy of the unreliable
+	messages with only the updates that tier gets, so that gathering
+	stays a matter of copying ranges.
+*/
+class ActiveObjectMessageFrame
+{
+public:
+	ActiveObjectMessageFrame();
+
+	/*
+		From distance (in BS units) on, clients get one in divisor of
+		the skippable position updates. Tier 0 starts at 0 and gets
+		all of them; tier distances should increase.
+	*/
+	void setTier(u8 tier, f32 distance, u16 divisor);
+
+	void clear();
+
+	// object_pos is only used if aom is skippable
+	void add(const ActiveObjectMessage &aom, v3f object_pos);
+
+	// Encodes the messages added since the last clear()
+	void encode();
+
+	bool empty() const
+	{
+		return m_objects.empty();
+	}
+
+	/*
+		Appends the encoded messages of the objects in known_objects
+		to reliable and unreliable, for a client at client_pos.
+	*/
+	void gather(const std::set<u16> &known_objects, v3f client_pos,
+			std::string &reliable, std::string &unreliable);
+
+	// Same as above, with every skippable message
+	void gather(const std::set<u16> &known_objects,
+			std::string &reliable, std::string &unreliable);
+
+	/*
+		Skippable updates sent and skipped in a tier since the last
+		clear(), and the unreliable bytes sent of the objects that had
+		them
+	*/
+	void getTierStats(u8 tier, u32 &sent, u32 &skipped, u32 &bytes) const;
+
+private:
+	// Where the messages of an object are in the frame buffers
+	struct ObjectRange
+	{
+		u16 id;
+		v3f position;
+		u32 reliable_start;
+		u32 reliable_end;
+		u32 unreliable_start[OBJECT_UPDATE_TIERS];
+		u32 unreliable_end[OBJECT_UPDATE_TIERS];
+		u16 skippable;
+		u16 skippable_sent[OBJECT_UPDATE_TIERS];
+
+		bool operator < (const ObjectRange &other) const
+		{
+			return id < other.id;
+		}
+	};
+
+	// Ends of the runs of the buffers that are being appended
+	struct GatherState
+	{
+		u32 reliable_start;
+		u32 reliable_end;
+		u8 tier;
+		u32 unreliable_start;
+		u32 unreliable_end;
+	};
+
+	void gather(const std::set<u16> &known_objects, const v3f *client_pos,
+			std::string &reliable, std::string &unreliable);
+	void gatherObject(const ObjectRange &r, const v3f *client_pos,
+			GatherState &state, std::string &reliable,
+			std::string &unreliable);
+
+	f32 m_tier_distance[OBJECT_UPDATE_TIERS];
+	u16 m_tier_divisor[OBJECT_UPDATE_TIERS];
+	u32 m_tier_sent[OBJECT_UPDATE_TIERS];
+	u32 m_tier_skipped[OBJECT_UPDATE_TIERS];
+	u32 m_tier_bytes[OBJECT_UPDATE_TIERS];
+
+	std::vector<ActiveObjectMessage> m_messages;
+	std::vector<v3f> m_positions;
+	// (object id, index in m_messages)
+	std::vector<std::pair<u16, u32> > m_order;
+	std::string m_reliable;
+	std::string m_unreliable[OBJECT_UPDATE_TIERS];
+	std::vector<ObjectRange> m_objects;
+};
+
 class RemoteClient
 {
 public:
@@ -218,7 +329,13 @@ class RemoteClient
 		m_version_patch(0),
 		m_full_version("unknown"),
 		m_supported_compressions(0),
-		m_connection_time(getTime(PRECISION_SECONDS))
+		m_connection_time(getTime(PRECISION_SECONDS)),
+		m_max_simul_sends(g_settings,
+				"max_simultaneous_block_sends_per_client"),
+		m_min_time_from_building(g_settings,
+				"full_block_send_enable_min_time_from_building"),
+		m_max_send_distance(g_settings, "max_block_send_distance"),
+		m_max_gen_distance(g_settings, "max_block_generate_distance")
 	{
 	}
 	~RemoteClient()
@@ -380,6 +497,14 @@ class RemoteClient
 		time this client was created
 	 */
 	const u32 m_connection_time;
+
+	/*
+		Settings read by GetNextBlocks() on every call
+	*/
+	CachedU16Setting m_max_simul_sends;
+	CachedFloatSetting m_min_time_from_building;
+	CachedS16Setting m_max_send_distance;
+	CachedS16Setting m_max_gen_distance;
 };
 
 class ClientInterface {
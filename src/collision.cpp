@@ -193,6 +193,19 @@ bool wouldCollideWithCeiling(
 }
 
 
+static void addObjectCollisionBox(CollisionBoxBuffer &cb,
+		ActiveObject *object)
+{
+	if (object == NULL)
+		return;
+
+	aabb3f object_collisionbox;
+	if (object->getCollisionBox(&object_collisionbox) &&
+			object->collideWithObjects()) {
+		cb.add(object_collisionbox, false, true, 0, v3s16(0,0,0));
+	}
+}
+
 collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 		f32 pos_max_d, const aabb3f &box_0,
 		f32 stepheight, f32 dtime,
@@ -227,16 +240,12 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 	/*
 		Collect node boxes in movement range
 	*/
-	std::vector<aabb3f> cboxes;
-	std::vector<bool> is_unloaded;
-	std::vector<bool> is_step_up;
-	std::vector<bool> is_object;
-	std::vector<int> bouncy_values;
-	std::vector<v3s16> node_positions;
+	CollisionBoxBuffer &cb = env->getCollisionBoxBuffer();
+	cb.clear();
 	{
 	//TimeTaker tt2("collisionMoveSimple collect boxes");
-    ScopeProfiler sp(g_profiler, "collisionMoveSimple collect boxes avg", SPT_AVG);
 
+	INodeDefManager *ndef = gamedef->getNodeDefManager();
 	v3s16 oldpos_i = floatToInt(pos_f, BS);
 	v3s16 newpos_i = floatToInt(pos_f + speed_f * dtime, BS);
 	s16 min_x = MYMIN(oldpos_i.X, newpos_i.X) + (box_0.MinEdge.X / BS) - 1;
@@ -258,49 +267,36 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 		if (is_position_valid) {
 			// Object collides into walkable nodes
 
-			const ContentFeatures &f = gamedef->getNodeDefManager()->get(n);
+			const ContentFeatures &f = ndef->get(n);
 			if(f.walkable == false)
 				continue;
-			int n_bouncy_value = itemgroup_get(f.groups, "bouncy");
 
-			std::vector<aabb3f> nodeboxes = n.getCollisionBoxes(gamedef->ndef());
-			for(std::vector<aabb3f>::iterator
+			const std::vector<aabb3f> &nodeboxes =
+					f.getCollisionBoxes(n.getParam2());
+			v3f offset = v3f(x, y, z) * BS;
+			for(std::vector<aabb3f>::const_iterator
 					i = nodeboxes.begin();
 					i != nodeboxes.end(); i++)
 			{
 				aabb3f box = *i;
-				box.MinEdge += v3f(x, y, z)*BS;
-				box.MaxEdge += v3f(x, y, z)*BS;
-				cboxes.push_back(box);
-				is_unloaded.push_back(false);
-				is_step_up.push_back(false);
-				bouncy_values.push_back(n_bouncy_value);
-				node_positions.push_back(p);
-				is_object.push_back(false);
+				box.MinEdge += offset;
+				box.MaxEdge += offset;
+				cb.add(box, false, false, f.bouncy, p);
 			}
 		}
 		else {
 			// Collide with unloaded nodes
-			aabb3f box = getNodeBox(p, BS);
-			cboxes.push_back(box);
-			is_unloaded.push_back(true);
-			is_step_up.push_back(false);
-			bouncy_values.push_back(0);
-			node_positions.push_back(p);
-			is_object.push_back(false);
+			cb.add(getNodeBox(p, BS), true, false, 0, p);
 		}
 	}
 	} // tt2
 
 	if(collideWithObjects)
 	{
-		ScopeProfiler sp(g_profiler, "collisionMoveSimple objects avg", SPT_AVG);
 		//TimeTaker tt3("collisionMoveSimple collect object boxes");
 
 		/* add object boxes to cboxes */
 
-
-		std::vector<ActiveObject*> objects;
 #ifndef SERVER
 		ClientEnvironment *c_env = dynamic_cast<ClientEnvironment*>(env);
 		if (c_env != 0) {
@@ -309,7 +305,7 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 			c_env->getActiveObjects(pos_f,distance * 1.5,clientobjects);
 			for (size_t i=0; i < clientobjects.size(); i++) {
 				if ((self == 0) || (self != clientobjects[i].obj)) {
-					objects.push_back((ActiveObject*)clientobjects[i].obj);
+					addObjectCollisionBox(cb, clientobjects[i].obj);
 				}
 			}
 		}
@@ -319,41 +315,18 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 			ServerEnvironment *s_env = dynamic_cast<ServerEnvironment*>(env);
 			if (s_env != 0) {
 				f32 distance = speed_f.getLength();
-				std::set<u16> s_objects = s_env->getObjectsInsideRadius(pos_f,distance * 1.5);
-				for (std::set<u16>::iterator iter = s_objects.begin(); iter != s_objects.end(); iter++) {
-					ServerActiveObject *current = s_env->getActiveObject(*iter);
-					if ((self == 0) || (self != current)) {
-						objects.push_back((ActiveObject*)current);
+				std::vector<ServerActiveObject*> &s_objects = cb.server_objects;
+				s_objects.clear();
+				s_env->getObjectsInsideRadius(pos_f, distance * 1.5, s_objects);
+				for (size_t i = 0; i < s_objects.size(); i++) {
+					if ((self == 0) || (self != s_objects[i])) {
+						addObjectCollisionBox(cb, s_objects[i]);
 					}
 				}
 			}
 		}
-
-		for (std::vector<ActiveObject*>::const_iterator iter = objects.begin();
-				iter != objects.end(); ++iter) {
-			ActiveObject *object = *iter;
-
-			if (object != NULL) {
-				aabb3f object_collisionbox;
-				if (object->getCollisionBox(&object_collisionbox) &&
-						object->collideWithObjects()) {
-					cboxes.push_back(object_collisionbox);
-					is_unloaded.push_back(false);
-					is_step_up.push_back(false);
-					bouncy_values.push_back(0);
-					node_positions.push_back(v3s16(0,0,0));
-					is_object.push_back(true);
-				}
-			}
-		}
 	} //tt3
 
-	assert(cboxes.size() == is_unloaded.size());    // post-condition
-	assert(cboxes.size() == is_step_up.size());     // post-condition
-	assert(cboxes.size() == bouncy_values.size());  // post-condition
-	assert(cboxes.size() == node_positions.size()); // post-condition
-	assert(cboxes.size() == is_object.size());      // post-condition
-
 	/*
 		Collision detection
 	*/
@@ -374,7 +347,6 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 	while(dtime > BS*1e-10)
 	{
 		//TimeTaker tt3("collisionMoveSimple dtime loop");
-        ScopeProfiler sp(g_profiler, "collisionMoveSimple dtime loop avg", SPT_AVG);
 
 		// Avoid infinite loop
 		loopcount++;
@@ -396,16 +368,16 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 		/*
 			Go through every nodebox, find nearest collision
 		*/
-		for(u32 boxindex = 0; boxindex < cboxes.size(); boxindex++)
+		for(u32 boxindex = 0; boxindex < cb.size(); boxindex++)
 		{
 			// Ignore if already stepped up this nodebox.
-			if(is_step_up[boxindex])
+			if(cb.is_step_up[boxindex])
 				continue;
 
 			// Find nearest collision of the two boxes (raytracing-like)
 			f32 dtime_tmp;
 			int collided = axisAlignedCollision(
-					cboxes[boxindex], movingbox, speed_f, d, dtime_tmp);
+					cb.boxes[boxindex], movingbox, speed_f, d, dtime_tmp);
 
 			if(collided == -1 || dtime_tmp >= nearest_dtime)
 				continue;
@@ -425,19 +397,19 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 		{
 			// Otherwise, a collision occurred.
 
-			const aabb3f& cbox = cboxes[nearest_boxindex];
+			const aabb3f& cbox = cb.boxes[nearest_boxindex];
 
 			// Check for stairs.
 			bool step_up = (nearest_collided != 1) && // must not be Y direction
 					(movingbox.MinEdge.Y < cbox.MaxEdge.Y) &&
 					(movingbox.MinEdge.Y + stepheight > cbox.MaxEdge.Y) &&
-					(!wouldCollideWithCeiling(cboxes, movingbox,
+					(!wouldCollideWithCeiling(cb.boxes, movingbox,
 							cbox.MaxEdge.Y - movingbox.MinEdge.Y,
 							d));
 
 			// Get bounce multiplier
-			bool bouncy = (bouncy_values[nearest_boxindex] >= 1);
-			float bounce = -(float)bouncy_values[nearest_boxindex] / 100.0;
+			bool bouncy = (cb.bouncy_values[nearest_boxindex] >= 1);
+			float bounce = -(float)cb.bouncy_values[nearest_boxindex] / 100.0;
 
 			// Move to the point of collision and reduce dtime by nearest_dtime
 			if(nearest_dtime < 0)
@@ -460,17 +432,17 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 			}
 			
 			bool is_collision = true;
-			if(is_unloaded[nearest_boxindex])
+			if(cb.is_unloaded[nearest_boxindex])
 				is_collision = false;
 
 			CollisionInfo info;
-			if (is_object[nearest_boxindex]) {
+			if (cb.is_object[nearest_boxindex]) {
 				info.type = COLLISION_OBJECT;
 			}
 			else {
 				info.type = COLLISION_NODE;
 			}
-			info.node_p = node_positions[nearest_boxindex];
+			info.node_p = cb.node_positions[nearest_boxindex];
 			info.bouncy = bouncy;
 			info.old_speed = speed_f;
 
@@ -478,7 +450,7 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 			if(step_up)
 			{
 				// Special case: Handle stairs
-				is_step_up[nearest_boxindex] = true;
+				cb.is_step_up[nearest_boxindex] = true;
 				is_collision = false;
 			}
 			else if(nearest_collided == 0) // X
@@ -524,9 +496,9 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 	aabb3f box = box_0;
 	box.MinEdge += pos_f;
 	box.MaxEdge += pos_f;
-	for(u32 boxindex = 0; boxindex < cboxes.size(); boxindex++)
+	for(u32 boxindex = 0; boxindex < cb.size(); boxindex++)
 	{
-		const aabb3f& cbox = cboxes[boxindex];
+		const aabb3f& cbox = cb.boxes[boxindex];
 
 		/*
 			See if the object is touching ground.
@@ -543,7 +515,7 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 				cbox.MaxEdge.Z-d > box.MinEdge.Z &&
 				cbox.MinEdge.Z+d < box.MaxEdge.Z
 		){
-			if(is_step_up[boxindex])
+			if(cb.is_step_up[boxindex])
 			{
 				pos_f.Y += (cbox.MaxEdge.Y - box.MinEdge.Y);
 				box = box_0;
@@ -553,7 +525,7 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 			if(fabs(cbox.MaxEdge.Y-box.MinEdge.Y) < 0.15*BS)
 			{
 				result.touching_ground = true;
-				if(is_unloaded[boxindex])
+				if(cb.is_unloaded[boxindex])
 					result.standing_on_unloaded = true;
 			}
 		}
@@ -27,6 +27,7 @@ class Map;
 class IGameDef;
 class Environment;
 class ActiveObject;
+class ServerActiveObject;
 
 enum CollisionType
 {
@@ -67,6 +68,47 @@ struct collisionMoveResult
 	{}
 };
 
+/*
+	Collision boxes collected by collisionMoveSimple(), as parallel arrays.
+	Every Environment owns one, so the arrays keep their capacity from
+	one call to the next instead of being allocated for every move.
+*/
+struct CollisionBoxBuffer
+{
+	std::vector<aabb3f> boxes;
+	std::vector<u8> is_unloaded;
+	std::vector<u8> is_step_up;
+	std::vector<u8> is_object;
+	std::vector<int> bouncy_values;
+	std::vector<v3s16> node_positions;
+
+	// Scratch space for finding nearby server objects
+	std::vector<ServerActiveObject*> server_objects;
+
+	void clear()
+	{
+		boxes.clear();
+		is_unloaded.clear();
+		is_step_up.clear();
+		is_object.clear();
+		bouncy_values.clear();
+		node_positions.clear();
+	}
+
+	void add(const aabb3f &box, bool unloaded, bool object,
+			int bouncy, v3s16 node_p)
+	{
+		boxes.push_back(box);
+		is_unloaded.push_back(unloaded);
+		is_step_up.push_back(false);
+		is_object.push_back(object);
+		bouncy_values.push_back(bouncy);
+		node_positions.push_back(node_p);
+	}
+
+	size_t size() const { return boxes.size(); }
+};
+
 // Moves using a single iteration; speed should not exceed pos_max_d/dtime
 collisionMoveResult collisionMoveSimple(Environment *env,IGameDef *gamedef,
 		f32 pos_max_d, const aabb3f &box_0,
@@ -34,6 +34,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "genericobject.h"
 #include "log.h"
 
+/*
+	Seconds a moving object has to stand still after a skippable position
+	update before its position is sent again to every client
+*/
+#define POSITION_SETTLE_TIME 1.0
+
 std::map<u16, ServerActiveObject::Factory> ServerActiveObject::m_types;
 
 /*
@@ -134,6 +140,8 @@ LuaEntitySAO::LuaEntitySAO(ServerEnvironment *env, v3f pos,
 	m_last_sent_velocity(0,0,0),
 	m_last_sent_position_timer(0),
 	m_last_sent_move_precision(0),
+	m_position_skip_seq(0),
+	m_last_sent_position_skippable(false),
 	m_armor_groups_sent(false),
 	m_animation_speed(0),
 	m_animation_blend(0),
@@ -310,6 +318,10 @@ void LuaEntitySAO::step(float dtime, bool send_recommended)
 		float vel_d = m_velocity.getDistanceFrom(m_last_sent_velocity);
 		if(move_d > minchange || vel_d > minchange ||
 				fabs(m_yaw - m_last_sent_yaw) > 1.0){
+			// Clients far away can skip it unless the object stops
+			sendPosition(true, false, m_velocity != v3f(0,0,0));
+		} else if(m_last_sent_position_skippable &&
+				m_last_sent_position_timer > POSITION_SETTLE_TIME){
 			sendPosition(true, false);
 		}
 	}
@@ -488,7 +500,7 @@ void LuaEntitySAO::setPos(v3f pos)
 {
 	if(isAttached())
 		return;
-	m_base_position = pos;
+	setBasePosition(pos);
 	sendPosition(false, true);
 }
 
@@ -496,7 +508,7 @@ void LuaEntitySAO::moveTo(v3f pos, bool continuous)
 {
 	if(isAttached())
 		return;
-	m_base_position = pos;
+	setBasePosition(pos);
 	if(!continuous)
 		sendPosition(true, true);
 }
@@ -637,7 +649,8 @@ std::string LuaEntitySAO::getPropertyPacket()
 	return gob_cmd_set_properties(m_prop);
 }
 
-void LuaEntitySAO::sendPosition(bool do_interpolate, bool is_movement_end)
+void LuaEntitySAO::sendPosition(bool do_interpolate, bool is_movement_end,
+		bool skippable)
 {
 	// If the object is attached client-side, don't waste bandwidth sending its position to clients
 	if(isAttached())
@@ -664,6 +677,11 @@ void LuaEntitySAO::sendPosition(bool do_interpolate, bool is_movement_end)
 	);
 	// create message and add to list
 	ActiveObjectMessage aom(getId(), false, str);
+	aom.skippable = skippable;
+	aom.skip_seq = m_position_skip_seq;
+	if(skippable)
+		m_position_skip_seq++;
+	m_last_sent_position_skippable = skippable;
 	m_messages_out.push(aom);
 }
 
@@ -706,6 +724,10 @@ PlayerSAO::PlayerSAO(ServerEnvironment *env_, Player *player_, u16 peer_id_,
 	m_nocheat_dig_time(0),
 	m_wield_index(0),
 	m_position_not_sent(false),
+	m_position_teleported(false),
+	m_last_sent_position_timer(0),
+	m_position_skip_seq(0),
+	m_last_sent_position_skippable(false),
 	m_armor_groups_sent(false),
 	m_properties_sent(true),
 	m_privs(privs),
@@ -895,13 +917,31 @@ void PlayerSAO::step(float dtime, bool send_recommended)
 		m_player->setPosition(pos);
 	}
 
+	m_last_sent_position_timer += dtime;
+
 	if(send_recommended == false)
 		return;
 
+	/*
+		Updates of a moving player may be skipped by clients far away;
+		once the player stands still the position is sent to everyone.
+		So are teleports, which far clients would otherwise only see
+		after the settle time.
+	*/
+	bool send_position = m_position_not_sent;
+	bool skippable = !m_position_teleported;
+	if(!send_position && m_last_sent_position_skippable &&
+			m_last_sent_position_timer > POSITION_SETTLE_TIME){
+		send_position = true;
+		skippable = false;
+	}
+
 	// If the object is attached client-side, don't waste bandwidth sending its position to clients
-	if(m_position_not_sent && !isAttached())
+	if(send_position && !isAttached())
 	{
 		m_position_not_sent = false;
+		m_position_teleported = false;
+		m_last_sent_position_timer = 0;
 		float update_interval = m_env->getSendRecommendedInterval();
 		v3f pos;
 		if(isAttached()) // Just in case we ever do send attachment position too
@@ -919,6 +959,11 @@ void PlayerSAO::step(float dtime, bool send_recommended)
 		);
 		// create message and add to list
 		ActiveObjectMessage aom(getId(), false, str);
+		aom.skippable = skippable;
+		aom.skip_seq = m_position_skip_seq;
+		if(skippable)
+			m_position_skip_seq++;
+		m_last_sent_position_skippable = skippable;
 		m_messages_out.push(aom);
 	}
 
@@ -980,6 +1025,7 @@ void PlayerSAO::setPos(v3f pos)
 	if(isAttached())
 		return;
 	m_player->setPosition(pos);
+	m_position_teleported = true;
 	// Movement caused by this command is always valid
 	m_last_good_position = pos;
 	((Server*)m_env->getGameDef())->SendMovePlayer(m_peer_id);
@@ -990,6 +1036,7 @@ void PlayerSAO::moveTo(v3f pos, bool continuous)
 	if(isAttached())
 		return;
 	m_player->setPosition(pos);
+	m_position_teleported = true;
 	// Movement caused by this command is always valid
 	m_last_good_position = pos;
 	((Server*)m_env->getGameDef())->SendMovePlayer(m_peer_id);
@@ -78,7 +78,8 @@ class LuaEntitySAO : public ServerActiveObject
 	bool collideWithObjects();
 private:
 	std::string getPropertyPacket();
-	void sendPosition(bool do_interpolate, bool is_movement_end);
+	void sendPosition(bool do_interpolate, bool is_movement_end,
+			bool skippable=false);
 
 	std::string m_init_name;
 	std::string m_init_state;
@@ -97,6 +98,8 @@ class LuaEntitySAO : public ServerActiveObject
 	v3f m_last_sent_velocity;
 	float m_last_sent_position_timer;
 	float m_last_sent_move_precision;
+	u32 m_position_skip_seq;
+	bool m_last_sent_position_skippable;
 	bool m_armor_groups_sent;
 
 	v2f m_animation_range;
@@ -290,6 +293,11 @@ class PlayerSAO : public ServerActiveObject
 
 	int m_wield_index;
 	bool m_position_not_sent;
+	// Moved by setPos() or moveTo(); has to reach every client
+	bool m_position_teleported;
+	float m_last_sent_position_timer;
+	u32 m_position_skip_seq;
+	bool m_last_sent_position_skippable;
 	ItemGroupList m_armor_groups;
 	bool m_armor_groups_sent;
 
@@ -82,16 +82,18 @@ static std::vector<std::string> craftGetItemNames(
 	return result;
 }
 
-// Get name of each item, and return them as a new list.
+// Get name of each item, with aliases resolved like recipe itemstrings,
+// and return them as a new list.
 static std::vector<std::string> craftGetItemNames(
 		const std::vector<ItemStack> &items, IGameDef *gamedef)
 {
+	IItemDefManager *idef = gamedef->idef();
 	std::vector<std::string> result;
 	for(std::vector<ItemStack>::const_iterator
 			i = items.begin();
 			i != items.end(); i++)
 	{
-		result.push_back(i->name);
+		result.push_back(i->name == "" ? "" : idef->getAlias(i->name));
 	}
 	return result;
 }
@@ -152,6 +154,75 @@ static bool craftGetBounds(const std::vector<std::string> &items, unsigned int w
 	return success;
 }
 
+/*
+	Recipe index keys
+
+	A recipe made only of item names can only match an input holding
+	exactly those items, so it is indexed by its crafting method and
+	sorted item names. A recipe using groups is indexed by its method,
+	number of items and the first of its item names, if any; the input
+	has to contain that item.
+*/
+
+static std::string craftIndexKeyByCount(CraftMethod method, size_t count,
+		const std::string &name="")
+{
+	std::ostringstream os(std::ios::binary);
+	os<<(int)method<<"#"<<count;
+	if(name != "")
+		os<<"\n"<<name;
+	return os.str();
+}
+
+// Empty names are skipped
+static std::string craftIndexKeyByItems(CraftMethod method,
+		const std::vector<std::string> &names)
+{
+	std::vector<std::string> sorted;
+	for(std::vector<std::string>::const_iterator
+			i = names.begin();
+			i != names.end(); i++)
+	{
+		if(*i != "")
+			sorted.push_back(*i);
+	}
+	std::sort(sorted.begin(), sorted.end());
+
+	std::ostringstream os(std::ios::binary);
+	os<<(int)method;
+	for(std::vector<std::string>::const_iterator
+			i = sorted.begin();
+			i != sorted.end(); i++)
+	{
+		os<<"\n"<<(*i);
+	}
+	return os.str();
+}
+
+// Key of a recipe with the given item names (which may be groups)
+static std::string craftIndexKey(CraftMethod method,
+		const std::vector<std::string> &names)
+{
+	size_t count = 0;
+	bool uses_groups = false;
+	std::string first_name;
+	for(std::vector<std::string>::const_iterator
+			i = names.begin();
+			i != names.end(); i++)
+	{
+		if(*i == "")
+			continue;
+		count++;
+		if(i->substr(0,6) == "group:")
+			uses_groups = true;
+		else if(first_name == "" || *i < first_name)
+			first_name = *i;
+	}
+	if(uses_groups)
+		return craftIndexKeyByCount(method, count, first_name);
+	return craftIndexKeyByItems(method, names);
+}
+
 // Removes 1 from each item stack
 static void craftDecrementInput(CraftInput &input, IGameDef *gamedef)
 {
@@ -462,6 +533,11 @@ void CraftDefinitionShaped::decrementInput(CraftInput &input, IGameDef *gamedef)
 	craftDecrementOrReplaceInput(input, replacements, gamedef);
 }
 
+std::string CraftDefinitionShaped::getIndexKey(IGameDef *gamedef) const
+{
+	return craftIndexKey(CRAFT_METHOD_NORMAL, craftGetItemNames(recipe, gamedef));
+}
+
 std::string CraftDefinitionShaped::dump() const
 {
 	std::ostringstream os(std::ios::binary);
@@ -509,13 +585,14 @@ bool CraftDefinitionShapeless::check(const CraftInput &input, IGameDef *gamedef)
 		return false;
 	
 	// Filter empty items out of input
+	std::vector<std::string> input_names = craftGetItemNames(input.items, gamedef);
 	std::vector<std::string> input_filtered;
-	for(std::vector<ItemStack>::const_iterator
-			i = input.items.begin();
-			i != input.items.end(); i++)
+	for(std::vector<std::string>::const_iterator
+			i = input_names.begin();
+			i != input_names.end(); i++)
 	{
-		if(i->name != "")
-			input_filtered.push_back(i->name);
+		if(*i != "")
+			input_filtered.push_back(*i);
 	}
 
 	// If there is a wrong number of items in input, no match
@@ -566,6 +643,11 @@ void CraftDefinitionShapeless::decrementInput(CraftInput &input, IGameDef *gamed
 	craftDecrementOrReplaceInput(input, replacements, gamedef);
 }
 
+std::string CraftDefinitionShapeless::getIndexKey(IGameDef *gamedef) const
+{
+	return craftIndexKey(CRAFT_METHOD_NORMAL, craftGetItemNames(recipe, gamedef));
+}
+
 std::string CraftDefinitionShapeless::dump() const
 {
 	std::ostringstream os(std::ios::binary);
@@ -725,13 +807,14 @@ bool CraftDefinitionCooking::check(const CraftInput &input, IGameDef *gamedef) c
 		return false;
 
 	// Filter empty items out of input
+	std::vector<std::string> input_names = craftGetItemNames(input.items, gamedef);
 	std::vector<std::string> input_filtered;
-	for(std::vector<ItemStack>::const_iterator
-			i = input.items.begin();
-			i != input.items.end(); i++)
+	for(std::vector<std::string>::const_iterator
+			i = input_names.begin();
+			i != input_names.end(); i++)
 	{
-		if(i->name != "")
-			input_filtered.push_back(i->name);
+		if(*i != "")
+			input_filtered.push_back(*i);
 	}
 
 	// If there is a wrong number of items in input, no match
@@ -743,7 +826,8 @@ bool CraftDefinitionCooking::check(const CraftInput &input, IGameDef *gamedef) c
 	}
 	
 	// Check the single input item
-	return inputItemMatchesRecipe(input_filtered[0], recipe, gamedef->idef());
+	return inputItemMatchesRecipe(input_filtered[0],
+			craftGetItemName(recipe, gamedef), gamedef->idef());
 }
 
 CraftOutput CraftDefinitionCooking::getOutput(const CraftInput &input, IGameDef *gamedef) const
@@ -763,6 +847,13 @@ void CraftDefinitionCooking::decrementInput(CraftInput &input, IGameDef *gamedef
 	craftDecrementOrReplaceInput(input, replacements, gamedef);
 }
 
+std::string CraftDefinitionCooking::getIndexKey(IGameDef *gamedef) const
+{
+	std::vector<std::string> rec;
+	rec.push_back(craftGetItemName(recipe, gamedef));
+	return craftIndexKey(CRAFT_METHOD_COOKING, rec);
+}
+
 std::string CraftDefinitionCooking::dump() const
 {
 	std::ostringstream os(std::ios::binary);
@@ -806,13 +897,14 @@ bool CraftDefinitionFuel::check(const CraftInput &input, IGameDef *gamedef) cons
 		return false;
 
 	// Filter empty items out of input
+	std::vector<std::string> input_names = craftGetItemNames(input.items, gamedef);
 	std::vector<std::string> input_filtered;
-	for(std::vector<ItemStack>::const_iterator
-			i = input.items.begin();
-			i != input.items.end(); i++)
+	for(std::vector<std::string>::const_iterator
+			i = input_names.begin();
+			i != input_names.end(); i++)
 	{
-		if(i->name != "")
-			input_filtered.push_back(i->name);
+		if(*i != "")
+			input_filtered.push_back(*i);
 	}
 
 	// If there is a wrong number of items in input, no match
@@ -824,7 +916,8 @@ bool CraftDefinitionFuel::check(const CraftInput &input, IGameDef *gamedef) cons
 	}
 	
 	// Check the single input item
-	return inputItemMatchesRecipe(input_filtered[0], recipe, gamedef->idef());
+	return inputItemMatchesRecipe(input_filtered[0],
+			craftGetItemName(recipe, gamedef), gamedef->idef());
 }
 
 CraftOutput CraftDefinitionFuel::getOutput(const CraftInput &input, IGameDef *gamedef) const
@@ -844,6 +937,13 @@ void CraftDefinitionFuel::decrementInput(CraftInput &input, IGameDef *gamedef) c
 	craftDecrementOrReplaceInput(input, replacements, gamedef);
 }
 
+std::string CraftDefinitionFuel::getIndexKey(IGameDef *gamedef) const
+{
+	std::vector<std::string> rec;
+	rec.push_back(craftGetItemName(recipe, gamedef));
+	return craftIndexKey(CRAFT_METHOD_FUEL, rec);
+}
+
 std::string CraftDefinitionFuel::dump() const
 {
 	std::ostringstream os(std::ios::binary);
@@ -876,6 +976,9 @@ void CraftDefinitionFuel::deSerializeBody(std::istream &is, int version)
 class CCraftDefManager: public IWritableCraftDefManager
 {
 public:
+	CCraftDefManager():
+		m_recipe_index_built(false)
+	{}
 	virtual ~CCraftDefManager()
 	{
 		clear();
@@ -901,13 +1004,42 @@ class CCraftDefManager: public IWritableCraftDefManager
 		if(all_empty)
 			return false;
 
-		// Walk crafting definitions from back to front, so that later
+		// Collect the definitions that can match the input: those
+		// indexed by its items, those indexed by its item count (and
+		// one of its items) and those that aren't indexed. The names
+		// are resolved as check() does, as are the keys.
+		std::vector<std::string> input_names =
+				craftGetItemNames(input.items, gamedef);
+		std::vector<std::string> names;
+		for(std::vector<std::string>::const_iterator
+				i = input_names.begin();
+				i != input_names.end(); i++)
+		{
+			if(*i != "")
+				names.push_back(*i);
+		}
+		std::vector<u32> candidates = m_unindexed_recipes;
+		appendIndexedRecipes(craftIndexKeyByItems(input.method, names),
+				candidates);
+		appendIndexedRecipes(craftIndexKeyByCount(input.method, names.size()),
+				candidates);
+		std::set<std::string> distinct_names(names.begin(), names.end());
+		for(std::set<std::string>::const_iterator
+				i = distinct_names.begin();
+				i != distinct_names.end(); i++)
+		{
+			appendIndexedRecipes(craftIndexKeyByCount(input.method,
+					names.size(), *i), candidates);
+		}
+		std::sort(candidates.begin(), candidates.end());
+
+		// Walk them from back to front, so that later
 		// definitions can override earlier ones.
-		for(std::vector<CraftDefinition*>::const_reverse_iterator
-				i = m_craft_definitions.rbegin();
-				i != m_craft_definitions.rend(); i++)
+		for(std::vector<u32>::const_reverse_iterator
+				i = candidates.rbegin();
+				i != candidates.rend(); i++)
 		{
-			CraftDefinition *def = *i;
+			CraftDefinition *def = m_craft_definitions[*i];
 
 			/*infostream<<"Checking "<<input.dump()<<std::endl
 					<<" against "<<def->dump()<<std::endl;*/
@@ -979,6 +1111,25 @@ class CCraftDefManager: public IWritableCraftDefManager
 		std::string output_name = craftGetItemName(
 				def->getOutput(input, gamedef).item, gamedef);
 		m_output_craft_definitions[output_name].push_back(def);
+
+		u32 index = m_craft_definitions.size() - 1;
+		if(m_recipe_index_built)
+			indexRecipe(index, gamedef);
+		else
+			m_unindexed_recipes.push_back(index);
+	}
+	virtual void buildRecipeIndex(IGameDef *gamedef)
+	{
+		m_recipe_index.clear();
+		m_unindexed_recipes.clear();
+		for(u32 i=0; i<m_craft_definitions.size(); i++)
+			indexRecipe(i, gamedef);
+		m_recipe_index_built = true;
+
+		infostream<<"CraftDefManager: Indexed "<<m_craft_definitions.size()
+				<<" craft definitions under "<<m_recipe_index.size()
+				<<" keys, "<<m_unindexed_recipes.size()
+				<<" left unindexed"<<std::endl;
 	}
 	virtual void clear()
 	{
@@ -989,6 +1140,9 @@ class CCraftDefManager: public IWritableCraftDefManager
 		}
 		m_craft_definitions.clear();
 		m_output_craft_definitions.clear();
+		m_recipe_index.clear();
+		m_unindexed_recipes.clear();
+		m_recipe_index_built = false;
 	}
 	virtual void serialize(std::ostream &os) const
 	{
@@ -1023,8 +1177,37 @@ class CCraftDefManager: public IWritableCraftDefManager
 		}
 	}
 private:
+	void indexRecipe(u32 index, IGameDef *gamedef)
+	{
+		CraftDefinition *def = m_craft_definitions[index];
+		std::string key;
+		try {
+			key = def->getIndexKey(gamedef);
+		}
+		catch(SerializationError &e)
+		{
+			// check() will report it
+		}
+		if(key == "")
+			m_unindexed_recipes.push_back(index);
+		else
+			m_recipe_index[key].push_back(index);
+	}
+	void appendIndexedRecipes(const std::string &key,
+			std::vector<u32> &result) const
+	{
+		std::map<std::string, std::vector<u32> >::const_iterator
+			i = m_recipe_index.find(key);
+		if(i != m_recipe_index.end())
+			result.insert(result.end(), i->second.begin(), i->second.end());
+	}
+
 	std::vector<CraftDefinition*> m_craft_definitions;
 	std::map<std::string, std::vector<CraftDefinition*> > m_output_craft_definitions;
+	// Indices into m_craft_definitions, in registration order
+	std::map<std::string, std::vector<u32> > m_recipe_index;
+	std::vector<u32> m_unindexed_recipes;
+	bool m_recipe_index_built;
 };
 
 IWritableCraftDefManager* createCraftDefManager()
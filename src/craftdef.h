@@ -134,6 +134,11 @@ class CraftDefinition
 	virtual CraftInput getInput(const CraftOutput &output, IGameDef *gamedef) const=0;
 	// Decreases count of every input item
 	virtual void decrementInput(CraftInput &input, IGameDef *gamedef) const=0;
+	// Returns the key the manager indexes the recipe by (see
+	// craftIndexKey() in craftdef.cpp), or "" if it has to be checked
+	// against every input
+	virtual std::string getIndexKey(IGameDef *gamedef) const
+	{ return ""; }
 
 	virtual std::string dump() const=0;
 
@@ -168,6 +173,7 @@ class CraftDefinitionShaped: public CraftDefinition
 	virtual CraftOutput getOutput(const CraftInput &input, IGameDef *gamedef) const;
 	virtual CraftInput getInput(const CraftOutput &output, IGameDef *gamedef) const;
 	virtual void decrementInput(CraftInput &input, IGameDef *gamedef) const;
+	virtual std::string getIndexKey(IGameDef *gamedef) const;
 
 	virtual std::string dump() const;
 
@@ -210,6 +216,7 @@ class CraftDefinitionShapeless: public CraftDefinition
 	virtual CraftOutput getOutput(const CraftInput &input, IGameDef *gamedef) const;
 	virtual CraftInput getInput(const CraftOutput &output, IGameDef *gamedef) const;
 	virtual void decrementInput(CraftInput &input, IGameDef *gamedef) const;
+	virtual std::string getIndexKey(IGameDef *gamedef) const;
 
 	virtual std::string dump() const;
 
@@ -288,6 +295,7 @@ class CraftDefinitionCooking: public CraftDefinition
 	virtual CraftOutput getOutput(const CraftInput &input, IGameDef *gamedef) const;
 	virtual CraftInput getInput(const CraftOutput &output, IGameDef *gamedef) const;
 	virtual void decrementInput(CraftInput &input, IGameDef *gamedef) const;
+	virtual std::string getIndexKey(IGameDef *gamedef) const;
 
 	virtual std::string dump() const;
 
@@ -328,6 +336,7 @@ class CraftDefinitionFuel: public CraftDefinition
 	virtual CraftOutput getOutput(const CraftInput &input, IGameDef *gamedef) const;
 	virtual CraftInput getInput(const CraftOutput &output, IGameDef *gamedef) const;
 	virtual void decrementInput(CraftInput &input, IGameDef *gamedef) const;
+	virtual std::string getIndexKey(IGameDef *gamedef) const;
 
 	virtual std::string dump() const;
 
@@ -383,6 +392,11 @@ class IWritableCraftDefManager : public ICraftDefManager
 	// Add a crafting definition.
 	// After calling this, the pointer belongs to the manager.
 	virtual void registerCraft(CraftDefinition *def, IGameDef *gamedef) = 0;
+	// Index the registered definitions by their input, so that
+	// getCraftResult() only checks the ones that can match.
+	// Call after all item aliases are known; definitions registered
+	// afterwards are indexed right away.
+	virtual void buildRecipeIndex(IGameDef *gamedef) = 0;
 	// Delete all crafting definitions
 	virtual void clear()=0;
 
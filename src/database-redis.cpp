@@ -119,6 +119,54 @@ std::string Database_Redis::loadBlock(const v3s16 &pos)
 	return str;
 }
 
+void Database_Redis::loadBlocks(const std::vector<v3s16> &positions,
+		std::vector<std::string> *data)
+{
+	data->clear();
+	data->resize(positions.size());
+	if (positions.empty())
+		return;
+
+	// One HMGET for all of them
+	std::vector<std::string> keys;
+	keys.reserve(positions.size());
+	for (size_t i = 0; i < positions.size(); i++)
+		keys.push_back(i64tos(getBlockAsInteger(positions[i])));
+
+	std::vector<const char *> argv;
+	std::vector<size_t> argvlen;
+	argv.push_back("HMGET");
+	argvlen.push_back(5);
+	argv.push_back(hash.c_str());
+	argvlen.push_back(hash.size());
+	for (size_t i = 0; i < keys.size(); i++) {
+		argv.push_back(keys[i].c_str());
+		argvlen.push_back(keys[i].size());
+	}
+
+	redisReply *reply = static_cast<redisReply *>(redisCommandArgv(ctx,
+			argv.size(), &argv[0], &argvlen[0]));
+	if (!reply) {
+		throw FileNotGoodException(std::string(
+			"Redis command 'HMGET' failed: ") + ctx->errstr);
+	}
+	if (reply->type != REDIS_REPLY_ARRAY ||
+			reply->elements != positions.size()) {
+		std::string err = reply->type == REDIS_REPLY_ERROR ?
+			std::string(reply->str, reply->len) :
+			"unexpected reply type";
+		freeReplyObject(reply);
+		throw FileNotGoodException(std::string(
+			"Redis command 'HMGET' failed: ") + err);
+	}
+	for (size_t i = 0; i < reply->elements; i++) {
+		redisReply *r = reply->element[i];
+		if (r->type == REDIS_REPLY_STRING)
+			(*data)[i].assign(r->str, r->len);
+	}
+	freeReplyObject(reply);
+}
+
 bool Database_Redis::deleteBlock(const v3s16 &pos)
 {
 	std::string tmp = i64tos(getBlockAsInteger(pos));
@@ -41,6 +41,8 @@ class Database_Redis : public Database
 
 	virtual bool saveBlock(const v3s16 &pos, const std::string &data);
 	virtual std::string loadBlock(const v3s16 &pos);
+	virtual void loadBlocks(const std::vector<v3s16> &positions,
+			std::vector<std::string> *data);
 	virtual bool deleteBlock(const v3s16 &pos);
 	virtual void listAllLoadableBlocks(std::vector<v3s16> &dst);
 
@@ -33,6 +33,7 @@ SQLite format specification:
 #include "main.h"
 #include "settings.h"
 #include "util/string.h"
+#include "util/numeric.h"
 
 #include <cassert>
 
@@ -50,6 +51,9 @@ SQLite format specification:
 #define PREPARE_STATEMENT(name, query) \
 	SQLOK(sqlite3_prepare_v2(m_database, query, -1, &m_stmt_##name, NULL))
 
+// Number of positions looked up by one m_stmt_read_many query
+#define READ_MANY_COUNT 32
+
 #define FINALIZE_STATEMENT(statement) \
 	if (sqlite3_finalize(statement) != SQLITE_OK) { \
 		throw FileNotGoodException(std::string( \
@@ -63,6 +67,7 @@ Database_SQLite3::Database_SQLite3(const std::string &savedir) :
 	m_savedir(savedir),
 	m_database(NULL),
 	m_stmt_read(NULL),
+	m_stmt_read_many(NULL),
 	m_stmt_write(NULL),
 	m_stmt_list(NULL),
 	m_stmt_delete(NULL)
@@ -124,6 +129,11 @@ void Database_SQLite3::verifyDatabase()
 	PREPARE_STATEMENT(begin, "BEGIN");
 	PREPARE_STATEMENT(end, "COMMIT");
 	PREPARE_STATEMENT(read, "SELECT `data` FROM `blocks` WHERE `pos` = ? LIMIT 1");
+	std::string read_many = "SELECT `pos`, `data` FROM `blocks` WHERE `pos` IN (?";
+	for (u32 i = 1; i < READ_MANY_COUNT; i++)
+		read_many += ", ?";
+	read_many += ")";
+	PREPARE_STATEMENT(read_many, read_many.c_str());
 #ifdef __ANDROID__
 	PREPARE_STATEMENT(write,  "INSERT INTO `blocks` (`pos`, `data`) VALUES (?, ?)");
 #else
@@ -208,6 +218,44 @@ std::string Database_SQLite3::loadBlock(const v3s16 &pos)
 	return s;
 }
 
+void Database_SQLite3::loadBlocks(const std::vector<v3s16> &positions,
+		std::vector<std::string> *data)
+{
+	verifyDatabase();
+
+	data->clear();
+	data->resize(positions.size());
+
+	for (size_t start = 0; start < positions.size(); start += READ_MANY_COUNT) {
+		size_t end = MYMIN(start + READ_MANY_COUNT, positions.size());
+		if (end - start == 1) {
+			(*data)[start] = loadBlock(positions[start]);
+			continue;
+		}
+
+		// Unused parameters repeat the last position
+		for (size_t i = 0; i < READ_MANY_COUNT; i++)
+			bindPos(m_stmt_read_many, positions[MYMIN(start + i, end - 1)], i + 1);
+
+		int res;
+		while ((res = sqlite3_step(m_stmt_read_many)) == SQLITE_ROW) {
+			v3s16 pos = getIntegerAsBlock(
+					sqlite3_column_int64(m_stmt_read_many, 0));
+			const char *blob = (const char *)
+					sqlite3_column_blob(m_stmt_read_many, 1);
+			size_t len = sqlite3_column_bytes(m_stmt_read_many, 1);
+			if (!blob)
+				continue;
+			for (size_t i = start; i < end; i++) {
+				if (positions[i] == pos)
+					(*data)[i].assign(blob, len);
+			}
+		}
+		sqlite3_reset(m_stmt_read_many);
+		SQLRES(res, SQLITE_DONE)
+	}
+}
+
 void Database_SQLite3::createDatabase()
 {
 	assert(m_database); // Pre-condition
@@ -232,6 +280,7 @@ void Database_SQLite3::listAllLoadableBlocks(std::vector<v3s16> &dst)
 Database_SQLite3::~Database_SQLite3()
 {
 	FINALIZE_STATEMENT(m_stmt_read)
+	FINALIZE_STATEMENT(m_stmt_read_many)
 	FINALIZE_STATEMENT(m_stmt_write)
 	FINALIZE_STATEMENT(m_stmt_list)
 	FINALIZE_STATEMENT(m_stmt_begin)
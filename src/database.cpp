@@ -48,6 +48,15 @@ static inline s64 pythonmodulo(s64 i, s16 mod)
 }
 
 
+void Database::loadBlocks(const std::vector<v3s16> &positions,
+		std::vector<std::string> *data)
+{
+	data->resize(positions.size());
+	for (size_t i = 0; i < positions.size(); i++)
+		(*data)[i] = loadBlock(positions[i]);
+}
+
+
 s64 Database::getBlockAsInteger(const v3s16 &pos)
 {
 	return (u64) pos.Z * 0x1000000 +
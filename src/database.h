@@ -39,6 +39,10 @@ class Database
 
 	virtual bool saveBlock(const v3s16 &pos, const std::string &data) = 0;
 	virtual std::string loadBlock(const v3s16 &pos) = 0;
+	// Loads many blocks at once; data gets one entry per position,
+	// empty if the block doesn't exist. The default calls loadBlock().
+	virtual void loadBlocks(const std::vector<v3s16> &positions,
+			std::vector<std::string> *data);
 	virtual bool deleteBlock(const v3s16 &pos) = 0;
 
 	static s64 getBlockAsInteger(const v3s16 &pos);
@@ -109,6 +109,7 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("new_style_leaves", "true");
 	settings->setDefault("connected_glass", "false");
 	settings->setDefault("smooth_lighting", "true");
+	settings->setDefault("num_mesh_threads", "0");
 	settings->setDefault("display_gamma", "1.8");
 	settings->setDefault("texture_path", "");
 	settings->setDefault("shader_path", "");
@@ -245,7 +246,12 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("profiler_print_interval", "0");
 	settings->setDefault("enable_mapgen_debug_info", "false");
 	settings->setDefault("active_object_send_range_blocks", "3");
+	settings->setDefault("object_update_medium_distance", "20");
+	settings->setDefault("object_update_medium_divisor", "2");
+	settings->setDefault("object_update_far_distance", "40");
+	settings->setDefault("object_update_far_divisor", "4");
 	settings->setDefault("active_block_range", "2");
+	settings->setDefault("num_abm_threads", "0");
 	//settings->setDefault("max_simultaneous_block_sends_per_client", "1");
 	// This causes frametime jitter on client side, or does it?
 	settings->setDefault("max_simultaneous_block_sends_per_client", "10");
@@ -260,6 +266,7 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("max_objects_per_block", "49");
 	settings->setDefault("server_map_save_interval", "5.3");
 	settings->setDefault("sqlite_synchronous", "2");
+	settings->setDefault("map_save_queue_size", "512");
 	settings->setDefault("full_block_send_enable_min_time_from_building", "2.0");
 	settings->setDefault("dedicated_server_step", "0.1");
 	settings->setDefault("ignore_world_load_errors", "false");
@@ -287,6 +294,7 @@ void set_default_settings(Settings *settings)
 	//liquid stuff
 	settings->setDefault("liquid_loop_max", "100000");
 	settings->setDefault("liquid_queue_purge_time", "0");
+	settings->setDefault("num_liquid_threads", "0");
 	settings->setDefault("liquid_update", "1.0");
 
 	//mapgen stuff
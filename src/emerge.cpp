@@ -22,7 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "emerge.h"
 #include "server.h"
 #include <iostream>
-#include <queue>
+#include <algorithm>
 #include "jthread/jevent.h"
 #include "map.h"
 #include "environment.h"
@@ -71,7 +71,6 @@ class EmergeThread : public JThread
 	int id;
 
 	Event qevent;
-	std::queue<v3s16> blockqueue;
 
 	EmergeThread(Server *server, int ethreadid):
 		JThread(),
@@ -85,7 +84,6 @@ class EmergeThread : public JThread
 	}
 
 	void *Thread();
-	bool popBlockEmerge(v3s16 *pos, u8 *flags);
 	bool getBlockOrStartGen(v3s16 p, MapBlock **b,
 			BlockMakeData *data, bool allow_generate);
 };
@@ -101,6 +99,8 @@ EmergeManager::EmergeManager(IGameDef *gamedef)
 	this->decomgr   = new DecorationManager(gamedef);
 	this->schemmgr  = new SchematicManager(gamedef);
 	this->gen_notify_on = 0;
+	this->last_peer_served = 0;
+	this->next_seq = 0;
 
 	// Note that accesses to this variable are not synchronized.
 	// This is because the *only* thread ever starting or stopping
@@ -147,11 +147,18 @@ EmergeManager::~EmergeManager()
 			emergethread[i]->Wait();
 		}
 		delete emergethread[i];
-		delete mapgen[i];
 	}
 	emergethread.clear();
+	// Empty if initMapgens() has not been called
+	for (u32 i = 0; i != mapgen.size(); i++)
+		delete mapgen[i];
 	mapgen.clear();
 
+	std::map<v3s16, BlockEmergeData *>::iterator iter;
+	for (iter = blocks_enqueued.begin(); iter != blocks_enqueued.end(); ++iter)
+		delete iter->second;
+	blocks_enqueued.clear();
+
 	delete biomemgr;
 	delete oremgr;
 	delete decomgr;
@@ -240,9 +247,7 @@ bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate
 {
 	std::map<v3s16, BlockEmergeData *>::const_iterator iter;
 	BlockEmergeData *bedata;
-	u16 count;
 	u8 flags = 0;
-	int idx = 0;
 
 	if (allow_generate)
 		flags |= BLOCK_EMERGE_ALLOWGEN;
@@ -250,47 +255,241 @@ bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate
 	{
 		JMutexAutoLock queuelock(queuemutex);
 
-		count = blocks_enqueued.size();
-		if (count >= qlimit_total)
+		if (blocks_enqueued.size() >= qlimit_total)
 			return false;
 
-		count = peer_queue_count[peer_id];
+		std::set<v3s16> &peer_queue = peer_queues[peer_id];
 		u16 qlimit_peer = allow_generate ? qlimit_generate : qlimit_diskonly;
-		if (count >= qlimit_peer)
+		if (peer_queue.size() >= qlimit_peer) {
+			if (peer_queue.empty())
+				peer_queues.erase(peer_id);
 			return false;
+		}
 
 		iter = blocks_enqueued.find(p);
 		if (iter != blocks_enqueued.end()) {
 			bedata = iter->second;
 			bedata->flags |= flags;
+			if (peer_queue.insert(p).second)
+				bedata->peers_requested.push_back(peer_id);
 			return true;
 		}
 
 		bedata = new BlockEmergeData;
 		bedata->flags = flags;
-		bedata->peer_requested = peer_id;
+		bedata->peers_requested.push_back(peer_id);
+		bedata->seq = next_seq++;
 		blocks_enqueued.insert(std::make_pair(p, bedata));
+		peer_queue.insert(p);
+	}
+
+	// All threads take from the same queue; wake up any idle ones
+	for (u32 i = 0; i != emergethread.size(); i++)
+		emergethread[i]->qevent.signal();
+
+	return true;
+}
+
+
+/*
+	Lower is sooner. Blocks are ordered by their distance to the peer, like
+	in RemoteClient::GetNextBlocks(), and blocks behind the peer count up to
+	twice as far as blocks in front of it.
+*/
+static float emerge_priority(v3s16 p, const EmergePeerView &view)
+{
+	v3s16 d = p - view.blockpos;
+	s16 dist = MYMAX(MYMAX(abs(d.X), abs(d.Y)), abs(d.Z));
+	if (dist == 0)
+		return 0;
+
+	v3f dirf(d.X, d.Y, d.Z);
+	float facing = dirf.dotProduct(view.dir) / dirf.getLength();
+	return dist * (1.5 - 0.5 * facing);
+}
 
-		peer_queue_count[peer_id] = count + 1;
 
-		// insert into the EmergeThread queue with the least items
-		int lowestitems = emergethread[0]->blockqueue.size();
-		for (u32 i = 1; i != emergethread.size(); i++) {
-			int nitems = emergethread[i]->blockqueue.size();
-			if (nitems < lowestitems) {
-				idx = i;
-				lowestitems = nitems;
+bool EmergeManager::popBlockEmerge(v3s16 *pos, u8 *flags)
+{
+	JMutexAutoLock queuelock(queuemutex);
+
+	if (blocks_enqueued.empty())
+		return false;
+
+	std::map<v3s16, BlockEmergeData *>::iterator best = blocks_enqueued.end();
+
+	/*
+		Serve the peers in turn, so that one peer with a full queue can't
+		starve the others
+	*/
+	std::map<u16, std::set<v3s16> >::iterator peer =
+		peer_queues.upper_bound(last_peer_served);
+	if (peer == peer_queues.end())
+		peer = peer_queues.begin();
+
+	if (peer != peer_queues.end()) {
+		u16 peer_id = peer->first;
+		last_peer_served = peer_id;
+
+		// Pick the request of that peer that is needed soonest
+		std::map<u16, EmergePeerView>::iterator view = peer_views.find(peer_id);
+		float best_priority = 0;
+		for (std::set<v3s16>::iterator i = peer->second.begin();
+				i != peer->second.end(); ++i) {
+			std::map<v3s16, BlockEmergeData *>::iterator iter =
+				blocks_enqueued.find(*i);
+			if (iter == blocks_enqueued.end())
+				continue;
+
+			float priority = 0;
+			if (view != peer_views.end())
+				priority = emerge_priority(iter->first, view->second);
+
+			if (best == blocks_enqueued.end() || priority < best_priority ||
+					(priority == best_priority &&
+					iter->second->seq < best->second->seq)) {
+				best = iter;
+				best_priority = priority;
 			}
 		}
+	}
 
-		emergethread[idx]->blockqueue.push(p);
+	// Every queued block should be in a peer queue; if not, take the
+	// oldest one
+	if (best == blocks_enqueued.end()) {
+		errorstream << "EmergeManager: queued blocks without a peer queue"
+			<< std::endl;
+		std::map<v3s16, BlockEmergeData *>::iterator iter;
+		for (iter = blocks_enqueued.begin(); iter != blocks_enqueued.end(); ++iter) {
+			if (best == blocks_enqueued.end() ||
+					iter->second->seq < best->second->seq)
+				best = iter;
+		}
 	}
-	emergethread[idx]->qevent.signal();
+
+	*pos = best->first;
+	*flags = best->second->flags;
+
+	removeBlockEmerge(best);
 
 	return true;
 }
 
 
+void EmergeManager::getQueuedBlocksNear(v3s16 p, s16 radius,
+	std::vector<v3s16> &dst)
+{
+	JMutexAutoLock queuelock(queuemutex);
+
+	// Look up the positions around p rather than walk the whole queue
+	v3s16 d;
+	for (d.Z = -radius; d.Z <= radius; d.Z++)
+	for (d.Y = -radius; d.Y <= radius; d.Y++)
+	for (d.X = -radius; d.X <= radius; d.X++) {
+		if (blocks_enqueued.find(p + d) != blocks_enqueued.end())
+			dst.push_back(p + d);
+	}
+}
+
+
+void EmergeManager::updatePeerView(u16 peer_id, v3s16 blockpos, v3f dir, s16 range)
+{
+	JMutexAutoLock queuelock(queuemutex);
+
+	EmergePeerView &view = peer_views[peer_id];
+	view.blockpos = blockpos;
+	view.dir      = dir;
+	view.range    = range;
+
+	/*
+		Drop the requests of the peer that have gone out of its range.
+		It will ask again if it gets back in range. Blocks that other
+		peers want stay queued.
+	*/
+	std::map<u16, std::set<v3s16> >::iterator peer = peer_queues.find(peer_id);
+	if (peer == peer_queues.end())
+		return;
+
+	std::vector<v3s16> stale;
+	for (std::set<v3s16>::iterator i = peer->second.begin();
+			i != peer->second.end(); ++i) {
+		v3s16 d = *i - blockpos;
+		if (MYMAX(MYMAX(abs(d.X), abs(d.Y)), abs(d.Z)) > range + 1)
+			stale.push_back(*i);
+	}
+
+	for (u32 i = 0; i != stale.size(); i++)
+		dropPeerRequest(stale[i], peer_id);
+	if (!stale.empty())
+		g_profiler->add("EmergeManager: stale requests dropped", stale.size());
+}
+
+
+void EmergeManager::cancelPeerEmerges(u16 peer_id)
+{
+	JMutexAutoLock queuelock(queuemutex);
+
+	std::map<u16, std::set<v3s16> >::iterator peer = peer_queues.find(peer_id);
+	if (peer != peer_queues.end()) {
+		std::vector<v3s16> queued(peer->second.begin(), peer->second.end());
+		for (u32 i = 0; i != queued.size(); i++)
+			dropPeerRequest(queued[i], peer_id);
+	}
+
+	peer_views.erase(peer_id);
+}
+
+
+u32 EmergeManager::getPeerQueueSize(u16 peer_id)
+{
+	JMutexAutoLock queuelock(queuemutex);
+
+	std::map<u16, std::set<v3s16> >::iterator peer = peer_queues.find(peer_id);
+	return peer == peer_queues.end() ? 0 : peer->second.size();
+}
+
+
+void EmergeManager::dropPeerRequest(v3s16 p, u16 peer_id)
+{
+	std::map<u16, std::set<v3s16> >::iterator peer = peer_queues.find(peer_id);
+	if (peer != peer_queues.end()) {
+		peer->second.erase(p);
+		if (peer->second.empty())
+			peer_queues.erase(peer);
+	}
+
+	std::map<v3s16, BlockEmergeData *>::iterator iter = blocks_enqueued.find(p);
+	if (iter == blocks_enqueued.end())
+		return;
+
+	std::vector<u16> &peers = iter->second->peers_requested;
+	peers.erase(std::remove(peers.begin(), peers.end(), peer_id), peers.end());
+	if (peers.empty()) {
+		delete iter->second;
+		blocks_enqueued.erase(iter);
+	}
+}
+
+
+void EmergeManager::removeBlockEmerge(
+	std::map<v3s16, BlockEmergeData *>::iterator iter)
+{
+	std::vector<u16> &peers = iter->second->peers_requested;
+	for (u32 i = 0; i != peers.size(); i++) {
+		std::map<u16, std::set<v3s16> >::iterator peer =
+			peer_queues.find(peers[i]);
+		if (peer == peer_queues.end())
+			continue;
+		peer->second.erase(iter->first);
+		if (peer->second.empty())
+			peer_queues.erase(peer);
+	}
+
+	delete iter->second;
+	blocks_enqueued.erase(iter);
+}
+
+
 int EmergeManager::getGroundLevelAtPoint(v2s16 p)
 {
 	if (mapgen.size() == 0 || !mapgen[0]) {
@@ -358,34 +557,6 @@ MapgenSpecificParams *EmergeManager::createMapgenParams(const std::string &mgnam
 
 ////////////////////////////// Emerge Thread //////////////////////////////////
 
-bool EmergeThread::popBlockEmerge(v3s16 *pos, u8 *flags)
-{
-	std::map<v3s16, BlockEmergeData *>::iterator iter;
-	JMutexAutoLock queuelock(emerge->queuemutex);
-
-	if (blockqueue.empty())
-		return false;
-	v3s16 p = blockqueue.front();
-	blockqueue.pop();
-
-	*pos = p;
-
-	iter = emerge->blocks_enqueued.find(p);
-	if (iter == emerge->blocks_enqueued.end())
-		return false; //uh oh, queue and map out of sync!!
-
-	BlockEmergeData *bedata = iter->second;
-	*flags = bedata->flags;
-
-	emerge->peer_queue_count[bedata->peer_requested]--;
-
-	delete bedata;
-	emerge->blocks_enqueued.erase(iter);
-
-	return true;
-}
-
-
 bool EmergeThread::getBlockOrStartGen(v3s16 p, MapBlock **b,
 	BlockMakeData *data, bool allow_gen)
 {
@@ -402,6 +573,26 @@ bool EmergeThread::getBlockOrStartGen(v3s16 p, MapBlock **b,
 	if (!block || block->isDummy() || !block->isGenerated()) {
 		EMERGE_DBG_OUT("not in memory, attempting to load from disk");
 		block = map->loadBlock(p);
+
+		/*
+			Requests usually come in whole neighbourhoods, so load the
+			queued blocks around this one with one database query. Not
+			when this one is missing: in new terrain they all would be.
+		*/
+		if (block) {
+			std::vector<v3s16> positions;
+			std::vector<v3s16> queued;
+			emerge->getQueuedBlocksNear(p, EMERGE_PREFETCH_RADIUS, queued);
+			for (size_t i = 0; i < queued.size(); i++) {
+				if (queued[i] != p && !blockpos_over_limit(queued[i]) &&
+						!map->getBlockNoCreateNoEx(queued[i]))
+					positions.push_back(queued[i]);
+			}
+			g_profiler->avg("EmergeThread: blocks prefetched", positions.size());
+			if (!positions.empty())
+				map->loadBlocks(positions);
+		}
+
 		if (block && block->isGenerated())
 			map->prepareBlock(block);
 	}
@@ -439,7 +630,7 @@ void *EmergeThread::Thread()
 
 	while (!StopRequested())
 	try {
-		if (!popBlockEmerge(&p, &flags)) {
+		if (!emerge->popBlockEmerge(&p, &flags)) {
 			qevent.wait();
 			continue;
 		}
@@ -538,23 +729,6 @@ void *EmergeThread::Thread()
 		m_server->setAsyncFatalError(err.str());
 	}
 
-	{
-		JMutexAutoLock queuelock(emerge->queuemutex);
-		while (!blockqueue.empty())
-		{
-			v3s16 p = blockqueue.front();
-			blockqueue.pop();
-
-			std::map<v3s16, BlockEmergeData *>::iterator iter;
-			iter = emerge->blocks_enqueued.find(p);
-			if (iter == emerge->blocks_enqueued.end())
-				continue; //uh oh, queue and map out of sync!!
-
-			BlockEmergeData *bedata = iter->second;
-			delete bedata;
-		}
-	}
-
 	END_DEBUG_EXCEPTION_HANDLER(errorstream)
 	log_deregister_thread();
 	return NULL;
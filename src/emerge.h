@@ -21,6 +21,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define EMERGE_HEADER
 
 #include <map>
+#include <set>
+#include <vector>
 #include "irr_v3d.h"
 #include "util/container.h"
 #include "mapgen.h" // for MapgenParams
@@ -28,6 +30,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #define BLOCK_EMERGE_ALLOWGEN (1<<0)
 
+// Queued blocks this close to a block that is loaded from disk are
+// loaded along with it
+#define EMERGE_PREFETCH_RADIUS 2
+
 #define EMERGE_DBG_OUT(x) \
 	do {                                                   \
 		if (enable_mapgen_debug_info)                      \
@@ -62,8 +68,22 @@ struct BlockMakeData {
 };
 
 struct BlockEmergeData {
-	u16 peer_requested;
+	// Every peer that has asked for the block and still wants it
+	std::vector<u16> peers_requested;
 	u8 flags;
+	// Order of arrival; requests of equal priority are served in this order
+	u32 seq;
+};
+
+/*
+	Where a peer is and where it is looking, for ordering its emerge
+	requests. Set by RemoteClient::GetNextBlocks().
+*/
+struct EmergePeerView {
+	v3s16 blockpos;
+	v3f dir;
+	// Requests farther away than this (in blocks) are dropped
+	s16 range;
 };
 
 class EmergeManager {
@@ -88,7 +108,11 @@ class EmergeManager {
 	//// Block emerge queue data structures
 	JMutex queuemutex;
 	std::map<v3s16, BlockEmergeData *> blocks_enqueued;
-	std::map<u16, u16> peer_queue_count;
+	// The queued blocks of each peer; peers with none are left out
+	std::map<u16, std::set<v3s16> > peer_queues;
+	std::map<u16, EmergePeerView> peer_views;
+	u16 last_peer_served;
+	u32 next_seq;
 
 	//// Managers of map generation-related components
 	BiomeManager *biomemgr;
@@ -110,11 +134,23 @@ class EmergeManager {
 	void startThreads();
 	void stopThreads();
 	bool enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate);
+	bool popBlockEmerge(v3s16 *pos, u8 *flags);
+	// Queued positions at most radius blocks away from p
+	void getQueuedBlocksNear(v3s16 p, s16 radius, std::vector<v3s16> &dst);
+	void updatePeerView(u16 peer_id, v3s16 blockpos, v3f dir, s16 range);
+	void cancelPeerEmerges(u16 peer_id);
+	// Number of blocks that peer_id has queued
+	u32 getPeerQueueSize(u16 peer_id);
 
 	//mapgen helper methods
 	Biome *getBiomeAtPoint(v3s16 p);
 	int getGroundLevelAtPoint(v2s16 p);
 	bool isBlockUnderground(v3s16 blockpos);
+
+private:
+	// These expect queuemutex to be locked
+	void dropPeerRequest(v3s16 p, u16 peer_id);
+	void removeBlockEmerge(std::map<v3s16, BlockEmergeData *>::iterator iter);
 };
 
 #endif
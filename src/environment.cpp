@@ -43,7 +43,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "map.h"
 #include "emerge.h"
 #include "util/serialize.h"
+#include "util/thread.h"
 #include "jthread/jmutexautolock.h"
+#include "voxel.h"
+#include "noise.h" // PcgRandom
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -349,6 +352,125 @@ void ActiveBlockList::update(std::vector<v3s16> &active_positions,
 	}
 }
 
+/*
+	ActiveObjectGrid
+*/
+
+v3s16 ActiveObjectGrid::getCellPos(v3f pos)
+{
+	return getNodeBlockPos(floatToInt(pos, BS));
+}
+
+void ActiveObjectGrid::insert(ServerActiveObject *obj)
+{
+	v3s16 cellpos = getCellPos(obj->getBasePosition());
+	m_cells[cellpos].push_back(obj);
+	Entry &entry = m_objects[obj->getId()];
+	entry.obj = obj;
+	entry.cellpos = cellpos;
+	if(obj->getType() == ACTIVEOBJECT_TYPE_PLAYER)
+		m_player_objects.insert(obj);
+}
+
+void ActiveObjectGrid::removeFromCell(v3s16 cellpos, ServerActiveObject *obj)
+{
+	CellMap::iterator c = m_cells.find(cellpos);
+	if(c == m_cells.end())
+		return;
+	std::vector<ServerActiveObject*> &objects = c->second;
+	for(std::vector<ServerActiveObject*>::iterator
+			i = objects.begin(); i != objects.end(); ++i) {
+		if(*i == obj) {
+			*i = objects.back();
+			objects.pop_back();
+			break;
+		}
+	}
+	if(objects.empty())
+		m_cells.erase(c);
+}
+
+void ActiveObjectGrid::remove(u16 id)
+{
+	// The object may already be deleted, so only its address is used
+	std::map<u16, Entry>::iterator n = m_objects.find(id);
+	if(n == m_objects.end())
+		return;
+	removeFromCell(n->second.cellpos, n->second.obj);
+	m_player_objects.erase(n->second.obj);
+	m_objects.erase(n);
+}
+
+void ActiveObjectGrid::update(ServerActiveObject *obj)
+{
+	std::map<u16, Entry>::iterator n = m_objects.find(obj->getId());
+	if(n == m_objects.end())
+		return;
+	v3s16 cellpos = getCellPos(obj->getBasePosition());
+	if(cellpos == n->second.cellpos)
+		return;
+	removeFromCell(n->second.cellpos, obj);
+	m_cells[cellpos].push_back(obj);
+	n->second.cellpos = cellpos;
+}
+
+void ActiveObjectGrid::clear()
+{
+	m_cells.clear();
+	m_objects.clear();
+	m_player_objects.clear();
+}
+
+u32 ActiveObjectGrid::getObjectsNear(v3f pos, float radius,
+		std::vector<ServerActiveObject*> &result) const
+{
+	size_t count_before = result.size();
+	v3f r(radius, radius, radius);
+
+	/*
+		For a large radius it is cheaper to go through the occupied
+		cells than to look up every cell of the bounding box.
+	*/
+	f32 span = 2 * radius / (MAP_BLOCKSIZE * BS) + 2;
+	if(span * span * span > m_cells.size()) {
+		v3f pmin = pos - r;
+		v3f pmax = pos + r;
+		for(CellMap::const_iterator
+				c = m_cells.begin(); c != m_cells.end(); ++c) {
+			// Extent of the cell, which holds whole nodes
+			v3f cmin = intToFloat(c->first * MAP_BLOCKSIZE, BS)
+					- v3f(BS, BS, BS) / 2;
+			v3f cmax = cmin + v3f(BS, BS, BS) * MAP_BLOCKSIZE;
+			if(cmax.X < pmin.X || cmin.X > pmax.X ||
+					cmax.Y < pmin.Y || cmin.Y > pmax.Y ||
+					cmax.Z < pmin.Z || cmin.Z > pmax.Z)
+				continue;
+			result.insert(result.end(), c->second.begin(), c->second.end());
+		}
+		return result.size() - count_before;
+	}
+
+	v3s16 cmin = getCellPos(pos - r);
+	v3s16 cmax = getCellPos(pos + r);
+	v3s16 p;
+	for(p.X = cmin.X; p.X <= cmax.X; p.X++)
+	for(p.Y = cmin.Y; p.Y <= cmax.Y; p.Y++)
+	for(p.Z = cmin.Z; p.Z <= cmax.Z; p.Z++) {
+		CellMap::const_iterator c = m_cells.find(p);
+		if(c == m_cells.end())
+			continue;
+		result.insert(result.end(), c->second.begin(), c->second.end());
+	}
+	return result.size() - count_before;
+}
+
+void ActiveObjectGrid::getPlayerObjects(
+		std::vector<ServerActiveObject*> &result) const
+{
+	result.insert(result.end(),
+			m_player_objects.begin(), m_player_objects.end());
+}
+
 /*
 	ServerEnvironment
 */
@@ -365,8 +487,14 @@ ServerEnvironment::ServerEnvironment(ServerMap *map,
 	m_game_time(0),
 	m_game_time_fraction_counter(0),
 	m_recommended_send_interval(0.1),
-	m_max_lag_estimate(0.1)
+	m_max_lag_estimate(0.1),
+	m_abm_workers(NULL),
+	m_active_block_range(g_settings, "active_block_range"),
+	m_max_objects_per_block(g_settings, "max_objects_per_block")
 {
+	u16 num_abm_threads = g_settings->getU16("num_abm_threads");
+	if(num_abm_threads > 0)
+		m_abm_workers = new WorkerPool(num_abm_threads, "ABMWorkerThread");
 }
 
 ServerEnvironment::~ServerEnvironment()
@@ -381,6 +509,8 @@ ServerEnvironment::~ServerEnvironment()
 	// Drop/delete map
 	m_map->drop();
 
+	delete m_abm_workers;
+
 	// Delete ActiveBlockModifiers
 	for(std::vector<ABMWithState>::iterator
 			i = m_abms.begin(); i != m_abms.end(); ++i){
@@ -554,11 +684,70 @@ struct ActiveABM
 	std::set<content_t> required_neighbors;
 };
 
+class ABMHandler;
+
+/*
+	An ABM that passed its chance roll and neighbor check in a worker thread
+	and is to be triggered on the server thread
+*/
+struct ABMTrigger
+{
+	ABMTrigger(v3s16 a_p, content_t a_c, const ActiveABM *a_aabm):
+		p(a_p), c(a_c), aabm(a_aabm)
+	{}
+	// Position relative to the block
+	v3s16 p;
+	// Content of the node when it was evaluated
+	content_t c;
+	const ActiveABM *aabm;
+};
+
+/*
+	The read-only part of running ABMs on one block, done on the ABM
+	worker threads.
+	Reads the block and its neighbors in place; the map isn't changed while
+	the jobs run, as the server thread holds the environment lock and only
+	helps running them.
+*/
+struct ABMBlockJob : public WorkerJob
+{
+	void run();
+
+	// Content of a node relative to the block, at most one node outside
+	// of it. CONTENT_IGNORE in neighbors that aren't loaded.
+	content_t getContent(v3s16 p) const
+	{
+		s16 bx = p.X < 0 ? 0 : p.X < MAP_BLOCKSIZE ? 1 : 2;
+		s16 by = p.Y < 0 ? 0 : p.Y < MAP_BLOCKSIZE ? 1 : 2;
+		s16 bz = p.Z < 0 ? 0 : p.Z < MAP_BLOCKSIZE ? 1 : 2;
+		MapBlock *b = blocks[bz*9 + by*3 + bx];
+		if(b == NULL)
+			return CONTENT_IGNORE;
+		v3s16 rel((p.X + MAP_BLOCKSIZE) % MAP_BLOCKSIZE,
+				(p.Y + MAP_BLOCKSIZE) % MAP_BLOCKSIZE,
+				(p.Z + MAP_BLOCKSIZE) % MAP_BLOCKSIZE);
+		return b->getNodeNoEx(rel).getContent();
+	}
+
+	const ABMHandler *handler;
+	v3s16 blockpos;
+	// The block and its neighbors, indexed by (z+1)*9 + (y+1)*3 + (x+1);
+	// NULL where not loaded
+	MapBlock *blocks[27];
+	// Number of nodes in the block that can trigger an ABM
+	u32 candidates;
+	// Seed for the chance rolls
+	u64 seed;
+	// Result
+	std::vector<ABMTrigger> triggers;
+};
+
 class ABMHandler
 {
 private:
 	ServerEnvironment *m_env;
-	std::map<content_t, std::vector<ActiveABM> > m_aabms;
+	// Indexed by content id; empty for contents that trigger no ABM
+	std::vector<std::vector<ActiveABM> > m_aabms;
 public:
 	ABMHandler(std::vector<ABMWithState> &abms,
 			float dtime_s, ServerEnvironment *env,
@@ -613,14 +802,9 @@ class ABMHandler
 						k != ids.end(); k++)
 				{
 					content_t c = *k;
-					std::map<content_t, std::vector<ActiveABM> >::iterator j;
-					j = m_aabms.find(c);
-					if(j == m_aabms.end()){
-						std::vector<ActiveABM> aabmlist;
-						m_aabms[c] = aabmlist;
-						j = m_aabms.find(c);
-					}
-					j->second.push_back(aabm);
+					if(c >= m_aabms.size())
+						m_aabms.resize(c + 256);
+					m_aabms[c].push_back(aabm);
 				}
 			}
 		}
@@ -653,33 +837,67 @@ class ABMHandler
 		return active_object_count;
 
 	}
+	// NULL if the content triggers no ABM
+	const std::vector<ActiveABM> *getABMs(content_t c) const
+	{
+		if(c >= m_aabms.size() || m_aabms[c].empty())
+			return NULL;
+		return &m_aabms[c];
+	}
+	// Uses the content histogram to find out how many nodes in the
+	// block can trigger anything
+	u32 countCandidates(MapBlock *block) const
+	{
+		u32 candidates = 0;
+		const MapBlock::ContentCounts &counts = block->getContentCounts();
+		for(MapBlock::ContentCounts::const_iterator
+				i = counts.begin(); i != counts.end(); ++i) {
+			if(getABMs(i->first))
+				candidates += i->second;
+		}
+		return candidates;
+	}
 	void apply(MapBlock *block)
 	{
 		if(m_aabms.empty())
 			return;
 
+		// Skip the block if nothing in it can trigger
+		u32 candidates_left = countCandidates(block);
+		if(candidates_left == 0)
+			return;
+
 		ServerMap *map = &m_env->getServerMap();
 
 		u32 active_object_count_wider;
 		u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
 		m_env->m_added_objects = 0;
 
+		/*
+			Iterate in storage order, stopping once all candidates are
+			seen. Once an ABM has been triggered the rest of the block is
+			scanned in full, as the callback may have placed new
+			candidates further ahead.
+		*/
+		bool scan_all = false;
 		v3s16 p0;
-		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
-		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
+		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE && (candidates_left > 0 || scan_all); p0.Z++)
+		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE && (candidates_left > 0 || scan_all); p0.Y++)
+		for(p0.X=0; p0.X<MAP_BLOCKSIZE && (candidates_left > 0 || scan_all); p0.X++)
 		{
 			MapNode n = block->getNodeNoEx(p0);
 			content_t c = n.getContent();
-			v3s16 p = p0 + block->getPosRelative();
 
-			std::map<content_t, std::vector<ActiveABM> >::iterator j;
-			j = m_aabms.find(c);
-			if(j == m_aabms.end())
+			const std::vector<ActiveABM> *aabms = getABMs(c);
+			if(aabms == NULL)
 				continue;
+			if(candidates_left > 0)
+				candidates_left--;
 
-			for(std::vector<ActiveABM>::iterator
-					i = j->second.begin(); i != j->second.end(); i++) {
+			v3s16 p = p0 + block->getPosRelative();
+
+			for(std::vector<ActiveABM>::const_iterator
+					i = aabms->begin(); i != aabms->end(); i++) {
 				if(myrand() % i->chance != 0)
 					continue;
 
@@ -706,6 +924,8 @@ class ABMHandler
 				}
 neighbor_found:
 
+				scan_all = true;
+
 				// Call all the trigger variations
 				i->abm->trigger(m_env, p, n);
 				i->abm->trigger(m_env, p, n,
@@ -719,8 +939,136 @@ class ABMHandler
 			}
 		}
 	}
+
+	/*
+		Split version of apply() for the ABM worker threads:
+		makeJob() and applyTriggers() run on the server thread,
+		evaluate() can run on any thread.
+		Unlike apply(), nodes that the callbacks place in the block are
+		only seen on the next run.
+	*/
+
+	// Returns NULL if nothing in the block can trigger
+	ABMBlockJob *makeJob(MapBlock *block)
+	{
+		if(m_aabms.empty())
+			return NULL;
+
+		u32 candidates = countCandidates(block);
+		if(candidates == 0)
+			return NULL;
+
+		ABMBlockJob *job = new ABMBlockJob;
+		job->handler = this;
+		job->blockpos = block->getPos();
+		job->candidates = candidates;
+		job->seed = ((u64)myrand() << 32) | myrand();
+
+		// Only the block pointers are looked up here; nothing is copied
+		ServerMap *map = &m_env->getServerMap();
+		for(s16 z=-1; z<=1; z++)
+		for(s16 y=-1; y<=1; y++)
+		for(s16 x=-1; x<=1; x++)
+		{
+			job->blocks[(z+1)*9 + (y+1)*3 + (x+1)] = (x == 0 && y == 0 && z == 0) ?
+					block : map->getBlockNoCreateNoEx(job->blockpos + v3s16(x,y,z));
+		}
+		return job;
+	}
+
+	// Does the chance rolls and neighbor checks of apply() without
+	// changing anything, so it is safe to call from any thread
+	void evaluate(ABMBlockJob *job) const
+	{
+		MapNode *data = job->blocks[13]->getData();
+		if(data == NULL)
+			return;
+		PcgRandom pr(job->seed);
+		u32 candidates_left = job->candidates;
+
+		// Storage order, as in apply()
+		v3s16 p0;
+		u32 index = 0;
+		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE && candidates_left > 0; p0.Z++)
+		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE && candidates_left > 0; p0.Y++)
+		for(p0.X=0; p0.X<MAP_BLOCKSIZE && candidates_left > 0; p0.X++, index++)
+		{
+			content_t c = data[index].getContent();
+			const std::vector<ActiveABM> *aabms = getABMs(c);
+			if(aabms == NULL)
+				continue;
+			candidates_left--;
+
+			for(std::vector<ActiveABM>::const_iterator
+					i = aabms->begin(); i != aabms->end(); ++i) {
+				if(pr.next() % i->chance != 0)
+					continue;
+
+				// Check neighbors
+				if(!i->required_neighbors.empty())
+				{
+					bool found = false;
+					v3s16 p1;
+					for(p1.X = p0.X-1; p1.X <= p0.X+1 && !found; p1.X++)
+					for(p1.Y = p0.Y-1; p1.Y <= p0.Y+1 && !found; p1.Y++)
+					for(p1.Z = p0.Z-1; p1.Z <= p0.Z+1 && !found; p1.Z++)
+					{
+						if(p1 == p0)
+							continue;
+						found = i->required_neighbors.count(
+								job->getContent(p1)) != 0;
+					}
+					if(!found)
+						continue;
+				}
+
+				job->triggers.push_back(ABMTrigger(p0, c, &(*i)));
+			}
+		}
+	}
+
+	// Runs the ABMs found by evaluate()
+	void applyTriggers(ABMBlockJob *job)
+	{
+		if(job->triggers.empty())
+			return;
+
+		ServerMap *map = &m_env->getServerMap();
+		MapBlock *block = map->getBlockNoCreateNoEx(job->blockpos);
+		if(block == NULL)
+			return;
+
+		u32 active_object_count_wider;
+		u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
+		m_env->m_added_objects = 0;
+
+		for(std::vector<ABMTrigger>::iterator
+				i = job->triggers.begin(); i != job->triggers.end(); ++i) {
+			MapNode n = block->getNodeNoEx(i->p);
+			// Skip nodes that an earlier trigger has changed
+			if(n.getContent() != i->c)
+				continue;
+			v3s16 p = i->p + block->getPosRelative();
+
+			// Call all the trigger variations
+			i->aabm->abm->trigger(m_env, p, n);
+			i->aabm->abm->trigger(m_env, p, n,
+					active_object_count, active_object_count_wider);
+
+			// Count surrounding objects again if the abms added any
+			if(m_env->m_added_objects > 0) {
+				active_object_count = countObjects(block, map, active_object_count_wider);
+				m_env->m_added_objects = 0;
+			}
+		}
+	}
 };
 
+void ABMBlockJob::run()
+{
+	handler->evaluate(this);
+}
+
 void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 {
 	// Reset usage timer immediately, otherwise a block that becomes active
@@ -770,6 +1118,50 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 	abmhandler.apply(block);
 }
 
+void ServerEnvironment::applyActiveBlockModifiers(const std::set<v3s16> &blocks,
+		float dtime_s)
+{
+	// Initialize handling of ActiveBlockModifiers
+	ABMHandler abmhandler(m_abms, dtime_s, this, true);
+	std::vector<ABMBlockJob *> abm_jobs;
+
+	for(std::set<v3s16>::const_iterator
+			i = blocks.begin(); i != blocks.end(); ++i)
+	{
+		v3s16 p = *i;
+
+		/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
+				<<") being handled"<<std::endl;*/
+
+		MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+		if(block == NULL)
+			continue;
+
+		// Set current time as timestamp
+		block->setTimestampNoChangedFlag(m_game_time);
+
+		/* Handle ActiveBlockModifiers */
+		if(m_abm_workers == NULL) {
+			abmhandler.apply(block);
+		} else if(ABMBlockJob *job = abmhandler.makeJob(block)) {
+			abm_jobs.push_back(job);
+		}
+	}
+
+	if(abm_jobs.empty())
+		return;
+
+	{
+		ScopeProfiler sp(g_profiler, "SEnv: ABM threaded evaluation avg", SPT_AVG);
+		m_abm_workers->run(abm_jobs);
+	}
+	for(std::vector<ABMBlockJob *>::iterator
+			i = abm_jobs.begin(); i != abm_jobs.end(); ++i) {
+		abmhandler.applyTriggers(*i);
+		delete *i;
+	}
+}
+
 void ServerEnvironment::addActiveBlockModifier(ActiveBlockModifier *abm)
 {
 	m_abms.push_back(ABMWithState(abm));
@@ -840,19 +1232,33 @@ bool ServerEnvironment::swapNode(v3s16 p, const MapNode &n)
 
 std::set<u16> ServerEnvironment::getObjectsInsideRadius(v3f pos, float radius)
 {
+	std::vector<ServerActiveObject*> nearby;
+	getObjectsInsideRadius(pos, radius, nearby);
+
 	std::set<u16> objects;
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	for(std::vector<ServerActiveObject*>::iterator
+			i = nearby.begin(); i != nearby.end(); ++i)
+		objects.insert((*i)->getId());
+	return objects;
+}
+
+void ServerEnvironment::getObjectsInsideRadius(v3f pos, float radius,
+		std::vector<ServerActiveObject*> &objects)
+{
+	size_t first = objects.size();
+	u32 checked = m_active_object_grid.getObjectsNear(pos, radius, objects);
+	g_profiler->add("SEnv: objects checked by radius queries", checked);
+
+	// Drop the ones outside the sphere
+	size_t kept = first;
+	for(size_t i = first; i < objects.size(); i++)
 	{
-		ServerActiveObject* obj = i->second;
-		u16 id = i->first;
-		v3f objectpos = obj->getBasePosition();
+		v3f objectpos = objects[i]->getBasePosition();
 		if(objectpos.getDistanceFrom(pos) > radius)
 			continue;
-		objects.insert(id);
+		objects[kept++] = objects[i];
 	}
-	return objects;
+	objects.resize(kept);
 }
 
 void ServerEnvironment::clearAllObjects()
@@ -900,6 +1306,7 @@ void ServerEnvironment::clearAllObjects()
 	for(std::vector<u16>::iterator i = objects_to_remove.begin();
 			i != objects_to_remove.end(); ++i) {
 		m_active_objects.erase(*i);
+		m_active_object_grid.remove(*i);
 	}
 
 	// Get list of loaded blocks
@@ -1056,7 +1463,7 @@ void ServerEnvironment::step(float dtime)
 		/*
 			Update list of active blocks, collecting changes
 		*/
-		const s16 active_block_range = g_settings->getS16("active_block_range");
+		const s16 active_block_range = m_active_block_range.get();
 		std::set<v3s16> blocks_removed;
 		std::set<v3s16> blocks_added;
 		m_active_blocks.update(players_blockpos, active_block_range,
@@ -1169,28 +1576,7 @@ void ServerEnvironment::step(float dtime)
 		ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg /1s", SPT_AVG);
 		TimeTaker timer("modify in active blocks");
 		
-		// Initialize handling of ActiveBlockModifiers
-		ABMHandler abmhandler(m_abms, abm_interval, this, true);
-
-		for(std::set<v3s16>::iterator
-				i = m_active_blocks.m_list.begin();
-				i != m_active_blocks.m_list.end(); ++i)
-		{
-			v3s16 p = *i;
-			
-			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
-					<<") being handled"<<std::endl;*/
-
-			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-			if(block == NULL)
-				continue;
-			
-			// Set current time as timestamp
-			block->setTimestampNoChangedFlag(m_game_time);
-
-			/* Handle ActiveBlockModifiers */
-			abmhandler.apply(block);
-		}
+		applyActiveBlockModifiers(m_active_blocks.m_list, abm_interval);
 
 		u32 time_ms = timer.stop(true);
 		u32 max_time_ms = 200;
@@ -1235,6 +1621,7 @@ void ServerEnvironment::step(float dtime)
 				continue;
 			// Step object
 			obj->step(dtime, send_recommended);
+			m_active_object_grid.update(obj);
 			// Read messages from object
 			while(!obj->m_messages_out.empty())
 			{
@@ -1362,6 +1749,17 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 	if (player_radius_f < 0)
 		player_radius_f = 0;
 
+	/*
+		Get the objects near enough from the spatial index. A zero
+		player_radius means players are sent at any distance.
+	*/
+	std::vector<ServerActiveObject*> nearby;
+	u32 checked = m_active_object_grid.getObjectsNear(pos_f,
+			MYMAX(radius_f, player_radius_f), nearby);
+	if (player_radius_f == 0)
+		m_active_object_grid.getPlayerObjects(nearby);
+	g_profiler->add("SEnv: objects checked by radius queries", checked);
+
 	/*
 		Go through the object list,
 		- discard m_removed objects,
@@ -1369,15 +1767,12 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 		- discard objects that are found in current_objects.
 		- add remaining objects to added_objects
 	*/
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	for(std::vector<ServerActiveObject*>::iterator
+			i = nearby.begin(); i != nearby.end(); ++i)
 	{
-		u16 id = i->first;
 		// Get object
-		ServerActiveObject *object = i->second;
-		if(object == NULL)
-			continue;
+		ServerActiveObject *object = *i;
+		u16 id = object->getId();
 		// Discard if removed or deactivating
 		if(object->m_removed || object->m_pending_deactivation)
 			continue;
@@ -1502,6 +1897,7 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 			<<"added (id="<<object->getId()<<")"<<std::endl;*/
 			
 	m_active_objects[object->getId()] = object;
+	m_active_object_grid.insert(object);
   
 	verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 			<<"Added id="<<object->getId()<<"; there are now "
@@ -1628,6 +2024,7 @@ void ServerEnvironment::removeRemovedObjects()
 	for(std::vector<u16>::iterator i = objects_to_remove.begin();
 			i != objects_to_remove.end(); ++i) {
 		m_active_objects.erase(*i);
+		m_active_object_grid.remove(*i);
 	}
 }
 
@@ -1681,7 +2078,7 @@ void ServerEnvironment::activateObjects(MapBlock *block, u32 dtime_s)
 			<<"activating objects of block "<<PP(block->getPos())
 			<<" ("<<block->m_static_objects.m_stored.size()
 			<<" objects)"<<std::endl;
-	bool large_amount = (block->m_static_objects.m_stored.size() > g_settings->getU16("max_objects_per_block"));
+	bool large_amount = (block->m_static_objects.m_stored.size() > m_max_objects_per_block.get());
 	if (large_amount) {
 		errorstream<<"suspiciously large amount of objects detected: "
 				<<block->m_static_objects.m_stored.size()<<" in "
@@ -1909,7 +2306,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 
 			if(block)
 			{
-				if(block->m_static_objects.m_stored.size() >= g_settings->getU16("max_objects_per_block")){
+				if(block->m_static_objects.m_stored.size() >= m_max_objects_per_block.get()){
 					errorstream<<"ServerEnv: Trying to store id="<<obj->getId()
 							<<" statically but block "<<PP(blockpos)
 							<<" already contains "
@@ -1990,6 +2387,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 	for(std::vector<u16>::iterator i = objects_to_remove.begin();
 			i != objects_to_remove.end(); ++i) {
 		m_active_objects.erase(*i);
+		m_active_object_grid.remove(*i);
 	}
 }
 
@@ -39,9 +39,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapnode.h"
 #include "mapblock.h"
 #include "jthread/jmutex.h"
+#include "settings.h"
+#include "collision.h"
 
 class ServerEnvironment;
 class ActiveBlockModifier;
+class WorkerPool;
 class ServerActiveObject;
 class ITextureSource;
 class IGameDef;
@@ -96,6 +99,10 @@ class Environment
 		m_day_night_ratio_override = value;
 	}
 
+	// Reused by collisionMoveSimple()
+	CollisionBoxBuffer &getCollisionBoxBuffer()
+	{ return m_collision_boxes; }
+
 	// counter used internally when triggering ABMs
 	u32 m_added_objects;
 
@@ -128,6 +135,7 @@ class Environment
 	JMutex m_timeofday_lock;
 	JMutex m_time_lock;
 
+	CollisionBoxBuffer m_collision_boxes;
 };
 
 /*
@@ -193,6 +201,47 @@ class ActiveBlockList
 private:
 };
 
+/*
+	Spatial index of the active objects, used by ServerEnvironment.
+	Objects are bucketed by the MapBlock their base position is in, so
+	radius queries only look at the objects in nearby blocks.
+*/
+
+class ActiveObjectGrid
+{
+public:
+	void insert(ServerActiveObject *obj);
+	void remove(u16 id);
+	// Moves obj to the cell of its current position; no-op if not indexed
+	void update(ServerActiveObject *obj);
+	void clear();
+
+	/*
+		Appends the objects in all cells touching the sphere to result.
+		Objects may be outside the sphere; the caller checks the distance.
+		Returns the number of objects appended.
+	*/
+	u32 getObjectsNear(v3f pos, float radius,
+			std::vector<ServerActiveObject*> &result) const;
+
+	// Appends all player objects to result
+	void getPlayerObjects(std::vector<ServerActiveObject*> &result) const;
+
+private:
+	typedef std::map<v3s16, std::vector<ServerActiveObject*> > CellMap;
+	struct Entry {
+		ServerActiveObject *obj;
+		v3s16 cellpos;
+	};
+
+	static v3s16 getCellPos(v3f pos);
+	void removeFromCell(v3s16 cellpos, ServerActiveObject *obj);
+
+	CellMap m_cells;
+	std::map<u16, Entry> m_objects;
+	std::set<ServerActiveObject*> m_player_objects;
+};
+
 /*
 	The server-side environment.
 
@@ -306,6 +355,15 @@ class ServerEnvironment : public Environment
 
 	// Find all active objects inside a radius around a point
 	std::set<u16> getObjectsInsideRadius(v3f pos, float radius);
+	// Same, appending the objects to a vector without sorting them
+	void getObjectsInsideRadius(v3f pos, float radius,
+			std::vector<ServerActiveObject*> &objects);
+
+	// Called when the base position of an active object changes
+	void updateActiveObjectPosition(ServerActiveObject *obj)
+	{
+		m_active_object_grid.update(obj);
+	}
 
 	// Clear all objects, loading and going through every MapBlock
 	void clearAllObjects();
@@ -313,6 +371,13 @@ class ServerEnvironment : public Environment
 	// This makes stuff happen
 	void step(f32 dtime);
 
+	/*
+		Runs the ABMs on the given blocks as step() does on the active
+		blocks, dtime_s seconds after the last run. Uses the ABM worker
+		threads if num_abm_threads is set.
+	*/
+	void applyActiveBlockModifiers(const std::set<v3s16> &blocks, float dtime_s);
+
 	//check if there's a line of sight between two positions
 	bool line_of_sight(v3f pos1, v3f pos2, float stepsize=1.0, v3s16 *p=NULL);
 
@@ -377,6 +442,8 @@ class ServerEnvironment : public Environment
 	const std::string m_path_world;
 	// Active object list
 	std::map<u16, ServerActiveObject*> m_active_objects;
+	// Spatial index of m_active_objects
+	ActiveObjectGrid m_active_object_grid;
 	// Outgoing network message buffer for active objects
 	std::list<ActiveObjectMessage> m_active_object_messages;
 	// Some timers
@@ -399,6 +466,12 @@ class ServerEnvironment : public Environment
 	// Estimate for general maximum lag as determined by server.
 	// Can raise to high values like 15s with eg. map generation mods.
 	float m_max_lag_estimate;
+	// NULL if ABMs are run on the server thread only
+	WorkerPool *m_abm_workers;
+	// Read on every step and for every block with objects;
+	// only used with the environment locked
+	CachedS16Setting m_active_block_range;
+	CachedU16Setting m_max_objects_per_block;
 };
 
 #ifndef SERVER
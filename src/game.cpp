@@ -3284,6 +3284,7 @@ void Game::updateCamera(VolatileRunFlags *flags, u32 busy_time,
 	if (!flags->disable_camera_update) {
 		client->getEnv().getClientMap().updateCamera(camera_position,
 				camera_direction, camera_fov, camera_offset);
+		client->updateCamera(camera_position, camera_direction);
 
 		if (flags->camera_offset_changed) {
 			client->updateCameraOffset(camera_offset);
@@ -33,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "gamedef.h"
 #include "util/directiontables.h"
 #include "util/mathconstants.h"
+#include "util/thread.h"
 #include "rollback_interface.h"
 #include "environment.h"
 #include "emerge.h"
@@ -42,6 +43,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "server.h"
 #include "database.h"
 #include "database-dummy.h"
+#include "map_saver.h"
+#include "jthread/jmutexautolock.h"
 #include "database-sqlite3.h"
 #include <deque>
 #if USE_LEVELDB
@@ -62,6 +65,8 @@ Map::Map(std::ostream &dout, IGameDef *gamedef):
 	m_dout(dout),
 	m_gamedef(gamedef),
 	m_sector_cache(NULL),
+	m_block_cache(NULL),
+	m_liquid_workers(NULL),
 	m_transforming_liquid_loop_count_multiplier(1.0f),
 	m_unprocessed_count(0),
 	m_inc_trending_up_start_time(0),
@@ -71,6 +76,8 @@ Map::Map(std::ostream &dout, IGameDef *gamedef):
 
 Map::~Map()
 {
+	delete m_liquid_workers;
+
 	/*
 		Free all MapSectors
 	*/
@@ -138,14 +145,140 @@ MapSector * Map::getSectorNoGenerate(v2s16 p)
 
 MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
 {
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector * sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
-		return NULL;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
+	if(m_block_cache != NULL && p3d == m_block_cache_p)
+		return m_block_cache;
+
+	MapBlock *block = m_block_index.get(p3d);
+	if(block != NULL) {
+		m_block_cache_p = p3d;
+		m_block_cache = block;
+	}
 	return block;
 }
 
+void Map::addIndexedBlock(MapBlock *block)
+{
+	m_block_index.set(block->getPos(), block);
+}
+
+void Map::removeIndexedBlock(v3s16 p)
+{
+	if(m_block_cache != NULL && m_block_cache_p == p)
+		m_block_cache = NULL;
+	m_block_index.remove(p);
+}
+
+/*
+	MapBlockIndex
+*/
+
+MapBlockIndex::MapBlockIndex():
+	m_mask(0),
+	m_count(0)
+{
+	resize(64);
+}
+
+void MapBlockIndex::set(v3s16 p, MapBlock *block)
+{
+	assert(block != NULL);
+
+	// Keep at most half of the slots used so that probes stay short
+	if((m_count + 1) * 2 > m_slots.size())
+		resize(m_slots.size() * 2);
+
+	u64 key = packPos(p);
+	for(u32 i = hash(key) & m_mask;; i = (i + 1) & m_mask) {
+		Slot &slot = m_slots[i];
+		if(slot.block == NULL) {
+			slot.key = key;
+			slot.block = block;
+			m_count++;
+			return;
+		}
+		if(slot.key == key) {
+			slot.block = block;
+			return;
+		}
+	}
+}
+
+void MapBlockIndex::remove(v3s16 p)
+{
+	u64 key = packPos(p);
+	u32 i = hash(key) & m_mask;
+	for(;; i = (i + 1) & m_mask) {
+		if(m_slots[i].block == NULL)
+			return;
+		if(m_slots[i].key == key)
+			break;
+	}
+	m_count--;
+
+	/*
+		Move back the entries of the same probe run that would not be
+		found anymore with slot i empty
+	*/
+	u32 j = i;
+	for(;;) {
+		m_slots[i].block = NULL;
+		for(;;) {
+			j = (j + 1) & m_mask;
+			if(m_slots[j].block == NULL)
+				return;
+			u32 home = hash(m_slots[j].key) & m_mask;
+			// Stays if its home slot lies cyclically in (i, j]
+			if(i <= j ? (i < home && home <= j) : (i < home || home <= j))
+				continue;
+			break;
+		}
+		m_slots[i] = m_slots[j];
+		i = j;
+	}
+}
+
+void MapBlockIndex::clear()
+{
+	m_slots.clear();
+	m_count = 0;
+	resize(64);
+}
+
+void MapBlockIndex::getBlocks(std::vector<MapBlock*> &dst) const
+{
+	dst.reserve(dst.size() + m_count);
+	for(std::vector<Slot>::const_iterator i = m_slots.begin();
+			i != m_slots.end(); ++i) {
+		if(i->block != NULL)
+			dst.push_back(i->block);
+	}
+}
+
+void MapBlockIndex::resize(u32 capacity)
+{
+	std::vector<Slot> old;
+	old.swap(m_slots);
+
+	Slot empty;
+	empty.key = 0;
+	empty.block = NULL;
+	m_slots.resize(capacity, empty);
+	m_mask = capacity - 1;
+	m_count = 0;
+
+	for(std::vector<Slot>::iterator i = old.begin(); i != old.end(); ++i) {
+		if(i->block == NULL)
+			continue;
+		for(u32 j = hash(i->key) & m_mask;; j = (j + 1) & m_mask) {
+			if(m_slots[j].block == NULL) {
+				m_slots[j] = *i;
+				m_count++;
+				break;
+			}
+		}
+	}
+}
+
 MapBlock * Map::getBlockNoCreate(v3s16 p3d)
 {
 	MapBlock *block = getBlockNoCreateNoEx(p3d);
@@ -233,388 +366,116 @@ void Map::setNode(v3s16 p, MapNode & n)
 
 
 /*
-	Goes recursively through the neighbours of the node.
-
-	Alters only transparent nodes.
-
-	If the lighting of the neighbour is lower than the lighting of
-	the node was (before changing it to 0 at the step before), the
-	lighting of the neighbour is set to 0 and then the same stuff
-	repeats for the neighbour.
-
-	The ending nodes of the routine are stored in light_sources.
-	This is useful when a light is removed. In such case, this
-	routine can be called for the light node and then again for
-	light_sources to re-light the area without the removed light.
-
-	values of from_nodes are lighting values.
+	The nodes of the loaded blocks of a Map, for the lighting code in
+	voxelalgorithms.h. Blocks whose light is changed are put in
+	modified_blocks.
 */
-void Map::unspreadLight(enum LightBank bank,
-		std::map<v3s16, u8> & from_nodes,
-		std::set<v3s16> & light_sources,
-		std::map<v3s16, MapBlock*>  & modified_blocks)
+class MapLightNodes
 {
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
+public:
+	typedef MapNodeRef Ref;
 
-	if(from_nodes.empty())
-		return;
-
-	u32 blockchangecount = 0;
-
-	std::map<v3s16, u8> unlighted_nodes;
-
-	/*
-		Initialize block cache
-	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
-
-	for(std::map<v3s16, u8>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
+	MapLightNodes(Map *map, std::map<v3s16, MapBlock*> &modified_blocks):
+		m_map(map),
+		m_modified_blocks(modified_blocks),
+		m_last_changed(NULL)
 	{
-		v3s16 pos = j->first;
-		v3s16 blockpos = getNodeBlockPos(pos);
-
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
-
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
-		{
-			continue;
-		}
-
-		if(block->isDummy())
-			continue;
-
-		// Calculate relative position in block
-		//v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
-
-		// Get node straight from the block
-		//MapNode n = block->getNode(relpos);
-
-		u8 oldlight = j->second;
-
-		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++)
-		{
-			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-
-			// Get the block where the node is located
-			v3s16 blockpos, relpos;
-			getNodeBlockPosWithOffset(n2pos, blockpos, relpos);
-
-			// Only fetch a new block if the block position has changed
-			try {
-				if(block == NULL || blockpos != blockpos_last){
-					block = getBlockNoCreate(blockpos);
-					blockpos_last = blockpos;
-
-					block_checked_in_modified = false;
-					blockchangecount++;
-				}
-			}
-			catch(InvalidPositionException &e) {
-				continue;
-			}
-
-			// Get node straight from the block
-			bool is_valid_position;
-			MapNode n2 = block->getNode(relpos, &is_valid_position);
-			if (!is_valid_position)
-				continue;
-
-			bool changed = false;
-
-			//TODO: Optimize output by optimizing light_sources?
-
-			/*
-				If the neighbor is dimmer than what was specified
-				as oldlight (the light of the previous node)
-			*/
-			if(n2.getLight(bank, nodemgr) < oldlight)
-			{
-				/*
-					And the neighbor is transparent and it has some light
-				*/
-				if(nodemgr->get(n2).light_propagates
-						&& n2.getLight(bank, nodemgr) != 0)
-				{
-					/*
-						Set light to 0 and add to queue
-					*/
-
-					u8 current_light = n2.getLight(bank, nodemgr);
-					n2.setLight(bank, 0, nodemgr);
-					block->setNode(relpos, n2);
-
-					unlighted_nodes[n2pos] = current_light;
-					changed = true;
-
-					/*
-						Remove from light_sources if it is there
-						NOTE: This doesn't happen nearly at all
-					*/
-					/*if(light_sources.find(n2pos))
-					{
-						infostream<<"Removed from light_sources"<<std::endl;
-						light_sources.remove(n2pos);
-					}*/
-				}
-
-				/*// DEBUG
-				if(light_sources.find(n2pos) != NULL)
-					light_sources.remove(n2pos);*/
-			}
-			else{
-				light_sources.insert(n2pos);
-			}
-
-			// Add to modified_blocks
-			if(changed == true && block_checked_in_modified == false)
-			{
-				// If the block is not found in modified_blocks, add.
-				if(modified_blocks.find(blockpos) == modified_blocks.end())
-				{
-					modified_blocks[blockpos] = block;
-				}
-				block_checked_in_modified = true;
-			}
-		}
 	}
 
-	/*infostream<<"unspreadLight(): Changed block "
-	<<blockchangecount<<" times"
-	<<" for "<<from_nodes.size()<<" nodes"
-	<<std::endl;*/
-
-	if(!unlighted_nodes.empty())
-		unspreadLight(bank, unlighted_nodes, light_sources, modified_blocks);
-}
-
-/*
-	A single-node wrapper of the above
-*/
-void Map::unLightNeighbors(enum LightBank bank,
-		v3s16 pos, u8 lightwas,
-		std::set<v3s16> & light_sources,
-		std::map<v3s16, MapBlock*>  & modified_blocks)
-{
-	std::map<v3s16, u8> from_nodes;
-	from_nodes[pos] = lightwas;
-
-	unspreadLight(bank, from_nodes, light_sources, modified_blocks);
-}
-
-/*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
-*/
-void Map::spreadLight(enum LightBank bank,
-		std::set<v3s16> & from_nodes,
-		std::map<v3s16, MapBlock*> & modified_blocks)
-{
-	INodeDefManager *nodemgr = m_gamedef->ndef();
+	MapNode & get(const Ref &r)
+	{
+		return r.block->getData()[r.i];
+	}
 
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
+	u32 getNeighbors(const Ref &r, Ref *neighbors)
+	{
+		const s16 last = MAP_BLOCKSIZE - 1;
+		s16 x = r.i % MAP_BLOCKSIZE;
+		s16 y = (r.i / MAP_BLOCKSIZE) % MAP_BLOCKSIZE;
+		s16 z = r.i / (MAP_BLOCKSIZE * MAP_BLOCKSIZE);
+		u32 count = 0;
 
-	if(from_nodes.empty())
-		return;
+		// In the order of g_6dirs
+		count += getNeighbor(r, 0, z < last, MAP_BLOCKSIZE * MAP_BLOCKSIZE,
+				neighbors[count]);
+		count += getNeighbor(r, 1, y < last, MAP_BLOCKSIZE, neighbors[count]);
+		count += getNeighbor(r, 2, x < last, 1, neighbors[count]);
+		count += getNeighbor(r, 3, z > 0, -MAP_BLOCKSIZE * MAP_BLOCKSIZE,
+				neighbors[count]);
+		count += getNeighbor(r, 4, y > 0, -MAP_BLOCKSIZE, neighbors[count]);
+		count += getNeighbor(r, 5, x > 0, -1, neighbors[count]);
 
-	u32 blockchangecount = 0;
+		return count;
+	}
 
-	std::set<v3s16> lighted_nodes;
+	void setChanged(const Ref &r)
+	{
+		if(r.block == m_last_changed)
+			return;
+		m_last_changed = r.block;
+		m_modified_blocks[r.block->getPos()] = r.block;
+		r.block->raiseModified(MOD_STATE_WRITE_NEEDED, "lighting");
+	}
 
+private:
 	/*
-		Initialize block cache
+		Gets the neighbour of r in direction g_6dirs[dir], which is step
+		away in the node array if it is inside the same block
 	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-		// Cache this a bit, too
-	bool block_checked_in_modified = false;
-
-	for(std::set<v3s16>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
+	bool getNeighbor(const Ref &r, u16 dir, bool inside_block, s16 step,
+			Ref &neighbor)
 	{
-		v3s16 pos = *j;
-		v3s16 blockpos, relpos;
-
-		getNodeBlockPosWithOffset(pos, blockpos, relpos);
-
-		// Only fetch a new block if the block position has changed
-		try {
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
-
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e) {
-			continue;
+		if(inside_block) {
+			neighbor = Ref(r.block, r.i + step);
+			return true;
 		}
 
-		if(block->isDummy())
-			continue;
-
-		// Get node straight from the block
-		bool is_valid_position;
-		MapNode n = block->getNode(relpos, &is_valid_position);
-
-		u8 oldlight = is_valid_position ? n.getLight(bank, nodemgr) : 0;
-		u8 newlight = diminish_light(oldlight);
-
-		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++){
-			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-
-			// Get the block where the node is located
-			v3s16 blockpos, relpos;
-			getNodeBlockPosWithOffset(n2pos, blockpos, relpos);
-
-			// Only fetch a new block if the block position has changed
-			try {
-				if(block == NULL || blockpos != blockpos_last){
-					block = getBlockNoCreate(blockpos);
-					blockpos_last = blockpos;
-
-					block_checked_in_modified = false;
-					blockchangecount++;
-				}
-			}
-			catch(InvalidPositionException &e) {
-				continue;
-			}
+		MapBlock *block = m_map->getBlockNoCreateNoEx(
+				r.block->getPos() + g_6dirs[dir]);
+		if(block == NULL || block->isDummy())
+			return false;
 
-			// Get node straight from the block
-			MapNode n2 = block->getNode(relpos, &is_valid_position);
-			if (!is_valid_position)
-				continue;
+		// Wrap around to the other side of the neighbouring block
+		neighbor = Ref(block, r.i + step - step * MAP_BLOCKSIZE);
+		return true;
+	}
 
-			bool changed = false;
-			/*
-				If the neighbor is brighter than the current node,
-				add to list (it will light up this node on its turn)
-			*/
-			if(n2.getLight(bank, nodemgr) > undiminish_light(oldlight))
-			{
-				lighted_nodes.insert(n2pos);
-				changed = true;
-			}
-			/*
-				If the neighbor is dimmer than how much light this node
-				would spread on it, add to list
-			*/
-			if(n2.getLight(bank, nodemgr) < newlight)
-			{
-				if(nodemgr->get(n2).light_propagates)
-				{
-					n2.setLight(bank, newlight, nodemgr);
-					block->setNode(relpos, n2);
-					lighted_nodes.insert(n2pos);
-					changed = true;
-				}
-			}
+	Map *m_map;
+	std::map<v3s16, MapBlock*> &m_modified_blocks;
+	// Saves looking up modified_blocks for every changed node
+	MapBlock *m_last_changed;
+};
 
-			// Add to modified_blocks
-			if(changed == true && block_checked_in_modified == false)
-			{
-				// If the block is not found in modified_blocks, add.
-				if(modified_blocks.find(blockpos) == modified_blocks.end())
-				{
-					modified_blocks[blockpos] = block;
-				}
-				block_checked_in_modified = true;
-			}
-		}
-	}
+bool Map::getNodeRef(v3s16 p, MapNodeRef &ref)
+{
+	v3s16 blockpos, relpos;
+	getNodeBlockPosWithOffset(p, blockpos, relpos);
 
-	/*infostream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
+	if(block == NULL || block->isDummy())
+		return false;
 
-	if(!lighted_nodes.empty())
-		spreadLight(bank, lighted_nodes, modified_blocks);
+	ref = MapNodeRef(block, relpos.Z * MAP_BLOCKSIZE * MAP_BLOCKSIZE
+			+ relpos.Y * MAP_BLOCKSIZE + relpos.X);
+	return true;
 }
 
-/*
-	A single-node source variation of the above.
-*/
-void Map::lightNeighbors(enum LightBank bank,
-		v3s16 pos,
+void Map::unspreadLight(enum LightBank bank,
+		MapLightQueue & from_nodes,
+		MapLightQueue & light_sources,
 		std::map<v3s16, MapBlock*> & modified_blocks)
 {
-	std::set<v3s16> from_nodes;
-	from_nodes.insert(pos);
-	spreadLight(bank, from_nodes, modified_blocks);
+	MapLightNodes nodes(this, modified_blocks);
+	voxalgo::unspreadLight(nodes, bank, m_gamedef->ndef(),
+			from_nodes, light_sources);
 }
 
-v3s16 Map::getBrightestNeighbour(enum LightBank bank, v3s16 p)
+void Map::spreadLight(enum LightBank bank,
+		MapLightQueue & light_sources,
+		std::map<v3s16, MapBlock*> & modified_blocks)
 {
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	u8 brightest_light = 0;
-	v3s16 brightest_pos(0,0,0);
-	bool found_something = false;
-
-	// Loop through 6 neighbors
-	for(u16 i=0; i<6; i++){
-		// Get the position of the neighbor node
-		v3s16 n2pos = p + dirs[i];
-		MapNode n2;
-		bool is_valid_position;
-		n2 = getNodeNoEx(n2pos, &is_valid_position);
-		if (!is_valid_position)
-			continue;
-
-		if(n2.getLight(bank, nodemgr) > brightest_light || found_something == false){
-			brightest_light = n2.getLight(bank, nodemgr);
-			brightest_pos = n2pos;
-			found_something = true;
-		}
-	}
-
-	if(found_something == false)
-		throw InvalidPositionException();
-
-	return brightest_pos;
+	MapLightNodes nodes(this, modified_blocks);
+	voxalgo::spreadLight(nodes, bank, m_gamedef->ndef(), light_sources);
 }
 
 /*
@@ -636,14 +497,9 @@ s16 Map::propagateSunlight(v3s16 start,
 		v3s16 pos(start.X, y, start.Z);
 
 		v3s16 blockpos = getNodeBlockPos(pos);
-		MapBlock *block;
-		try{
-			block = getBlockNoCreate(blockpos);
-		}
-		catch(InvalidPositionException &e)
-		{
+		MapBlock *block = getBlockNoCreateNoEx(blockpos);
+		if(block == NULL)
 			break;
-		}
 
 		v3s16 relpos = pos - blockpos*MAP_BLOCKSIZE;
 		bool is_valid_position;
@@ -678,21 +534,14 @@ void Map::updateLighting(enum LightBank bank,
 
 	//TimeTaker timer("updateLighting");
 
-	// For debugging
-	//bool debug=true;
-	//u32 count_was = modified_blocks.size();
+	MapLightQueue unlight_from;
+	MapLightQueue light_sources;
 
-	//std::map<v3s16, MapBlock*> blocks_to_update;
-
-	std::set<v3s16> light_sources;
-
-	std::map<v3s16, u8> unlight_from;
+	// The blocks whose light is cleared and propagated again
+	std::vector<MapBlock*> lit_blocks;
 
 	int num_bottom_invalid = 0;
 
-	{
-	//TimeTaker t("first stuff");
-
 	for(std::map<v3s16, MapBlock*>::iterator i = a_blocks.begin();
 		i != a_blocks.end(); ++i)
 	{
@@ -705,36 +554,21 @@ void Map::updateLighting(enum LightBank bank,
 				break;
 
 			v3s16 pos = block->getPos();
-			v3s16 posnodes = block->getPosRelative();
 			modified_blocks[pos] = block;
-			//blocks_to_update[pos] = block;
+			lit_blocks.push_back(block);
 
 			/*
 				Clear all light from block
 			*/
+			MapNode *data = block->getData();
 			for(s16 z=0; z<MAP_BLOCKSIZE; z++)
-			for(s16 x=0; x<MAP_BLOCKSIZE; x++)
 			for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+			for(s16 x=0; x<MAP_BLOCKSIZE; x++)
 			{
-				v3s16 p(x,y,z);
-				bool is_valid_position;
-				MapNode n = block->getNode(p, &is_valid_position);
-				if (!is_valid_position) {
-					/* This would happen when dealing with a
-					   dummy block.
-					*/
-					infostream<<"updateLighting(): InvalidPositionException"
-							<<std::endl;
-					continue;
-				}
+				u16 ni = z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x;
+				MapNode &n = data[ni];
 				u8 oldlight = n.getLight(bank, nodemgr);
 				n.setLight(bank, 0, nodemgr);
-				block->setNode(p, n);
-
-				// If node sources light, add to list
-				u8 source = nodemgr->get(n).light_source;
-				if(source != 0)
-					light_sources.insert(p + posnodes);
 
 				// Collect borders for unlighting
 				if((x==0 || x == MAP_BLOCKSIZE-1
@@ -742,16 +576,14 @@ void Map::updateLighting(enum LightBank bank,
 						|| z==0 || z == MAP_BLOCKSIZE-1)
 						&& oldlight != 0)
 				{
-					v3s16 p_map = p + posnodes;
-					unlight_from[p_map] = oldlight;
+					unlight_from.push(oldlight, MapNodeRef(block, ni));
 				}
-
-
 			}
+			block->raiseModified(MOD_STATE_WRITE_NEEDED, "updateLighting");
 
 			if(bank == LIGHTBANK_DAY)
 			{
-				bool bottom_valid = block->propagateSunlight(light_sources);
+				bool bottom_valid = block->propagateSunlight();
 
 				if(!bottom_valid)
 					num_bottom_invalid++;
@@ -777,127 +609,38 @@ void Map::updateLighting(enum LightBank bank,
 			// Bottom sunlight is not valid; get the block and loop to it
 
 			pos.Y--;
-			try{
-				block = getBlockNoCreate(pos);
-			}
-			catch(InvalidPositionException &e)
-			{
+			block = getBlockNoCreateNoEx(pos);
+			if(block == NULL)
 				FATAL_ERROR("Invalid position");
-			}
-
 		}
 	}
 
+	{
+		//TimeTaker timer("unspreadLight");
+		unspreadLight(bank, unlight_from, light_sources, modified_blocks);
 	}
 
 	/*
-		Enable this to disable proper lighting for speeding up map
-		generation for testing or whatever
+		Spread light from everything that is lit in the blocks now:
+		sunlight, light sources and what unspreadLight() left alone
 	*/
-#if 0
-	//if(g_settings->get(""))
+	for(u32 i = 0; i < lit_blocks.size(); i++)
 	{
-		core::map<v3s16, MapBlock*>::Iterator i;
-		i = blocks_to_update.getIterator();
-		for(; i.atEnd() == false; i++)
+		MapBlock *block = lit_blocks[i];
+		MapNode *data = block->getData();
+		for(u16 ni = 0; ni < MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; ni++)
 		{
-			MapBlock *block = i.getNode()->getValue();
-			v3s16 p = block->getPos();
-			block->setLightingExpired(false);
+			u8 light = data[ni].getLight(bank, nodemgr);
+			if(light > 1)
+				light_sources.push(light, MapNodeRef(block, ni));
 		}
-		return;
 	}
-#endif
-
-#if 1
-	{
-		//TimeTaker timer("unspreadLight");
-		unspreadLight(bank, unlight_from, light_sources, modified_blocks);
-	}
-
-	/*if(debug)
-	{
-		u32 diff = modified_blocks.size() - count_was;
-		count_was = modified_blocks.size();
-		infostream<<"unspreadLight modified "<<diff<<std::endl;
-	}*/
 
 	{
 		//TimeTaker timer("spreadLight");
 		spreadLight(bank, light_sources, modified_blocks);
 	}
 
-	/*if(debug)
-	{
-		u32 diff = modified_blocks.size() - count_was;
-		count_was = modified_blocks.size();
-		infostream<<"spreadLight modified "<<diff<<std::endl;
-	}*/
-#endif
-
-#if 0
-	{
-		//MapVoxelManipulator vmanip(this);
-
-		// Make a manual voxel manipulator and load all the blocks
-		// that touch the requested blocks
-		ManualMapVoxelManipulator vmanip(this);
-
-		{
-		//TimeTaker timer("initialEmerge");
-
-		core::map<v3s16, MapBlock*>::Iterator i;
-		i = blocks_to_update.getIterator();
-		for(; i.atEnd() == false; i++)
-		{
-			MapBlock *block = i.getNode()->getValue();
-			v3s16 p = block->getPos();
-
-			// Add all surrounding blocks
-			vmanip.initialEmerge(p - v3s16(1,1,1), p + v3s16(1,1,1));
-
-			/*
-				Add all surrounding blocks that have up-to-date lighting
-				NOTE: This doesn't quite do the job (not everything
-					  appropriate is lighted)
-			*/
-			/*for(s16 z=-1; z<=1; z++)
-			for(s16 y=-1; y<=1; y++)
-			for(s16 x=-1; x<=1; x++)
-			{
-				v3s16 p2 = p + v3s16(x,y,z);
-				MapBlock *block = getBlockNoCreateNoEx(p2);
-				if(block == NULL)
-					continue;
-				if(block->isDummy())
-					continue;
-				if(block->getLightingExpired())
-					continue;
-				vmanip.initialEmerge(p2, p2);
-			}*/
-
-			// Lighting of block will be updated completely
-			block->setLightingExpired(false);
-		}
-		}
-
-		{
-			//TimeTaker timer("unSpreadLight");
-			vmanip.unspreadLight(bank, unlight_from, light_sources, nodemgr);
-		}
-		{
-			//TimeTaker timer("spreadLight");
-			vmanip.spreadLight(bank, light_sources, nodemgr);
-		}
-		{
-			//TimeTaker timer("blitBack");
-			vmanip.blitBack(modified_blocks);
-		}
-		/*infostream<<"emerge_time="<<emerge_time<<std::endl;
-		emerge_time = 0;*/
-	}
-#endif
-
 	//m_dout<<"Done ("<<getTimestamp()<<")"<<std::endl;
 }
 
@@ -942,7 +685,6 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 	//v3s16 bottompos = p + v3s16(0,-1,0);
 
 	bool node_under_sunlight = true;
-	std::set<v3s16> light_sources;
 
 	/*
 		Collect old node for rollback
@@ -962,6 +704,16 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 	if(is_valid_position && topnode.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN)
 		node_under_sunlight = false;
 
+	// Add the block of the added node to modified_blocks
+	v3s16 blockpos = getNodeBlockPos(p);
+	MapBlock * block = getBlockNoCreate(blockpos);
+	assert(block != NULL);
+	modified_blocks[blockpos] = block;
+
+	MapNodeRef ref;
+	if(!getNodeRef(p, ref))
+		throw InvalidPositionException();
+
 	/*
 		Remove all light that has come out of this node
 	*/
@@ -971,26 +723,15 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 		LIGHTBANK_DAY,
 		LIGHTBANK_NIGHT
 	};
+	MapLightQueue unlight_from[2];
+	MapLightQueue light_sources[2];
 	for(s32 i=0; i<2; i++)
 	{
 		enum LightBank bank = banks[i];
 
 		u8 lightwas = getNodeNoEx(p).getLight(bank, ndef);
-
-		// Add the block of the added node to modified_blocks
-		v3s16 blockpos = getNodeBlockPos(p);
-		MapBlock * block = getBlockNoCreate(blockpos);
-		assert(block != NULL);
-		modified_blocks[blockpos] = block;
-
-		assert(isValidPosition(p));
-
-		// Unlight neighbours of node.
-		// This means setting light of all consequent dimmer nodes
-		// to 0.
-		// This also collects the nodes at the border which will spread
-		// light again into this.
-		unLightNeighbors(bank, p, lightwas, light_sources, modified_blocks);
+		if(lightwas != 0)
+			unlight_from[i].push(lightwas, ref);
 
 		n.setLight(bank, 0, ndef);
 	}
@@ -1019,34 +760,22 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 
 	/*
 		If node is under sunlight and doesn't let sunlight through,
-		take all sunlighted nodes under it and clear light from them
-		and from where the light has been spread.
-		TODO: This could be optimized by mass-unlighting instead
-			  of looping
+		take all sunlighted nodes under it and clear light from them.
+		The light spread from them is cleared with the rest below.
 	*/
 	if(node_under_sunlight && !ndef->get(n).sunlight_propagates)
 	{
-		s16 y = p.Y - 1;
-		for(;; y--){
-			//m_dout<<DTIME<<"y="<<y<<std::endl;
-			v3s16 n2pos(p.X, y, p.Z);
-
-			MapNode n2;
-
-			n2 = getNodeNoEx(n2pos, &is_valid_position);
-			if (!is_valid_position)
+		MapLightNodes nodes(this, modified_blocks);
+		MapNodeRef ref2;
+		for(s16 y = p.Y - 1; getNodeRef(v3s16(p.X, y, p.Z), ref2); y--)
+		{
+			MapNode &n2 = nodes.get(ref2);
+			if(n2.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN)
 				break;
 
-			if(n2.getLight(LIGHTBANK_DAY, ndef) == LIGHT_SUN)
-			{
-				unLightNeighbors(LIGHTBANK_DAY,
-						n2pos, n2.getLight(LIGHTBANK_DAY, ndef),
-						light_sources, modified_blocks);
-				n2.setLight(LIGHTBANK_DAY, 0, ndef);
-				setNode(n2pos, n2);
-			}
-			else
-				break;
+			n2.setLight(LIGHTBANK_DAY, 0, ndef);
+			nodes.setChanged(ref2);
+			unlight_from[0].push(LIGHT_SUN, ref2);
 		}
 	}
 
@@ -1054,10 +783,20 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 	{
 		enum LightBank bank = banks[i];
 
+		// Unlight the nodes that were lit from here, collecting the
+		// ones that will spread light back in
+		unspreadLight(bank, unlight_from[i], light_sources[i],
+				modified_blocks);
+
+		// The node itself may give light
+		u8 light = ref.block->getData()[ref.i].getLight(bank, ndef);
+		if(light != 0)
+			light_sources[i].push(light, ref);
+
 		/*
 			Spread light from all nodes that might be capable of doing so
 		*/
-		spreadLight(bank, light_sources, modified_blocks);
+		spreadLight(bank, light_sources[i], modified_blocks);
 	}
 
 	/*
@@ -1140,13 +879,17 @@ void Map::removeNodeAndUpdate(v3s16 p,
 	if(is_valid_position && topnode.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN)
 		node_under_sunlight = false;
 
-	std::set<v3s16> light_sources;
+	MapNodeRef ref;
+	if(!getNodeRef(p, ref))
+		throw InvalidPositionException();
 
 	enum LightBank banks[] =
 	{
 		LIGHTBANK_DAY,
 		LIGHTBANK_NIGHT
 	};
+	MapLightQueue unlight_from[2];
+	MapLightQueue light_sources[2];
 	for(s32 i=0; i<2; i++)
 	{
 		enum LightBank bank = banks[i];
@@ -1154,9 +897,9 @@ void Map::removeNodeAndUpdate(v3s16 p,
 		/*
 			Unlight neighbors (in case the node is a light source)
 		*/
-		unLightNeighbors(bank, p,
-				getNodeNoEx(p).getLight(bank, ndef),
-				light_sources, modified_blocks);
+		u8 lightwas = getNodeNoEx(p).getLight(bank, ndef);
+		if(lightwas != 0)
+			unlight_from[i].push(lightwas, ref);
 	}
 
 	/*
@@ -1173,26 +916,19 @@ void Map::removeNodeAndUpdate(v3s16 p,
 	MapNode n(replace_material);
 	setNode(p, n);
 
+	// Add the block of the removed node to modified_blocks
+	modified_blocks[ref.block->getPos()] = ref.block;
+
 	for(s32 i=0; i<2; i++)
 	{
-		enum LightBank bank = banks[i];
-
-		/*
-			Recalculate lighting
-		*/
-		spreadLight(bank, light_sources, modified_blocks);
+		unspreadLight(banks[i], unlight_from[i], light_sources[i],
+				modified_blocks);
 	}
 
-	// Add the block of the removed node to modified_blocks
-	v3s16 blockpos = getNodeBlockPos(p);
-	MapBlock * block = getBlockNoCreate(blockpos);
-	assert(block != NULL);
-	modified_blocks[blockpos] = block;
-
 	/*
 		If the removed node was under sunlight, propagate the
-		sunlight down from it and then light all neighbors
-		of the propagated blocks.
+		sunlight down from it and spread light from all of the
+		sunlighted nodes.
 	*/
 	if(node_under_sunlight)
 	{
@@ -1200,42 +936,32 @@ void Map::removeNodeAndUpdate(v3s16 p,
 		/*m_dout<<DTIME<<"Node was under sunlight. "
 				"Propagating sunlight";
 		m_dout<<DTIME<<" -> ybottom="<<ybottom<<std::endl;*/
-		s16 y = p.Y;
-		for(; y >= ybottom; y--)
+		MapNodeRef ref2;
+		for(s16 y = p.Y; y >= ybottom; y--)
 		{
-			v3s16 p2(p.X, y, p.Z);
-			/*m_dout<<DTIME<<"lighting neighbors of node ("
-					<<p2.X<<","<<p2.Y<<","<<p2.Z<<")"
-					<<std::endl;*/
-			lightNeighbors(LIGHTBANK_DAY, p2, modified_blocks);
-		}
-	}
-	else
-	{
-		// Set the lighting of this node to 0
-		// TODO: Is this needed? Lighting is cleared up there already.
-		MapNode n = getNodeNoEx(p, &is_valid_position);
-		if (is_valid_position) {
-			n.setLight(LIGHTBANK_DAY, 0, ndef);
-			setNode(p, n);
-		} else {
-			FATAL_ERROR("Invalid position");
+			if(getNodeRef(v3s16(p.X, y, p.Z), ref2))
+				light_sources[0].push(LIGHT_SUN, ref2);
 		}
 	}
 
+	/*
+		Light comes back in from the neighbours
+	*/
 	for(s32 i=0; i<2; i++)
 	{
 		enum LightBank bank = banks[i];
 
-		// Get the brightest neighbour node and propagate light from it
-		v3s16 n2p = getBrightestNeighbour(bank, p);
-		try{
-			//MapNode n2 = getNode(n2p);
-			lightNeighbors(bank, n2p, modified_blocks);
-		}
-		catch(InvalidPositionException &e)
+		for(u16 j=0; j<6; j++)
 		{
+			MapNodeRef ref2;
+			if(!getNodeRef(p + g_6dirs[j], ref2))
+				continue;
+			u8 light = ref2.block->getData()[ref2.i].getLight(bank, ndef);
+			if(light != 0)
+				light_sources[i].push(light, ref2);
 		}
+
+		spreadLight(bank, light_sources[i], modified_blocks);
 	}
 
 	/*
@@ -1417,51 +1143,50 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 	u32 block_count_all = 0;
 
 	beginSave();
-	for(std::map<v2s16, MapSector*>::iterator si = m_sectors.begin();
-		si != m_sectors.end(); ++si) {
-		MapSector *sector = si->second;
 
-		bool all_blocks_deleted = true;
+	// Walking the flat block index is much cheaper than the sector tree
+	MapBlockVect blocks;
+	m_block_index.getBlocks(blocks);
 
-		MapBlockVect blocks;
-		sector->getBlocks(blocks);
+	for(MapBlockVect::iterator i = blocks.begin();
+			i != blocks.end(); ++i) {
+		MapBlock *block = (*i);
 
-		for(MapBlockVect::iterator i = blocks.begin();
-				i != blocks.end(); ++i) {
-			MapBlock *block = (*i);
-
-			block->incrementUsageTimer(dtime);
+		block->incrementUsageTimer(dtime);
+		block->incrementNetworkCacheTimer(dtime);
 
-			if(block->refGet() == 0 && block->getUsageTimer() > unload_timeout) {
-				v3s16 p = block->getPos();
+		if(block->refGet() == 0 && block->getUsageTimer() > unload_timeout) {
+			v3s16 p = block->getPos();
 
-				// Save if modified
-				if (block->getModified() != MOD_STATE_CLEAN && save_before_unloading) {
-					modprofiler.add(block->getModifiedReason(), 1);
-					if (!saveBlock(block))
-						continue;
-					saved_blocks_count++;
-				}
+			// Save if modified
+			if (block->getModified() != MOD_STATE_CLEAN && save_before_unloading) {
+				modprofiler.add(block->getModifiedReason(), 1);
+				if (!saveBlock(block))
+					continue;
+				saved_blocks_count++;
+			}
 
-				// Delete from memory
-				sector->deleteBlock(block);
+			// Delete from memory
+			MapSector *sector = getSectorNoGenerateNoEx(v2s16(p.X, p.Z));
+			sector->deleteBlock(block);
 
-				if(unloaded_blocks)
-					unloaded_blocks->push_back(p);
+			if(unloaded_blocks)
+				unloaded_blocks->push_back(p);
 
-				deleted_blocks_count++;
-			}
-			else {
-				all_blocks_deleted = false;
-				block_count_all++;
-			}
+			deleted_blocks_count++;
+		}
+		else {
+			block_count_all++;
 		}
+	}
+	endSave();
 
-		if(all_blocks_deleted) {
+	// Sectors that have no blocks left are deleted too
+	for(std::map<v2s16, MapSector*>::iterator si = m_sectors.begin();
+		si != m_sectors.end(); ++si) {
+		if(si->second->empty())
 			sector_deletion_queue.push_back(si->first);
-		}
 	}
-	endSave();
 
 	// Finally delete the empty sectors
 	deleteSectors(sector_deletion_queue);
@@ -1539,6 +1264,391 @@ s32 Map::transforming_liquid_size() {
         return m_transforming_liquid.size();
 }
 
+/*
+	What transforming one liquid node produces, besides the node itself
+*/
+struct LiquidTransformResult
+{
+	// Positions to add to the queue, in order
+	std::vector<v3s16> queue;
+	// Nodes that due to viscosity have not reached their max level height
+	std::vector<v3s16> must_reflow;
+	std::map<v3s16, MapBlock*> modified_blocks;
+	// MapBlocks that will require a lighting update (due to lava)
+	std::map<v3s16, MapBlock*> lighting_modified_blocks;
+};
+
+/*
+	Removes the positions from queue[from] on that are in waiting, that
+	is, positions that are still to be transformed in this step. Queueing
+	them again would transform them twice.
+*/
+static void drop_waiting_liquid(std::vector<v3s16> &queue, size_t from,
+		const std::set<v3s16> &waiting)
+{
+	size_t to = from;
+	for(size_t i = from; i < queue.size(); i++) {
+		if(waiting.find(queue[i]) == waiting.end())
+			queue[to++] = queue[i];
+	}
+	queue.resize(to);
+}
+
+/*
+	Node access for transformLiquidNode() that goes through the Map.
+	Changes are reported to the rollback manager.
+*/
+class LiquidMapAccess
+{
+public:
+	LiquidMapAccess(Map *map, IGameDef *gamedef):
+		m_map(map),
+		m_gamedef(gamedef)
+	{
+	}
+
+	MapNode getNode(v3s16 p)
+	{
+		return m_map->getNodeNoEx(p);
+	}
+
+	MapBlock *getBlock(v3s16 blockpos)
+	{
+		return m_map->getBlockNoCreateNoEx(blockpos);
+	}
+
+	void setNode(v3s16 p, MapNode &n)
+	{
+		// Find out whether there is a suspect for this action
+		std::string suspect;
+		if(m_gamedef->rollback()) {
+			suspect = m_gamedef->rollback()->getSuspect(p, 83, 1);
+		}
+
+		if(m_gamedef->rollback() && !suspect.empty()){
+			// Blame suspect
+			RollbackScopeActor rollback_scope(m_gamedef->rollback(), suspect, true);
+			// Get old node for rollback
+			RollbackNode rollback_oldnode(m_map, p, m_gamedef);
+			// Set node
+			m_map->setNode(p, n);
+			// Report
+			RollbackNode rollback_newnode(m_map, p, m_gamedef);
+			RollbackAction action;
+			action.setSetNode(p, rollback_oldnode, rollback_newnode);
+			m_gamedef->rollback()->reportAction(action);
+		} else {
+			// Set node
+			m_map->setNode(p, n);
+		}
+	}
+
+private:
+	Map *m_map;
+	IGameDef *m_gamedef;
+};
+
+/*
+	The queued liquid nodes of one MapBlock, transformed by a worker thread.
+
+	Only the block itself is written to and only the block and its
+	neighbours are read, so jobs of blocks that are not next to each
+	other can run at the same time. The blocks are looked up by the
+	server thread beforehand, since the Map itself is not thread safe.
+*/
+struct LiquidBlockJob : public WorkerJob
+{
+	LiquidBlockJob(INodeDefManager *nodemgr_, v3s16 blockpos_):
+		nodemgr(nodemgr_),
+		blockpos(blockpos_)
+	{
+		for(u16 i = 0; i < 27; i++)
+			blocks[i] = NULL;
+	}
+
+	MapNode getNode(v3s16 p)
+	{
+		v3s16 nblockpos = getNodeBlockPos(p);
+		MapBlock *block = getBlock(nblockpos);
+		if(block == NULL || block->isDummy())
+			return MapNode(CONTENT_IGNORE);
+		bool is_valid_position;
+		return block->getNodeNoCheck(p - nblockpos * MAP_BLOCKSIZE,
+				&is_valid_position);
+	}
+
+	MapBlock *getBlock(v3s16 nblockpos)
+	{
+		v3s16 d = nblockpos - blockpos + v3s16(1,1,1);
+		return blocks[d.Z * 9 + d.Y * 3 + d.X];
+	}
+
+	void setNode(v3s16 p, MapNode &n)
+	{
+		// Like Map::setNode()
+		MapBlock *block = getBlock(blockpos);
+		if(n.getContent() == CONTENT_IGNORE){
+			errorstream<<"Map::transformLiquids(): Not allowing to place "
+					<<"CONTENT_IGNORE at "<<PP(p)<<std::endl;
+			return;
+		}
+		block->setNodeNoCheck(p - blockpos * MAP_BLOCKSIZE, n);
+	}
+
+	void run();
+
+	INodeDefManager *nodemgr;
+	v3s16 blockpos;
+	// The block and its neighbours, indexed by z*9+y*3+x of the offset
+	// plus one. NULL where not loaded.
+	MapBlock *blocks[27];
+	// Queued positions in this block
+	std::vector<v3s16> positions;
+	LiquidTransformResult result;
+	// Those of positions that have not been transformed yet
+	std::set<v3s16> waiting;
+};
+
+template<typename NodeAccess>
+static void transformLiquidNode(INodeDefManager *nodemgr, NodeAccess &access,
+		v3s16 p0, LiquidTransformResult &result)
+{
+	MapNode n0 = access.getNode(p0);
+
+	/*
+		Collect information about current node
+	 */
+	s8 liquid_level = -1;
+	content_t liquid_kind = CONTENT_IGNORE;
+	LiquidType liquid_type = nodemgr->get(n0).liquid_type;
+	switch (liquid_type) {
+		case LIQUID_SOURCE:
+			liquid_level = LIQUID_LEVEL_SOURCE;
+			liquid_kind = nodemgr->getId(nodemgr->get(n0).liquid_alternative_flowing);
+			break;
+		case LIQUID_FLOWING:
+			liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
+			liquid_kind = n0.getContent();
+			break;
+		case LIQUID_NONE:
+			// if this is an air node, it *could* be transformed into a liquid. otherwise,
+			// continue with the next node.
+			if (n0.getContent() != CONTENT_AIR)
+				return;
+			liquid_kind = CONTENT_AIR;
+			break;
+	}
+
+	/*
+		Collect information about the environment
+	 */
+	const v3s16 *dirs = g_6dirs;
+	NodeNeighbor sources[6]; // surrounding sources
+	int num_sources = 0;
+	NodeNeighbor flows[6]; // surrounding flowing liquid nodes
+	int num_flows = 0;
+	NodeNeighbor airs[6]; // surrounding air
+	int num_airs = 0;
+	NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
+	int num_neutrals = 0;
+	bool flowing_down = false;
+	for (u16 i = 0; i < 6; i++) {
+		NeighborType nt = NEIGHBOR_SAME_LEVEL;
+		switch (i) {
+			case 1:
+				nt = NEIGHBOR_UPPER;
+				break;
+			case 4:
+				nt = NEIGHBOR_LOWER;
+				break;
+		}
+		v3s16 npos = p0 + dirs[i];
+		NodeNeighbor nb(access.getNode(npos), nt, npos);
+		switch (nodemgr->get(nb.n.getContent()).liquid_type) {
+			case LIQUID_NONE:
+				if (nb.n.getContent() == CONTENT_AIR) {
+					airs[num_airs++] = nb;
+					// if the current node is a water source the neighbor
+					// should be enqueded for transformation regardless of whether the
+					// current node changes or not.
+					if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
+						result.queue.push_back(npos);
+					// if the current node happens to be a flowing node, it will start to flow down here.
+					if (nb.t == NEIGHBOR_LOWER) {
+						flowing_down = true;
+					}
+				} else {
+					neutrals[num_neutrals++] = nb;
+				}
+				break;
+			case LIQUID_SOURCE:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
+				if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					// Do not count bottom source, it will screw things up
+					if(dirs[i].Y != -1)
+						sources[num_sources++] = nb;
+				}
+				break;
+			case LIQUID_FLOWING:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
+				if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					flows[num_flows++] = nb;
+					if (nb.t == NEIGHBOR_LOWER)
+						flowing_down = true;
+				}
+				break;
+		}
+	}
+
+	/*
+		decide on the type (and possibly level) of the current node
+	 */
+	content_t new_node_content;
+	s8 new_node_level = -1;
+	s8 max_node_level = -1;
+
+	u8 range = nodemgr->get(liquid_kind).liquid_range;
+	if (range > LIQUID_LEVEL_MAX+1)
+		range = LIQUID_LEVEL_MAX+1;
+
+	if ((num_sources >= 2 && nodemgr->get(liquid_kind).liquid_renewable) || liquid_type == LIQUID_SOURCE) {
+		// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
+		// or the flowing alternative of the first of the surrounding sources (if it's air), so
+		// it's perfectly safe to use liquid_kind here to determine the new node content.
+		new_node_content = nodemgr->getId(nodemgr->get(liquid_kind).liquid_alternative_source);
+	} else if (num_sources >= 1 && sources[0].t != NEIGHBOR_LOWER) {
+		// liquid_kind is set properly, see above
+		new_node_content = liquid_kind;
+		max_node_level = new_node_level = LIQUID_LEVEL_MAX;
+		if (new_node_level < (LIQUID_LEVEL_MAX+1-range))
+			new_node_content = CONTENT_AIR;
+	} else {
+		// no surrounding sources, so get the maximum level that can flow into this node
+		for (u16 i = 0; i < num_flows; i++) {
+			u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
+			switch (flows[i].t) {
+				case NEIGHBOR_UPPER:
+					if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
+						max_node_level = LIQUID_LEVEL_MAX;
+						if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
+							max_node_level = nb_liquid_level + WATER_DROP_BOOST;
+					} else if (nb_liquid_level > max_node_level)
+						max_node_level = nb_liquid_level;
+					break;
+				case NEIGHBOR_LOWER:
+					break;
+				case NEIGHBOR_SAME_LEVEL:
+					if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
+						nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
+						max_node_level = nb_liquid_level - 1;
+					}
+					break;
+			}
+		}
+
+		u8 viscosity = nodemgr->get(liquid_kind).liquid_viscosity;
+		if (viscosity > 1 && max_node_level != liquid_level) {
+			// amount to gain, limited by viscosity
+			// must be at least 1 in absolute value
+			s8 level_inc = max_node_level - liquid_level;
+			if (level_inc < -viscosity || level_inc > viscosity)
+				new_node_level = liquid_level + level_inc/viscosity;
+			else if (level_inc < 0)
+				new_node_level = liquid_level - 1;
+			else if (level_inc > 0)
+				new_node_level = liquid_level + 1;
+			if (new_node_level != max_node_level)
+				result.must_reflow.push_back(p0);
+		} else
+			new_node_level = max_node_level;
+
+		if (max_node_level >= (LIQUID_LEVEL_MAX+1-range))
+			new_node_content = liquid_kind;
+		else
+			new_node_content = CONTENT_AIR;
+
+	}
+
+	/*
+		check if anything has changed. if not, just continue with the next node.
+	 */
+	if (new_node_content == n0.getContent() && (nodemgr->get(n0.getContent()).liquid_type != LIQUID_FLOWING ||
+									 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
+									 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
+									 == flowing_down)))
+		return;
+
+
+	/*
+		update the current node
+	 */
+	MapNode n00 = n0;
+	//bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
+	if (nodemgr->get(new_node_content).liquid_type == LIQUID_FLOWING) {
+		// set level to last 3 bits, flowing down bit to 4th bit
+		n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
+	} else {
+		// set the liquid level and flow bit to 0
+		n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
+	}
+	n0.setContent(new_node_content);
+
+	access.setNode(p0, n0);
+
+	v3s16 blockpos = getNodeBlockPos(p0);
+	MapBlock *block = access.getBlock(blockpos);
+	if(block != NULL) {
+		result.modified_blocks[blockpos] =  block;
+		// If new or old node emits light, MapBlock requires lighting update
+		if(nodemgr->get(n0).light_source != 0 ||
+				nodemgr->get(n00).light_source != 0)
+			result.lighting_modified_blocks[block->getPos()] = block;
+	}
+
+	/*
+		enqueue neighbors for update if neccessary
+	 */
+	switch (nodemgr->get(n0.getContent()).liquid_type) {
+		case LIQUID_SOURCE:
+		case LIQUID_FLOWING:
+			// make sure source flows into all neighboring nodes
+			for (u16 i = 0; i < num_flows; i++)
+				if (flows[i].t != NEIGHBOR_UPPER)
+					result.queue.push_back(flows[i].p);
+			for (u16 i = 0; i < num_airs; i++)
+				if (airs[i].t != NEIGHBOR_UPPER)
+					result.queue.push_back(airs[i].p);
+			break;
+		case LIQUID_NONE:
+			// this flow has turned to air; neighboring flows might need to do the same
+			for (u16 i = 0; i < num_flows; i++)
+				result.queue.push_back(flows[i].p);
+			break;
+	}
+}
+
+void LiquidBlockJob::run()
+{
+	if(getBlock(blockpos) == NULL)
+		return;
+	waiting.insert(positions.begin(), positions.end());
+	for(std::vector<v3s16>::iterator i = positions.begin();
+			i != positions.end(); ++i) {
+		waiting.erase(*i);
+		size_t from = result.queue.size();
+		transformLiquidNode(nodemgr, *this, *i, result);
+		drop_waiting_liquid(result.queue, from, waiting);
+	}
+}
+
 void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 {
 
@@ -1553,11 +1663,9 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 	/*if(initial_size != 0)
 		infostream<<"transformLiquids(): initial_size="<<initial_size<<std::endl;*/
 
-	// list of nodes that due to viscosity have not reached their max level height
-	std::deque<v3s16> must_reflow;
+	g_profiler->avg("Server: liquid queue size", initial_size);
 
-	// List of MapBlocks that will require a lighting update (due to lava)
-	std::map<v3s16, MapBlock*> lighting_modified_blocks;
+	LiquidTransformResult result;
 
 	u32 liquid_loop_max = g_settings->getS32("liquid_loop_max");
 	u32 loop_max = liquid_loop_max;
@@ -1579,267 +1687,123 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 	loop_max *= m_transforming_liquid_loop_count_multiplier;
 #endif
 
+	/*
+		Take this step's share of the queue. Positions queued during the
+		step end up behind it, so they are collected into result and
+		queued at the end. Those that are queued while they are still to
+		be transformed in this step are dropped, as the queue does.
+	*/
+	std::vector<v3s16> share;
 	while(m_transforming_liquid.size() != 0)
 	{
-		// This should be done here so that it is done when continue is used
 		if(loopcount >= initial_size || loopcount >= loop_max)
 			break;
 		loopcount++;
 
-		/*
-			Get a queued transforming liquid node
-		*/
-		v3s16 p0 = m_transforming_liquid.front();
+		share.push_back(m_transforming_liquid.front());
 		m_transforming_liquid.pop_front();
+	}
+	std::set<v3s16> waiting(share.begin(), share.end());
 
-		MapNode n0 = getNodeNoEx(p0);
-
-		/*
-			Collect information about current node
-		 */
-		s8 liquid_level = -1;
-		content_t liquid_kind = CONTENT_IGNORE;
-		LiquidType liquid_type = nodemgr->get(n0).liquid_type;
-		switch (liquid_type) {
-			case LIQUID_SOURCE:
-				liquid_level = LIQUID_LEVEL_SOURCE;
-				liquid_kind = nodemgr->getId(nodemgr->get(n0).liquid_alternative_flowing);
-				break;
-			case LIQUID_FLOWING:
-				liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
-				liquid_kind = n0.getContent();
-				break;
-			case LIQUID_NONE:
-				// if this is an air node, it *could* be transformed into a liquid. otherwise,
-				// continue with the next node.
-				if (n0.getContent() != CONTENT_AIR)
-					continue;
-				liquid_kind = CONTENT_AIR;
-				break;
-		}
-
-		/*
-			Collect information about the environment
-		 */
-		const v3s16 *dirs = g_6dirs;
-		NodeNeighbor sources[6]; // surrounding sources
-		int num_sources = 0;
-		NodeNeighbor flows[6]; // surrounding flowing liquid nodes
-		int num_flows = 0;
-		NodeNeighbor airs[6]; // surrounding air
-		int num_airs = 0;
-		NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
-		int num_neutrals = 0;
-		bool flowing_down = false;
-		for (u16 i = 0; i < 6; i++) {
-			NeighborType nt = NEIGHBOR_SAME_LEVEL;
-			switch (i) {
-				case 1:
-					nt = NEIGHBOR_UPPER;
-					break;
-				case 4:
-					nt = NEIGHBOR_LOWER;
-					break;
-			}
-			v3s16 npos = p0 + dirs[i];
-			NodeNeighbor nb(getNodeNoEx(npos), nt, npos);
-			switch (nodemgr->get(nb.n.getContent()).liquid_type) {
-				case LIQUID_NONE:
-					if (nb.n.getContent() == CONTENT_AIR) {
-						airs[num_airs++] = nb;
-						// if the current node is a water source the neighbor
-						// should be enqueded for transformation regardless of whether the
-						// current node changes or not.
-						if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
-							m_transforming_liquid.push_back(npos);
-						// if the current node happens to be a flowing node, it will start to flow down here.
-						if (nb.t == NEIGHBOR_LOWER) {
-							flowing_down = true;
-						}
-					} else {
-						neutrals[num_neutrals++] = nb;
-					}
-					break;
-				case LIQUID_SOURCE:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
-					if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						// Do not count bottom source, it will screw things up
-						if(dirs[i].Y != -1)
-							sources[num_sources++] = nb;
-					}
-					break;
-				case LIQUID_FLOWING:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
-					if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						flows[num_flows++] = nb;
-						if (nb.t == NEIGHBOR_LOWER)
-							flowing_down = true;
-					}
-					break;
-			}
+	if (m_liquid_workers == NULL || m_gamedef->rollback() != NULL) {
+		LiquidMapAccess access(this, m_gamedef);
+		for(std::vector<v3s16>::iterator i = share.begin();
+				i != share.end(); ++i) {
+			waiting.erase(*i);
+			size_t from = result.queue.size();
+			transformLiquidNode(nodemgr, access, *i, result);
+			drop_waiting_liquid(result.queue, from, waiting);
 		}
-
+	} else {
 		/*
-			decide on the type (and possibly level) of the current node
-		 */
-		content_t new_node_content;
-		s8 new_node_level = -1;
-		s8 max_node_level = -1;
-
-		u8 range = nodemgr->get(liquid_kind).liquid_range;
-		if (range > LIQUID_LEVEL_MAX+1)
-			range = LIQUID_LEVEL_MAX+1;
-
-		if ((num_sources >= 2 && nodemgr->get(liquid_kind).liquid_renewable) || liquid_type == LIQUID_SOURCE) {
-			// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
-			// or the flowing alternative of the first of the surrounding sources (if it's air), so
-			// it's perfectly safe to use liquid_kind here to determine the new node content.
-			new_node_content = nodemgr->getId(nodemgr->get(liquid_kind).liquid_alternative_source);
-		} else if (num_sources >= 1 && sources[0].t != NEIGHBOR_LOWER) {
-			// liquid_kind is set properly, see above
-			new_node_content = liquid_kind;
-			max_node_level = new_node_level = LIQUID_LEVEL_MAX;
-			if (new_node_level < (LIQUID_LEVEL_MAX+1-range))
-				new_node_content = CONTENT_AIR;
-		} else {
-			// no surrounding sources, so get the maximum level that can flow into this node
-			for (u16 i = 0; i < num_flows; i++) {
-				u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
-				switch (flows[i].t) {
-					case NEIGHBOR_UPPER:
-						if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
-							max_node_level = LIQUID_LEVEL_MAX;
-							if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
-								max_node_level = nb_liquid_level + WATER_DROP_BOOST;
-						} else if (nb_liquid_level > max_node_level)
-							max_node_level = nb_liquid_level;
-						break;
-					case NEIGHBOR_LOWER:
-						break;
-					case NEIGHBOR_SAME_LEVEL:
-						if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
-							nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
-							max_node_level = nb_liquid_level - 1;
-						}
-						break;
-				}
-			}
-
-			u8 viscosity = nodemgr->get(liquid_kind).liquid_viscosity;
-			if (viscosity > 1 && max_node_level != liquid_level) {
-				// amount to gain, limited by viscosity
-				// must be at least 1 in absolute value
-				s8 level_inc = max_node_level - liquid_level;
-				if (level_inc < -viscosity || level_inc > viscosity)
-					new_node_level = liquid_level + level_inc/viscosity;
-				else if (level_inc < 0)
-					new_node_level = liquid_level - 1;
-				else if (level_inc > 0)
-					new_node_level = liquid_level + 1;
-				if (new_node_level != max_node_level)
-					must_reflow.push_back(p0);
-			} else
-				new_node_level = max_node_level;
-
-			if (max_node_level >= (LIQUID_LEVEL_MAX+1-range))
-				new_node_content = liquid_kind;
-			else
-				new_node_content = CONTENT_AIR;
-
+			Partition the share by MapBlock
+		*/
+		std::map<v3s16, LiquidBlockJob*> jobs;
+		for(std::vector<v3s16>::iterator i = share.begin();
+				i != share.end(); ++i) {
+			v3s16 blockpos = getNodeBlockPos(*i);
+			LiquidBlockJob *&job = jobs[blockpos];
+			if(job == NULL)
+				job = new LiquidBlockJob(nodemgr, blockpos);
+			job->positions.push_back(*i);
 		}
 
 		/*
-			check if anything has changed. if not, just continue with the next node.
-		 */
-		if (new_node_content == n0.getContent() && (nodemgr->get(n0.getContent()).liquid_type != LIQUID_FLOWING ||
-										 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
-										 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
-										 == flowing_down)))
-			continue;
-
-
-		/*
-			update the current node
-		 */
-		MapNode n00 = n0;
-		//bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
-		if (nodemgr->get(new_node_content).liquid_type == LIQUID_FLOWING) {
-			// set level to last 3 bits, flowing down bit to 4th bit
-			n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
-		} else {
-			// set the liquid level and flow bit to 0
-			n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
-		}
-		n0.setContent(new_node_content);
-
-		// Find out whether there is a suspect for this action
-		std::string suspect;
-		if(m_gamedef->rollback()) {
-			suspect = m_gamedef->rollback()->getSuspect(p0, 83, 1);
+			Process the blocks in eight passes, by the parity of their
+			coordinates. Blocks of the same pass are never next to each
+			other, so their jobs do not see each other's changes.
+		*/
+		std::vector<LiquidBlockJob*> passes[8];
+		for(std::map<v3s16, LiquidBlockJob*>::iterator
+				i = jobs.begin(); i != jobs.end(); ++i) {
+			LiquidBlockJob *job = i->second;
+			v3s16 blockpos = job->blockpos;
+			for(s16 z = -1; z <= 1; z++)
+			for(s16 y = -1; y <= 1; y++)
+			for(s16 x = -1; x <= 1; x++)
+				job->blocks[(z + 1) * 9 + (y + 1) * 3 + (x + 1)] =
+						getBlockNoCreateNoEx(blockpos + v3s16(x, y, z));
+			u8 pass = (blockpos.X & 1) | (blockpos.Y & 1) << 1 |
+					(blockpos.Z & 1) << 2;
+			passes[pass].push_back(job);
 		}
 
-		if(m_gamedef->rollback() && !suspect.empty()){
-			// Blame suspect
-			RollbackScopeActor rollback_scope(m_gamedef->rollback(), suspect, true);
-			// Get old node for rollback
-			RollbackNode rollback_oldnode(this, p0, m_gamedef);
-			// Set node
-			setNode(p0, n0);
-			// Report
-			RollbackNode rollback_newnode(this, p0, m_gamedef);
-			RollbackAction action;
-			action.setSetNode(p0, rollback_oldnode, rollback_newnode);
-			m_gamedef->rollback()->reportAction(action);
-		} else {
-			// Set node
-			setNode(p0, n0);
+		{
+			ScopeProfiler sp(g_profiler, "Server: liquid threaded transform avg",
+					SPT_AVG);
+			for(u8 pass = 0; pass < 8; pass++)
+				if(!passes[pass].empty())
+					m_liquid_workers->run(passes[pass]);
 		}
 
-		v3s16 blockpos = getNodeBlockPos(p0);
-		MapBlock *block = getBlockNoCreateNoEx(blockpos);
-		if(block != NULL) {
-			modified_blocks[blockpos] =  block;
-			// If new or old node emits light, MapBlock requires lighting update
-			if(nodemgr->get(n0).light_source != 0 ||
-					nodemgr->get(n00).light_source != 0)
-				lighting_modified_blocks[block->getPos()] = block;
-		}
+		g_profiler->avg("Server: liquid blocks per step", jobs.size());
 
 		/*
-			enqueue neighbors for update if neccessary
-		 */
-		switch (nodemgr->get(n0.getContent()).liquid_type) {
-			case LIQUID_SOURCE:
-			case LIQUID_FLOWING:
-				// make sure source flows into all neighboring nodes
-				for (u16 i = 0; i < num_flows; i++)
-					if (flows[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(flows[i].p);
-				for (u16 i = 0; i < num_airs; i++)
-					if (airs[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(airs[i].p);
-				break;
-			case LIQUID_NONE:
-				// this flow has turned to air; neighboring flows might need to do the same
-				for (u16 i = 0; i < num_flows; i++)
-					m_transforming_liquid.push_back(flows[i].p);
-				break;
+			A job only knows about the positions of its own block. A
+			position it queued in a block of a later pass was still to be
+			transformed then; one that is only queued in a block of this
+			or an earlier pass was not. Neighbouring blocks are never in
+			the same pass.
+		*/
+		for(u8 pass = 0; pass < 8; pass++) {
+			for(size_t j = 0; j < passes[pass].size(); j++) {
+				std::vector<v3s16> &positions = passes[pass][j]->positions;
+				for(size_t k = 0; k < positions.size(); k++)
+					waiting.erase(positions[k]);
+			}
+			for(size_t j = 0; j < passes[pass].size(); j++) {
+				LiquidTransformResult &r = passes[pass][j]->result;
+				size_t from = result.queue.size();
+				result.queue.insert(result.queue.end(),
+						r.queue.begin(), r.queue.end());
+				drop_waiting_liquid(result.queue, from, waiting);
+				result.must_reflow.insert(result.must_reflow.end(),
+						r.must_reflow.begin(), r.must_reflow.end());
+				result.modified_blocks.insert(
+						r.modified_blocks.begin(), r.modified_blocks.end());
+				result.lighting_modified_blocks.insert(
+						r.lighting_modified_blocks.begin(),
+						r.lighting_modified_blocks.end());
+			}
 		}
+
+		for(std::map<v3s16, LiquidBlockJob*>::iterator
+				i = jobs.begin(); i != jobs.end(); ++i)
+			delete i->second;
 	}
 	//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
 
-	for (std::deque<v3s16>::iterator iter = must_reflow.begin(); iter != must_reflow.end(); ++iter)
+	g_profiler->avg("Server: liquid nodes processed per step", loopcount);
+
+	for (std::vector<v3s16>::iterator iter = result.queue.begin(); iter != result.queue.end(); ++iter)
+		m_transforming_liquid.push_back(*iter);
+	for (std::vector<v3s16>::iterator iter = result.must_reflow.begin(); iter != result.must_reflow.end(); ++iter)
 		m_transforming_liquid.push_back(*iter);
 
-	updateLighting(lighting_modified_blocks, modified_blocks);
+	modified_blocks.insert(result.modified_blocks.begin(),
+			result.modified_blocks.end());
+
+	updateLighting(result.lighting_modified_blocks, modified_blocks);
 
 
 	/* ----------------------------------------------------------------------
@@ -1926,6 +1890,7 @@ bool Map::setNodeMetadata(v3s16 p, NodeMetadata *meta)
 		return false;
 	}
 	block->m_node_metadata.set(p_rel, meta);
+	block->expireNetworkCache();
 	return true;
 }
 
@@ -1941,6 +1906,7 @@ void Map::removeNodeMetadata(v3s16 p)
 		return;
 	}
 	block->m_node_metadata.remove(p_rel);
+	block->expireNetworkCache();
 }
 
 NodeTimer Map::getNodeTimer(v3s16 p)
@@ -2000,10 +1966,15 @@ void Map::removeNodeTimer(v3s16 p)
 ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emerge):
 	Map(dout_server, gamedef),
 	m_emerge(emerge),
-	m_map_metadata_changed(true)
+	m_map_metadata_changed(true),
+	m_saver(NULL)
 {
 	verbosestream<<__FUNCTION_NAME<<std::endl;
 
+	u16 num_liquid_threads = g_settings->getU16("num_liquid_threads");
+	if(num_liquid_threads > 0)
+		m_liquid_workers = new WorkerPool(num_liquid_threads, "LiquidWorkerThread");
+
 	/*
 		Try to load map; if not found, create a new one.
 	*/
@@ -2019,6 +1990,12 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 	std::string backend = conf.get("backend");
 	dbase = createDatabase(backend, savedir, conf);
 
+	u16 save_queue_size = g_settings->getU16("map_save_queue_size");
+	if (save_queue_size > 0) {
+		m_saver = new MapSaver(dbase, &m_dbase_mutex, save_queue_size);
+		m_saver->Start();
+	}
+
 	if (!conf.updateConfigFile(conf_path.c_str()))
 		errorstream << "ServerMap::ServerMap(): Failed to update world.mt!" << std::endl;
 
@@ -2110,6 +2087,9 @@ ServerMap::~ServerMap()
 				<<", exception: "<<e.what()<<std::endl;
 	}
 
+	// Commits the blocks still queued
+	delete m_saver;
+
 	/*
 		Close database if it was opened
 	*/
@@ -2980,7 +2960,26 @@ void ServerMap::listAllLoadableBlocks(std::vector<v3s16> &dst)
 		errorstream << "Map::listAllLoadableBlocks(): Result will be missing "
 				<< "all blocks that are stored in flat files." << std::endl;
 	}
-	dbase->listAllLoadableBlocks(dst);
+	if (!m_saver) {
+		JMutexAutoLock lock(m_dbase_mutex);
+		dbase->listAllLoadableBlocks(dst);
+		return;
+	}
+
+	// Include the blocks that are only queued so far. The queue is listed
+	// first; a block committed in between is then in the database.
+	std::vector<v3s16> queued;
+	m_saver->listQueuedBlocks(queued);
+	std::vector<v3s16> stored;
+	{
+		JMutexAutoLock lock(m_dbase_mutex);
+		dbase->listAllLoadableBlocks(stored);
+	}
+	std::set<v3s16> seen(stored.begin(), stored.end());
+	dst.insert(dst.end(), stored.begin(), stored.end());
+	for (std::vector<v3s16>::iterator i = queued.begin(); i != queued.end(); ++i)
+		if (seen.insert(*i).second)
+			dst.push_back(*i);
 }
 
 void ServerMap::listAllLoadedBlocks(std::vector<v3s16> &dst)
@@ -3245,17 +3244,39 @@ Database *ServerMap::createDatabase(const std::string &name, const std::string &
 
 void ServerMap::beginSave()
 {
+	if (m_saver)
+		return;
 	dbase->beginSave();
 }
 
 void ServerMap::endSave()
 {
+	if (m_saver)
+		return;
 	dbase->endSave();
 }
 
 bool ServerMap::saveBlock(MapBlock *block)
 {
-	return saveBlock(block, dbase);
+	if (!m_saver)
+		return saveBlock(block, dbase);
+
+	// Dummy blocks are not written
+	if (block->isDummy()) {
+		errorstream << "WARNING: saveBlock: Not writing dummy block "
+			<< PP(block->getPos()) << std::endl;
+		return true;
+	}
+
+	// Only take the data here; compressing and writing it is done by
+	// the saver thread
+	MapBlockDiskData data;
+	block->serializeDisk(data, SER_FMT_VER_HIGHEST_WRITE);
+	m_saver->queueBlock(block->getPos(), data);
+
+	// The queued snapshot is what loadBlock() will get from now on
+	block->resetModified();
+	return true;
 }
 
 bool ServerMap::saveBlock(MapBlock *block, Database *db)
@@ -3345,7 +3366,8 @@ void ServerMap::loadBlock(std::string sectordir, std::string blockfile,
 			saveBlock(block);
 
 			// Should be in database now, so delete the old file
-			fs::RecursiveDelete(fullpath);
+			if (!m_saver || m_saver->flushBlock(p3d))
+				fs::RecursiveDelete(fullpath);
 		}
 
 		// We just loaded it from the disk, so it's up-to-date.
@@ -3442,12 +3464,52 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 
 	std::string ret;
 
-	ret = dbase->loadBlock(blockpos);
+	// A block waiting to be written is newer than the database copy
+	if (!m_saver || !m_saver->getQueuedBlock(blockpos, &ret)) {
+		JMutexAutoLock lock(m_dbase_mutex);
+		ret = dbase->loadBlock(blockpos);
+	}
 	if (ret != "") {
 		loadBlock(&ret, blockpos, createSector(p2d), false);
 		return getBlockNoCreateNoEx(blockpos);
 	}
 	// Not found in database, try the files
+	return loadBlockFromFiles(blockpos);
+}
+
+void ServerMap::loadBlocks(const std::vector<v3s16> &positions)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	std::vector<v3s16> from_db;
+	std::string queued;
+	for (size_t i = 0; i < positions.size(); i++) {
+		v3s16 p = positions[i];
+		// A block waiting to be written is newer than the database copy
+		if (m_saver && m_saver->getQueuedBlock(p, &queued))
+			loadBlock(&queued, p, createSector(v2s16(p.X, p.Z)), false);
+		else
+			from_db.push_back(p);
+	}
+
+	std::vector<std::string> data;
+	{
+		JMutexAutoLock lock(m_dbase_mutex);
+		dbase->loadBlocks(from_db, &data);
+	}
+
+	for (size_t i = 0; i < from_db.size(); i++) {
+		v3s16 p = from_db[i];
+		if (data[i] != "")
+			loadBlock(&data[i], p, createSector(v2s16(p.X, p.Z)), false);
+		else
+			loadBlockFromFiles(p);
+	}
+}
+
+MapBlock* ServerMap::loadBlockFromFiles(v3s16 blockpos)
+{
+	v2s16 p2d(blockpos.X, blockpos.Z);
 
 	// The directory layout we're going to load from.
 	//  1 - original sectors/xxxxzzzz/
@@ -3507,8 +3569,15 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 
 bool ServerMap::deleteBlock(v3s16 blockpos)
 {
-	if (!dbase->deleteBlock(blockpos))
-		return false;
+	// Don't let a queued write bring the block back
+	if (m_saver)
+		m_saver->dropBlock(blockpos);
+
+	{
+		JMutexAutoLock lock(m_dbase_mutex);
+		if (!dbase->deleteBlock(blockpos))
+			return false;
+	}
 
 	MapBlock *block = getBlockNoCreateNoEx(blockpos);
 	if (block) {
@@ -25,14 +25,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <map>
 #include <list>
+#include <vector>
 
 #include "irrlichttypes_bloated.h"
 #include "mapnode.h"
 #include "constants.h"
 #include "voxel.h"
+#include "voxelalgorithms.h"
 #include "modifiedstate.h"
 #include "util/container.h"
 #include "nodetimer.h"
+#include "jthread/jmutex.h"
 
 class Settings;
 class Database;
@@ -45,10 +48,34 @@ class IGameDef;
 class IRollbackManager;
 class EmergeManager;
 class ServerEnvironment;
+class WorkerPool;
+class MapSaver;
 struct BlockMakeData;
 struct MapgenParams;
 
 
+/*
+	A node of a loaded MapBlock, by its index in MapBlock::getData().
+	The lighting code queues these instead of positions.
+*/
+struct MapNodeRef
+{
+	MapBlock *block;
+	u16 i;
+
+	MapNodeRef():
+		block(NULL),
+		i(0)
+	{}
+	MapNodeRef(MapBlock *block_, u16 i_):
+		block(block_),
+		i(i_)
+	{}
+};
+
+typedef voxalgo::LightQueue<MapNodeRef> MapLightQueue;
+
+
 /*
 	MapEditEvent
 */
@@ -137,6 +164,63 @@ class MapEventReceiver
 	virtual void onMapEditEvent(MapEditEvent *event) = 0;
 };
 
+/*
+	Hash table of all the MapBlocks of a Map by position, so that a block
+	is found without going through the sector tree.
+	Open addressing with linear probing; entries are removed by shifting
+	the following ones back, so there are no tombstones.
+	The MapSectors still own the blocks and keep this up to date.
+*/
+class MapBlockIndex
+{
+public:
+	MapBlockIndex();
+
+	MapBlock *get(v3s16 p) const
+	{
+		u64 key = packPos(p);
+		for (u32 i = hash(key) & m_mask;; i = (i + 1) & m_mask) {
+			const Slot &slot = m_slots[i];
+			if (slot.block == NULL)
+				return NULL;
+			if (slot.key == key)
+				return slot.block;
+		}
+	}
+
+	// Adds or replaces the block at p
+	void set(v3s16 p, MapBlock *block);
+	void remove(v3s16 p);
+	void clear();
+
+	u32 size() const { return m_count; }
+	// Appends all blocks in table order, which is cheap to iterate
+	void getBlocks(std::vector<MapBlock*> &dst) const;
+
+private:
+	struct Slot
+	{
+		u64 key;
+		MapBlock *block;
+	};
+
+	static u64 packPos(v3s16 p)
+	{
+		return (u64)(u16)p.X | (u64)(u16)p.Y << 16 | (u64)(u16)p.Z << 32;
+	}
+
+	static u32 hash(u64 key)
+	{
+		return (u32)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+	}
+
+	void resize(u32 capacity);
+
+	std::vector<Slot> m_slots;
+	u32 m_mask;
+	u32 m_count;
+};
+
 class Map /*: public NodeContainer*/
 {
 public:
@@ -189,6 +273,11 @@ class Map /*: public NodeContainer*/
 	// Returns NULL if not found
 	MapBlock * getBlockNoCreateNoEx(v3s16 p);
 
+	// Called by MapSector when it gets or loses a block
+	void addIndexedBlock(MapBlock *block);
+	void removeIndexedBlock(v3s16 p);
+	u32 getBlockCount() const { return m_block_index.size(); }
+
 	/* Server overrides */
 	virtual MapBlock * emergeBlock(v3s16 p, bool create_blank=true)
 	{ return getBlockNoCreateNoEx(p); }
@@ -206,26 +295,19 @@ class Map /*: public NodeContainer*/
 	// position is valid, otherwise false
 	MapNode getNodeNoEx(v3s16 p, bool *is_valid_position = NULL);
 
-	void unspreadLight(enum LightBank bank,
-			std::map<v3s16, u8> & from_nodes,
-			std::set<v3s16> & light_sources,
-			std::map<v3s16, MapBlock*> & modified_blocks);
+	// Returns false if the node is not in a loaded block
+	bool getNodeRef(v3s16 p, MapNodeRef &ref);
 
-	void unLightNeighbors(enum LightBank bank,
-			v3s16 pos, u8 lightwas,
-			std::set<v3s16> & light_sources,
+	// See voxalgo::unspreadLight() and voxalgo::spreadLight()
+	void unspreadLight(enum LightBank bank,
+			MapLightQueue & from_nodes,
+			MapLightQueue & light_sources,
 			std::map<v3s16, MapBlock*> & modified_blocks);
 
 	void spreadLight(enum LightBank bank,
-			std::set<v3s16> & from_nodes,
+			MapLightQueue & light_sources,
 			std::map<v3s16, MapBlock*> & modified_blocks);
 
-	void lightNeighbors(enum LightBank bank,
-			v3s16 pos,
-			std::map<v3s16, MapBlock*> & modified_blocks);
-
-	v3s16 getBrightestNeighbour(enum LightBank bank, v3s16 p);
-
 	s16 propagateSunlight(v3s16 start,
 			std::map<v3s16, MapBlock*> & modified_blocks);
 
@@ -356,8 +438,17 @@ class Map /*: public NodeContainer*/
 	MapSector *m_sector_cache;
 	v2s16 m_sector_cache_p;
 
+	// All blocks of m_sectors by position
+	MapBlockIndex m_block_index;
+	// Last block returned by getBlockNoCreateNoEx(); cleared by
+	// removeIndexedBlock()
+	MapBlock *m_block_cache;
+	v3s16 m_block_cache_p;
+
 	// Queued transforming water nodes
 	UniqueQueue<v3s16> m_transforming_liquid;
+	// NULL if liquids are transformed on the server thread only
+	WorkerPool *m_liquid_workers;
 
 private:
 	f32 m_transforming_liquid_loop_count_multiplier;
@@ -453,7 +544,8 @@ class ServerMap : public Map
 	// Returns true if the database file does not exist
 	bool loadFromFolders();
 
-	// Call these before and after saving of blocks
+	// Call these before and after saving of blocks.
+	// Without effect when blocks are written in the background.
 	void beginSave();
 	void endSave();
 
@@ -488,6 +580,10 @@ class ServerMap : public Map
 	// This will generate a sector with getSector if not found.
 	void loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load=false);
 	MapBlock* loadBlock(v3s16 p);
+	// Loads the blocks that exist with as few database queries as possible
+	void loadBlocks(const std::vector<v3s16> &positions);
+	// Legacy flat files version
+	MapBlock* loadBlockFromFiles(v3s16 p);
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
@@ -524,6 +620,10 @@ class ServerMap : public Map
 	*/
 	bool m_map_metadata_changed;
 	Database *dbase;
+	// Held around every use of dbase while m_saver is running
+	JMutex m_dbase_mutex;
+	// Writes blocks in the background; NULL if saving is synchronous
+	MapSaver *m_saver;
 };
 
 
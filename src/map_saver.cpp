@@ -0,0 +1,321 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "map_saver.h"
+
+#include <sstream>
+#include <vector>
+#include "database.h"
+#include "debug.h"
+#include "log.h"
+#include "main.h" // for g_profiler
+#include "profiler.h"
+#include "porting.h"
+#include "jthread/jmutexautolock.h"
+#include "util/serialize.h"
+#include "util/timetaker.h"
+
+// Maximum number of blocks written in one transaction
+#define MAP_SAVER_BATCH_SIZE 128
+// The database is locked for a whole transaction; batches are made smaller
+// while committing one takes longer than this
+#define MAP_SAVER_MAX_LOCK_MS 50
+
+MapSaver::MapSaver(Database *db, JMutex *db_mutex, u32 queue_limit):
+	m_db(db),
+	m_db_mutex(db_mutex),
+	m_queue_limit(queue_limit),
+	m_failed_count(0),
+	m_batch_size(MAP_SAVER_BATCH_SIZE),
+	m_waiters(0)
+{
+}
+
+MapSaver::~MapSaver()
+{
+	if (IsRunning()) {
+		Stop();
+		m_queue_event.Post();
+		Wait();
+	}
+	// Whatever the thread didn't get to
+	flush();
+	if (!m_blocks.empty())
+		errorstream << "MapSaver: " << m_blocks.size()
+				<< " blocks could not be written" << std::endl;
+}
+
+void MapSaver::queueBlock(v3s16 pos, const MapBlockDiskData &data)
+{
+	m_queue_mutex.Lock();
+
+	std::map<v3s16, QueuedBlock>::iterator i = m_blocks.find(pos);
+	if (i == m_blocks.end()) {
+		// Only new blocks grow the queue
+		// Blocks that failed to be written don't count, the thread
+		// can't make room by retrying them
+		if (m_blocks.size() - m_failed_count >= m_queue_limit && IsRunning()) {
+			g_profiler->add("MapSaver: queue full waits", 1);
+			while (m_blocks.size() - m_failed_count >= m_queue_limit)
+				waitBatch();
+		}
+		i = m_blocks.find(pos);
+	}
+
+	if (i == m_blocks.end()) {
+		QueuedBlock &qb = m_blocks[pos];
+		qb.data = data;
+		qb.generation = 0;
+		qb.queued = true;
+		qb.failed = false;
+		m_order.push_back(pos);
+	} else {
+		QueuedBlock &qb = i->second;
+		qb.data = data;
+		qb.generation++;
+		if (qb.failed) {
+			qb.failed = false;
+			m_failed_count--;
+		}
+		// Being committed right now; has to be written again afterwards
+		if (!qb.queued) {
+			qb.queued = true;
+			m_order.push_back(pos);
+		}
+	}
+
+	m_queue_mutex.Unlock();
+	m_queue_event.Post();
+}
+
+bool MapSaver::getQueuedBlock(v3s16 pos, std::string *data)
+{
+	MapBlockDiskData d;
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		std::map<v3s16, QueuedBlock>::iterator i = m_blocks.find(pos);
+		if (i == m_blocks.end())
+			return false;
+		d = i->second.data;
+	}
+
+	std::ostringstream os(std::ios_base::binary);
+	writeU8(os, d.version);
+	d.write(os);
+	*data = os.str();
+	return true;
+}
+
+void MapSaver::flush()
+{
+	if (!IsRunning()) {
+		while (commitBatch())
+			;
+		return;
+	}
+
+	m_queue_mutex.Lock();
+	while (m_blocks.size() > m_failed_count)
+		waitBatch();
+	m_queue_mutex.Unlock();
+}
+
+bool MapSaver::flushBlock(v3s16 pos)
+{
+	if (!IsRunning())
+		flush();
+
+	m_queue_mutex.Lock();
+	std::map<v3s16, QueuedBlock>::iterator i;
+	while ((i = m_blocks.find(pos)) != m_blocks.end() && !i->second.failed)
+		waitBatch();
+	bool written = (i == m_blocks.end());
+	m_queue_mutex.Unlock();
+	return written;
+}
+
+void MapSaver::dropBlock(v3s16 pos)
+{
+	m_queue_mutex.Lock();
+	std::map<v3s16, QueuedBlock>::iterator i;
+	while ((i = m_blocks.find(pos)) != m_blocks.end()) {
+		// Can't take it back while it's being written
+		if (!i->second.queued) {
+			waitBatch();
+			continue;
+		}
+		// The stale entry in m_order is skipped by commitBatch()
+		if (i->second.failed)
+			m_failed_count--;
+		m_blocks.erase(i);
+	}
+	m_queue_mutex.Unlock();
+}
+
+void MapSaver::listQueuedBlocks(std::vector<v3s16> &dst)
+{
+	JMutexAutoLock lock(m_queue_mutex);
+	for (std::map<v3s16, QueuedBlock>::const_iterator
+			i = m_blocks.begin(); i != m_blocks.end(); ++i)
+		dst.push_back(i->first);
+}
+
+u32 MapSaver::getQueueSize()
+{
+	JMutexAutoLock lock(m_queue_mutex);
+	return m_blocks.size();
+}
+
+void MapSaver::waitBatch()
+{
+	m_waiters++;
+	m_queue_mutex.Unlock();
+	m_batch_done.Wait();
+	m_queue_mutex.Lock();
+}
+
+void MapSaver::notifyWaiters()
+{
+	for (; m_waiters > 0; m_waiters--)
+		m_batch_done.Post();
+}
+
+bool MapSaver::commitBatch()
+{
+	std::vector<v3s16> positions;
+	std::vector<u32> generations;
+	std::vector<MapBlockDiskData> snapshots;
+	u32 queue_depth;
+
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		queue_depth = m_blocks.size();
+		while (!m_order.empty() && positions.size() < m_batch_size) {
+			v3s16 pos = m_order.front();
+			m_order.pop_front();
+			// Dropped, or queued again after being dropped
+			std::map<v3s16, QueuedBlock>::iterator it = m_blocks.find(pos);
+			if (it == m_blocks.end() || !it->second.queued)
+				continue;
+			QueuedBlock &qb = it->second;
+			qb.queued = false;
+			positions.push_back(pos);
+			generations.push_back(qb.generation);
+			snapshots.push_back(qb.data);
+		}
+	}
+
+	if (positions.empty()) {
+		JMutexAutoLock lock(m_queue_mutex);
+		notifyWaiters();
+		return false;
+	}
+
+	g_profiler->avg("MapSaver: queue depth", queue_depth);
+
+	// Compress without holding any lock
+	std::vector<std::string> blobs(positions.size());
+	for (size_t i = 0; i < positions.size(); i++) {
+		std::ostringstream os(std::ios_base::binary);
+		writeU8(os, snapshots[i].version);
+		snapshots[i].write(os);
+		blobs[i] = os.str();
+	}
+	snapshots.clear();
+
+	/*
+		Other threads use the same connection, and some backends can't
+		answer them inside a transaction (Redis queues every command after
+		MULTI), so the database is locked for the whole transaction
+	*/
+	std::vector<bool> written(positions.size());
+	u32 written_count = 0;
+	u32 commit_time_ms = 0;
+	{
+		JMutexAutoLock lock(*m_db_mutex);
+		TimeTaker timer("MapSaver commit", NULL, PRECISION_MILLI);
+		m_db->beginSave();
+		for (size_t i = 0; i < positions.size(); i++) {
+			written[i] = m_db->saveBlock(positions[i], blobs[i]);
+			if (written[i])
+				written_count++;
+			else
+				errorstream << "MapSaver: Failed to write block "
+						<< PP(positions[i]) << std::endl;
+		}
+		m_db->endSave();
+		commit_time_ms = timer.stop(true);
+	}
+	g_profiler->avg("MapSaver: commit time (ms)", commit_time_ms);
+	g_profiler->avg("MapSaver: blocks per commit", positions.size());
+
+	// Keep loads from waiting too long on the lock
+	if (commit_time_ms > MAP_SAVER_MAX_LOCK_MS && m_batch_size > 1)
+		m_batch_size /= 2;
+	else if (commit_time_ms < MAP_SAVER_MAX_LOCK_MS / 2 &&
+			positions.size() == m_batch_size &&
+			m_batch_size < MAP_SAVER_BATCH_SIZE)
+		m_batch_size *= 2;
+
+	JMutexAutoLock lock(m_queue_mutex);
+	for (size_t i = 0; i < positions.size(); i++) {
+		std::map<v3s16, QueuedBlock>::iterator it = m_blocks.find(positions[i]);
+		// Blocks that got a newer snapshot meanwhile are queued already
+		if (it == m_blocks.end() || it->second.queued ||
+				it->second.generation != generations[i])
+			continue;
+		QueuedBlock &qb = it->second;
+		if (written[i]) {
+			if (qb.failed)
+				m_failed_count--;
+			m_blocks.erase(it);
+			continue;
+		}
+		// Keep the snapshot; it is the only copy of the block's data
+		if (!qb.failed) {
+			qb.failed = true;
+			m_failed_count++;
+		}
+		qb.queued = true;
+		m_order.push_back(positions[i]);
+	}
+	notifyWaiters();
+	// Don't retry in a loop when nothing can be written
+	return written_count > 0;
+}
+
+void *MapSaver::Thread()
+{
+	ThreadStarted();
+	log_register_thread("MapSaver");
+	DSTACK(__FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	porting::setThreadName("MapSaver");
+
+	while (!StopRequested()) {
+		m_queue_event.Wait();
+		while (commitBatch())
+			;
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+	log_deregister_thread();
+	return NULL;
+}
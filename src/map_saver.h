@@ -0,0 +1,115 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAP_SAVER_HEADER
+#define MAP_SAVER_HEADER
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include "irr_v3d.h"
+#include "jthread/jthread.h"
+#include "jthread/jmutex.h"
+#include "jthread/jsemaphore.h"
+#include "mapblock.h"
+
+class Database;
+
+/*
+	Writes MapBlocks to the database in the background.
+
+	The server thread only takes a MapBlockDiskData snapshot of a modified
+	block and queues it; this thread compresses the snapshots and commits
+	them in batched transactions. Queued blocks are served to the map by
+	getQueuedBlock() until they are committed, so a block that is unloaded
+	and loaded again before that never comes back stale. A block that fails
+	to be written stays queued and is tried again with a later batch.
+
+	All use of the database by other threads has to hold the mutex passed
+	to the constructor.
+*/
+class MapSaver : public JThread
+{
+public:
+	// queue_limit is the number of queued blocks above which
+	// queueBlock() waits for the thread to catch up
+	MapSaver(Database *db, JMutex *db_mutex, u32 queue_limit);
+	// Commits everything still queued
+	~MapSaver();
+
+	// Replaces a previously queued snapshot of the same block
+	void queueBlock(v3s16 pos, const MapBlockDiskData &data);
+	// Gets the serialized data of a queued block, as it will be written
+	bool getQueuedBlock(v3s16 pos, std::string *data);
+	// Returns once everything queued so far has been committed or has
+	// failed to be written. Commits on the calling thread if the saver
+	// thread isn't running.
+	void flush();
+	// Like flush() for a single block; returns false if it isn't written
+	bool flushBlock(v3s16 pos);
+	// Forgets a queued block so that it doesn't get written anymore
+	void dropBlock(v3s16 pos);
+	// Adds the positions of all queued blocks to dst
+	void listQueuedBlocks(std::vector<v3s16> &dst);
+
+	u32 getQueueSize();
+
+	void *Thread();
+
+private:
+	struct QueuedBlock
+	{
+		MapBlockDiskData data;
+		// Bumped for each new snapshot of the block
+		u32 generation;
+		// false while the thread is committing the snapshot
+		bool queued;
+		// The last write of this snapshot failed
+		bool failed;
+	};
+
+	// Commits one batch; returns false if there was nothing to do or
+	// none of the blocks could be written
+	bool commitBatch();
+	// Wakes up the threads waiting in queueBlock() or flush()
+	void notifyWaiters();
+	// Waits for the next batch to finish. m_queue_mutex has to be locked;
+	// it is released while waiting.
+	void waitBatch();
+
+	Database *m_db;
+	JMutex *m_db_mutex;
+	u32 m_queue_limit;
+
+	JMutex m_queue_mutex;
+	std::map<v3s16, QueuedBlock> m_blocks;
+	// Number of blocks in m_blocks whose last write failed
+	u32 m_failed_count;
+	// Blocks per transaction; only used by the committing thread
+	u32 m_batch_size;
+	std::deque<v3s16> m_order;
+	JSemaphore m_queue_event;
+
+	u32 m_waiters;
+	JSemaphore m_batch_done;
+};
+
+#endif
+
@@ -38,6 +38,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
+/*
+	Seconds a cached network serialization is kept without being sent.
+	Clients close to each other request a block within a few seconds.
+*/
+#define BLOCK_NETWORK_CACHE_TIMEOUT 10.0
+
 /*
 	MapBlock
 */
@@ -53,11 +59,13 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_lighting_expired(true),
 		m_day_night_differs(false),
 		m_day_night_differs_expired(true),
+		m_content_counts_expired(true),
 		m_generated(false),
 		m_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
 		m_disk_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
 		m_usage_timer(0),
-		m_refcount(0)
+		m_refcount(0),
+		m_network_cache_timer(0)
 {
 	data = NULL;
 	if(dummy == false)
@@ -124,23 +132,18 @@ MapNode MapBlock::getNodeParent(v3s16 p, bool *is_valid_position)
 	If there is no block above, assumes there is sunlight, unless
 	is_underground is set or highest node is water.
 
-	All sunlighted nodes are added to light_sources.
-
 	if remove_light==true, sets non-sunlighted nodes black.
 
 	if black_air_left!=NULL, it is set to true if non-sunlighted
 	air is left in block.
 */
-bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
-		bool remove_light, bool *black_air_left)
+bool MapBlock::propagateSunlight(bool remove_light, bool *black_air_left)
 {
 	INodeDefManager *nodemgr = m_gamedef->ndef();
 
 	// Whether the sunlight at the top of the bottom block is valid
 	bool block_below_is_valid = true;
 
-	v3s16 pos_relative = getPosRelative();
-
 	for(s16 x=0; x<MAP_BLOCKSIZE; x++)
 	{
 		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
@@ -253,11 +256,6 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 					n.setLight(LIGHTBANK_DAY, current_light, nodemgr);
 				}
 
-				if(diminish_light(current_light) != 0)
-				{
-					light_sources.insert(pos_relative + pos);
-				}
-
 				if(current_light == 0 && stopped_to_solid_object)
 				{
 					if(black_air_left)
@@ -317,6 +315,26 @@ void MapBlock::copyTo(VoxelManipulator &dst)
 			getPosRelative(), data_size);
 }
 
+void MapBlock::copyTo(VoxelManipulator &dst, const VoxelArea &area)
+{
+	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
+	v3s16 pos_nodes = getPosRelative();
+
+	// The part of this block that is inside area
+	v3s16 from(MYMAX(area.MinEdge.X, pos_nodes.X),
+			MYMAX(area.MinEdge.Y, pos_nodes.Y),
+			MYMAX(area.MinEdge.Z, pos_nodes.Z));
+	v3s16 to(MYMIN(area.MaxEdge.X, pos_nodes.X + MAP_BLOCKSIZE - 1),
+			MYMIN(area.MaxEdge.Y, pos_nodes.Y + MAP_BLOCKSIZE - 1),
+			MYMIN(area.MaxEdge.Z, pos_nodes.Z + MAP_BLOCKSIZE - 1));
+	if (from.X > to.X || from.Y > to.Y || from.Z > to.Z)
+		return;
+
+	dst.copyFrom(data, data_area, from - pos_nodes, from,
+			to - from + v3s16(1,1,1));
+}
+
 void MapBlock::copyFrom(VoxelManipulator &dst)
 {
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
@@ -325,6 +343,9 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+
+	expireContentCounts();
+	expireNetworkCache();
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
@@ -386,6 +407,73 @@ void MapBlock::expireDayNightDiff()
 	m_day_night_differs_expired = true;
 }
 
+u16 MapBlock::getContentCount(content_t c)
+{
+	const ContentCounts &counts = getContentCounts();
+	for (ContentCounts::const_iterator it = counts.begin();
+			it != counts.end(); ++it) {
+		if (it->first == c)
+			return it->second;
+	}
+	return 0;
+}
+
+void MapBlock::actuallyUpdateContentCounts()
+{
+	m_content_counts.clear();
+	m_content_counts_expired = false;
+
+	if (data == NULL)
+		return;
+
+	// Runs of the same content are common, so only search the
+	// histogram when the content changes
+	content_t prev_c = CONTENT_IGNORE;
+	u16 run = 0;
+	for (u32 i = 0; i < MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++) {
+		content_t c = data[i].getContent();
+		if (c == prev_c) {
+			run++;
+			continue;
+		}
+		if (run > 0)
+			addContentCount(prev_c, run);
+		prev_c = c;
+		run = 1;
+	}
+	addContentCount(prev_c, run);
+}
+
+void MapBlock::changeContentCount(content_t old_c, content_t new_c)
+{
+	if (m_content_counts_expired)
+		return;
+
+	for (ContentCounts::iterator it = m_content_counts.begin();
+			it != m_content_counts.end(); ++it) {
+		if (it->first == old_c) {
+			if (--it->second == 0) {
+				*it = m_content_counts.back();
+				m_content_counts.pop_back();
+			}
+			break;
+		}
+	}
+	addContentCount(new_c, 1);
+}
+
+void MapBlock::addContentCount(content_t c, u16 count)
+{
+	for (ContentCounts::iterator it = m_content_counts.begin();
+			it != m_content_counts.end(); ++it) {
+		if (it->first == c) {
+			it->second += count;
+			return;
+		}
+	}
+	m_content_counts.push_back(std::make_pair(c, count));
+}
+
 s16 MapBlock::getGroundLevel(v2s16 p2d)
 {
 	if(isDummy())
@@ -511,8 +599,24 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 	}
 }
 
+void MapBlockDiskData::write(std::ostream &os) const
+{
+	os.write(head.c_str(), head.size());
+	compressZlib(nodes, os);
+	compressZlib(metadata, os);
+	os.write(tail.c_str(), tail.size());
+}
+
 void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 {
+	if(disk)
+	{
+		MapBlockDiskData d;
+		serializeDisk(d, version);
+		d.write(os);
+		return;
+	}
+
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 
@@ -524,46 +628,18 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	FATAL_ERROR_IF(version < SER_FMT_CLIENT_VER_LOWEST, "Serialize version error");
 
 	// First byte
-	u8 flags = 0;
-	if(is_underground)
-		flags |= 0x01;
-	if(getDayNightDiff())
-		flags |= 0x02;
-	if(m_lighting_expired)
-		flags |= 0x04;
-	if(m_generated == false)
-		flags |= 0x08;
-	writeU8(os, flags);
+	writeU8(os, getSerializationFlags());
 
 	/*
 		Bulk node data
 	*/
-	NameIdMapping nimap;
 	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
-	if(disk)
-	{
-		MapNode *tmp_nodes = new MapNode[nodecount];
-		for(u32 i=0; i<nodecount; i++)
-			tmp_nodes[i] = data[i];
-		getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
-
-		u8 content_width = 2;
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, tmp_nodes, nodecount,
-				content_width, params_width, true);
-		delete[] tmp_nodes;
-	}
-	else
-	{
-		u8 content_width = 2;
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, data, nodecount,
-				content_width, params_width, true);
-	}
+	u8 content_width = 2;
+	u8 params_width = 2;
+	writeU8(os, content_width);
+	writeU8(os, params_width);
+	MapNode::serializeBulk(os, version, data, nodecount,
+			content_width, params_width, true);
 
 	/*
 		Node metadata
@@ -571,31 +647,90 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	std::ostringstream oss(std::ios_base::binary);
 	m_node_metadata.serialize(oss);
 	compressZlib(oss.str(), os);
+}
+
+void MapBlock::serializeDisk(MapBlockDiskData &dst, u8 version)
+{
+	if(!ser_ver_supported(version))
+		throw VersionMismatchException("ERROR: MapBlock format not supported");
+
+	if(data == NULL)
+	{
+		throw SerializationError("ERROR: Not writing dummy block.");
+	}
+
+	FATAL_ERROR_IF(version < SER_FMT_CLIENT_VER_LOWEST, "Serialize version error");
+
+	dst.version = version;
+
+	u8 content_width = 2;
+	u8 params_width = 2;
+	std::ostringstream head(std::ios_base::binary);
+	writeU8(head, getSerializationFlags());
+	writeU8(head, content_width);
+	writeU8(head, params_width);
+	dst.head = head.str();
+
+	/*
+		Bulk node data
+	*/
+	NameIdMapping nimap;
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	MapNode *tmp_nodes = new MapNode[nodecount];
+	for(u32 i=0; i<nodecount; i++)
+		tmp_nodes[i] = data[i];
+	getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
+
+	std::ostringstream nodes(std::ios_base::binary);
+	MapNode::serializeBulk(nodes, version, tmp_nodes, nodecount,
+			content_width, params_width, false);
+	delete[] tmp_nodes;
+	dst.nodes = nodes.str();
+
+	/*
+		Node metadata
+	*/
+	std::ostringstream metadata(std::ios_base::binary);
+	m_node_metadata.serialize(metadata);
+	dst.metadata = metadata.str();
 
 	/*
 		Data that goes to disk, but not the network
 	*/
-	if(disk)
-	{
-		if(version <= 24){
-			// Node timers
-			m_node_timers.serialize(os, version);
-		}
+	std::ostringstream tail(std::ios_base::binary);
+	if(version <= 24){
+		// Node timers
+		m_node_timers.serialize(tail, version);
+	}
 
-		// Static objects
-		m_static_objects.serialize(os);
+	// Static objects
+	m_static_objects.serialize(tail);
 
-		// Timestamp
-		writeU32(os, getTimestamp());
+	// Timestamp
+	writeU32(tail, getTimestamp());
 
-		// Write block-specific node definition id mapping
-		nimap.serialize(os);
+	// Write block-specific node definition id mapping
+	nimap.serialize(tail);
 
-		if(version >= 25){
-			// Node timers
-			m_node_timers.serialize(os, version);
-		}
+	if(version >= 25){
+		// Node timers
+		m_node_timers.serialize(tail, version);
 	}
+	dst.tail = tail.str();
+}
+
+u8 MapBlock::getSerializationFlags()
+{
+	u8 flags = 0;
+	if(is_underground)
+		flags |= 0x01;
+	if(getDayNightDiff())
+		flags |= 0x02;
+	if(m_lighting_expired)
+		flags |= 0x04;
+	if(m_generated == false)
+		flags |= 0x08;
+	return flags;
 }
 
 void MapBlock::serializeNetworkSpecific(std::ostream &os, u16 net_proto_version)
@@ -613,11 +748,54 @@ void MapBlock::serializeNetworkSpecific(std::ostream &os, u16 net_proto_version)
 	}
 }
 
+const std::string &MapBlock::getNetworkSerialization(u8 version,
+		u16 net_proto_version, bool *cache_hit)
+{
+	for (std::vector<NetworkCacheEntry>::iterator
+			it = m_network_cache.begin();
+			it != m_network_cache.end(); ++it) {
+		if (it->version == version &&
+				it->net_proto_version == net_proto_version) {
+			m_network_cache_timer = 0;
+			if (cache_hit)
+				*cache_hit = true;
+			return it->data;
+		}
+	}
+
+	std::ostringstream os(std::ios_base::binary);
+	serialize(os, version, false);
+	serializeNetworkSpecific(os, net_proto_version);
+
+	NetworkCacheEntry entry;
+	entry.version = version;
+	entry.net_proto_version = net_proto_version;
+	entry.data = os.str();
+	m_network_cache.push_back(entry);
+	m_network_cache_timer = 0;
+
+	if (cache_hit)
+		*cache_hit = false;
+	return m_network_cache.back().data;
+}
+
+void MapBlock::incrementNetworkCacheTimer(float dtime)
+{
+	if (m_network_cache.empty())
+		return;
+	m_network_cache_timer += dtime;
+	if (m_network_cache_timer > BLOCK_NETWORK_CACHE_TIMEOUT)
+		expireNetworkCache();
+}
+
 void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 
+	expireContentCounts();
+	expireNetworkCache();
+
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())<<std::endl);
 
 	m_day_night_differs_expired = false;
@@ -37,6 +37,7 @@ class NodeMetadataList;
 class IGameDef;
 class MapBlockMesh;
 class VoxelManipulator;
+class VoxelArea;
 
 #define BLOCK_TIMESTAMP_UNDEFINED 0xffffffff
 
@@ -97,6 +98,28 @@ class NodeContainer
 };
 #endif
 
+/*
+	On-disk serialization of a MapBlock with the zlib compression of the
+	node data and node metadata still left to do.
+	MapBlock::serializeDisk() fills it in on the thread that owns the block;
+	write() produces the bytes serialize(os, version, true) would have and
+	can be called from any thread.
+*/
+struct MapBlockDiskData
+{
+	u8 version;
+	// Flags, content width and params width
+	std::string head;
+	// Uncompressed bulk node data
+	std::string nodes;
+	// Uncompressed node metadata
+	std::string metadata;
+	// Node timers, static objects, timestamp and name-id mapping
+	std::string tail;
+
+	void write(std::ostream &os) const;
+};
+
 /*
 	MapBlock itself
 */
@@ -127,6 +150,7 @@ class MapBlock /*: public NodeContainer*/
 			//data[i] = MapNode();
 			data[i] = MapNode(CONTENT_IGNORE);
 		}
+		expireContentCounts();
 		raiseModified(MOD_STATE_WRITE_NEEDED, "reallocate");
 	}
 
@@ -138,6 +162,17 @@ class MapBlock /*: public NodeContainer*/
 	{
 		return (data == NULL);
 	}
+
+	/*
+		The nodes of the block, indexed by z*MAP_BLOCKSIZE*MAP_BLOCKSIZE
+		+ y*MAP_BLOCKSIZE + x. NULL for a dummy block.
+		For algorithms that go through lots of nodes; they have to call
+		raiseModified() themselves.
+	*/
+	MapNode * getData()
+	{
+		return data;
+	}
 	void unDummify()
 	{
 		assert(isDummy()); // Pre-condition
@@ -147,6 +182,8 @@ class MapBlock /*: public NodeContainer*/
 	// m_modified methods
 	void raiseModified(u32 mod, const std::string &reason="unknown")
 	{
+		if(mod >= MOD_STATE_WRITE_NEEDED)
+			expireNetworkCache();
 		if(mod > m_modified){
 			m_modified = mod;
 			m_modified_reason = reason;
@@ -168,6 +205,8 @@ class MapBlock /*: public NodeContainer*/
 	}
 	void raiseModified(u32 mod, const char *reason)
 	{
+		if (mod >= MOD_STATE_WRITE_NEEDED)
+			expireNetworkCache();
 		if (mod > m_modified){
 			m_modified = mod;
 			m_modified_reason = reason;
@@ -316,7 +355,10 @@ class MapBlock /*: public NodeContainer*/
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		MapNode &dst = data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		if(dst.getContent() != n.getContent())
+			changeContentCount(dst.getContent(), n.getContent());
+		dst = n;
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNode");
 	}
 	
@@ -347,7 +389,10 @@ class MapBlock /*: public NodeContainer*/
 	{
 		if(data == NULL)
 			throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		MapNode &dst = data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		if(dst.getContent() != n.getContent())
+			changeContentCount(dst.getContent(), n.getContent());
+		dst = n;
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNodeNoCheck");
 	}
 	
@@ -373,11 +418,13 @@ class MapBlock /*: public NodeContainer*/
 	}
 
 	// See comments in mapblock.cpp
-	bool propagateSunlight(std::set<v3s16> & light_sources,
-			bool remove_light=false, bool *black_air_left=NULL);
+	bool propagateSunlight(bool remove_light=false,
+			bool *black_air_left=NULL);
 	
 	// Copies data to VoxelManipulator to getPosRelative()
 	void copyTo(VoxelManipulator &dst);
+	// Copies the part of data that is inside area
+	void copyTo(VoxelManipulator &dst, const VoxelArea &area);
 	// Copies data from VoxelManipulator getPosRelative()
 	void copyFrom(VoxelManipulator &dst);
 
@@ -400,6 +447,28 @@ class MapBlock /*: public NodeContainer*/
 		return m_day_night_differs;
 	}
 
+	/*
+		Content histogram: the number of nodes of each content type
+		in this block, in no particular order.
+		setNode() keeps it up to date. Bulk writes expire it and it is
+		recounted when it is next needed.
+	*/
+	typedef std::vector<std::pair<content_t, u16> > ContentCounts;
+
+	const ContentCounts &getContentCounts()
+	{
+		if(m_content_counts_expired)
+			actuallyUpdateContentCounts();
+		return m_content_counts;
+	}
+	// Returns the number of nodes with content c
+	u16 getContentCount(content_t c);
+	void expireContentCounts()
+	{
+		m_content_counts_expired = true;
+		m_content_counts.clear();
+	}
+
 	/*
 		Miscellaneous stuff
 	*/
@@ -496,6 +565,8 @@ class MapBlock /*: public NodeContainer*/
 	// Set disk to true for on-disk format, false for over-the-network format
 	// Precondition: version >= SER_FMT_CLIENT_VER_LOWEST
 	void serialize(std::ostream &os, u8 version, bool disk);
+	// Takes the on-disk serialization without compressing it yet
+	void serializeDisk(MapBlockDiskData &dst, u8 version);
 	// If disk == true: In addition to doing other things, will add
 	// unknown blocks from id-name mapping to wndef
 	void deSerialize(std::istream &is, u8 version, bool disk);
@@ -503,12 +574,38 @@ class MapBlock /*: public NodeContainer*/
 	void serializeNetworkSpecific(std::ostream &os, u16 net_proto_version);
 	void deSerializeNetworkSpecific(std::istream &is);
 
+	/*
+		Returns the output of serialize(os, version, false) followed by
+		serializeNetworkSpecific(os, net_proto_version).
+		The result is cached until the block is modified, so that a block
+		sent to many clients is only serialized once per version pair.
+		If cache_hit is not NULL, it is set to whether the cache was used.
+	*/
+	const std::string &getNetworkSerialization(u8 version,
+			u16 net_proto_version, bool *cache_hit = NULL);
+	// Drops the cached network serializations
+	void expireNetworkCache()
+	{
+		m_network_cache.clear();
+		m_network_cache_timer = 0;
+	}
+	// Drops the cache once it hasn't been used for a while, so that only
+	// blocks that are currently being sent keep a copy
+	void incrementNetworkCacheTimer(float dtime);
+
 private:
 	/*
 		Private methods
 	*/
 
 	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
+	// First byte of the serialization
+	u8 getSerializationFlags();
+
+	void actuallyUpdateContentCounts();
+	// Moves one node from old_c to new_c in the content histogram
+	void changeContentCount(content_t old_c, content_t new_c);
+	void addContentCount(content_t c, u16 count);
 
 	/*
 		Used only internally, because changes can't be tracked
@@ -546,6 +643,13 @@ class MapBlock /*: public NodeContainer*/
 		Private member variables
 	*/
 
+	struct NetworkCacheEntry
+	{
+		u8 version;
+		u16 net_proto_version;
+		std::string data;
+	};
+
 	// NOTE: Lots of things rely on this being the Map
 	Map *m_parent;
 	// Position in blocks on parent
@@ -591,6 +695,10 @@ class MapBlock /*: public NodeContainer*/
 	bool m_day_night_differs;
 	bool m_day_night_differs_expired;
 
+	// See getContentCounts()
+	ContentCounts m_content_counts;
+	bool m_content_counts_expired;
+
 	bool m_generated;
 	
 	/*
@@ -612,6 +720,15 @@ class MapBlock /*: public NodeContainer*/
 		the list of blocks to be drawn.
 	*/
 	int m_refcount;
+
+	/*
+		Cached over-the-network serializations, one for each pair of
+		serialization and protocol version this block has been sent with.
+		See getNetworkSerialization().
+	*/
+	std::vector<NetworkCacheEntry> m_network_cache;
+	// Time since m_network_cache was last used
+	float m_network_cache_timer;
 };
 
 typedef std::vector<MapBlock*> MapBlockVect;
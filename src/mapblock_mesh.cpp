@@ -31,6 +31,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "shader.h"
 #include "settings.h"
 #include "util/directiontables.h"
+#include "jthread/jmutexautolock.h"
 
 static void applyFacesShading(video::SColor& color, float factor)
 {
@@ -38,11 +39,58 @@ static void applyFacesShading(video::SColor& color, float factor)
 	color.setGreen(core::clamp(core::round32(color.getGreen()*factor), 0, 255));
 }
 
+/*
+	MeshMakeBufferPool
+*/
+
+MeshMakeBufferPool::~MeshMakeBufferPool()
+{
+	for (std::vector<VoxelManipulator*>::iterator
+			i = m_buffers.begin();
+			i != m_buffers.end(); ++i)
+		delete *i;
+}
+
+void MeshMakeBufferPool::take(VoxelManipulator &vmanip)
+{
+	if (vmanip.m_data != NULL)
+		return;
+
+	VoxelManipulator *buffer;
+	{
+		JMutexAutoLock lock(m_mutex);
+		if (m_buffers.empty())
+			return;
+		buffer = m_buffers.back();
+		m_buffers.pop_back();
+	}
+	vmanip.swap(*buffer);
+	delete buffer;
+}
+
+void MeshMakeBufferPool::give(VoxelManipulator &vmanip)
+{
+	if (vmanip.m_data == NULL)
+		return;
+
+	VoxelManipulator *buffer = new VoxelManipulator;
+	buffer->swap(vmanip);
+	{
+		JMutexAutoLock lock(m_mutex);
+		if (m_buffers.size() < m_max_buffers) {
+			m_buffers.push_back(buffer);
+			return;
+		}
+	}
+	delete buffer;
+}
+
 /*
 	MeshMakeData
 */
 
-MeshMakeData::MeshMakeData(IGameDef *gamedef, bool use_shaders):
+MeshMakeData::MeshMakeData(IGameDef *gamedef, bool use_shaders,
+		MeshMakeBufferPool *buffer_pool):
 	m_vmanip(),
 	m_blockpos(-1337,-1337,-1337),
 	m_crack_pos_relative(-1337, -1337, -1337),
@@ -51,9 +99,16 @@ MeshMakeData::MeshMakeData(IGameDef *gamedef, bool use_shaders):
 	m_show_hud(false),
 	m_highlight_mesh_color(255, 255, 255, 255),
 	m_gamedef(gamedef),
-	m_use_shaders(use_shaders)
+	m_use_shaders(use_shaders),
+	m_buffer_pool(buffer_pool)
 {}
 
+MeshMakeData::~MeshMakeData()
+{
+	if (m_buffer_pool)
+		m_buffer_pool->give(m_vmanip);
+}
+
 void MeshMakeData::fill(MapBlock *block)
 {
 	m_blockpos = block->getPos();
@@ -64,11 +119,14 @@ void MeshMakeData::fill(MapBlock *block)
 		Copy data
 	*/
 
-	// Allocate this block + neighbors
-	m_vmanip.clear();
-	VoxelArea voxel_area(blockpos_nodes - v3s16(1,1,1) * MAP_BLOCKSIZE,
-			blockpos_nodes + v3s16(1,1,1) * MAP_BLOCKSIZE*2-v3s16(1,1,1));
-	m_vmanip.addArea(voxel_area);
+	// Allocate this block + a border of one node; the mesh does not look
+	// further out than that
+	if (m_buffer_pool)
+		m_buffer_pool->take(m_vmanip);
+	m_smooth_light_cache.clear();
+	VoxelArea voxel_area(blockpos_nodes - v3s16(1,1,1),
+			blockpos_nodes + v3s16(1,1,1) * MAP_BLOCKSIZE);
+	m_vmanip.resetArea(voxel_area);
 
 	{
 		//TimeTaker timer("copy central block data");
@@ -82,8 +140,8 @@ void MeshMakeData::fill(MapBlock *block)
 		// 0ms
 
 		/*
-			Copy neighbors. This is lightning fast.
-			Copying only the borders would be *very* slow.
+			Copy the sides, edges and corners of the neighbors that
+			touch the block.
 		*/
 
 		// Get map
@@ -95,7 +153,7 @@ void MeshMakeData::fill(MapBlock *block)
 			v3s16 bp = m_blockpos + dir;
 			MapBlock *b = map->getBlockNoCreateNoEx(bp);
 			if(b)
-				b->copyTo(m_vmanip);
+				b->copyTo(m_vmanip, voxel_area);
 		}
 	}
 }
@@ -105,14 +163,16 @@ void MeshMakeData::fillSingleNode(MapNode *node)
 	m_blockpos = v3s16(0,0,0);
 
 	v3s16 blockpos_nodes = v3s16(0,0,0);
-	VoxelArea area(blockpos_nodes-v3s16(1,1,1)*MAP_BLOCKSIZE,
-			blockpos_nodes+v3s16(1,1,1)*MAP_BLOCKSIZE*2-v3s16(1,1,1));
+	VoxelArea area(blockpos_nodes-v3s16(1,1,1),
+			blockpos_nodes+v3s16(1,1,1)*MAP_BLOCKSIZE);
 	s32 volume = area.getVolume();
 	s32 our_node_index = area.index(1,1,1);
 
-	// Allocate this block + neighbors
-	m_vmanip.clear();
-	m_vmanip.addArea(area);
+	// Allocate this block + a border of one node
+	if (m_buffer_pool)
+		m_buffer_pool->take(m_vmanip);
+	m_smooth_light_cache.clear();
+	m_vmanip.resetArea(area);
 
 	// Fill in data
 	MapNode *data = new MapNode[volume];
@@ -221,25 +281,43 @@ u16 getFaceLight(MapNode n, MapNode n2, v3s16 face_dir, INodeDefManager *ndef)
 	return day | (night << 8);
 }
 
+enum SmoothLightSampleType
+{
+	SMOOTHLIGHT_IGNORE,
+	SMOOTHLIGHT_LIT,
+	SMOOTHLIGHT_OCCLUDER
+};
+
+static void getSmoothLightSample(const MapNode &n, INodeDefManager *ndef,
+		SmoothLightSample &sample)
+{
+	// if it's CONTENT_IGNORE we can't do any light calculations
+	if (n.getContent() == CONTENT_IGNORE) {
+		sample.type = SMOOTHLIGHT_IGNORE;
+		sample.light_source = 0;
+		sample.day = sample.night = 0;
+		return;
+	}
+
+	const ContentFeatures &f = ndef->get(n);
+	sample.light_source = f.light_source;
+	// Check f.solidness because fast-style leaves look better this way
+	if (f.param_type == CPT_LIGHT && f.solidness != 2) {
+		sample.type = SMOOTHLIGHT_LIT;
+		sample.day = decode_light(n.getLightNoChecks(LIGHTBANK_DAY, &f));
+		sample.night = decode_light(n.getLightNoChecks(LIGHTBANK_NIGHT, &f));
+	} else {
+		sample.type = SMOOTHLIGHT_OCCLUDER;
+		sample.day = sample.night = 0;
+	}
+}
+
 /*
-	Calculate smooth lighting at the XYZ- corner of p.
+	Combines the samples of the 8 nodes around a corner.
 	Both light banks
 */
-static u16 getSmoothLightCombined(v3s16 p, MeshMakeData *data)
+static u16 combineSmoothLight(const SmoothLightSample *samples[8])
 {
-	static const v3s16 dirs8[8] = {
-		v3s16(0,0,0),
-		v3s16(0,0,1),
-		v3s16(0,1,0),
-		v3s16(0,1,1),
-		v3s16(1,0,0),
-		v3s16(1,1,0),
-		v3s16(1,0,1),
-		v3s16(1,1,1),
-	};
-
-	INodeDefManager *ndef = data->m_gamedef->ndef();
-
 	u16 ambient_occlusion = 0;
 	u16 light_count = 0;
 	u8 light_source_max = 0;
@@ -248,20 +326,15 @@ static u16 getSmoothLightCombined(v3s16 p, MeshMakeData *data)
 
 	for (u32 i = 0; i < 8; i++)
 	{
-		const MapNode &n = data->m_vmanip.getNodeRefUnsafeCheckFlags(p - dirs8[i]);
-
-		// if it's CONTENT_IGNORE we can't do any light calculations
-		if (n.getContent() == CONTENT_IGNORE) {
+		const SmoothLightSample &sample = *samples[i];
+		if (sample.type == SMOOTHLIGHT_IGNORE)
 			continue;
-		}
 
-		const ContentFeatures &f = ndef->get(n);
-		if (f.light_source > light_source_max)
-			light_source_max = f.light_source;
-		// Check f.solidness because fast-style leaves look better this way
-		if (f.param_type == CPT_LIGHT && f.solidness != 2) {
-			light_day += decode_light(n.getLightNoChecks(LIGHTBANK_DAY, &f));
-			light_night += decode_light(n.getLightNoChecks(LIGHTBANK_NIGHT, &f));
+		if (sample.light_source > light_source_max)
+			light_source_max = sample.light_source;
+		if (sample.type == SMOOTHLIGHT_LIT) {
+			light_day += sample.day;
+			light_night += sample.night;
 			light_count++;
 		} else {
 			ambient_occlusion++;
@@ -311,6 +384,37 @@ static u16 getSmoothLightCombined(v3s16 p, MeshMakeData *data)
 	return light_day | (light_night << 8);
 }
 
+/*
+	Calculate smooth lighting at the XYZ- corner of p.
+	Both light banks
+*/
+static u16 getSmoothLightCombined(v3s16 p, MeshMakeData *data)
+{
+	static const v3s16 dirs8[8] = {
+		v3s16(0,0,0),
+		v3s16(0,0,1),
+		v3s16(0,1,0),
+		v3s16(0,1,1),
+		v3s16(1,0,0),
+		v3s16(1,1,0),
+		v3s16(1,0,1),
+		v3s16(1,1,1),
+	};
+
+	INodeDefManager *ndef = data->m_gamedef->ndef();
+
+	SmoothLightSample samples[8];
+	const SmoothLightSample *sample_ptrs[8];
+	for (u32 i = 0; i < 8; i++) {
+		getSmoothLightSample(
+				data->m_vmanip.getNodeRefUnsafeCheckFlags(p - dirs8[i]),
+				ndef, samples[i]);
+		sample_ptrs[i] = &samples[i];
+	}
+
+	return combineSmoothLight(sample_ptrs);
+}
+
 /*
 	Calculate smooth lighting at the given corner of p.
 	Both light banks.
@@ -324,9 +428,60 @@ u16 getSmoothLight(v3s16 p, v3s16 corner, MeshMakeData *data)
 	if(corner.Z == 1) p.Z += 1;
 	// else corner.Z == -1
 
+	if(data->m_smooth_light_cache.isFilled()) {
+		v3s16 c = p - data->m_blockpos * MAP_BLOCKSIZE;
+		if(c.X >= 0 && c.X <= MAP_BLOCKSIZE &&
+				c.Y >= 0 && c.Y <= MAP_BLOCKSIZE &&
+				c.Z >= 0 && c.Z <= MAP_BLOCKSIZE)
+			return data->m_smooth_light_cache.get(c);
+	}
+
 	return getSmoothLightCombined(p, data);
 }
 
+void SmoothLightCache::fill(MeshMakeData *data)
+{
+	INodeDefManager *ndef = data->m_gamedef->ndef();
+	v3s16 blockpos_nodes = data->m_blockpos * MAP_BLOCKSIZE;
+
+	const s32 ns = MAP_BLOCKSIZE + 2;
+	m_samples.resize(ns * ns * ns);
+	u32 i = 0;
+	v3s16 p;
+	for (p.Z = -1; p.Z <= MAP_BLOCKSIZE; p.Z++)
+	for (p.Y = -1; p.Y <= MAP_BLOCKSIZE; p.Y++)
+	for (p.X = -1; p.X <= MAP_BLOCKSIZE; p.X++) {
+		getSmoothLightSample(
+				data->m_vmanip.getNodeRefUnsafeCheckFlags(blockpos_nodes + p),
+				ndef, m_samples[i++]);
+	}
+
+	const s32 nc = MAP_BLOCKSIZE + 1;
+	m_lights.resize(nc * nc * nc);
+	m_done.assign(nc * nc * nc, false);
+	m_filled = true;
+}
+
+u16 SmoothLightCache::combine(v3s16 c)
+{
+	// The corner c is the XYZ- corner of the node c, which is sampled
+	// at c + (1,1,1)
+	const s32 ns = MAP_BLOCKSIZE + 2;
+	const SmoothLightSample *s =
+			&m_samples[((c.Z + 1) * ns + c.Y + 1) * ns + c.X + 1];
+	const SmoothLightSample *sample_ptrs[8] = {
+		s,
+		s - 1,
+		s - ns,
+		s - ns - 1,
+		s - ns * ns,
+		s - ns * ns - 1,
+		s - ns * ns - ns,
+		s - ns * ns - ns - 1,
+	};
+	return combineSmoothLight(sample_ptrs);
+}
+
 /*
 	Converts from day + night color values (0..255)
 	and a given daynight_ratio to the final SColor shown on screen.
@@ -1046,6 +1201,11 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data, v3s16 camera_offset):
 	std::vector<FastFace> fastfaces_new;
 	fastfaces_new.reserve(512);
 
+	if (data->m_smooth_lighting) {
+		ScopeProfiler sp(g_profiler, "Meshgen: smooth light cache", SPT_AVG);
+		data->m_smooth_light_cache.fill(data);
+	}
+
 	/*
 		We are including the faces of the trailing edges of the block.
 		This means that when something changes, the caller must
@@ -1183,8 +1343,14 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data, v3s16 camera_offset):
 				u8 day = vc.getRed();
 				u8 night = vc.getGreen();
 				finalColorBlend(vc, day, night, 1000);
-				if(day != night)
-					m_daynight_diffs[i][j] = std::make_pair(day, night);
+				if(day != night) {
+					DayNightVertex v;
+					v.buffer = i;
+					v.vertex = j;
+					v.day = day;
+					v.night = night;
+					m_daynight_diffs.push_back(v);
+				}
 			}
 		}
 
@@ -1348,25 +1514,23 @@ bool MapBlockMesh::animate(bool faraway, float time, int crack, u32 daynight_rat
 		}
 	}
 
-	// Day-night transition
+	// Day-night transition (shaders do this by themselves)
 	if(!m_enable_shaders && (daynight_ratio != m_last_daynight_ratio))
 	{
-		for(std::map<u32, std::map<u32, std::pair<u8, u8> > >::iterator
+		video::S3DVertex *vertices = NULL;
+		u32 last_buffer = (u32) -1;
+		for(std::vector<DayNightVertex>::const_iterator
 				i = m_daynight_diffs.begin();
 				i != m_daynight_diffs.end(); i++)
 		{
-			scene::IMeshBuffer *buf = m_mesh->getMeshBuffer(i->first);
-			video::S3DVertex *vertices = (video::S3DVertex*)buf->getVertices();
-			for(std::map<u32, std::pair<u8, u8 > >::iterator
-					j = i->second.begin();
-					j != i->second.end(); j++)
+			if(i->buffer != last_buffer)
 			{
-				u32 vertexIndex = j->first;
-				u8 day = j->second.first;
-				u8 night = j->second.second;
-				finalColorBlend(vertices[vertexIndex].Color,
-						day, night, daynight_ratio);
+				scene::IMeshBuffer *buf = m_mesh->getMeshBuffer(i->buffer);
+				vertices = (video::S3DVertex*)buf->getVertices();
+				last_buffer = i->buffer;
 			}
+			finalColorBlend(vertices[i->vertex].Color,
+					i->day, i->night, daynight_ratio);
 		}
 		m_last_daynight_ratio = daynight_ratio;
 	}
@@ -23,7 +23,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irrlichttypes_extrabloated.h"
 #include "client/tile.h"
 #include "voxel.h"
+#include "constants.h"
+#include "jthread/jmutex.h"
 #include <map>
+#include <vector>
 
 class IGameDef;
 
@@ -33,9 +36,94 @@ class IGameDef;
 
 
 class MapBlock;
+struct MeshMakeData;
+
+/*
+	What a node adds to the smooth lighting of the corners it touches
+*/
+struct SmoothLightSample
+{
+	u8 type;
+	u8 light_source;
+	u8 day;
+	u8 night;
+};
+
+/*
+	Smooth lighting of the (MAP_BLOCKSIZE+1)^3 node corners of a block.
+
+	fill() samples the block and the nodes around it in one pass; a
+	corner is combined from the 8 nodes around it the first time it is
+	asked for, as only the corners of faces are.
+*/
+class SmoothLightCache
+{
+public:
+	SmoothLightCache():
+		m_filled(false)
+	{}
+
+	void fill(MeshMakeData *data);
+
+	void clear()
+	{
+		m_filled = false;
+	}
+
+	bool isFilled() const
+	{
+		return m_filled;
+	}
+
+	// c is the XYZ- corner of the node c of the block; 0 <= c <= 16
+	u16 get(v3s16 c)
+	{
+		const s32 n = MAP_BLOCKSIZE + 1;
+		u32 i = (c.Z * n + c.Y) * n + c.X;
+		if (!m_done[i]) {
+			m_lights[i] = combine(c);
+			m_done[i] = true;
+		}
+		return m_lights[i];
+	}
+
+private:
+	u16 combine(v3s16 c);
+
+	bool m_filled;
+	// (MAP_BLOCKSIZE+2)^3, from the XYZ- corner of the block one node out
+	std::vector<SmoothLightSample> m_samples;
+	std::vector<u16> m_lights;
+	std::vector<u8> m_done;
+};
+
+/*
+	Keeps the node arrays of mesh input buffers, so that they need not be
+	allocated for each mesh update. Used from several threads.
+*/
+class MeshMakeBufferPool
+{
+public:
+	MeshMakeBufferPool(u32 max_buffers = 32):
+		m_max_buffers(max_buffers)
+	{}
+
+	~MeshMakeBufferPool();
+
+	// Moves a pooled buffer into vmanip if vmanip has none
+	void take(VoxelManipulator &vmanip);
+	// Moves the buffer of vmanip into the pool, or frees it if it is full
+	void give(VoxelManipulator &vmanip);
+
+private:
+	u32 m_max_buffers;
+	std::vector<VoxelManipulator*> m_buffers;
+	JMutex m_mutex;
+};
 
 struct MeshMakeData
 {
+	// The block and a one node thick border around it
 	VoxelManipulator m_vmanip;
 	v3s16 m_blockpos;
 	v3s16 m_crack_pos_relative;
@@ -47,11 +135,17 @@ struct MeshMakeData
 	IGameDef *m_gamedef;
 	bool m_use_shaders;
 
-	MeshMakeData(IGameDef *gamedef, bool use_shaders);
+	// Used by getSmoothLight() once filled
+	SmoothLightCache m_smooth_light_cache;
+
+	// Buffers of m_vmanip are taken from and given back to buffer_pool
+	MeshMakeData(IGameDef *gamedef, bool use_shaders,
+			MeshMakeBufferPool *buffer_pool = NULL);
+	~MeshMakeData();
 
 	/*
-		Copy central data directly from block, and other data from
-		parent of block.
+		Copy central data directly from block, and the border from
+		the neighbors of block in its parent.
 	*/
 	void fill(MapBlock *block);
 
@@ -74,6 +168,9 @@ struct MeshMakeData
 		Enable or disable smooth lighting
 	*/
 	void setSmoothLighting(bool smooth_lighting);
+
+private:
+	MeshMakeBufferPool *m_buffer_pool;
 };
 
 /*
@@ -147,10 +244,19 @@ class MapBlockMesh
 	std::map<u32, int> m_animation_frame_offsets;
 	
 	// Animation info: day/night transitions
+	// Only used without shaders; the shaders blend the day (red) and
+	// night (green) light of each vertex by the dayNightRatio uniform.
+	struct DayNightVertex
+	{
+		u16 buffer;
+		u16 vertex;
+		u8 day;
+		u8 night;
+	};
 	// Last daynight_ratio value passed to animate()
 	u32 m_last_daynight_ratio;
-	// For each meshbuffer, maps vertex indices to (day,night) pairs
-	std::map<u32, std::map<u32, std::pair<u8, u8> > > m_daynight_diffs;
+	// Vertices whose day and night light differ, ordered by meshbuffer
+	std::vector<DayNightVertex> m_daynight_diffs;
 	
 	// Camera offset info -> do we have to translate the mesh?
 	v3s16 m_camera_offset;
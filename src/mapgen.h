@@ -157,7 +157,6 @@ class Mapgen {
 	void updateLiquid(UniqueQueue<v3s16> *trans_liquid, v3s16 nmin, v3s16 nmax);
 
 	void setLighting(u8 light, v3s16 nmin, v3s16 nmax);
-	void lightSpread(VoxelArea &a, v3s16 p, u8 light);
 
 	void calcLighting(v3s16 nmin, v3s16 nmax);
 	void calcLighting(v3s16 nmin, v3s16 nmax,
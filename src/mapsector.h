@@ -62,6 +62,8 @@ class MapSector
 	void deleteBlock(MapBlock *block);
 	
 	void getBlocks(MapBlockVect &dest);
+
+	bool empty() const { return m_blocks.empty(); }
 	
 	// Always false at the moment, because sector contains no metadata.
 	bool differs_from_disk;
@@ -205,26 +205,41 @@ SharedBuffer<u8> makeReliablePacket(
 	ReliablePacketBuffer
 */
 
-ReliablePacketBuffer::ReliablePacketBuffer(): m_list_size(0) {}
+ReliablePacketBuffer::ReliablePacketBuffer():
+	m_list_size(0),
+	m_first(0),
+	m_last(0),
+	m_clock(0)
+{
+}
+
+ReliablePacketBuffer::~ReliablePacketBuffer()
+{
+	JMutexAutoLock listlock(m_list_mutex);
+	for (size_t i = 0; i < m_ring.size(); i++)
+		delete m_ring[i];
+}
 
 void ReliablePacketBuffer::print()
 {
 	JMutexAutoLock listlock(m_list_mutex);
 	LOG(dout_con<<"Dump of ReliablePacketBuffer:" << std::endl);
+	if (m_list_size == 0)
+		return;
 	unsigned int index = 0;
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end();
-		++i)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		LOG(dout_con<<index<< ":" << s << std::endl);
-		index++;
+	for (u16 s = m_first; ; s++) {
+		if (findPacket(s) != NULL) {
+			LOG(dout_con<<index<< ":" << s << std::endl);
+			index++;
+		}
+		if (s == m_last)
+			break;
 	}
 }
 bool ReliablePacketBuffer::empty()
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	return m_list.empty();
+	return m_list_size == 0;
 }
 
 u32 ReliablePacketBuffer::size()
@@ -234,80 +249,94 @@ u32 ReliablePacketBuffer::size()
 
 bool ReliablePacketBuffer::containsPacket(u16 seqnum)
 {
-	return !(findPacket(seqnum) == m_list.end());
+	JMutexAutoLock listlock(m_list_mutex);
+	return findPacket(seqnum) != NULL;
 }
 
-RPBSearchResult ReliablePacketBuffer::findPacket(u16 seqnum)
+ReliablePacketBuffer::Entry *ReliablePacketBuffer::findPacket(u16 seqnum)
 {
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	for(; i != m_list.end(); ++i)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		/*dout_con<<"findPacket(): finding seqnum="<<seqnum
-				<<", comparing to s="<<s<<std::endl;*/
-		if (s == seqnum)
-			break;
+	if (m_ring.empty())
+		return NULL;
+	Entry *e = m_ring[seqnum & (m_ring.size() - 1)];
+	if (e == NULL || e->seqnum != seqnum)
+		return NULL;
+	return e;
+}
+
+void ReliablePacketBuffer::grow()
+{
+	std::vector<Entry*> ring(m_ring.empty() ? 64 : m_ring.size() * 2,
+			(Entry*)NULL);
+	u32 mask = ring.size() - 1;
+	for (size_t i = 0; i < m_ring.size(); i++) {
+		if (m_ring[i] != NULL)
+			ring[m_ring[i]->seqnum & mask] = m_ring[i];
 	}
-	return i;
+	m_ring.swap(ring);
 }
-RPBSearchResult ReliablePacketBuffer::notFound()
+
+BufferedPacket ReliablePacketBuffer::takeEntry(Entry *e)
 {
-	return m_list.end();
+	u32 mask = m_ring.size() - 1;
+	m_ring[e->seqnum & mask] = NULL;
+	--m_list_size;
+
+	BufferedPacket p = e->packet;
+	p.time = m_clock - e->sent_at;
+	p.totaltime = m_clock - e->buffered_at;
+	u16 seqnum = e->seqnum;
+	delete e;
+
+	if (m_list_size == 0) {
+		m_resend_queue.clear();
+		return p;
+	}
+
+	// Move on to the next packet; all packets are between
+	// m_first and m_last, so this stops before passing m_last
+	if (seqnum == m_first) {
+		do {
+			m_first++;
+		} while (m_ring[m_first & mask] == NULL);
+	}
+
+	// Drop resend entries of packets that are gone
+	while (!m_resend_queue.empty()) {
+		const ResendEntry &r = m_resend_queue.front();
+		Entry *front = findPacket(r.seqnum);
+		if (front != NULL && front->sent_at == r.sent_at)
+			break;
+		m_resend_queue.pop_front();
+	}
+	return p;
 }
+
 bool ReliablePacketBuffer::getFirstSeqnum(u16& result)
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	if (m_list.empty())
+	if (m_list_size == 0)
 		return false;
-	BufferedPacket p = *m_list.begin();
-	result = readU16(&p.data[BASE_HEADER_SIZE+1]);
+	result = m_first;
 	return true;
 }
 
 BufferedPacket ReliablePacketBuffer::popFirst()
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	if (m_list.empty())
+	if (m_list_size == 0)
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	m_list.erase(m_list.begin());
-	--m_list_size;
-
-	if (m_list_size == 0) {
-		m_oldest_non_answered_ack = 0;
-	} else {
-		m_oldest_non_answered_ack =
-				readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);
-	}
-	return p;
+	return takeEntry(findPacket(m_first));
 }
 BufferedPacket ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	RPBSearchResult r = findPacket(seqnum);
-	if (r == notFound()) {
+	Entry *e = findPacket(seqnum);
+	if (e == NULL) {
 		LOG(dout_con<<"Sequence number: " << seqnum
 				<< " not found in reliable buffer"<<std::endl);
 		throw NotFoundException("seqnum not found in buffer");
 	}
-	BufferedPacket p = *r;
-
-
-	RPBSearchResult next = r;
-	next++;
-	if (next != notFound()) {
-		u16 s = readU16(&(next->data[BASE_HEADER_SIZE+1]));
-		m_oldest_non_answered_ack = s;
-	}
-
-	m_list.erase(r);
-	--m_list_size;
-
-	if (m_list_size == 0)
-	{ m_oldest_non_answered_ack = 0; }
-	else
-	{ m_oldest_non_answered_ack = readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);	}
-	return p;
+	return takeEntry(e);
 }
 void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 {
@@ -320,92 +349,64 @@ void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 	sanity_check(seqnum_in_window(seqnum, next_expected, MAX_RELIABLE_WINDOW_SIZE));
 	sanity_check(seqnum != next_expected);
 
-	++m_list_size;
-	sanity_check(m_list_size <= SEQNUM_MAX+1);	// FIXME: Handle the error?
-
-	// Find the right place for the packet and insert it there
-	// If list is empty, just add it
-	if (m_list.empty())
-	{
-		m_list.push_back(p);
-		m_oldest_non_answered_ack = seqnum;
-		// Done.
-		return;
-	}
+	if (m_list_size == 0) {
+		m_first = seqnum;
+		m_last = seqnum;
+	} else {
+		Entry *old = findPacket(seqnum);
+		if (old != NULL) {
+			BufferedPacket *i = &old->packet;
+			if (
+				(readU16(&(i->data[BASE_HEADER_SIZE+1])) != seqnum) ||
+				(i->data.getSize() != p.data.getSize()) ||
+				(i->address != p.address)
+				)
+			{
+				/* if this happens your maximum transfer window may be to big */
+				fprintf(stderr,
+						"Duplicated seqnum %d non matching packet detected:\n",
+						seqnum);
+				fprintf(stderr, "Old: seqnum: %05d size: %04d, address: %s\n",
+						readU16(&(i->data[BASE_HEADER_SIZE+1])),i->data.getSize(),
+						i->address.serializeString().c_str());
+				fprintf(stderr, "New: seqnum: %05d size: %04u, address: %s\n",
+						readU16(&(p.data[BASE_HEADER_SIZE+1])),p.data.getSize(),
+						p.address.serializeString().c_str());
+				throw IncomingDataCorruption("duplicated packet isn't same as original one");
+			}
 
-	// Otherwise find the right place
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
+			sanity_check(readU16(&(i->data[BASE_HEADER_SIZE+1])) == seqnum);
+			sanity_check(i->data.getSize() == p.data.getSize());
+			sanity_check(i->address == p.address);
 
-	/* case seqnum is smaller then next_expected seqnum */
-	/* this is true e.g. on wrap around */
-	if (seqnum < next_expected) {
-		while(((s < seqnum) || (s >= next_expected)) && (i != m_list.end())) {
-			i++;
-			if (i != m_list.end())
-				s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		}
-	}
-	/* non wrap around case (at least for incoming and next_expected */
-	else
-	{
-		while(((s < seqnum) && (s >= next_expected)) && (i != m_list.end())) {
-			i++;
-			if (i != m_list.end())
-				s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
+			/* nothing to do this seems to be a resent packet */
+			/* for paranoia reason data should be compared */
+			return;
 		}
-	}
 
-	if (s == seqnum) {
-		if (
-			(readU16(&(i->data[BASE_HEADER_SIZE+1])) != seqnum) ||
-			(i->data.getSize() != p.data.getSize()) ||
-			(i->address != p.address)
-			)
-		{
-			/* if this happens your maximum transfer window may be to big */
-			fprintf(stderr,
-					"Duplicated seqnum %d non matching packet detected:\n",
-					seqnum);
-			fprintf(stderr, "Old: seqnum: %05d size: %04d, address: %s\n",
-					readU16(&(i->data[BASE_HEADER_SIZE+1])),i->data.getSize(),
-					i->address.serializeString().c_str());
-			fprintf(stderr, "New: seqnum: %05d size: %04u, address: %s\n",
-					readU16(&(p.data[BASE_HEADER_SIZE+1])),p.data.getSize(),
-					p.address.serializeString().c_str());
-			throw IncomingDataCorruption("duplicated packet isn't same as original one");
-		}
+		// Compare positions relative to next_expected for wrap around
+		u16 offset = seqnum - next_expected;
+		if (offset < (u16)(m_first - next_expected))
+			m_first = seqnum;
+		else if (offset > (u16)(m_last - next_expected))
+			m_last = seqnum;
+	}
 
-		sanity_check(readU16(&(i->data[BASE_HEADER_SIZE+1])) == seqnum);
-		sanity_check(i->data.getSize() == p.data.getSize());
-		sanity_check(i->address == p.address);
+	++m_list_size;
+	sanity_check(m_list_size <= SEQNUM_MAX+1);	// FIXME: Handle the error?
 
-		/* nothing to do this seems to be a resent packet */
-		/* for paranoia reason data should be compared */
-		--m_list_size;
-	}
-	/* insert or push back */
-	else if (i != m_list.end()) {
-		m_list.insert(i, p);
-	}
-	else {
-		m_list.push_back(p);
-	}
+	while ((u16)(m_last - m_first) >= m_ring.size())
+		grow();
+	m_ring[seqnum & (m_ring.size() - 1)] = new Entry(p, seqnum, m_clock);
 
-	/* update last packet number */
-	m_oldest_non_answered_ack = readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);
+	ResendEntry r = { seqnum, m_clock };
+	m_resend_queue.push_back(r);
 }
 
 void ReliablePacketBuffer::incrementTimeouts(float dtime)
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
-	{
-		i->time += dtime;
-		i->totaltime += dtime;
-	}
+	m_clock += dtime;
 }
 
 std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout,
@@ -413,17 +414,30 @@ std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout,
 {
 	JMutexAutoLock listlock(m_list_mutex);
 	std::list<BufferedPacket> timed_outs;
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
-	{
-		if (i->time >= timeout) {
-			timed_outs.push_back(*i);
-
-			//this packet will be sent right afterwards reset timeout here
-			i->time = 0.0;
-			if (timed_outs.size() >= max_packets)
-				break;
+	// Each packet is looked at once, even if it is queued again
+	size_t n = m_resend_queue.size();
+	for (; n > 0 && timed_outs.size() < max_packets; n--) {
+		ResendEntry r = m_resend_queue.front();
+		Entry *e = findPacket(r.seqnum);
+		if (e == NULL || e->sent_at != r.sent_at) {
+			// Acknowledged or queued again later
+			m_resend_queue.pop_front();
+			continue;
 		}
+		// The queue is in order of sending, the rest are newer
+		if (m_clock - e->sent_at < timeout)
+			break;
+
+		BufferedPacket p = e->packet;
+		p.time = m_clock - e->sent_at;
+		p.totaltime = m_clock - e->buffered_at;
+		timed_outs.push_back(p);
+
+		//this packet will be sent right afterwards reset timeout here
+		e->sent_at = m_clock;
+		m_resend_queue.pop_front();
+		r.sent_at = m_clock;
+		m_resend_queue.push_back(r);
 	}
 	return timed_outs;
 }
@@ -1239,7 +1253,8 @@ ConnectionSendThread::ConnectionSendThread( unsigned int max_packet_size,
 	m_timeout(timeout),
 	m_max_commands_per_iteration(1),
 	m_max_data_packets_per_iteration(g_settings->getU16("max_packets_per_iteration")),
-	m_max_packets_requeued(256)
+	m_max_packets_requeued(256),
+	m_workaround_window_size(g_settings, "workaround_window_size")
 {
 }
 
@@ -1296,6 +1311,9 @@ void * ConnectionSendThread::Thread()
 		/* send non reliable packets */
 		sendPackets(dtime);
 
+		/* put everything queued by rawSend on the wire */
+		flushSendBatch();
+
 		END_DEBUG_EXCEPTION_HANDLER(errorstream);
 	}
 
@@ -1385,7 +1403,7 @@ void ConnectionSendThread::runTimeouts(float dtime)
 			Channel *channel = &(dynamic_cast<UDPPeer*>(&peer))->channels[i];
 
 			if (dynamic_cast<UDPPeer*>(&peer)->getLegacyPeer())
-				channel->setWindowSize(g_settings->getU16("workaround_window_size"));
+				channel->setWindowSize(m_workaround_window_size.get());
 
 			// Remove timed out incomplete unreliable split packets
 			channel->incoming_splits.removeUnreliableTimedOuts(dtime, m_timeout);
@@ -1465,17 +1483,35 @@ void ConnectionSendThread::runTimeouts(float dtime)
 
 void ConnectionSendThread::rawSend(const BufferedPacket &packet)
 {
-	try{
-		m_connection->m_udpSocket.Send(packet.address, *packet.data,
-				packet.data.getSize());
-		LOG(dout_con <<m_connection->getDesc()
-				<< " rawSend: " << packet.data.getSize()
-				<< " bytes sent" << std::endl);
-	} catch(SendFailedException &e) {
+	m_send_batch.push_back(packet);
+	if (m_send_batch.size() >= UDP_BATCH_MAX)
+		flushSendBatch();
+}
+
+void ConnectionSendThread::flushSendBatch()
+{
+	if (m_send_batch.empty())
+		return;
+
+	UDPDatagram datagrams[UDP_BATCH_MAX];
+	u32 count = m_send_batch.size();
+	for (u32 i = 0; i < count; i++) {
+		datagrams[i].address = m_send_batch[i].address;
+		datagrams[i].data = *m_send_batch[i].data;
+		datagrams[i].size = m_send_batch[i].data.getSize();
+	}
+
+	int sent = m_connection->m_udpSocket.SendBatch(datagrams, count);
+	m_connection->addBatchStat(true, count);
+	LOG(dout_con <<m_connection->getDesc()
+			<< " rawSend: " << sent << " of " << count
+			<< " packets sent" << std::endl);
+	if (sent != (int)count) {
 		LOG(derr_con<<m_connection->getDesc()
-				<<"Connection::rawSend(): SendFailedException: "
-				<<packet.address.serializeString()<<std::endl);
+				<<"Connection::rawSend(): failed to send "
+				<<(count - sent)<<" packets"<<std::endl);
 	}
+	m_send_batch.clear();
 }
 
 void ConnectionSendThread::sendAsPacketReliable(BufferedPacket& p, Channel* channel)
@@ -2093,7 +2129,12 @@ void ConnectionReceiveThread::receive()
 	// theoretical reliable upper boundary of a udp packet for all IPv6 enabled
 	// infrastructure
 	unsigned int packet_maxsize = 1500;
-	SharedBuffer<u8> packetdata(packet_maxsize);
+	if (m_batch_buffer.empty())
+		m_batch_buffer.resize(UDP_BATCH_MAX * packet_maxsize);
+
+	UDPDatagram datagrams[UDP_BATCH_MAX];
+	for (u32 i = 0; i < UDP_BATCH_MAX; i++)
+		datagrams[i].data = &m_batch_buffer[i * packet_maxsize];
 
 	bool packet_queued = true;
 
@@ -2104,147 +2145,160 @@ void ConnectionReceiveThread::receive()
 	while( (loop_count < 10) &&
 			(m_connection->m_udpSocket.WaitData(50))) {
 		loop_count++;
-		try {
-			if (packet_queued) {
-				bool data_left = true;
-				u16 peer_id;
-				SharedBuffer<u8> resultdata;
-				while(data_left) {
-					try {
-						data_left = getFromBuffers(peer_id, resultdata);
-						if (data_left) {
-							ConnectionEvent e;
-							e.dataReceived(peer_id, resultdata);
-							m_connection->putEvent(e);
-						}
-					}
-					catch(ProcessedSilentlyException &e) {
-						/* try reading again */
-					}
+
+		/* read everything that is waiting, up to a batch */
+		int count = m_connection->m_udpSocket.ReceiveBatch(datagrams,
+				UDP_BATCH_MAX, packet_maxsize);
+		if (count > 0)
+			m_connection->addBatchStat(false, count);
+
+		for (int i = 0; i < count; i++) {
+			try {
+				handlePacket(datagrams[i].address, datagrams[i].data,
+						datagrams[i].size, packet_queued);
+			}
+			catch(InvalidIncomingDataException &e) {
+			}
+			catch(ProcessedSilentlyException &e) {
+			}
+		}
+	}
+}
+
+void ConnectionReceiveThread::handlePacket(Address &sender,
+		u8 *packetdata, s32 received_size, bool &packet_queued)
+{
+	if (packet_queued) {
+		bool data_left = true;
+		u16 peer_id;
+		SharedBuffer<u8> resultdata;
+		while(data_left) {
+			try {
+				data_left = getFromBuffers(peer_id, resultdata);
+				if (data_left) {
+					ConnectionEvent e;
+					e.dataReceived(peer_id, resultdata);
+					m_connection->putEvent(e);
 				}
-				packet_queued = false;
 			}
+			catch(ProcessedSilentlyException &e) {
+				/* try reading again */
+			}
+		}
+		packet_queued = false;
+	}
 
-			Address sender;
-			s32 received_size = m_connection->m_udpSocket.Receive(sender, *packetdata, packet_maxsize);
+	if ((received_size < BASE_HEADER_SIZE) ||
+		(readU32(&packetdata[0]) != m_connection->GetProtocolID()))
+	{
+		LOG(derr_con<<m_connection->getDesc()
+				<<"Receive(): Invalid incoming packet, "
+				<<"size: " << received_size
+				<<", protocol: "
+				<< ((received_size >= 4) ? readU32(&packetdata[0]) : -1)
+				<< std::endl);
+		return;
+	}
 
-			if ((received_size < BASE_HEADER_SIZE) ||
-				(readU32(&packetdata[0]) != m_connection->GetProtocolID()))
-			{
-				LOG(derr_con<<m_connection->getDesc()
-						<<"Receive(): Invalid incoming packet, "
-						<<"size: " << received_size
-						<<", protocol: "
-						<< ((received_size >= 4) ? readU32(&packetdata[0]) : -1)
-						<< std::endl);
-				continue;
-			}
+	u16 peer_id          = readPeerId(packetdata);
+	u8 channelnum        = readChannel(packetdata);
 
-			u16 peer_id          = readPeerId(*packetdata);
-			u8 channelnum        = readChannel(*packetdata);
+	if (channelnum > CHANNEL_COUNT-1) {
+		LOG(derr_con<<m_connection->getDesc()
+				<<"Receive(): Invalid channel "<<channelnum<<std::endl);
+		throw InvalidIncomingDataException("Channel doesn't exist");
+	}
 
-			if (channelnum > CHANNEL_COUNT-1) {
-				LOG(derr_con<<m_connection->getDesc()
-						<<"Receive(): Invalid channel "<<channelnum<<std::endl);
-				throw InvalidIncomingDataException("Channel doesn't exist");
-			}
+	/* preserve original peer_id for later usage */
+	u16 packet_peer_id   = peer_id;
 
-			/* preserve original peer_id for later usage */
-			u16 packet_peer_id   = peer_id;
+	/* Try to identify peer by sender address (may happen on join) */
+	if (peer_id == PEER_ID_INEXISTENT) {
+		peer_id = m_connection->lookupPeer(sender);
+	}
 
-			/* Try to identify peer by sender address (may happen on join) */
-			if (peer_id == PEER_ID_INEXISTENT) {
-				peer_id = m_connection->lookupPeer(sender);
-			}
+	/* The peer was not found in our lists. Add it. */
+	if (peer_id == PEER_ID_INEXISTENT) {
+		peer_id = m_connection->createPeer(sender, MTP_MINETEST_RELIABLE_UDP, 0);
+	}
 
-			/* The peer was not found in our lists. Add it. */
-			if (peer_id == PEER_ID_INEXISTENT) {
-				peer_id = m_connection->createPeer(sender, MTP_MINETEST_RELIABLE_UDP, 0);
-			}
+	PeerHelper peer = m_connection->getPeerNoEx(peer_id);
 
-			PeerHelper peer = m_connection->getPeerNoEx(peer_id);
+	if (!peer) {
+		LOG(dout_con<<m_connection->getDesc()
+				<<" got packet from unknown peer_id: "
+				<<peer_id<<" Ignoring."<<std::endl);
+		return;
+	}
 
-			if (!peer) {
-				LOG(dout_con<<m_connection->getDesc()
-						<<" got packet from unknown peer_id: "
-						<<peer_id<<" Ignoring."<<std::endl);
-				continue;
-			}
+	// Validate peer address
 
-			// Validate peer address
+	Address peer_address;
 
-			Address peer_address;
+	if (peer->getAddress(MTP_UDP, peer_address)) {
+		if (peer_address != sender) {
+			LOG(derr_con<<m_connection->getDesc()
+					<<m_connection->getDesc()
+					<<" Peer "<<peer_id<<" sending from different address."
+					" Ignoring."<<std::endl);
+			return;
+		}
+	}
+	else {
 
-			if (peer->getAddress(MTP_UDP, peer_address)) {
-				if (peer_address != sender) {
-					LOG(derr_con<<m_connection->getDesc()
-							<<m_connection->getDesc()
-							<<" Peer "<<peer_id<<" sending from different address."
-							" Ignoring."<<std::endl);
-					continue;
-				}
-			}
-			else {
-
-				bool invalid_address = true;
-				if (invalid_address) {
-					LOG(derr_con<<m_connection->getDesc()
-							<<m_connection->getDesc()
-							<<" Peer "<<peer_id<<" unknown."
-							" Ignoring."<<std::endl);
-					continue;
-				}
-			}
+		bool invalid_address = true;
+		if (invalid_address) {
+			LOG(derr_con<<m_connection->getDesc()
+					<<m_connection->getDesc()
+					<<" Peer "<<peer_id<<" unknown."
+					" Ignoring."<<std::endl);
+			return;
+		}
+	}
 
 
-			/* mark peer as seen with id */
-			if (!(packet_peer_id == PEER_ID_INEXISTENT))
-				peer->setSentWithID();
+	/* mark peer as seen with id */
+	if (!(packet_peer_id == PEER_ID_INEXISTENT))
+		peer->setSentWithID();
 
-			peer->ResetTimeout();
+	peer->ResetTimeout();
 
-			Channel *channel = 0;
+	Channel *channel = 0;
 
-			if (dynamic_cast<UDPPeer*>(&peer) != 0)
-			{
-				channel = &(dynamic_cast<UDPPeer*>(&peer)->channels[channelnum]);
-			}
+	if (dynamic_cast<UDPPeer*>(&peer) != 0)
+	{
+		channel = &(dynamic_cast<UDPPeer*>(&peer)->channels[channelnum]);
+	}
 
-			if (channel != 0) {
-				channel->UpdateBytesReceived(received_size);
-			}
+	if (channel != 0) {
+		channel->UpdateBytesReceived(received_size);
+	}
 
-			// Throw the received packet to channel->processPacket()
+	// Throw the received packet to channel->processPacket()
 
-			// Make a new SharedBuffer from the data without the base headers
-			SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
-			memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
-					strippeddata.getSize());
+	// Make a new SharedBuffer from the data without the base headers
+	SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
+	memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
+			strippeddata.getSize());
 
-			try{
-				// Process it (the result is some data with no headers made by us)
-				SharedBuffer<u8> resultdata = processPacket
-						(channel, strippeddata, peer_id, channelnum, false);
+	try{
+		// Process it (the result is some data with no headers made by us)
+		SharedBuffer<u8> resultdata = processPacket
+				(channel, strippeddata, peer_id, channelnum, false);
 
-				LOG(dout_con<<m_connection->getDesc()
-						<<" ProcessPacket from peer_id: " << peer_id
-						<< ",channel: " << (channelnum & 0xFF) << ", returned "
-						<< resultdata.getSize() << " bytes" <<std::endl);
+		LOG(dout_con<<m_connection->getDesc()
+				<<" ProcessPacket from peer_id: " << peer_id
+				<< ",channel: " << (channelnum & 0xFF) << ", returned "
+				<< resultdata.getSize() << " bytes" <<std::endl);
 
-				ConnectionEvent e;
-				e.dataReceived(peer_id, resultdata);
-				m_connection->putEvent(e);
-			}
-			catch(ProcessedSilentlyException &e) {
-			}
-			catch(ProcessedQueued &e) {
-				packet_queued = true;
-			}
-		}
-		catch(InvalidIncomingDataException &e) {
-		}
-		catch(ProcessedSilentlyException &e) {
-		}
+		ConnectionEvent e;
+		e.dataReceived(peer_id, resultdata);
+		m_connection->putEvent(e);
+	}
+	catch(ProcessedSilentlyException &e) {
+	}
+	catch(ProcessedQueued &e) {
+		packet_queued = true;
 	}
 }
 
@@ -2646,6 +2700,8 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	m_sendThread(max_packet_size, timeout),
 	m_receiveThread(max_packet_size),
 	m_info_mutex(),
+	m_avg_recv_batch_size(0),
+	m_avg_send_batch_size(0),
 	m_bc_peerhandler(0),
 	m_bc_receive_timeout(0),
 	m_shutting_down(false),
@@ -2670,6 +2726,8 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	m_sendThread(max_packet_size, timeout),
 	m_receiveThread(max_packet_size),
 	m_info_mutex(),
+	m_avg_recv_batch_size(0),
+	m_avg_send_batch_size(0),
 	m_bc_peerhandler(peerhandler),
 	m_bc_receive_timeout(0),
 	m_shutting_down(false),
@@ -2944,6 +3002,13 @@ float Connection::getPeerStat(u16 peer_id, rtt_stat_type type)
 
 float Connection::getLocalStat(rate_stat_type type)
 {
+	// These are about the socket rather than the server peer
+	if (type == AVG_RECV_BATCH_SIZE || type == AVG_SEND_BATCH_SIZE) {
+		JMutexAutoLock lock(m_batch_stat_mutex);
+		return type == AVG_RECV_BATCH_SIZE ?
+				m_avg_recv_batch_size : m_avg_send_batch_size;
+	}
+
 	PeerHelper peer = getPeerNoEx(PEER_ID_SERVER);
 
 	FATAL_ERROR_IF(!peer, "Connection::getLocalStat we couldn't get our own peer? are you serious???");
@@ -2977,6 +3042,13 @@ float Connection::getLocalStat(rate_stat_type type)
 	return retval;
 }
 
+void Connection::addBatchStat(bool send, u32 num_datagrams)
+{
+	JMutexAutoLock lock(m_batch_stat_mutex);
+	float &avg = send ? m_avg_send_batch_size : m_avg_recv_batch_size;
+	avg = avg * 0.95 + num_datagrams * 0.05;
+}
+
 u16 Connection::createPeer(Address& sender, MTProtocols protocol, int fd)
 {
 	// Somebody wants to make a new connection
@@ -29,10 +29,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/container.h"
 #include "util/thread.h"
 #include "util/numeric.h"
+#include "settings.h"
 #include <iostream>
 #include <fstream>
 #include <list>
 #include <map>
+#include <deque>
 
 namespace con
 {
@@ -313,14 +315,19 @@ with a buffer in the receiving and transmitting end.
 /*
 	A buffer which stores reliable packets and sorts them internally
 	for fast access to the smallest one.
-*/
 
-typedef std::list<BufferedPacket>::iterator RPBSearchResult;
+	Packets are kept in a ring indexed by seqnum, so inserting, finding
+	and removing a packet takes constant time. The ring grows as needed
+	to hold the range of seqnums between the first and the last packet.
+	Resend timeouts are kept in a queue in order of sending, so finding
+	the timed out packets only looks at the ones that are due.
+*/
 
 class ReliablePacketBuffer
 {
 public:
 	ReliablePacketBuffer();
+	~ReliablePacketBuffer();
 
 	bool getFirstSeqnum(u16& result);
 
@@ -335,17 +342,48 @@ class ReliablePacketBuffer
 	void print();
 	bool empty();
 	bool containsPacket(u16 seqnum);
-	RPBSearchResult notFound();
 	u32 size();
 
 
 private:
-	RPBSearchResult findPacket(u16 seqnum);
+	struct Entry
+	{
+		BufferedPacket packet;
+		u16 seqnum;
+		// m_clock when buffered and when last (re)sent
+		double buffered_at;
+		double sent_at;
+
+		Entry(const BufferedPacket &p, u16 s, double now):
+			packet(p), seqnum(s), buffered_at(now), sent_at(now)
+		{}
+	};
+
+	struct ResendEntry
+	{
+		u16 seqnum;
+		double sent_at;
+	};
+
+	// Not copyable, the ring owns its entries
+	ReliablePacketBuffer(const ReliablePacketBuffer &);
+	ReliablePacketBuffer &operator=(const ReliablePacketBuffer &);
 
-	std::list<BufferedPacket> m_list;
+	Entry *findPacket(u16 seqnum);
+	BufferedPacket takeEntry(Entry *e);
+	void grow();
+
+	// Ring of m_ring.size() slots, a power of two; slot is seqnum & mask
+	std::vector<Entry*> m_ring;
 	u32 m_list_size;
+	// First seqnum in the buffer and an upper bound of the last one
+	u16 m_first;
+	u16 m_last;
 
-	u16 m_oldest_non_answered_ack;
+	// Sum of the dtimes given to incrementTimeouts()
+	double m_clock;
+	// Entries in order of sending; outdated ones are skipped
+	std::deque<ResendEntry> m_resend_queue;
 
 	JMutex m_list_mutex;
 };
@@ -644,6 +682,8 @@ typedef enum {
 	AVG_INC_RATE,
 	CUR_LOSS_RATE,
 	AVG_LOSS_RATE,
+	AVG_RECV_BATCH_SIZE,
+	AVG_SEND_BATCH_SIZE,
 } rate_stat_type;
 
 class Peer {
@@ -928,7 +968,9 @@ class ConnectionSendThread : public JThread {
 
 private:
 	void runTimeouts    (float dtime);
+	// Queues the packet; it is sent by the next flushSendBatch()
 	void rawSend        (const BufferedPacket &packet);
+	void flushSendBatch ();
 	bool rawSendAsPacket(u16 peer_id, u8 channelnum,
 							SharedBuffer<u8> data, bool reliable);
 
@@ -959,11 +1001,15 @@ class ConnectionSendThread : public JThread {
 	float                 m_timeout;
 	std::queue<OutgoingPacket> m_outgoing_queue;
 	JSemaphore            m_send_sleep_semaphore;
+	std::vector<BufferedPacket> m_send_batch;
 
 	unsigned int          m_iteration_packets_avaialble;
 	unsigned int          m_max_commands_per_iteration;
 	unsigned int          m_max_data_packets_per_iteration;
 	unsigned int          m_max_packets_requeued;
+
+	// Read for every channel of legacy peers in runTimeouts()
+	CachedU16Setting      m_workaround_window_size;
 };
 
 class ConnectionReceiveThread : public JThread {
@@ -979,6 +1025,8 @@ class ConnectionReceiveThread : public JThread {
 
 private:
 	void receive        ();
+	void handlePacket   (Address &sender, u8 *packetdata,
+							s32 received_size, bool &packet_queued);
 
 	// Returns next data from a buffer if possible
 	// If found, returns true; if not, false.
@@ -1002,6 +1050,9 @@ class ConnectionReceiveThread : public JThread {
 
 
 	Connection*           m_connection;
+
+	// Receive buffers, UDP_BATCH_MAX of packet_maxsize bytes each
+	std::vector<u8>       m_batch_buffer;
 };
 
 class Connection
@@ -1060,6 +1111,9 @@ class Connection
 
 	void TriggerSend()
 		{ m_sendThread.Trigger(); }
+
+	// Records the number of datagrams handled by one batched socket call
+	void addBatchStat(bool send, u32 num_datagrams);
 private:
 	std::list<Peer*> getPeers();
 
@@ -1077,6 +1131,11 @@ class Connection
 
 	JMutex m_info_mutex;
 
+	// Moving averages of datagrams per batched socket call
+	float m_avg_recv_batch_size;
+	float m_avg_send_batch_size;
+	JMutex m_batch_stat_mutex;
+
 	// Backwards compatibility
 	PeerHandler *m_bc_peerhandler;
 	int m_bc_receive_timeout;
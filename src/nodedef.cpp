@@ -187,6 +187,10 @@ void ContentFeatures::reset()
 	has_on_construct = false;
 	has_on_destruct = false;
 	has_after_destruct = false;
+	bouncy = 0;
+	// Matches the regular node_box below
+	collision_boxes.assign(1, std::vector<aabb3f>(1,
+			aabb3f(-BS/2, -BS/2, -BS/2, BS/2, BS/2, BS/2)));
 	/*
 		Actual data
 
@@ -418,6 +422,7 @@ class CNodeDefManager: public IWritableNodeDefManager {
 
 private:
 	void addNameIdMapping(content_t i, std::string name);
+	void updateCollisionCache(content_t c);
 #ifndef SERVER
 	void fillTileAttribs(ITextureSource *tsrc, TileSpec *tile, TileDef *tiledef,
 		u32 shader_id, bool use_normal_texture, bool backface_culling,
@@ -667,6 +672,7 @@ content_t CNodeDefManager::set(const std::string &name, const ContentFeatures &d
 		addNameIdMapping(id, name);
 	}
 	m_content_features[id] = def;
+	updateCollisionCache(id);
 	verbosestream << "NodeDefManager: registering content id \"" << id
 		<< "\": name=\"" << def.name << "\""<<std::endl;
 
@@ -691,6 +697,31 @@ content_t CNodeDefManager::set(const std::string &name, const ContentFeatures &d
 }
 
 
+// Fills the values ContentFeatures caches for the collision code
+void CNodeDefManager::updateCollisionCache(content_t c)
+{
+	ContentFeatures &f = m_content_features[c];
+	f.bouncy = itemgroup_get(f.groups, "bouncy");
+
+	// Number of param2 values the boxes may differ for, counting
+	// only the bits MapNode looks at (a power of two)
+	const NodeBox &box = f.collision_box.fixed.empty() ?
+			f.node_box : f.collision_box;
+	u32 variants = 1;
+	if (box.type == NODEBOX_LEVELED)
+		variants = 256;
+	else if (box.type == NODEBOX_FIXED && f.param_type_2 == CPT2_FACEDIR)
+		variants = 32;
+	else if (box.type == NODEBOX_WALLMOUNTED &&
+			f.param_type_2 == CPT2_WALLMOUNTED)
+		variants = 8;
+
+	f.collision_boxes.resize(variants);
+	for (u32 i = 0; i < variants; i++)
+		f.collision_boxes[i] = MapNode(c, 0, i).getCollisionBoxes(this);
+}
+
+
 content_t CNodeDefManager::allocateDummy(const std::string &name)
 {
 	assert(name != "");	// Pre-condition
@@ -1053,6 +1084,7 @@ void CNodeDefManager::deSerialize(std::istream &is)
 		if (i >= m_content_features.size())
 			m_content_features.resize((u32)(i) + 1);
 		m_content_features[i] = f;
+		updateCollisionCache(i);
 		addNameIdMapping(i, f.name);
 		verbosestream << "deserialized " << f.name << std::endl;
 	}
@@ -179,6 +179,12 @@ struct ContentFeatures
 	bool has_on_destruct;
 	bool has_after_destruct;
 
+	// Filled by the node definition manager when the node is registered:
+	// Value of the "bouncy" group
+	int bouncy;
+	// Collision boxes relative to the node, by param2 & (size - 1)
+	std::vector<std::vector<aabb3f> > collision_boxes;
+
 	/*
 		Actual data
 	*/
@@ -271,6 +277,10 @@ struct ContentFeatures
 	/*
 		Some handy methods
 	*/
+	// Same as MapNode::getCollisionBoxes() for a node of this content
+	const std::vector<aabb3f> &getCollisionBoxes(u8 param2) const{
+		return collision_boxes[param2 & (collision_boxes.size() - 1)];
+	}
 	bool isLiquid() const{
 		return (liquid_type != LIQUID_NONE);
 	}
@@ -27,6 +27,7 @@
 #include "noise.h"
 #include <iostream>
 #include <string.h> // memset
+#include <algorithm> // std::swap
 #include "debug.h"
 #include "util/numeric.h"
 #include "util/string.h"
@@ -37,14 +38,23 @@
 #define NOISE_MAGIC_Z    52591
 #define NOISE_MAGIC_SEED 1013
 
-typedef float (*Interp2dFxn)(
-		float v00, float v10, float v01, float v11,
-		float x, float y);
+// SSE2 is always there on x86-64
+#if defined(__SSE2__) || defined(_M_X64)
+	#define NOISE_SSE2
+	#include <emmintrin.h>
+#endif
 
-typedef float (*Interp3dFxn)(
-		float v000, float v100, float v010, float v110,
-		float v001, float v101, float v011, float v111,
-		float x, float y, float z);
+#ifdef NOISE_SSE2
+// Only changed by tests, see noise_set_sse2_enabled()
+static bool use_sse2 = true;
+#endif
+
+void noise_set_sse2_enabled(bool enabled)
+{
+#ifdef NOISE_SSE2
+	use_sse2 = enabled;
+#endif
+}
 
 float cos_lookup[16] = {
 	1.0,  0.9238,  0.7071,  0.3826, 0, -0.3826, -0.7071, -0.9238,
@@ -469,6 +479,10 @@ Noise::Noise(NoiseParams *np_, int seed, int sx, int sy, int sz)
 	this->persist_buf  = NULL;
 	this->gradient_buf = NULL;
 	this->result       = NULL;
+	this->lattice_x    = NULL;
+	this->lattice_y    = NULL;
+	this->weight_x     = NULL;
+	this->weight_y     = NULL;
 
 	allocBuffers();
 }
@@ -480,6 +494,10 @@ Noise::~Noise()
 	delete[] persist_buf;
 	delete[] noise_buf;
 	delete[] result;
+	delete[] lattice_x;
+	delete[] lattice_y;
+	delete[] weight_x;
+	delete[] weight_y;
 }
 
 
@@ -491,12 +509,20 @@ void Noise::allocBuffers()
 	delete[] gradient_buf;
 	delete[] persist_buf;
 	delete[] result;
+	delete[] lattice_x;
+	delete[] lattice_y;
+	delete[] weight_x;
+	delete[] weight_y;
 
 	try {
 		size_t bufsize = sx * sy * sz;
 		this->persist_buf  = NULL;
 		this->gradient_buf = new float[bufsize];
 		this->result       = new float[bufsize];
+		this->lattice_x    = new int[sx];
+		this->lattice_y    = new int[sy];
+		this->weight_x     = new float[sx];
+		this->weight_y     = new float[sy];
 	} catch (std::bad_alloc &e) {
 		throw InvalidNoiseParamsException();
 	}
@@ -541,9 +567,10 @@ void Noise::resizeNoiseBuf(bool is3d)
 	//(int)(sz * spread * ofactor) is # of lattice points crossed due to length
 	// + 2 for the two initial endpoints
 	// + 1 for potentially crossing a boundary due to offset
+	//only two rows (2D) or planes (3D) of the lattice are kept at a time
 	nlx = (int)ceil(sx * ofactor / np.spread.X) + 3;
-	nly = (int)ceil(sy * ofactor / np.spread.Y) + 3;
-	nlz = is3d ? (int)ceil(sz * ofactor / np.spread.Z) + 3 : 1;
+	nly = is3d ? (int)ceil(sy * ofactor / np.spread.Y) + 3 : 1;
+	nlz = 2;
 
 	delete[] noise_buf;
 	try {
@@ -555,93 +582,169 @@ void Noise::resizeNoiseBuf(bool is3d)
 
 
 /*
- * NB:  This algorithm is not optimal in terms of space complexity.  The entire
- * integer lattice of noise points could be done as 2 lines instead, and for 3D,
- * 2 lines + 2 planes.
- * However, this would require the noise calls to be interposed with the
- * interpolation loops, which may trash the icache, leading to lower overall
- * performance.
- * Another optimization that could save half as many noise calls is to carry over
- * values from the previous noise lattice as midpoints in the new lattice for the
- * next octave.
+ * Offsets into the lattice and interpolation weights of successive
+ * samples, stepping by step from t. This must stay exactly the same
+ * float arithmetic as before it was split out of the sample loops, or
+ * existing worlds would get seams.
+ */
+static void latticeSteps(int *lattice, float *weight, int count,
+		float t, float step, bool eased)
+{
+	int l = 0;
+	for (int i = 0; i != count; i++) {
+		lattice[i] = l;
+		weight[i]  = eased ? easeCurve(t) : t;
+
+		t += step;
+		if (t >= 1.0) {
+			t -= 1.0;
+			l++;
+		}
+	}
+}
+
+
+/*
+ * Interpolates a row of samples between two rows of the lattice
+ * (2D), or between two pairs of rows (3D, r01 and r11 non-NULL).
+ * Each sample is interpolated the same way as linearInterpolation() and
+ * friends do, so the SSE2 version gives the same results.
+ */
+static void interpolateRow(float *out, int count,
+		const int *lattice_x, const float *weight_x,
+		const float *r00, const float *r10, float ty,
+		const float *r01, const float *r11, float tz)
+{
+	int i = 0;
+#ifdef NOISE_SSE2
+	if (use_sse2) {
+		const __m128 ty4 = _mm_set1_ps(ty);
+		const __m128 tz4 = _mm_set1_ps(tz);
+#define LERP4(v0, v1, t) _mm_add_ps((v0), _mm_mul_ps(_mm_sub_ps((v1), (v0)), (t)))
+#define GATHER4(r, o) _mm_setr_ps((r)[l0 + (o)], (r)[l1 + (o)], \
+		(r)[l2 + (o)], (r)[l3 + (o)])
+		for (; i + 4 <= count; i += 4) {
+			int l0 = lattice_x[i],     l1 = lattice_x[i + 1];
+			int l2 = lattice_x[i + 2], l3 = lattice_x[i + 3];
+			__m128 tx4 = _mm_loadu_ps(weight_x + i);
+
+			__m128 u = LERP4(GATHER4(r00, 0), GATHER4(r00, 1), tx4);
+			__m128 v = LERP4(GATHER4(r10, 0), GATHER4(r10, 1), tx4);
+			__m128 a = LERP4(u, v, ty4);
+			if (r01) {
+				u = LERP4(GATHER4(r01, 0), GATHER4(r01, 1), tx4);
+				v = LERP4(GATHER4(r11, 0), GATHER4(r11, 1), tx4);
+				a = LERP4(a, LERP4(u, v, ty4), tz4);
+			}
+			_mm_storeu_ps(out + i, a);
+		}
+#undef GATHER4
+#undef LERP4
+	}
+#endif
+	for (; i != count; i++) {
+		int l = lattice_x[i];
+		float tx = weight_x[i];
+		float a = biLinearInterpolationNoEase(
+			r00[l], r00[l + 1], r10[l], r10[l + 1], tx, ty);
+		if (r01) {
+			float b = biLinearInterpolationNoEase(
+				r01[l], r01[l + 1], r11[l], r11[l + 1], tx, ty);
+			a = linearInterpolation(a, b, tz);
+		}
+		out[i] = a;
+	}
+}
+
+
+/*
+ * Fills a row of the noise point lattice, starting at (x0, y[, z]).
+ */
+static void noiseLatticeRow2D(float *row, int nlx, int x0, int y, int seed)
+{
+	for (int i = 0; i != nlx; i++)
+		row[i] = noise2d(x0 + i, y, seed);
+}
+
+static void noiseLatticePlane3D(float *plane, int nlx, int nly,
+		int x0, int y0, int z, int seed)
+{
+	int index = 0;
+	for (int j = 0; j != nly; j++)
+		for (int i = 0; i != nlx; i++)
+			plane[index++] = noise3d(x0 + i, y0 + j, z, seed);
+}
+
+
+/*
+ * The noise point lattice is streamed: only the two rows (2D) or planes
+ * (3D) that the current samples lie between are kept in noise_buf, and
+ * the next one is computed when the samples cross into it. The lattice
+ * extent along x and y is taken from latticeSteps(), so no lattice points
+ * are computed that no sample uses.
+ *
+ * Carrying lattice values over to the next octave, as once suggested
+ * here, is not possible without changing the noise: each octave is
+ * seeded differently, so no two octaves share lattice values.
  */
-#define idx(x, y) ((y) * nlx + (x))
 void Noise::gradientMap2D(
 		float x, float y,
 		float step_x, float step_y,
 		int seed)
 {
-	float v00, v01, v10, v11, u, v, orig_u;
-	int index, i, j, x0, y0, noisex, noisey;
-	int nlx, nly;
+	float u, v;
+	int index, j, x0, y0, noisey;
+	int nlx;
 
 	bool eased = np.flags & (NOISE_FLAG_DEFAULTS | NOISE_FLAG_EASED);
-	Interp2dFxn interpolate = eased ?
-		biLinearInterpolation : biLinearInterpolationNoEase;
 
 	x0 = floor(x);
 	y0 = floor(y);
 	u = x - (float)x0;
 	v = y - (float)y0;
-	orig_u = u;
 
-	//calculate noise point lattice
-	nlx = (int)(u + sx * step_x) + 2;
-	nly = (int)(v + sy * step_y) + 2;
-	index = 0;
-	for (j = 0; j != nly; j++)
-		for (i = 0; i != nlx; i++)
-			noise_buf[index++] = noise2d(x0 + i, y0 + j, seed);
+	latticeSteps(lattice_x, weight_x, sx, u, step_x, eased);
+	nlx = lattice_x[sx - 1] + 2;
+
+	//calculate the first two lattice rows
+	float *row0 = noise_buf;
+	float *row1 = noise_buf + nlx;
+	noiseLatticeRow2D(row0, nlx, x0, y0,     seed);
+	noiseLatticeRow2D(row1, nlx, x0, y0 + 1, seed);
 
 	//calculate interpolations
 	index  = 0;
 	noisey = 0;
 	for (j = 0; j != sy; j++) {
-		v00 = noise_buf[idx(0, noisey)];
-		v10 = noise_buf[idx(1, noisey)];
-		v01 = noise_buf[idx(0, noisey + 1)];
-		v11 = noise_buf[idx(1, noisey + 1)];
-
-		u = orig_u;
-		noisex = 0;
-		for (i = 0; i != sx; i++) {
-			gradient_buf[index++] = interpolate(v00, v10, v01, v11, u, v);
-
-			u += step_x;
-			if (u >= 1.0) {
-				u -= 1.0;
-				noisex++;
-				v00 = v10;
-				v01 = v11;
-				v10 = noise_buf[idx(noisex + 1, noisey)];
-				v11 = noise_buf[idx(noisex + 1, noisey + 1)];
-			}
-		}
+		interpolateRow(&gradient_buf[index], sx, lattice_x, weight_x,
+			row0, row1, eased ? easeCurve(v) : v,
+			NULL, NULL, 0);
+		index += sx;
 
 		v += step_y;
 		if (v >= 1.0) {
 			v -= 1.0;
 			noisey++;
+			if (j + 1 != sy) {
+				std::swap(row0, row1);
+				noiseLatticeRow2D(row1, nlx, x0, y0 + noisey + 1, seed);
+			}
 		}
 	}
 }
-#undef idx
 
 
-#define idx(x, y, z) ((z) * nly * nlx + (y) * nlx + (x))
+#define idx(x, y) ((y) * nlx + (x))
 void Noise::gradientMap3D(
 		float x, float y, float z,
 		float step_x, float step_y, float step_z,
 		int seed)
 {
-	float v000, v010, v100, v110;
-	float v001, v011, v101, v111;
-	float u, v, w, orig_u, orig_v;
-	int index, i, j, k, x0, y0, z0, noisex, noisey, noisez;
-	int nlx, nly, nlz;
+	float u, v, w;
+	int index, j, k, x0, y0, z0, noisey, noisez;
+	int nlx, nly;
 
-	Interp3dFxn interpolate = (np.flags & NOISE_FLAG_EASED) ?
-		triLinearInterpolation : triLinearInterpolationNoEase;
+	bool eased = np.flags & NOISE_FLAG_EASED;
 
 	x0 = floor(x);
 	y0 = floor(y);
@@ -649,70 +752,42 @@ void Noise::gradientMap3D(
 	u = x - (float)x0;
 	v = y - (float)y0;
 	w = z - (float)z0;
-	orig_u = u;
-	orig_v = v;
-
-	//calculate noise point lattice
-	nlx = (int)(u + sx * step_x) + 2;
-	nly = (int)(v + sy * step_y) + 2;
-	nlz = (int)(w + sz * step_z) + 2;
-	index = 0;
-	for (k = 0; k != nlz; k++)
-		for (j = 0; j != nly; j++)
-			for (i = 0; i != nlx; i++)
-				noise_buf[index++] = noise3d(x0 + i, y0 + j, z0 + k, seed);
+
+	latticeSteps(lattice_x, weight_x, sx, u, step_x, eased);
+	latticeSteps(lattice_y, weight_y, sy, v, step_y, eased);
+	nlx = lattice_x[sx - 1] + 2;
+	nly = lattice_y[sy - 1] + 2;
+
+	//calculate the first two lattice planes
+	float *plane0 = noise_buf;
+	float *plane1 = noise_buf + nlx * nly;
+	noiseLatticePlane3D(plane0, nlx, nly, x0, y0, z0,     seed);
+	noiseLatticePlane3D(plane1, nlx, nly, x0, y0, z0 + 1, seed);
 
 	//calculate interpolations
 	index  = 0;
-	noisey = 0;
 	noisez = 0;
 	for (k = 0; k != sz; k++) {
-		v = orig_v;
-		noisey = 0;
+		float tz = eased ? easeCurve(w) : w;
 		for (j = 0; j != sy; j++) {
-			v000 = noise_buf[idx(0, noisey,     noisez)];
-			v100 = noise_buf[idx(1, noisey,     noisez)];
-			v010 = noise_buf[idx(0, noisey + 1, noisez)];
-			v110 = noise_buf[idx(1, noisey + 1, noisez)];
-			v001 = noise_buf[idx(0, noisey,     noisez + 1)];
-			v101 = noise_buf[idx(1, noisey,     noisez + 1)];
-			v011 = noise_buf[idx(0, noisey + 1, noisez + 1)];
-			v111 = noise_buf[idx(1, noisey + 1, noisez + 1)];
-
-			u = orig_u;
-			noisex = 0;
-			for (i = 0; i != sx; i++) {
-				gradient_buf[index++] = interpolate(
-					v000, v100, v010, v110,
-					v001, v101, v011, v111,
-					u, v, w);
-
-				u += step_x;
-				if (u >= 1.0) {
-					u -= 1.0;
-					noisex++;
-					v000 = v100;
-					v010 = v110;
-					v100 = noise_buf[idx(noisex + 1, noisey,     noisez)];
-					v110 = noise_buf[idx(noisex + 1, noisey + 1, noisez)];
-					v001 = v101;
-					v011 = v111;
-					v101 = noise_buf[idx(noisex + 1, noisey,     noisez + 1)];
-					v111 = noise_buf[idx(noisex + 1, noisey + 1, noisez + 1)];
-				}
-			}
-
-			v += step_y;
-			if (v >= 1.0) {
-				v -= 1.0;
-				noisey++;
-			}
+			noisey = lattice_y[j];
+			interpolateRow(&gradient_buf[index], sx, lattice_x, weight_x,
+				&plane0[idx(0, noisey)], &plane0[idx(0, noisey + 1)],
+				weight_y[j],
+				&plane1[idx(0, noisey)], &plane1[idx(0, noisey + 1)],
+				tz);
+			index += sx;
 		}
 
 		w += step_z;
 		if (w >= 1.0) {
 			w -= 1.0;
 			noisez++;
+			if (k + 1 != sz) {
+				std::swap(plane0, plane1);
+				noiseLatticePlane3D(plane1, nlx, nly,
+					x0, y0, z0 + noisez + 1, seed);
+			}
 		}
 	}
 }
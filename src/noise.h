@@ -154,6 +154,13 @@ class Noise {
 	float *gradient_buf;
 	float *persist_buf;
 	float *result;
+	// Lattice column and interpolation weight of each sample in a row,
+	// and of each row in a layer (3D only). These are the same for all
+	// rows and layers of a gradient map.
+	int *lattice_x;
+	int *lattice_y;
+	float *weight_x;
+	float *weight_y;
 
 	Noise(NoiseParams *np, int seed, int sx, int sy, int sz=1);
 	~Noise();
@@ -241,6 +248,11 @@ float noise3d_perlin(float x, float y, float z, int seed,
 float noise3d_perlin_abs(float x, float y, float z, int seed,
 		int octaves, float persistence, bool eased=false);
 
+// Test hook: turns the SSE2 version of the gradient maps, where it was
+// compiled in, off and on again. Both give the same results. Must not be
+// called while noise is computed on other threads.
+void noise_set_sse2_enabled(bool enabled);
+
 inline float easeCurve(float t)
 {
 	return t * t * t * (t * (6.f * t - 15.f) + 10.f);
@@ -27,6 +27,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "common/c_content.h"
 #include "scripting_game.h"
 #include "environment.h"
+#include "mapblock.h"
 #include "server.h"
 #include "nodedef.h"
 #include "daynightratio.h"
@@ -492,6 +493,42 @@ int ModApiEnvMod::l_get_gametime(lua_State *L)
 }
 
 
+// Reads a list of node names (or a single name) at index into a flat
+// bitset indexed by content id, sized to the largest id that matched.
+// Returns false if nothing matched.
+static bool read_content_filter(lua_State *L, int index,
+		INodeDefManager *ndef, std::vector<bool> &filter)
+{
+	std::set<content_t> ids;
+	if(lua_istable(L, index)) {
+		lua_pushnil(L);
+		while(lua_next(L, index) != 0) {
+			// key at index -2 and value at index -1
+			luaL_checktype(L, -1, LUA_TSTRING);
+			ndef->getIds(lua_tostring(L, -1), ids);
+			// removes value, keeps key for next iteration
+			lua_pop(L, 1);
+		}
+	} else if(lua_isstring(L, index)) {
+		ndef->getIds(lua_tostring(L, index), ids);
+	}
+
+	filter.clear();
+	if(ids.empty())
+		return false;
+	filter.resize(*ids.rbegin() + 1, false);
+	for(std::set<content_t>::const_iterator
+			it = ids.begin(); it != ids.end(); ++it)
+		filter[*it] = true;
+	return true;
+}
+
+static inline bool content_filter_has(const std::vector<bool> &filter,
+		content_t c)
+{
+	return c < filter.size() && filter[c];
+}
+
 // find_node_near(pos, radius, nodenames) -> pos or nil
 // nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
 int ModApiEnvMod::l_find_node_near(lua_State *L)
@@ -501,20 +538,9 @@ int ModApiEnvMod::l_find_node_near(lua_State *L)
 	INodeDefManager *ndef = getServer(L)->ndef();
 	v3s16 pos = read_v3s16(L, 1);
 	int radius = luaL_checkinteger(L, 2);
-	std::set<content_t> filter;
-	if(lua_istable(L, 3)){
-		int table = 3;
-		lua_pushnil(L);
-		while(lua_next(L, table) != 0){
-			// key at index -2 and value at index -1
-			luaL_checktype(L, -1, LUA_TSTRING);
-			ndef->getIds(lua_tostring(L, -1), filter);
-			// removes value, keeps key for next iteration
-			lua_pop(L, 1);
-		}
-	} else if(lua_isstring(L, 3)){
-		ndef->getIds(lua_tostring(L, 3), filter);
-	}
+	std::vector<bool> filter;
+	if(!read_content_filter(L, 3, ndef, filter))
+		return 0;
 
 	for(int d=1; d<=radius; d++){
 		std::vector<v3s16> list = FacePositionCache::getFacePositions(d);
@@ -522,7 +548,7 @@ int ModApiEnvMod::l_find_node_near(lua_State *L)
 				i != list.end(); ++i){
 			v3s16 p = pos + (*i);
 			content_t c = env->getMap().getNodeNoEx(p).getContent();
-			if(filter.count(c) != 0){
+			if(content_filter_has(filter, c)){
 				push_v3s16(L, p);
 				return 1;
 			}
@@ -531,43 +557,90 @@ int ModApiEnvMod::l_find_node_near(lua_State *L)
 	return 0;
 }
 
-// find_nodes_in_area(minp, maxp, nodenames) -> list of positions
+// find_nodes_in_area(minp, maxp, nodenames) -> list of positions, counts
 // nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
+// counts: {nodename = number of positions found}
 int ModApiEnvMod::l_find_nodes_in_area(lua_State *L)
 {
 	GET_ENV_PTR;
 
 	INodeDefManager *ndef = getServer(L)->ndef();
+	Map &map = env->getMap();
 	v3s16 minp = read_v3s16(L, 1);
 	v3s16 maxp = read_v3s16(L, 2);
-	std::set<content_t> filter;
-	if(lua_istable(L, 3)) {
-		int table = 3;
-		lua_pushnil(L);
-		while(lua_next(L, table) != 0) {
-			// key at index -2 and value at index -1
-			luaL_checktype(L, -1, LUA_TSTRING);
-			ndef->getIds(lua_tostring(L, -1), filter);
-			// removes value, keeps key for next iteration
-			lua_pop(L, 1);
-		}
-	} else if(lua_isstring(L, 3)) {
-		ndef->getIds(lua_tostring(L, 3), filter);
-	}
+	std::vector<bool> filter;
+	bool any = read_content_filter(L, 3, ndef, filter);
 
 	lua_newtable(L);
+	std::map<content_t, u32> found;
 	u64 i = 0;
-	for(s16 x = minp.X; x <= maxp.X; x++)
-	for(s16 y = minp.Y; y <= maxp.Y; y++)
-	for(s16 z = minp.Z; z <= maxp.Z; z++) {
-		v3s16 p(x, y, z);
-		content_t c = env->getMap().getNodeNoEx(p).getContent();
-		if(filter.count(c) != 0) {
-			push_v3s16(L, p);
-			lua_rawseti(L, -2, ++i);
+
+	/*
+		Walk the area one MapBlock at a time. A block whose content
+		histogram has none of the wanted ids is skipped without looking
+		at its nodes. Blocks that are not loaded read as "ignore".
+	*/
+	v3s16 bpmin = getNodeBlockPos(minp);
+	v3s16 bpmax = getNodeBlockPos(maxp);
+	for(s16 bx = bpmin.X; any && bx <= bpmax.X; bx++)
+	for(s16 by = bpmin.Y; by <= bpmax.Y; by++)
+	for(s16 bz = bpmin.Z; bz <= bpmax.Z; bz++) {
+		v3s16 bp(bx, by, bz);
+		v3s16 blockmin = bp * MAP_BLOCKSIZE;
+		v3s16 pmin(MYMAX(minp.X, blockmin.X), MYMAX(minp.Y, blockmin.Y),
+				MYMAX(minp.Z, blockmin.Z));
+		v3s16 pmax(MYMIN(maxp.X, (s16)(blockmin.X + MAP_BLOCKSIZE - 1)),
+				MYMIN(maxp.Y, (s16)(blockmin.Y + MAP_BLOCKSIZE - 1)),
+				MYMIN(maxp.Z, (s16)(blockmin.Z + MAP_BLOCKSIZE - 1)));
+
+		MapBlock *block = map.getBlockNoCreateNoEx(bp);
+		if(block == NULL || block->isDummy()) {
+			if(!content_filter_has(filter, CONTENT_IGNORE))
+				continue;
+			for(s16 x = pmin.X; x <= pmax.X; x++)
+			for(s16 y = pmin.Y; y <= pmax.Y; y++)
+			for(s16 z = pmin.Z; z <= pmax.Z; z++) {
+				push_v3s16(L, v3s16(x, y, z));
+				lua_rawseti(L, -2, ++i);
+				found[CONTENT_IGNORE]++;
+			}
+			continue;
+		}
+
+		const MapBlock::ContentCounts &counts = block->getContentCounts();
+		bool wanted = false;
+		for(MapBlock::ContentCounts::const_iterator
+				it = counts.begin(); it != counts.end(); ++it) {
+			if(content_filter_has(filter, it->first)) {
+				wanted = true;
+				break;
+			}
+		}
+		if(!wanted)
+			continue;
+
+		for(s16 x = pmin.X; x <= pmax.X; x++)
+		for(s16 y = pmin.Y; y <= pmax.Y; y++)
+		for(s16 z = pmin.Z; z <= pmax.Z; z++) {
+			v3s16 p(x, y, z);
+			bool is_valid;
+			content_t c = block->getNodeNoCheck(p - blockmin,
+					&is_valid).getContent();
+			if(content_filter_has(filter, c)) {
+				push_v3s16(L, p);
+				lua_rawseti(L, -2, ++i);
+				found[c]++;
+			}
 		}
 	}
-	return 1;
+
+	lua_newtable(L);
+	for(std::map<content_t, u32>::const_iterator
+			it = found.begin(); it != found.end(); ++it) {
+		lua_pushnumber(L, it->second);
+		lua_setfield(L, -2, ndef->get(it->first).name.c_str());
+	}
+	return 2;
 }
 
 // find_nodes_in_area_under_air(minp, maxp, nodenames) -> list of positions
@@ -586,21 +659,8 @@ int ModApiEnvMod::l_find_nodes_in_area_under_air(lua_State *L)
 	INodeDefManager *ndef = getServer(L)->ndef();
 	v3s16 minp = read_v3s16(L, 1);
 	v3s16 maxp = read_v3s16(L, 2);
-	std::set<content_t> filter;
-
-	if (lua_istable(L, 3)) {
-		int table = 3;
-		lua_pushnil(L);
-		while(lua_next(L, table) != 0) {
-			// key at index -2 and value at index -1
-			luaL_checktype(L, -1, LUA_TSTRING);
-			ndef->getIds(lua_tostring(L, -1), filter);
-			// removes value, keeps key for next iteration
-			lua_pop(L, 1);
-		}
-	} else if (lua_isstring(L, 3)) {
-		ndef->getIds(lua_tostring(L, 3), filter);
-	}
+	std::vector<bool> filter;
+	read_content_filter(L, 3, ndef, filter);
 
 	lua_newtable(L);
 	u64 i = 0;
@@ -613,7 +673,7 @@ int ModApiEnvMod::l_find_nodes_in_area_under_air(lua_State *L)
 			v3s16 psurf(x, y + 1, z);
 			content_t csurf = env->getMap().getNodeNoEx(psurf).getContent();
 			if(c != CONTENT_AIR && csurf == CONTENT_AIR &&
-					filter.count(c) != 0) {
+					content_filter_has(filter, c)) {
 				push_v3s16(L, v3s16(x, y, z));
 				lua_rawseti(L, -2, ++i);
 			}
@@ -115,7 +115,7 @@ class ModApiEnvMod : public ModApiBase {
 	// nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
 	static int l_find_node_near(lua_State *L);
 
-	// find_nodes_in_area(minp, maxp, nodenames) -> list of positions
+	// find_nodes_in_area(minp, maxp, nodenames) -> list of positions, counts
 	// nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
 	static int l_find_nodes_in_area(lua_State *L);
 
@@ -32,6 +32,21 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 				dynamic_cast<ServerEnvironment*>(getEnv(L));                   \
 				if (env == NULL) return 0
 
+// Removes the entries of a reused buffer table beyond the data written
+// to it; the table is at the top of the stack
+static void clear_buffer_tail(lua_State *L, int first)
+{
+	for (int i = first; ; i++) {
+		lua_rawgeti(L, -1, i);
+		bool end = lua_isnil(L, -1);
+		lua_pop(L, 1);
+		if (end)
+			break;
+		lua_pushnil(L);
+		lua_rawseti(L, -2, i);
+	}
+}
+
 // garbage collector
 int LuaVoxelManip::gc_object(lua_State *L)
 {
@@ -65,15 +80,24 @@ int LuaVoxelManip::l_get_data(lua_State *L)
 	LuaVoxelManip *o = checkobject(L, 1);
 	MMVManip *vm = o->vm;
 
+	bool use_buffer = lua_istable(L, 2);
+
 	int volume = vm->m_area.getVolume();
 
-	lua_newtable(L);
+	if (use_buffer)
+		lua_pushvalue(L, 2);
+	else
+		lua_createtable(L, volume, 0);
+
 	for (int i = 0; i != volume; i++) {
 		lua_Integer cid = vm->m_data[i].getContent();
 		lua_pushinteger(L, cid);
 		lua_rawseti(L, -2, i + 1);
 	}
 
+	if (use_buffer)
+		clear_buffer_tail(L, volume + 1);
+
 	return 1;
 }
 
@@ -228,15 +252,24 @@ int LuaVoxelManip::l_get_light_data(lua_State *L)
 	LuaVoxelManip *o = checkobject(L, 1);
 	MMVManip *vm = o->vm;
 
+	bool use_buffer = lua_istable(L, 2);
+
 	int volume = vm->m_area.getVolume();
 
-	lua_newtable(L);
+	if (use_buffer)
+		lua_pushvalue(L, 2);
+	else
+		lua_createtable(L, volume, 0);
+
 	for (int i = 0; i != volume; i++) {
 		lua_Integer light = vm->m_data[i].param1;
 		lua_pushinteger(L, light);
 		lua_rawseti(L, -2, i + 1);
 	}
 
+	if (use_buffer)
+		clear_buffer_tail(L, volume + 1);
+
 	return 1;
 }
 
@@ -270,15 +303,24 @@ int LuaVoxelManip::l_get_param2_data(lua_State *L)
 	LuaVoxelManip *o = checkobject(L, 1);
 	MMVManip *vm = o->vm;
 
+	bool use_buffer = lua_istable(L, 2);
+
 	int volume = vm->m_area.getVolume();
 
-	lua_newtable(L);
+	if (use_buffer)
+		lua_pushvalue(L, 2);
+	else
+		lua_createtable(L, volume, 0);
+
 	for (int i = 0; i != volume; i++) {
 		lua_Integer param2 = vm->m_data[i].param2;
 		lua_pushinteger(L, param2);
 		lua_rawseti(L, -2, i + 1);
 	}
 
+	if (use_buffer)
+		clear_buffer_tail(L, volume + 1);
+
 	return 1;
 }
 
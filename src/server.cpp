@@ -172,6 +172,19 @@ Server::Server(
 	m_gamespec(gamespec),
 	m_simple_singleplayer_mode(simple_singleplayer_mode),
 	m_async_fatal_error(""),
+	m_time_speed(g_settings, "time_speed"),
+	m_time_send_interval(g_settings, "time_send_interval"),
+	m_map_save_interval(g_settings, "server_map_save_interval"),
+	m_active_object_send_range(g_settings, "active_object_send_range_blocks"),
+	m_player_transfer_distance(g_settings, "player_transfer_distance"),
+	m_max_block_sends_total(g_settings,
+			"max_simultaneous_block_sends_server_total"),
+	m_object_update_medium_distance(g_settings,
+			"object_update_medium_distance"),
+	m_object_update_medium_divisor(g_settings,
+			"object_update_medium_divisor"),
+	m_object_update_far_distance(g_settings, "object_update_far_distance"),
+	m_object_update_far_divisor(g_settings, "object_update_far_divisor"),
 	m_env(NULL),
 	m_con(PROTOCOL_ID,
 			512,
@@ -330,6 +343,9 @@ Server::Server(
 	// Apply item aliases in the node definition manager
 	m_nodedef->updateAliases(m_itemdef);
 
+	// Index crafting recipes now that all aliases are known
+	m_craftdef->buildRecipeIndex(this);
+
 	m_nodedef->setNodeRegistrationStatus(true);
 
 	// Perform pending node name resolutions
@@ -536,7 +552,7 @@ void Server::AsyncRunStep(bool initial_step)
 	/*
 		Update time of day and overall game time
 	*/
-	m_env->setTimeOfDaySpeed(g_settings->getFloat("time_speed"));
+	m_env->setTimeOfDaySpeed(m_time_speed.get());
 
 	/*
 		Send to clients at constant intervals
@@ -544,9 +560,9 @@ void Server::AsyncRunStep(bool initial_step)
 
 	m_time_of_day_send_timer -= dtime;
 	if(m_time_of_day_send_timer < 0.0) {
-		m_time_of_day_send_timer = g_settings->getFloat("time_send_interval");
+		m_time_of_day_send_timer = m_time_send_interval.get();
 		u16 time = m_env->getTimeOfDay();
-		float time_speed = g_settings->getFloat("time_speed");
+		float time_speed = m_time_speed.get();
 		SendTimeOfDay(PEER_ID_INEXISTENT, time, time_speed);
 	}
 
@@ -656,8 +672,8 @@ void Server::AsyncRunStep(bool initial_step)
 		ScopeProfiler sp(g_profiler, "Server: checking added and deleted objs");
 
 		// Radius inside which objects are active
-		s16 radius = g_settings->getS16("active_object_send_range_blocks");
-		s16 player_radius = g_settings->getS16("player_transfer_distance");
+		s16 radius = m_active_object_send_range.get();
+		s16 player_radius = m_player_transfer_distance.get();
 
 		if (player_radius == 0 && g_settings->exists("unlimited_player_transfer_distance") &&
 				!g_settings->getBool("unlimited_player_transfer_distance"))
@@ -782,88 +798,84 @@ void Server::AsyncRunStep(bool initial_step)
 		JMutexAutoLock envlock(m_env_mutex);
 		ScopeProfiler sp(g_profiler, "Server: sending object messages");
 
-		// Key = object id
-		// Value = data sent by object
-		std::map<u16, std::vector<ActiveObjectMessage>* > buffered_messages;
-
-		// Get active object messages from environment
-		for(;;) {
-			ActiveObjectMessage aom = m_env->getActiveObjectMessage();
-			if (aom.id == 0)
-				break;
+		m_object_message_frame.clear();
+		m_object_message_frame.setTier(1,
+				m_object_update_medium_distance.get() * BS,
+				m_object_update_medium_divisor.get());
+		m_object_message_frame.setTier(2,
+				m_object_update_far_distance.get() * BS,
+				m_object_update_far_divisor.get());
+		{
+			ScopeProfiler sp(g_profiler, "Server: encode object messages");
 
-			std::vector<ActiveObjectMessage>* message_list = NULL;
-			std::map<u16, std::vector<ActiveObjectMessage>* >::iterator n;
-			n = buffered_messages.find(aom.id);
-			if (n == buffered_messages.end()) {
-				message_list = new std::vector<ActiveObjectMessage>;
-				buffered_messages[aom.id] = message_list;
-			}
-			else {
-				message_list = n->second;
+			// Get active object messages from environment
+			for(;;) {
+				ActiveObjectMessage aom = m_env->getActiveObjectMessage();
+				if (aom.id == 0)
+					break;
+				v3f pos(0,0,0);
+				if (aom.skippable) {
+					ServerActiveObject *obj = m_env->getActiveObject(aom.id);
+					if (obj)
+						pos = obj->getBasePosition();
+					else
+						aom.skippable = false;
+				}
+				m_object_message_frame.add(aom, pos);
 			}
-			message_list->push_back(aom);
+			m_object_message_frame.encode();
 		}
 
-		m_clients.Lock();
-		std::map<u16, RemoteClient*> clients = m_clients.getClientList();
-		// Route data to every client
-		for (std::map<u16, RemoteClient*>::iterator
-			i = clients.begin();
-			i != clients.end(); ++i) {
-			RemoteClient *client = i->second;
+		if (!m_object_message_frame.empty()) {
+			ScopeProfiler sp(g_profiler, "Server: route object messages");
+
+			m_clients.Lock();
+			std::map<u16, RemoteClient*> &clients = m_clients.getClientList();
 			std::string reliable_data;
 			std::string unreliable_data;
-			// Go through all objects in message buffer
-			for (std::map<u16, std::vector<ActiveObjectMessage>* >::iterator
-					j = buffered_messages.begin();
-					j != buffered_messages.end(); ++j) {
-				// If object is not known by client, skip it
-				u16 id = j->first;
-				if (client->m_known_objects.find(id) == client->m_known_objects.end())
-					continue;
+			// Route data to every client
+			for (std::map<u16, RemoteClient*>::iterator
+				i = clients.begin();
+				i != clients.end(); ++i) {
+				RemoteClient *client = i->second;
+				reliable_data.clear();
+				unreliable_data.clear();
+				// Objects far from the player get fewer updates
+				Player *player = m_env->getPlayer(client->peer_id);
+				if (player)
+					m_object_message_frame.gather(client->m_known_objects,
+							player->getPosition(),
+							reliable_data, unreliable_data);
+				else
+					m_object_message_frame.gather(client->m_known_objects,
+							reliable_data, unreliable_data);
+				/*
+					reliable_data and unreliable_data are now ready.
+					Send them.
+				*/
+				if(reliable_data.size() > 0) {
+					SendActiveObjectMessages(client->peer_id, reliable_data);
+				}
 
-				// Get message list of object
-				std::vector<ActiveObjectMessage>* list = j->second;
-				// Go through every message
-				for (std::vector<ActiveObjectMessage>::iterator
-						k = list->begin(); k != list->end(); ++k) {
-					// Compose the full new data with header
-					ActiveObjectMessage aom = *k;
-					std::string new_data;
-					// Add object id
-					char buf[2];
-					writeU16((u8*)&buf[0], aom.id);
-					new_data.append(buf, 2);
-					// Add data
-					new_data += serializeString(aom.datastring);
-					// Add data to buffer
-					if(aom.reliable)
-						reliable_data += new_data;
-					else
-						unreliable_data += new_data;
+				if(unreliable_data.size() > 0) {
+					SendActiveObjectMessages(client->peer_id, unreliable_data, false);
 				}
 			}
-			/*
-				reliable_data and unreliable_data are now ready.
-				Send them.
-			*/
-			if(reliable_data.size() > 0) {
-				SendActiveObjectMessages(client->peer_id, reliable_data);
-			}
+			m_clients.Unlock();
 
-			if(unreliable_data.size() > 0) {
-				SendActiveObjectMessages(client->peer_id, unreliable_data, false);
+			static const char *tier_names[OBJECT_UPDATE_TIERS] = {
+				"near", "medium", "far"
+			};
+			for (u8 t = 0; t < OBJECT_UPDATE_TIERS; t++) {
+				u32 sent, skipped, bytes;
+				m_object_message_frame.getTierStats(t, sent, skipped, bytes);
+				std::string tier = tier_names[t];
+				g_profiler->add("Server: object updates sent, " + tier, sent);
+				g_profiler->add("Server: object updates skipped, " + tier,
+						skipped);
+				g_profiler->add("Server: object update bytes, " + tier, bytes);
 			}
 		}
-		m_clients.Unlock();
-
-		// Clear buffered_messages
-		for(std::map<u16, std::vector<ActiveObjectMessage>* >::iterator
-				i = buffered_messages.begin();
-				i != buffered_messages.end(); ++i) {
-			delete i->second;
-		}
 	}
 
 	/*
@@ -912,6 +924,7 @@ void Server::AsyncRunStep(bool initial_step)
 			case MEET_BLOCK_NODE_METADATA_CHANGED:
 				infostream << "Server: MEET_BLOCK_NODE_METADATA_CHANGED" << std::endl;
 						prof.add("MEET_BLOCK_NODE_METADATA_CHANGED", 1);
+						expireBlockNetworkCache(event->p);
 						setBlockNotSent(event->p);
 				break;
 			case MEET_OTHER:
@@ -920,6 +933,7 @@ void Server::AsyncRunStep(bool initial_step)
 				for(std::set<v3s16>::iterator
 						i = event->modified_blocks.begin();
 						i != event->modified_blocks.end(); ++i) {
+					expireBlockNetworkCache(*i);
 					setBlockNotSent(*i);
 				}
 				break;
@@ -989,7 +1003,7 @@ void Server::AsyncRunStep(bool initial_step)
 	{
 		float &counter = m_savemap_timer;
 		counter += dtime;
-		if(counter >= g_settings->getFloat("server_map_save_interval"))
+		if(counter >= m_map_save_interval.get())
 		{
 			counter = 0.0;
 			JMutexAutoLock lock(m_env_mutex);
@@ -2091,6 +2105,13 @@ void Server::setBlockNotSent(v3s16 p)
 	m_clients.Unlock();
 }
 
+void Server::expireBlockNetworkCache(v3s16 blockpos)
+{
+	MapBlock *block = m_env->getMap().getBlockNoCreateNoEx(blockpos);
+	if (block)
+		block->expireNetworkCache();
+}
+
 void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto_version)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -2101,10 +2122,13 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto
 		Create a packet with the block in the right format
 	*/
 
-	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver, false);
-	block->serializeNetworkSpecific(os, net_proto_version);
-	std::string s = os.str();
+	bool cache_hit;
+	const std::string &s = block->getNetworkSerialization(ver,
+			net_proto_version, &cache_hit);
+	if (cache_hit)
+		g_profiler->add("Server: block network cache hits", 1);
+	else
+		g_profiler->add("Server: block network cache misses", 1);
 
 	NetworkPacket pkt(TOCLIENT_BLOCKDATA, 2 + 2 + 2 + 2 + s.size(), peer_id);
 
@@ -2150,12 +2174,12 @@ void Server::SendBlocks(float dtime)
 	// Lowest is most important.
 	std::sort(queue.begin(), queue.end());
 
+	s32 max_sending = m_max_block_sends_total.get();
 	m_clients.Lock();
 	for(u32 i=0; i<queue.size(); i++)
 	{
 		//TODO: Calculate limit dynamically
-		if(total_sending >= g_settings->getS32
-				("max_simultaneous_block_sends_server_total"))
+		if(total_sending >= max_sending)
 			break;
 
 		PrioritySortedBlockTransfer q = queue[i];
@@ -2628,6 +2652,9 @@ void Server::DeleteClient(u16 peer_id, ClientDeletionReason reason)
 			JMutexAutoLock env_lock(m_env_mutex);
 			m_clients.DeleteClient(peer_id);
 		}
+
+		// Don't generate blocks for a peer that is gone
+		m_emerge->cancelPeerEmerges(peer_id);
 	}
 
 	// Send leave chat message to all remaining clients
@@ -3314,10 +3341,13 @@ void dedicated_server_loop(Server &server, bool &kill)
 	verbosestream<<"dedicated_server_loop()"<<std::endl;
 
 	IntervalLimiter m_profiler_interval;
+	CachedFloatSetting dedicated_server_step(g_settings, "dedicated_server_step");
+	CachedFloatSetting profiler_print_interval_setting(g_settings,
+			"profiler_print_interval");
 
 	for(;;)
 	{
-		float steplen = g_settings->getFloat("dedicated_server_step");
+		float steplen = dedicated_server_step.get();
 		// This is kind of a hack but can be done like this
 		// because server.step() is very light
 		{
@@ -3339,8 +3369,7 @@ void dedicated_server_loop(Server &server, bool &kill)
 		/*
 			Profiler
 		*/
-		float profiler_print_interval =
-				g_settings->getFloat("profiler_print_interval");
+		float profiler_print_interval = profiler_print_interval_setting.get();
 		if(profiler_print_interval != 0)
 		{
 			if(m_profiler_interval.step(steplen, profiler_print_interval))
@@ -431,6 +431,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 			std::vector<u16> *far_players=NULL, float far_d_nodes=100,
 			bool remove_metadata=true);
 	void setBlockNotSent(v3s16 p);
+	// Environment mutex must be locked
+	void expireBlockNetworkCache(v3s16 blockpos);
 
 	// Environment and Connection must be locked when called
 	void SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto_version);
@@ -518,6 +520,18 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	float m_savemap_timer;
 	IntervalLimiter m_map_timer_and_unload_interval;
 
+	// Settings read by AsyncRunStep() on every step
+	CachedFloatSetting m_time_speed;
+	CachedFloatSetting m_time_send_interval;
+	CachedFloatSetting m_map_save_interval;
+	CachedS16Setting m_active_object_send_range;
+	CachedS16Setting m_player_transfer_distance;
+	CachedS32Setting m_max_block_sends_total;
+	CachedFloatSetting m_object_update_medium_distance;
+	CachedU16Setting m_object_update_medium_divisor;
+	CachedFloatSetting m_object_update_far_distance;
+	CachedU16Setting m_object_update_far_divisor;
+
 	// Environment
 	ServerEnvironment *m_env;
 	JMutex m_env_mutex;
@@ -610,6 +624,12 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 		This is behind m_env_mutex
 	*/
 	std::queue<MapEditEvent*> m_unsent_map_edit_queue;
+	/*
+		Active object messages of the current step, encoded once for
+		all clients. Kept around to reuse its buffers.
+		This is behind m_env_mutex
+	*/
+	ActiveObjectMessageFrame m_object_message_frame;
 	/*
 		Set to true when the server itself is modifying the map and does
 		all sending of information by itself.
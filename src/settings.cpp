@@ -556,6 +556,14 @@ bool Settings::getNoiseParamsFromGroup(const std::string &name,
 }
 
 
+u32 Settings::getRevision() const
+{
+	JMutexAutoLock lock(m_mutex);
+
+	return m_revision;
+}
+
+
 bool Settings::exists(const std::string &name) const
 {
 	JMutexAutoLock lock(m_mutex);
@@ -742,6 +750,7 @@ bool Settings::setEntry(const std::string &name, const void *data,
 
 		SettingsEntry &entry = set_default ? m_defaults[name] : m_settings[name];
 		old_group = entry.group;
+		m_revision++;
 
 		entry.value    = set_group ? "" : *(const std::string *)data;
 		entry.group    = set_group ? *(Settings **)data : NULL;
@@ -876,6 +885,7 @@ bool Settings::remove(const std::string &name)
 {
 	JMutexAutoLock lock(m_mutex);
 
+	m_revision++;
 	delete m_settings[name].group;
 	return m_settings.erase(name);
 }
@@ -904,6 +914,7 @@ void Settings::updateValue(const Settings &other, const std::string &name)
 		std::string val = other.get(name);
 
 		m_settings[name] = val;
+		m_revision++;
 	} catch (SettingNotFoundException &e) {
 	}
 }
@@ -951,6 +962,7 @@ SettingsParseEvent Settings::parseConfigObject(const std::string &line,
 
 void Settings::updateNoLock(const Settings &other)
 {
+	m_revision++;
 	m_settings.insert(other.m_settings.begin(), other.m_settings.end());
 	m_defaults.insert(other.m_defaults.begin(), other.m_defaults.end());
 }
@@ -962,6 +974,7 @@ void Settings::clearNoLock()
 	for (it = m_settings.begin(); it != m_settings.end(); ++it)
 		delete it->second.group;
 	m_settings.clear();
+	m_revision++;
 
 	clearDefaultsNoLock();
 }
@@ -972,6 +985,7 @@ void Settings::clearDefaultsNoLock()
 	for (it = m_defaults.begin(); it != m_defaults.end(); ++it)
 		delete it->second.group;
 	m_defaults.clear();
+	m_revision++;
 }
 
 
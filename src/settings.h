@@ -87,7 +87,9 @@ struct SettingsEntry {
 
 class Settings {
 public:
-	Settings() {}
+	Settings():
+		m_revision(0)
+	{}
 	~Settings();
 
 	Settings & operator += (const Settings &other);
@@ -148,6 +150,8 @@ class Settings {
 	// return all keys used
 	std::vector<std::string> getNames() const;
 	bool exists(const std::string &name) const;
+	// Changes whenever any setting or default is modified
+	u32 getRevision() const;
 
 
 	/***************************************
@@ -224,7 +228,57 @@ class Settings {
 	mutable JMutex m_callbackMutex;
 	mutable JMutex m_mutex; // All methods that access m_settings/m_defaults directly should lock this.
 
+	// Incremented with m_mutex locked on every modification, and only
+	// read with it locked
+	u32 m_revision;
 };
 
+/*
+	A setting whose parsed value is kept until the Settings it comes
+	from is modified, so that reading it costs a locked read of the
+	revision instead of a lookup and a parse.  Like the getter it uses,
+	get() throws SettingNotFoundException if the setting doesn't exist.
+
+	Any thread may call get() while other threads modify the Settings,
+	but a handle keeps its cached value unlocked, so each handle must
+	only be used by one thread at a time.
+*/
+template<typename T, T (Settings::*Getter)(const std::string &) const>
+class CachedSetting {
+public:
+	CachedSetting(const Settings *settings, const std::string &name):
+		m_settings(settings),
+		m_name(name),
+		m_revision(0),
+		m_valid(false)
+	{}
+
+	T get()
+	{
+		// Read the revision first; a change while parsing makes
+		// the next call parse again
+		u32 revision = m_settings->getRevision();
+		if (!m_valid || revision != m_revision) {
+			m_value = (m_settings->*Getter)(m_name);
+			m_revision = revision;
+			m_valid = true;
+		}
+		return m_value;
+	}
+
+private:
+	const Settings *m_settings;
+	std::string m_name;
+	T m_value;
+	u32 m_revision;
+	bool m_valid;
+};
+
+typedef CachedSetting<bool, &Settings::getBool> CachedBoolSetting;
+typedef CachedSetting<u16, &Settings::getU16> CachedU16Setting;
+typedef CachedSetting<s16, &Settings::getS16> CachedS16Setting;
+typedef CachedSetting<s32, &Settings::getS32> CachedS32Setting;
+typedef CachedSetting<float, &Settings::getFloat> CachedFloatSetting;
+
 #endif
 
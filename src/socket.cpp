@@ -61,6 +61,13 @@ typedef int socklen_t;
 typedef int socket_t;
 #endif
 
+#if defined(__linux__) && !defined(__ANDROID__)
+	#define HAVE_MMSG 1
+	#include <sys/uio.h>
+#else
+	#define HAVE_MMSG 0
+#endif
+
 // Set to true to enable verbose debug output
 bool socket_enable_debug_output = false;        // yuck
 
@@ -470,45 +477,38 @@ void UDPSocket::Send(const Address & destination, const void * data, int size)
 		throw SendFailedException("Failed to send packet");
 }
 
+static Address address_from_sockaddr(const struct sockaddr_storage &address)
+{
+	if (address.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *address6 =
+				(const struct sockaddr_in6 *)&address;
+		IPv6AddressBytes bytes;
+		memcpy(bytes.bytes, address6->sin6_addr.s6_addr, 16);
+		return Address(&bytes, ntohs(address6->sin6_port));
+	}
+
+	const struct sockaddr_in *address4 = (const struct sockaddr_in *)&address;
+	return Address(ntohl(address4->sin_addr.s_addr),
+			ntohs(address4->sin_port));
+}
+
 int UDPSocket::Receive(Address & sender, void *data, int size)
 {
 	// Return on timeout
 	if(WaitData(m_timeout_ms) == false)
 		return -1;
 
-	int received;
-	if (m_addr_family == AF_INET6) {
-		struct sockaddr_in6 address;
-		memset(&address, 0, sizeof(address));
-		socklen_t address_len = sizeof(address);
-
-		received = recvfrom(m_handle, (char *) data,
-				size, 0, (struct sockaddr *) &address, &address_len);
-
-		if(received < 0)
-			return -1;
+	struct sockaddr_storage address;
+	memset(&address, 0, sizeof(address));
+	socklen_t address_len = sizeof(address);
 
-		u16 address_port = ntohs(address.sin6_port);
-		IPv6AddressBytes bytes;
-		memcpy(bytes.bytes, address.sin6_addr.s6_addr, 16);
-		sender = Address(&bytes, address_port);
-	} else {
-		struct sockaddr_in address;
-		memset(&address, 0, sizeof(address));
+	int received = recvfrom(m_handle, (char *) data,
+			size, 0, (struct sockaddr *) &address, &address_len);
 
-		socklen_t address_len = sizeof(address);
-
-		received = recvfrom(m_handle, (char *)data,
-				size, 0, (struct sockaddr *)&address, &address_len);
-
-		if(received < 0)
-			return -1;
-
-		u32 address_ip = ntohl(address.sin_addr.s_addr);
-		u16 address_port = ntohs(address.sin_port);
+	if(received < 0)
+		return -1;
 
-		sender = Address(address_ip, address_port);
-	}
+	sender = address_from_sockaddr(address);
 
 	if (socket_enable_debug_output) {
 		// Print packet sender and size
@@ -533,6 +533,121 @@ int UDPSocket::Receive(Address & sender, void *data, int size)
 	return received;
 }
 
+int UDPSocket::SendBatch(const UDPDatagram *datagrams, int count)
+{
+	int sent = 0;
+
+#if HAVE_MMSG
+	// The single send prints debug output and simulates packet loss
+	if (!INTERNET_SIMULATOR && !socket_enable_debug_output) {
+		union {
+			struct sockaddr_in ipv4;
+			struct sockaddr_in6 ipv6;
+		} addresses[UDP_BATCH_MAX];
+		struct iovec iovecs[UDP_BATCH_MAX];
+		struct mmsghdr msgs[UDP_BATCH_MAX];
+
+		int i = 0;
+		while (i < count) {
+			// Fill in a batch, skipping datagrams for another family
+			int n = 0;
+			for (; i < count && n < UDP_BATCH_MAX; i++) {
+				const UDPDatagram &d = datagrams[i];
+				if (d.address.getFamily() != m_addr_family)
+					continue;
+				memset(&msgs[n], 0, sizeof(msgs[n]));
+				if (m_addr_family == AF_INET6) {
+					addresses[n].ipv6 = d.address.getAddress6();
+					addresses[n].ipv6.sin6_port = htons(d.address.getPort());
+					msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+				} else {
+					addresses[n].ipv4 = d.address.getAddress();
+					addresses[n].ipv4.sin_port = htons(d.address.getPort());
+					msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+				}
+				iovecs[n].iov_base = d.data;
+				iovecs[n].iov_len = d.size;
+				msgs[n].msg_hdr.msg_name = &addresses[n];
+				msgs[n].msg_hdr.msg_iov = &iovecs[n];
+				msgs[n].msg_hdr.msg_iovlen = 1;
+				n++;
+			}
+
+			// sendmmsg() stops at the first datagram that fails
+			int done = 0;
+			while (done < n) {
+				int result = sendmmsg(m_handle, &msgs[done], n - done, 0);
+				if (result <= 0) {
+					done++;
+					continue;
+				}
+				for (int j = done; j < done + result; j++)
+					if (msgs[j].msg_len == iovecs[j].iov_len)
+						sent++;
+				done += result;
+			}
+		}
+		return sent;
+	}
+#endif
+
+	for (int i = 0; i < count; i++) {
+		try {
+			Send(datagrams[i].address, datagrams[i].data, datagrams[i].size);
+			sent++;
+		} catch (SendFailedException &e) {
+		}
+	}
+	return sent;
+}
+
+int UDPSocket::ReceiveBatch(UDPDatagram *datagrams, int count, int buffer_size)
+{
+	count = MYMIN(count, UDP_BATCH_MAX);
+
+#if HAVE_MMSG
+	// The single receive prints debug output
+	if (!socket_enable_debug_output) {
+		struct sockaddr_storage addresses[UDP_BATCH_MAX];
+		struct iovec iovecs[UDP_BATCH_MAX];
+		struct mmsghdr msgs[UDP_BATCH_MAX];
+
+		memset(msgs, 0, sizeof(msgs[0]) * count);
+		for (int i = 0; i < count; i++) {
+			iovecs[i].iov_base = datagrams[i].data;
+			iovecs[i].iov_len = buffer_size;
+			msgs[i].msg_hdr.msg_name = &addresses[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+			msgs[i].msg_hdr.msg_iov = &iovecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int received = recvmmsg(m_handle, msgs, count, MSG_DONTWAIT, NULL);
+		if (received < 0)
+			return 0;
+
+		for (int i = 0; i < received; i++) {
+			datagrams[i].address = address_from_sockaddr(addresses[i]);
+			datagrams[i].size = msgs[i].msg_len;
+		}
+		return received;
+	}
+#endif
+
+	int received = 0;
+	while (received < count) {
+		UDPDatagram &d = datagrams[received];
+		d.size = Receive(d.address, d.data, buffer_size);
+		if (d.size < 0)
+			break;
+		received++;
+		// Only wait for the first one
+		if (!WaitData(0))
+			break;
+	}
+	return received;
+}
+
 int UDPSocket::GetHandle()
 {
 	return m_handle;
@@ -112,6 +112,16 @@ class Address
 	u16 m_port; // Port is separate from sockaddr structures
 };
 
+// Most datagrams handled by one system call in the batched functions
+#define UDP_BATCH_MAX 32
+
+struct UDPDatagram
+{
+	Address address;
+	u8 *data;
+	int size;
+};
+
 class UDPSocket
 {
 public:
@@ -127,6 +137,17 @@ class UDPSocket
 	void Send(const Address & destination, const void * data, int size);
 	// Returns -1 if there is no data
 	int Receive(Address & sender, void * data, int size);
+	/*
+		Batched versions of the above, using sendmmsg()/recvmmsg() where
+		available and a loop of single calls elsewhere.
+		SendBatch() sends count datagrams and returns how many of them
+		were sent successfully; failed ones are skipped.
+		ReceiveBatch() reads at most count datagrams that are already
+		waiting into the buffers of the given datagrams, each buffer_size
+		bytes, and returns how many were read.
+	*/
+	int SendBatch(const UDPDatagram *datagrams, int count);
+	int ReceiveBatch(UDPDatagram *datagrams, int count, int buffer_size);
 	int GetHandle(); // For debugging purposes only
 	void setTimeoutMs(int timeout_ms);
 	// Returns true if there is data, false if timeout occurred
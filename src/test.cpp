@@ -33,19 +33,42 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_mapnode.h"
 #include "nodedef.h"
 #include "mapsector.h"
+#include "nodemetadata.h"
 #include "settings.h"
 #include "log.h"
 #include "util/string.h"
 #include "filesys.h"
 #include "voxelalgorithms.h"
 #include "inventory.h"
+#include "craftdef.h"
+#include "gamedef.h"
 #include "util/numeric.h"
 #include "util/serialize.h"
 #include "noise.h" // PseudoRandom used for random data for compression
 #include "network/networkprotocol.h" // LATEST_PROTOCOL_VERSION
 #include "profiler.h"
+#include "environment.h"
+#include "serverobject.h"
+#include "clientiface.h"
+#include "database-dummy.h"
+#include "database-sqlite3.h"
+#include "map_saver.h"
+#include "mapgen.h"
+#include "emerge.h"
+#include "util/directiontables.h"
+#include "util/thread.h"
+#include "lua_api/l_vmanip.h"
 #include <algorithm>
 
+extern "C" {
+#include "lualib.h"
+}
+
+#ifndef SERVER
+#include "mapblock_mesh.h"
+#include "client.h"
+#endif
+
 /*
 	Asserts that the exception occurs
 */
@@ -74,6 +97,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 static content_t CONTENT_STONE;
 static content_t CONTENT_GRASS;
 static content_t CONTENT_TORCH;
+static content_t CONTENT_WATERSOURCE;
+static content_t CONTENT_WATERFLOWING;
 
 void define_some_nodes(IWritableItemDefManager *idef, IWritableNodeDefManager *ndef)
 {
@@ -136,6 +161,34 @@ void define_some_nodes(IWritableItemDefManager *idef, IWritableNodeDefManager *n
 	f.light_source = LIGHT_MAX-1;
 	idef->registerItem(itemdef);
 	CONTENT_TORCH = ndef->set(f.name, f);
+
+	/*
+		Water (minimal definitions for liquid tests)
+	*/
+	itemdef = ItemDefinition();
+	itemdef.type = ITEM_NODE;
+	itemdef.name = "default:water_source";
+	f = ContentFeatures();
+	f.name = itemdef.name;
+	f.drawtype = NDT_LIQUID;
+	f.light_propagates = true;
+	f.walkable = false;
+	f.buildable_to = true;
+	f.liquid_type = LIQUID_SOURCE;
+	f.liquid_alternative_flowing = "default:water_flowing";
+	f.liquid_alternative_source = "default:water_source";
+	f.liquid_viscosity = 1;
+	f.liquid_renewable = false;
+	idef->registerItem(itemdef);
+	CONTENT_WATERSOURCE = ndef->set(f.name, f);
+
+	itemdef.name = "default:water_flowing";
+	f.name = itemdef.name;
+	f.drawtype = NDT_FLOWINGLIQUID;
+	f.param_type_2 = CPT2_FLOWINGLIQUID;
+	f.liquid_type = LIQUID_FLOWING;
+	idef->registerItem(itemdef);
+	CONTENT_WATERFLOWING = ndef->set(f.name, f);
 }
 
 struct TestBase
@@ -605,6 +658,25 @@ struct TestSettings: public TestBase
 		//printf(">>>> expected config:\n%s\n", TEST_CONFIG_TEXT_AFTER);
 		//printf(">>>> actual config:\n%s\n", os.str().c_str());
 		UASSERT(os.str() == TEST_CONFIG_TEXT_AFTER);
+
+		// Test cached settings; they must follow every kind of change
+		CachedS16Setting cached_apples(group2, "num_apples");
+		UASSERT(cached_apples.get() == 4);
+		group2->setS16("num_apples", 7);
+		UASSERT(cached_apples.get() == 7);
+		group2->remove("num_apples");
+		group2->setDefault("num_apples", "9");
+		UASSERT(cached_apples.get() == 9);
+		Settings other;
+		other.setS16("num_apples", 11);
+		group2->updateValue(other, "num_apples");
+		UASSERT(cached_apples.get() == 11);
+		group2->clear();
+		try {
+			cached_apples.get();
+			UASSERT(!"Cached setting survived clear()");
+		} catch (SettingNotFoundException &e) {
+		}
 		} catch (SettingNotFoundException &e) {
 			UASSERT(!"Setting not found!");
 		}
@@ -1222,174 +1294,1874 @@ struct TestInventory: public TestBase
 	      These should be redone, utilizing some kind of a virtual
 		  interface for Map (IMap would be fine).
 */
-#if 0
-struct TestMapBlock: public TestBase
+/*
+	Just enough of a game for tests that need an IGameDef
+*/
+class TestGameDef : public IGameDef
 {
-	class TC : public NodeContainer
+public:
+	TestGameDef(IItemDefManager *idef, INodeDefManager *ndef,
+			ICraftDefManager *cdef):
+		m_idef(idef), m_ndef(ndef), m_cdef(cdef)
+	{}
+	virtual IItemDefManager* getItemDefManager() { return m_idef; }
+	virtual INodeDefManager* getNodeDefManager() { return m_ndef; }
+	virtual ICraftDefManager* getCraftDefManager() { return m_cdef; }
+	virtual ITextureSource* getTextureSource() { return NULL; }
+	virtual IShaderSource* getShaderSource() { return NULL; }
+	virtual u16 allocateUnknownNodeId(const std::string &name) { return 0; }
+	virtual ISoundManager* getSoundManager() { return NULL; }
+	virtual MtEventManager* getEventManager() { return NULL; }
+	virtual scene::ISceneManager* getSceneManager() { return NULL; }
+
+private:
+	IItemDefManager *m_idef;
+	INodeDefManager *m_ndef;
+	ICraftDefManager *m_cdef;
+};
+
+struct TestCraftDef: public TestBase
+{
+	IWritableItemDefManager *idef;
+	IWritableCraftDefManager *cdef;
+	TestGameDef *gamedef;
+	PseudoRandom pr;
+	// Input grid for each registered recipe
+	std::vector<CraftInput> recipe_inputs;
+
+	TestCraftDef():
+		pr(13)
+	{}
+
+	std::string itemName(int i)
 	{
-	public:
+		return "test:item" + itos(i);
+	}
 
-		MapNode node;
-		bool position_valid;
-		core::list<v3s16> validity_exceptions;
+	std::string recipeItem()
+	{
+		if (pr.range(0, 9) == 0)
+			return pr.range(0, 1) ? "group:test_even" : "group:test_odd";
+		return itemName(pr.range(0, 63));
+	}
 
-		TC()
-		{
-			position_valid = true;
+	// An item that matches a recipe item
+	std::string inputItem(const std::string &rec)
+	{
+		if (rec == "group:test_even")
+			return itemName(pr.range(0, 31) * 2);
+		if (rec == "group:test_odd")
+			return itemName(pr.range(0, 31) * 2 + 1);
+		return rec;
+	}
+
+	CraftInput gridInput(CraftMethod method, const std::vector<std::string> &names)
+	{
+		std::vector<ItemStack> items;
+		for (size_t i = 0; i < names.size(); i++)
+			items.push_back(ItemStack(names[i], names[i] == "" ? 0 : 1, 0, "", idef));
+		return CraftInput(method, 3, items);
+	}
+
+	void registerShaped(const std::string &output, const std::vector<std::string> &recipe,
+			unsigned int width)
+	{
+		cdef->registerCraft(new CraftDefinitionShaped(output, width, recipe,
+				CraftReplacements()), gamedef);
+	}
+
+	void registerRandomRecipe(u32 n)
+	{
+		std::string output = itemName(pr.range(0, 63)) + " " + itos(n % 99 + 1);
+		std::vector<std::string> grid(9, "");
+		std::vector<std::string> recipe;
+
+		switch (pr.range(0, 3)) {
+		case 0: {
+			// Shaped 2x2, placed anywhere in the grid
+			for (u32 i = 0; i < 4; i++)
+				recipe.push_back(pr.range(0, 4) ? recipeItem() : "");
+			if (recipe[0] == "")
+				recipe[0] = recipeItem();
+			registerShaped(output, recipe, 2);
+			u32 x = pr.range(0, 1), y = pr.range(0, 1);
+			for (u32 i = 0; i < 4; i++)
+				grid[(y + i / 2) * 3 + x + i % 2] = inputItem(recipe[i]);
+			recipe_inputs.push_back(gridInput(CRAFT_METHOD_NORMAL, grid));
+			break;
+		}
+		case 1: {
+			// Shapeless, put in the grid in another order
+			u32 count = pr.range(1, 4);
+			for (u32 i = 0; i < count; i++)
+				recipe.push_back(recipeItem());
+			cdef->registerCraft(new CraftDefinitionShapeless(output, recipe,
+					CraftReplacements()), gamedef);
+			for (u32 i = 0; i < count; i++)
+				grid[8 - i * 2] = inputItem(recipe[i]);
+			recipe_inputs.push_back(gridInput(CRAFT_METHOD_NORMAL, grid));
+			break;
 		}
+		case 2: {
+			std::string rec = recipeItem();
+			cdef->registerCraft(new CraftDefinitionCooking(output, rec, 3,
+					CraftReplacements()), gamedef);
+			grid.resize(1);
+			grid[0] = inputItem(rec);
+			recipe_inputs.push_back(gridInput(CRAFT_METHOD_COOKING, grid));
+			break;
+		}
+		default: {
+			std::string rec = recipeItem();
+			cdef->registerCraft(new CraftDefinitionFuel(rec, 10,
+					CraftReplacements()), gamedef);
+			grid.resize(1);
+			grid[0] = inputItem(rec);
+			recipe_inputs.push_back(gridInput(CRAFT_METHOD_FUEL, grid));
+		}
+		}
+	}
 
-		virtual bool isValidPosition(v3s16 p)
-		{
-			//return position_valid ^ (p==position_valid_exception);
-			bool exception = false;
-			for(core::list<v3s16>::Iterator i=validity_exceptions.begin();
-					i != validity_exceptions.end(); i++)
-			{
-				if(p == *i)
-				{
-					exception = true;
-					break;
-				}
+	std::string craft(CraftInput input)
+	{
+		CraftOutput output;
+		if (!cdef->getCraftResult(input, output, false, gamedef))
+			return "(none)";
+		return output.item + " " + ftos(output.time);
+	}
+
+	// Inputs built from the recipes, plus some that match nothing
+	std::vector<CraftInput> someInputs(u32 count)
+	{
+		std::vector<CraftInput> inputs;
+		for (u32 i = 0; i < count; i++) {
+			if (i % 8 == 7) {
+				std::vector<std::string> grid(9, "");
+				grid[pr.range(0, 8)] = itemName(pr.range(0, 63));
+				grid[pr.range(0, 8)] = itemName(pr.range(0, 63));
+				inputs.push_back(gridInput(CRAFT_METHOD_NORMAL, grid));
+			} else {
+				inputs.push_back(recipe_inputs[
+						pr.range(0, recipe_inputs.size() - 1)]);
 			}
-			return exception ? !position_valid : position_valid;
 		}
+		return inputs;
+	}
 
-		virtual MapNode getNode(v3s16 p)
-		{
-			if(isValidPosition(p) == false)
-				throw InvalidPositionException();
-			return node;
+	void Run()
+	{
+		idef = createItemDefManager();
+		cdef = createCraftDefManager();
+		TestGameDef craft_gamedef(idef, NULL, cdef);
+		gamedef = &craft_gamedef;
+
+		for (int i = 0; i < 64; i++) {
+			ItemDefinition itemdef;
+			itemdef.type = ITEM_CRAFT;
+			itemdef.name = itemName(i);
+			itemdef.groups[i % 2 ? "test_odd" : "test_even"] = 1;
+			idef->registerItem(itemdef);
 		}
 
-		virtual void setNode(v3s16 p, MapNode & n)
+		for (u32 i = 0; i < 3000; i++)
+			registerRandomRecipe(i);
+
+		// Later definitions override earlier ones, also across
+		// recipes using groups and ones using names
+		std::vector<std::string> recipe;
+		recipe.push_back(itemName(2));
+		recipe.push_back(itemName(4));
+		registerShaped("test:first", recipe, 1);
+		registerShaped("test:second", recipe, 1);
+		std::vector<std::string> grid(9, "");
+		grid[4] = itemName(2);
+		grid[7] = itemName(4);
+		CraftInput override_input = gridInput(CRAFT_METHOD_NORMAL, grid);
+		recipe[0] = "group:test_even";
+		registerShaped("test:third", recipe, 1);
+
+		std::vector<CraftInput> inputs = someInputs(200);
+		std::vector<std::string> expected;
+		u32 t0 = porting::getTimeUs();
+		for (size_t i = 0; i < inputs.size(); i++)
+			expected.push_back(craft(inputs[i]));
+		u32 t1 = porting::getTimeUs();
+
+		cdef->buildRecipeIndex(gamedef);
+		UASSERT(craft(override_input) == "test:third 0");
+
+		u32 t2 = porting::getTimeUs();
+		for (size_t i = 0; i < inputs.size(); i++)
+			UASSERT(craft(inputs[i]) == expected[i]);
+		u32 t3 = porting::getTimeUs();
+
+		// Recipes registered after indexing are indexed right away
+		recipe[0] = itemName(2);
+		registerShaped("test:fourth", recipe, 1);
+		UASSERT(craft(override_input) == "test:fourth 0");
+
+		// Aliases are resolved in inputs and recipes alike, also for
+		// input items that still have the old name
+		idef->registerAlias("test:old2", itemName(2));
+		idef->registerAlias("test:old4", itemName(4));
+		CraftInput alias_input = override_input;
+		alias_input.items[4].name = "test:old2";
+		UASSERT(craft(alias_input) == "test:fourth 0");
+		recipe[1] = "test:old4";
+		registerShaped("test:fifth", recipe, 1);
+		UASSERT(craft(override_input) == "test:fifth 0");
+		UASSERT(craft(alias_input) == "test:fifth 0");
+		cdef->registerCraft(new CraftDefinitionCooking("test:cooked",
+				"test:old4", 3, CraftReplacements()), gamedef);
+		grid.assign(1, "");
+		grid[0] = itemName(4);
+		CraftInput cook_input = gridInput(CRAFT_METHOD_COOKING, grid);
+		UASSERT(craft(cook_input) == "test:cooked 3");
+		cook_input.items[0].name = "test:old4";
+		UASSERT(craft(cook_input) == "test:cooked 3");
+
+		// Cleared definitions aren't indexed until the index is rebuilt
+		cdef->clear();
+		registerShaped("test:sixth", recipe, 1);
+		UASSERT(craft(override_input) == "test:sixth 0");
+		cdef->buildRecipeIndex(gamedef);
+		UASSERT(craft(alias_input) == "test:sixth 0");
+
+		infostream << "TestCraftDef: " << (t1 - t0) / inputs.size()
+			<< " us per lookup walking 3000 recipes, "
+			<< (t3 - t2) / inputs.size() << " us per indexed lookup"
+			<< std::endl;
+
+		delete cdef;
+		delete idef;
+	}
+};
+
+struct TestMapBlockContentCounts: public TestBase
+{
+	void Run(INodeDefManager *nodedef)
+	{
+		content_t c_stone = LEGN(nodedef, "CONTENT_STONE");
+		MapBlock b(NULL, v3s16(0,0,0), NULL);
+		const u16 nodecount = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
+
+		// A freshly allocated block is all CONTENT_IGNORE
+		UASSERT(b.getContentCounts().size() == 1);
+		UASSERT(b.getContentCount(CONTENT_IGNORE) == nodecount);
+
+		MapNode n_stone(c_stone);
+		MapNode n_air(CONTENT_AIR);
+		b.setNode(v3s16(1,2,3), n_stone);
+		b.setNode(v3s16(4,5,6), n_stone);
+		b.setNode(v3s16(4,5,6), n_stone);
+		b.setNodeNoCheck(v3s16(0,0,0), n_air);
+		UASSERT(b.getContentCount(c_stone) == 2);
+		UASSERT(b.getContentCount(CONTENT_AIR) == 1);
+		UASSERT(b.getContentCount(CONTENT_IGNORE) == nodecount - 3);
+
+		// Removing the last node of a content drops it from the histogram
+		b.setNode(v3s16(0,0,0), n_stone);
+		UASSERT(b.getContentCount(CONTENT_AIR) == 0);
+		UASSERT(b.getContentCounts().size() == 2);
+
+		// Bulk writes are recounted
+		VoxelManipulator v;
+		v.addArea(VoxelArea(v3s16(0,0,0),
+				v3s16(MAP_BLOCKSIZE-1, MAP_BLOCKSIZE-1, MAP_BLOCKSIZE-1)));
+		b.copyTo(v);
+		v.setNodeNoRef(v3s16(7,7,7), n_air);
+		b.copyFrom(v);
+		UASSERT(b.getContentCount(CONTENT_AIR) == 1);
+		UASSERT(b.getContentCount(c_stone) == 3);
+		UASSERT(b.getContentCount(CONTENT_IGNORE) == nodecount - 4);
+	}
+};
+
+struct TestMapBlockNetworkCache: public TestBase
+{
+	std::string serializeNetwork(MapBlock *block)
+	{
+		std::ostringstream os(std::ios_base::binary);
+		block->serialize(os, SER_FMT_VER_HIGHEST_WRITE, false);
+		block->serializeNetworkSpecific(os, LATEST_PROTOCOL_VERSION);
+		return os.str();
+	}
+
+	// Whether the block had its serialization cached; caches it again
+	bool cached(MapBlock *block)
+	{
+		bool hit;
+		const std::string &data = block->getNetworkSerialization(
+				SER_FMT_VER_HIGHEST_WRITE, LATEST_PROTOCOL_VERSION, &hit);
+		UASSERT(data == serializeNetwork(block));
+		return hit;
+	}
+
+	void Run(INodeDefManager *nodedef)
+	{
+		content_t c_stone = LEGN(nodedef, "CONTENT_STONE");
+		TestGameDef gamedef(NULL, nodedef, NULL);
+		Map map(dummyout, &gamedef);
+		MapSector *sector = new ServerMapSector(&map, v2s16(0, 0), &gamedef);
+		(*map.getSectorsPtr())[v2s16(0, 0)] = sector;
+		MapBlock *block = sector->createBlankBlock(0);
+
+		UASSERT(!cached(block));
+		UASSERT(cached(block));
+
+		// Every change to what is sent drops the cache
+		MapNode n_stone(c_stone);
+		block->setNode(v3s16(1, 2, 3), n_stone);
+		UASSERT(!cached(block));
+		block->setNodeNoCheck(v3s16(3, 2, 1), n_stone);
+		UASSERT(!cached(block));
+		block->setIsUnderground(true);
+		UASSERT(!cached(block));
+		block->setLightingExpired(false);
+		UASSERT(!cached(block));
+		block->setGenerated(true);
+		UASSERT(!cached(block));
+
+		VoxelManipulator v;
+		v.addArea(VoxelArea(v3s16(0,0,0),
+				v3s16(MAP_BLOCKSIZE-1, MAP_BLOCKSIZE-1, MAP_BLOCKSIZE-1)));
+		block->copyTo(v);
+		MapNode n_air(CONTENT_AIR);
+		v.setNodeNoRef(v3s16(1, 2, 3), n_air);
+		block->copyFrom(v);
+		UASSERT(!cached(block));
+
+		NodeMetadata *meta = new NodeMetadata(&gamedef);
+		meta->setString("foo", "bar");
+		map.setNodeMetadata(v3s16(4, 5, 6), meta);
+		UASSERT(!cached(block));
+		map.removeNodeMetadata(v3s16(4, 5, 6));
+		UASSERT(!cached(block));
+
+		MapBlock other(NULL, v3s16(0, 0, 0), &gamedef);
+		other.setNode(v3s16(7, 7, 7), n_stone);
+		std::ostringstream os(std::ios_base::binary);
+		other.serialize(os, SER_FMT_VER_HIGHEST_WRITE, false);
+		std::istringstream is(os.str(), std::ios_base::binary);
+		block->deSerialize(is, SER_FMT_VER_HIGHEST_WRITE, false);
+		UASSERT(!cached(block));
+
+		block->reallocate();
+		UASSERT(!cached(block));
+
+		// Timestamps aren't sent
+		block->setTimestamp(1234);
+		UASSERT(cached(block));
+
+		// The cache is dropped once it hasn't been used for a while
+		block->incrementNetworkCacheTimer(6.0);
+		UASSERT(cached(block));
+		block->incrementNetworkCacheTimer(6.0);
+		UASSERT(cached(block));
+		block->incrementNetworkCacheTimer(20.0);
+		UASSERT(!cached(block));
+	}
+};
+
+struct TestMapSaver: public TestBase
+{
+	// A database that can be made to refuse writes
+	class FailingDatabase: public Database_Dummy
+	{
+	public:
+		FailingDatabase(): fail(false) {}
+		bool saveBlock(const v3s16 &pos, const std::string &data)
 		{
-			if(isValidPosition(p) == false)
-				throw InvalidPositionException();
-		};
+			if (fail)
+				return false;
+			return Database_Dummy::saveBlock(pos, data);
+		}
+		bool fail;
+	};
 
-		virtual u16 nodeContainerId() const
+	// Like Redis, a database that can't answer loads inside a transaction
+	class TransactionDatabase: public Database_Dummy
+	{
+	public:
+		TransactionDatabase(): in_save(false), loads_in_save(0) {}
+		void beginSave() { in_save = true; }
+		void endSave() { in_save = false; }
+		bool saveBlock(const v3s16 &pos, const std::string &data)
 		{
-			return 666;
+			// Slow enough to give the loading thread its chances
+			sleep_ms(1);
+			return Database_Dummy::saveBlock(pos, data);
+		}
+		std::string loadBlock(const v3s16 &pos)
+		{
+			if (in_save)
+				loads_in_save++;
+			return Database_Dummy::loadBlock(pos);
 		}
+		bool in_save;
+		u32 loads_in_save;
 	};
 
-	void Run()
+	// Loads blocks the way ServerMap does, until stopped
+	class LoadThread: public JThread
 	{
-		TC parent;
+	public:
+		LoadThread(Database *db, JMutex *db_mutex):
+			loads(0), m_db(db), m_db_mutex(db_mutex) {}
+		void *Thread()
+		{
+			ThreadStarted();
+			for (s16 i = 0; !StopRequested(); i++) {
+				JMutexAutoLock lock(*m_db_mutex);
+				m_db->loadBlock(v3s16(i % 4, 0, 0));
+				loads++;
+			}
+			return NULL;
+		}
+		u32 loads;
+	private:
+		Database *m_db;
+		JMutex *m_db_mutex;
+	};
 
-		MapBlock b(&parent, v3s16(1,1,1));
-		v3s16 relpos(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+	std::string serializeBlock(MapBlock &block)
+	{
+		std::ostringstream os(std::ios_base::binary);
+		writeU8(os, SER_FMT_VER_HIGHEST_WRITE);
+		block.serialize(os, SER_FMT_VER_HIGHEST_WRITE, true);
+		return os.str();
+	}
 
-		UASSERT(b.getPosRelative() == relpos);
+	void Run(INodeDefManager *nodedef)
+	{
+		TestGameDef gamedef(NULL, nodedef, NULL);
+		content_t c_stone = LEGN(nodedef, "CONTENT_STONE");
+		content_t c_grass = LEGN(nodedef, "CONTENT_GRASS");
+
+		const u32 count = 64;
+		std::vector<MapBlock *> blocks;
+		PseudoRandom pr(1234);
+		for (u32 i = 0; i < count; i++) {
+			MapBlock *block = new MapBlock(NULL, v3s16(i % 4, i / 16, (i / 4) % 4),
+					&gamedef);
+			v3s16 p;
+			for (p.X = 0; p.X < MAP_BLOCKSIZE; p.X++)
+			for (p.Y = 0; p.Y < MAP_BLOCKSIZE; p.Y++)
+			for (p.Z = 0; p.Z < MAP_BLOCKSIZE; p.Z++) {
+				content_t c = p.Y > pr.range(0, 15) ? CONTENT_AIR :
+						pr.range(0, 3) ? c_stone : c_grass;
+				MapNode n(c, pr.range(0, 15));
+				block->setNodeNoCheck(p, n);
+			}
+			blocks.push_back(block);
+		}
 
-		UASSERT(b.getBox().MinEdge.X == MAP_BLOCKSIZE);
-		UASSERT(b.getBox().MaxEdge.X == MAP_BLOCKSIZE*2-1);
-		UASSERT(b.getBox().MinEdge.Y == MAP_BLOCKSIZE);
-		UASSERT(b.getBox().MaxEdge.Y == MAP_BLOCKSIZE*2-1);
-		UASSERT(b.getBox().MinEdge.Z == MAP_BLOCKSIZE);
-		UASSERT(b.getBox().MaxEdge.Z == MAP_BLOCKSIZE*2-1);
+		// The deferred compression writes exactly what serialize() does
+		for (u32 i = 0; i < count; i++) {
+			MapBlockDiskData d;
+			blocks[i]->serializeDisk(d, SER_FMT_VER_HIGHEST_WRITE);
+			std::ostringstream os(std::ios_base::binary);
+			writeU8(os, d.version);
+			d.write(os);
+			UASSERT(os.str() == serializeBlock(*blocks[i]));
+		}
 
-		UASSERT(b.isValidPosition(v3s16(0,0,0)) == true);
-		UASSERT(b.isValidPosition(v3s16(-1,0,0)) == false);
-		UASSERT(b.isValidPosition(v3s16(-1,-142,-2341)) == false);
-		UASSERT(b.isValidPosition(v3s16(-124,142,2341)) == false);
-		UASSERT(b.isValidPosition(v3s16(MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1)) == true);
-		UASSERT(b.isValidPosition(v3s16(MAP_BLOCKSIZE-1,MAP_BLOCKSIZE,MAP_BLOCKSIZE-1)) == false);
+		// What saving costs the server thread before and after
+		u32 t0 = porting::getTimeUs();
+		for (u32 i = 0; i < count; i++)
+			serializeBlock(*blocks[i]);
+		u32 t1 = porting::getTimeUs();
+		for (u32 i = 0; i < count; i++) {
+			MapBlockDiskData d;
+			blocks[i]->serializeDisk(d, SER_FMT_VER_HIGHEST_WRITE);
+		}
+		u32 t2 = porting::getTimeUs();
 
 		/*
-			TODO: this method should probably be removed
-			if the block size isn't going to be set variable
+			A queue much shorter than the number of blocks, so that
+			queueBlock() has to wait for the thread now and then
 		*/
-		/*UASSERT(b.getSizeNodes() == v3s16(MAP_BLOCKSIZE,
-				MAP_BLOCKSIZE, MAP_BLOCKSIZE));*/
-
-		// Changed flag should be initially set
-		UASSERT(b.getModified() == MOD_STATE_WRITE_NEEDED);
-		b.resetModified();
-		UASSERT(b.getModified() == MOD_STATE_CLEAN);
-
-		// All nodes should have been set to
-		// .d=CONTENT_IGNORE and .getLight() = 0
-		for(u16 z=0; z<MAP_BLOCKSIZE; z++)
-		for(u16 y=0; y<MAP_BLOCKSIZE; y++)
-		for(u16 x=0; x<MAP_BLOCKSIZE; x++)
+		Database_Dummy db;
+		JMutex db_mutex;
 		{
-			//UASSERT(b.getNode(v3s16(x,y,z)).getContent() == CONTENT_AIR);
-			UASSERT(b.getNode(v3s16(x,y,z)).getContent() == CONTENT_IGNORE);
-			UASSERT(b.getNode(v3s16(x,y,z)).getLight(LIGHTBANK_DAY) == 0);
-			UASSERT(b.getNode(v3s16(x,y,z)).getLight(LIGHTBANK_NIGHT) == 0);
+			MapSaver saver(&db, &db_mutex, 8);
+			saver.Start();
+
+			for (u32 i = 0; i < count; i++) {
+				MapBlockDiskData d;
+				blocks[i]->serializeDisk(d, SER_FMT_VER_HIGHEST_WRITE);
+				saver.queueBlock(blocks[i]->getPos(), d);
+			}
+			UASSERT(saver.getQueueSize() <= 8);
+
+			// Change a block and queue it again; the newest data wins
+			MapNode n_grass(c_grass);
+			blocks[0]->setNodeNoCheck(v3s16(0, 0, 0), n_grass);
+			MapBlockDiskData d;
+			blocks[0]->serializeDisk(d, SER_FMT_VER_HIGHEST_WRITE);
+			saver.queueBlock(blocks[0]->getPos(), d);
+			std::string queued;
+			if (saver.getQueuedBlock(blocks[0]->getPos(), &queued))
+				UASSERT(queued == serializeBlock(*blocks[0]));
+
+			saver.flush();
+			UASSERT(saver.getQueueSize() == 0);
+			UASSERT(!saver.getQueuedBlock(blocks[0]->getPos(), &queued));
+
+			// Everything left at destruction is written too
+			blocks[1]->setNodeNoCheck(v3s16(0, 0, 0), n_grass);
+			blocks[1]->serializeDisk(d, SER_FMT_VER_HIGHEST_WRITE);
+			saver.queueBlock(blocks[1]->getPos(), d);
 		}
 
+		for (u32 i = 0; i < count; i++)
+			UASSERT(db.loadBlock(blocks[i]->getPos()) == serializeBlock(*blocks[i]));
+
+		/*
+			Failed writes, and a saver whose thread isn't running
+		*/
+		FailingDatabase fdb;
 		{
-			MapNode n(CONTENT_AIR);
-			for(u16 z=0; z<MAP_BLOCKSIZE; z++)
-			for(u16 y=0; y<MAP_BLOCKSIZE; y++)
-			for(u16 x=0; x<MAP_BLOCKSIZE; x++)
-			{
-				b.setNode(v3s16(x,y,z), n);
+			MapSaver saver(&fdb, &db_mutex, 8);
+			MapBlockDiskData d;
+			for (u32 i = 0; i < 4; i++) {
+				blocks[i]->serializeDisk(d, SER_FMT_VER_HIGHEST_WRITE);
+				saver.queueBlock(blocks[i]->getPos(), d);
 			}
+
+			// Blocks that fail to be written stay queued
+			fdb.fail = true;
+			saver.flush();
+			UASSERT(saver.getQueueSize() == 4);
+			UASSERT(!saver.flushBlock(blocks[0]->getPos()));
+			std::string queued;
+			UASSERT(saver.getQueuedBlock(blocks[0]->getPos(), &queued));
+			UASSERT(queued == serializeBlock(*blocks[0]));
+
+			// Dropped blocks are never written
+			saver.dropBlock(blocks[1]->getPos());
+			UASSERT(saver.getQueueSize() == 3);
+			std::vector<v3s16> list;
+			saver.listQueuedBlocks(list);
+			UASSERT(list.size() == 3);
+			UASSERT(std::find(list.begin(), list.end(),
+					blocks[1]->getPos()) == list.end());
+
+			fdb.fail = false;
+			UASSERT(saver.flushBlock(blocks[0]->getPos()));
+			saver.flush();
+			UASSERT(saver.getQueueSize() == 0);
+			UASSERT(fdb.loadBlock(blocks[0]->getPos()) == queued);
+			UASSERT(fdb.loadBlock(blocks[1]->getPos()) == "");
+			UASSERT(fdb.loadBlock(blocks[3]->getPos()) ==
+					serializeBlock(*blocks[3]));
+
+			// Queued at destruction without the thread ever running
+			blocks[1]->serializeDisk(d, SER_FMT_VER_HIGHEST_WRITE);
+			saver.queueBlock(blocks[1]->getPos(), d);
 		}
+		UASSERT(fdb.loadBlock(blocks[1]->getPos()) == serializeBlock(*blocks[1]));
 
 		/*
-			Parent fetch functions
+			Loads from another thread while batches are committed never
+			end up inside a transaction
 		*/
-		parent.position_valid = false;
-		parent.node.setContent(5);
+		TransactionDatabase tdb;
+		{
+			LoadThread loader(&tdb, &db_mutex);
+			loader.Start();
+			MapSaver saver(&tdb, &db_mutex, 8);
+			saver.Start();
+			for (u32 round = 0; round < 4; round++)
+			for (u32 i = 0; i < count; i++) {
+				MapBlockDiskData d;
+				blocks[i]->serializeDisk(d, SER_FMT_VER_HIGHEST_WRITE);
+				saver.queueBlock(blocks[i]->getPos(), d);
+			}
+			saver.flush();
+			loader.Stop();
+			loader.Wait();
+			UASSERT(loader.loads > 0);
+		}
+		UASSERT(tdb.loads_in_save == 0);
+		for (u32 i = 0; i < count; i++)
+			UASSERT(tdb.loadBlock(blocks[i]->getPos()) == serializeBlock(*blocks[i]));
 
-		MapNode n;
+		for (u32 i = 0; i < count; i++)
+			delete blocks[i];
 
-		// Positions in the block should still be valid
-		UASSERT(b.isValidPositionParent(v3s16(0,0,0)) == true);
-		UASSERT(b.isValidPositionParent(v3s16(MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1)) == true);
-		n = b.getNodeParent(v3s16(0,MAP_BLOCKSIZE-1,0));
-		UASSERT(n.getContent() == CONTENT_AIR);
+		infostream << "TestMapSaver: " << (t1 - t0) / count
+			<< " us per block to serialize, " << (t2 - t1) / count
+			<< " us per block to take a snapshot" << std::endl;
+	}
+};
 
-		// ...but outside the block they should be invalid
-		UASSERT(b.isValidPositionParent(v3s16(-121,2341,0)) == false);
-		UASSERT(b.isValidPositionParent(v3s16(-1,0,0)) == false);
-		UASSERT(b.isValidPositionParent(v3s16(MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1,MAP_BLOCKSIZE)) == false);
+struct TestDatabase: public TestBase
+{
+	void testLoadBlocks(Database *db, const std::string &name)
+	{
+		PseudoRandom pr(4321);
+		std::vector<v3s16> saved;
+		db->beginSave();
+		for (s16 z = -4; z < 4; z++)
+		for (s16 y = -4; y < 4; y++)
+		for (s16 x = -8; x < 8; x++) {
+			if (pr.range(0, 3) == 0)
+				continue;
+			v3s16 p(x, y, z);
+			std::string data(pr.range(1, 2000), (char)pr.range(0, 255));
+			data += i64tos(Database::getBlockAsInteger(p));
+			UASSERT(db->saveBlock(p, data));
+			saved.push_back(p);
+		}
+		db->endSave();
+
+		// Existing, missing and repeated positions in any order
+		std::vector<v3s16> positions;
+		for (u32 i = 0; i < 1000; i++)
+			positions.push_back(v3s16(pr.range(-9, 8), pr.range(-5, 4),
+					pr.range(-5, 4)));
+		positions.push_back(saved[0]);
+		positions.push_back(saved[0]);
+
+		u32 t0 = porting::getTimeUs();
+		std::vector<std::string> data;
+		db->loadBlocks(positions, &data);
+		u32 t1 = porting::getTimeUs();
+		std::vector<std::string> expected;
+		for (size_t i = 0; i < positions.size(); i++)
+			expected.push_back(db->loadBlock(positions[i]));
+		u32 t2 = porting::getTimeUs();
+
+		UASSERT(data.size() == positions.size());
+		u32 found = 0;
+		for (size_t i = 0; i < positions.size(); i++) {
+			UASSERT(data[i] == expected[i]);
+			found += data[i] != "";
+		}
+		UASSERT(found > 0 && found < positions.size());
+
+		db->loadBlocks(std::vector<v3s16>(), &data);
+		UASSERT(data.empty());
 
+		infostream << "TestDatabase: " << name << ": "
+			<< (t1 - t0) * 1000 / positions.size() << " ns per block batched, "
+			<< (t2 - t1) * 1000 / positions.size() << " ns per block single"
+			<< std::endl;
+	}
+
+	void Run()
+	{
+		Database_Dummy dummy;
+		testLoadBlocks(&dummy, "dummy");
+
+		std::string dir = fs::TempPath() + DIR_DELIM "minetest_test_database";
+		fs::RecursiveDelete(dir);
+		UASSERT(fs::CreateAllDirs(dir));
 		{
-			bool exception_thrown = false;
-			try{
-				// This should throw an exception
-				MapNode n = b.getNodeParent(v3s16(0,0,-1));
-			}
-			catch(InvalidPositionException &e)
-			{
-				exception_thrown = true;
-			}
-			UASSERT(exception_thrown);
+			Database_SQLite3 sqlite(dir);
+			testLoadBlocks(&sqlite, "sqlite3");
 		}
+		fs::RecursiveDelete(dir);
+	}
+};
 
-		parent.position_valid = true;
-		// Now the positions outside should be valid
-		UASSERT(b.isValidPositionParent(v3s16(-121,2341,0)) == true);
-		UASSERT(b.isValidPositionParent(v3s16(-1,0,0)) == true);
-		UASSERT(b.isValidPositionParent(v3s16(MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1,MAP_BLOCKSIZE)) == true);
-		n = b.getNodeParent(v3s16(0,0,MAP_BLOCKSIZE));
-		UASSERT(n.getContent() == 5);
+struct TestMapBlockIndex: public TestBase
+{
+	// How blocks were looked up before the index: sector tree, then block
+	MapNode getNodeBySector(Map &map, v3s16 p)
+	{
+		v3s16 blockpos = getNodeBlockPos(p);
+		MapSector *sector = map.getSectorNoGenerateNoEx(
+				v2s16(blockpos.X, blockpos.Z));
+		MapBlock *block = sector ? sector->getBlockNoCreateNoEx(blockpos.Y) : NULL;
+		if (block == NULL)
+			return MapNode(CONTENT_IGNORE);
+		bool is_valid_p;
+		return block->getNodeNoCheck(p - blockpos * MAP_BLOCKSIZE, &is_valid_p);
+	}
 
+	void Run(INodeDefManager *nodedef)
+	{
 		/*
-			Set a node
+			Random inserts and removes against a std::map
 		*/
-		v3s16 p(1,2,0);
-		n.setContent(4);
-		b.setNode(p, n);
-		UASSERT(b.getNode(p).getContent() == 4);
-		//TODO: Update to new system
-		/*UASSERT(b.getNodeTile(p) == 4);
-		UASSERT(b.getNodeTile(v3s16(-1,-1,0)) == 5);*/
+		MapBlockIndex index;
+		std::map<v3s16, MapBlock*> reference;
+		PseudoRandom pr(99);
+		for (u32 i = 0; i < 20000; i++) {
+			v3s16 p(pr.range(-20, 20), pr.range(-20, 20), pr.range(-20, 20));
+			if (pr.range(0, 2) == 0) {
+				index.remove(p);
+				reference.erase(p);
+			} else {
+				MapBlock *fake = (MapBlock *)(size_t)(8 * (i + 1));
+				index.set(p, fake);
+				reference[p] = fake;
+			}
+		}
+		UASSERT(index.size() == reference.size());
+		for (s16 z = -21; z <= 21; z++)
+		for (s16 y = -21; y <= 21; y++)
+		for (s16 x = -21; x <= 21; x++) {
+			v3s16 p(x, y, z);
+			std::map<v3s16, MapBlock*>::iterator i = reference.find(p);
+			UASSERT(index.get(p) == (i == reference.end() ? NULL : i->second));
+		}
+		std::vector<MapBlock*> all;
+		index.getBlocks(all);
+		UASSERT(all.size() == reference.size());
 
 		/*
-			propagateSunlight()
+			A 16x4x16 block map, kept in sync by the sectors
 		*/
-		// Set lighting of all nodes to 0
-		for(u16 z=0; z<MAP_BLOCKSIZE; z++){
-			for(u16 y=0; y<MAP_BLOCKSIZE; y++){
-				for(u16 x=0; x<MAP_BLOCKSIZE; x++){
-					MapNode n = b.getNode(v3s16(x,y,z));
-					n.setLight(LIGHTBANK_DAY, 0);
+		TestGameDef gamedef(NULL, nodedef, NULL);
+		Map map(dummyout, &gamedef);
+		const s16 size_xz = 16, size_y = 4;
+		for (s16 x = 0; x < size_xz; x++)
+		for (s16 z = 0; z < size_xz; z++) {
+			MapSector *sector = new ServerMapSector(&map, v2s16(x, z), &gamedef);
+			(*map.getSectorsPtr())[v2s16(x, z)] = sector;
+			for (s16 y = 0; y < size_y; y++) {
+				MapBlock *block = sector->createBlankBlock(y);
+				MapNode n(CONTENT_AIR, x + y + z);
+				block->setNodeNoCheck(v3s16(0, 0, 0), n);
+			}
+		}
+		UASSERT(map.getBlockCount() == (u32)size_xz * size_y * size_xz);
+		UASSERT(map.getBlockNoCreateNoEx(v3s16(3, 2, 5))->getPos() == v3s16(3, 2, 5));
+		UASSERT(map.getBlockNoCreateNoEx(v3s16(3, size_y, 5)) == NULL);
+
+		// Removing blocks from a sector drops them from the index
+		MapBlock *gone = map.getBlockNoCreateNoEx(v3s16(1, 1, 1));
+		map.getSectorNoGenerateNoEx(v2s16(1, 1))->deleteBlock(gone);
+		UASSERT(map.getBlockNoCreateNoEx(v3s16(1, 1, 1)) == NULL);
+		UASSERT(map.getBlockNoCreateNoEx(v3s16(1, 2, 1)) != NULL);
+		map.getSectorNoGenerateNoEx(v2s16(1, 1))->createBlankBlock(1);
+
+		/*
+			Random and coherent node access, through the index and
+			through the sectors
+		*/
+		const u32 count = 1000000;
+		std::vector<v3s16> random_p(count);
+		for (u32 i = 0; i < count; i++)
+			random_p[i] = v3s16(pr.range(-8, size_xz * MAP_BLOCKSIZE + 8),
+					pr.range(-8, size_y * MAP_BLOCKSIZE + 8),
+					pr.range(-8, size_xz * MAP_BLOCKSIZE + 8));
+
+		u32 sum_index = 0, sum_sector = 0;
+		u32 t0 = porting::getTimeUs();
+		for (u32 i = 0; i < count; i++)
+			sum_index += map.getNodeNoEx(random_p[i]).param1;
+		u32 t1 = porting::getTimeUs();
+		for (u32 i = 0; i < count; i++)
+			sum_sector += getNodeBySector(map, random_p[i]).param1;
+		u32 t2 = porting::getTimeUs();
+		UASSERT(sum_index == sum_sector);
+
+		v3s16 p;
+		u32 coherent = 0;
+		for (p.Z = 0; p.Z < 64; p.Z++)
+		for (p.Y = 0; p.Y < 64; p.Y++)
+		for (p.X = 0; p.X < 64; p.X++, coherent++)
+			sum_index += map.getNodeNoEx(p).param1;
+		u32 t3 = porting::getTimeUs();
+		for (p.Z = 0; p.Z < 64; p.Z++)
+		for (p.Y = 0; p.Y < 64; p.Y++)
+		for (p.X = 0; p.X < 64; p.X++)
+			sum_sector += getNodeBySector(map, p).param1;
+		u32 t4 = porting::getTimeUs();
+		UASSERT(sum_index == sum_sector);
+
+		infostream << "TestMapBlockIndex: random access "
+			<< (t1 - t0) * 1000.0 / count << " ns index, "
+			<< (t2 - t1) * 1000.0 / count << " ns sectors; coherent access "
+			<< (t3 - t2) * 1000.0 / coherent << " ns index, "
+			<< (t4 - t3) * 1000.0 / coherent << " ns sectors" << std::endl;
+	}
+};
+
+struct TestLightSpread: public TestBase
+{
+	// Hills with caves under them and now and then a torch in a cave
+	MapNode terrainNode(v3s16 p)
+	{
+		s16 h = 32 + 8 * noise2d_perlin(0.5 + p.X / 24.0, 0.5 + p.Z / 24.0,
+				1337, 3, 0.5);
+		if (p.Y > h)
+			return MapNode(CONTENT_AIR);
+		if (p.Y < h - 4 && noise3d_perlin(0.5 + p.X / 12.0, 0.5 + p.Y / 12.0,
+				0.5 + p.Z / 12.0, 42, 2, 0.5) > 0.3) {
+			if (((u32)p.X * 73856093 ^ (u32)p.Y * 19349663 ^ (u32)p.Z * 83492791) % 401 == 0)
+				return MapNode(CONTENT_TORCH);
+			return MapNode(CONTENT_AIR);
+		}
+		return MapNode(CONTENT_STONE);
+	}
+
+	void fillTerrain(VoxelManipulator &v, const VoxelArea &a, s16 max_y)
+	{
+		v.addArea(a);
+		v3s16 p;
+		for (p.Z = a.MinEdge.Z; p.Z <= a.MaxEdge.Z; p.Z++)
+		for (p.Y = a.MinEdge.Y; p.Y <= a.MaxEdge.Y; p.Y++)
+		for (p.X = a.MinEdge.X; p.X <= a.MaxEdge.X; p.X++)
+			v.setNodeNoRef(p, p.Y > max_y ? MapNode(CONTENT_IGNORE) : terrainNode(p));
+	}
+
+	// Sunlight straight down from the top of the area
+	void referenceSunlight(VoxelManipulator &v, const VoxelArea &a,
+			INodeDefManager *ndef)
+	{
+		for (s16 z = a.MinEdge.Z; z <= a.MaxEdge.Z; z++)
+		for (s16 x = a.MinEdge.X; x <= a.MaxEdge.X; x++)
+		for (s16 y = a.MaxEdge.Y; y >= a.MinEdge.Y; y--) {
+			MapNode &n = v.getNodeRefUnsafe(v3s16(x, y, z));
+			if (!ndef->get(n).sunlight_propagates)
+				break;
+			n.setLight(LIGHTBANK_DAY, LIGHT_SUN, ndef);
+		}
+	}
+
+	// Relaxes the light until nothing changes; slow, but obviously right
+	void referenceSpread(VoxelManipulator &v, const VoxelArea &a,
+			enum LightBank bank, INodeDefManager *ndef, bool mapgen_style)
+	{
+		bool changed = true;
+		while (changed) {
+			changed = false;
+			v3s16 p;
+			for (p.Z = a.MinEdge.Z; p.Z <= a.MaxEdge.Z; p.Z++)
+			for (p.Y = a.MinEdge.Y; p.Y <= a.MaxEdge.Y; p.Y++)
+			for (p.X = a.MinEdge.X; p.X <= a.MaxEdge.X; p.X++) {
+				MapNode &n = v.getNodeRefUnsafe(p);
+				if (!ndef->get(n).light_propagates)
+					continue;
+				u8 light = n.getLight(bank, ndef);
+				u8 newlight = light;
+				for (u16 i = 0; i < 6; i++) {
+					v3s16 p2 = p + g_6dirs[i];
+					if (!a.contains(p2))
+						continue;
+					u8 light2 = v.getNodeRefUnsafe(p2).getLight(bank, ndef);
+					light2 = mapgen_style ? (light2 > 0 ? light2 - 1 : 0)
+							: diminish_light(light2);
+					newlight = MYMAX(newlight, light2);
+				}
+				if (newlight != light) {
+					n.setLight(bank, newlight, ndef);
+					changed = true;
+				}
+			}
+		}
+	}
+
+	void Run(INodeDefManager *ndef)
+	{
+		TestGameDef gamedef(NULL, ndef, NULL);
+
+		/*
+			Lighting of a freshly generated chunk, as done by the
+			mapgens: the default 80^3 chunk and one block around it
+		*/
+		{
+			Map map(dummyout, &gamedef);
+			v3s16 nmin(0, 0, 0), nmax(79, 79, 79);
+			VoxelArea full(nmin - v3s16(1, 1, 1) * MAP_BLOCKSIZE,
+					nmax + v3s16(1, 1, 1) * MAP_BLOCKSIZE);
+			MMVManip vm(&map), vm_ref(&map);
+			fillTerrain(vm, full, nmax.Y);
+			fillTerrain(vm_ref, full, nmax.Y);
+
+			Mapgen mg;
+			mg.ndef = ndef;
+			mg.vm = &vm;
+			u32 t0 = porting::getTimeUs();
+			mg.calcLighting(nmin, nmax);
+			u32 t1 = porting::getTimeUs();
+
+			mg.vm = &vm_ref;
+			mg.propagateSunlight(nmin - v3s16(1, 1, 1) * MAP_BLOCKSIZE,
+					nmax + v3s16(1, 0, 1) * MAP_BLOCKSIZE);
+			referenceSpread(vm_ref, full, LIGHTBANK_DAY, ndef, true);
+
+			u32 wrong = 0;
+			for (u32 i = 0; i < (u32)full.getVolume(); i++) {
+				if (vm.m_data[i].getLight(LIGHTBANK_DAY, ndef) !=
+						vm_ref.m_data[i].getLight(LIGHTBANK_DAY, ndef))
+					wrong++;
+			}
+			UASSERT(wrong == 0);
+
+			infostream << "TestLightSpread: mapgen chunk lit in "
+				<< (t1 - t0) / 1000.0 << " ms" << std::endl;
+		}
+
+		/*
+			A 6x4x6 block map, fully lit and then dug through
+		*/
+		{
+			Map map(dummyout, &gamedef);
+			v3s16 bmax(5, 3, 5);
+			VoxelArea area(v3s16(0, 0, 0),
+					(bmax + v3s16(1, 1, 1)) * MAP_BLOCKSIZE - v3s16(1, 1, 1));
+			VoxelManipulator ref;
+			fillTerrain(ref, area, area.MaxEdge.Y);
+
+			// A tunnel from above the surface down into the caves, then
+			// across, through rock that is put there first
+			std::vector<v3s16> dig;
+			for (s16 i = 0; i < 40; i++) {
+				dig.push_back(v3s16(20 + i, 45 - i, 40));
+				dig.push_back(v3s16(20 + i, 46 - i, 40));
+			}
+			for (s16 z = 40; z < 90; z++) {
+				dig.push_back(v3s16(59, 6, z));
+				dig.push_back(v3s16(59, 7, z));
+			}
+			for (u32 i = 0; i < dig.size(); i++)
+				ref.setNodeNoRef(dig[i], MapNode(CONTENT_STONE));
+
+			std::map<v3s16, MapBlock*> blocks, modified_blocks;
+			for (s16 x = 0; x <= bmax.X; x++)
+			for (s16 z = 0; z <= bmax.Z; z++) {
+				MapSector *sector = new ServerMapSector(&map, v2s16(x, z), &gamedef);
+				(*map.getSectorsPtr())[v2s16(x, z)] = sector;
+				for (s16 y = 0; y <= bmax.Y; y++) {
+					MapBlock *block = sector->createBlankBlock(y);
+					block->copyFrom(ref);
+					blocks[block->getPos()] = block;
+				}
+			}
+
+			u32 t0 = porting::getTimeUs();
+			map.updateLighting(blocks, modified_blocks);
+			u32 t1 = porting::getTimeUs();
+
+			u32 t2 = porting::getTimeUs();
+			for (u32 i = 0; i < dig.size(); i++) {
+				modified_blocks.clear();
+				map.removeNodeAndUpdate(dig[i], modified_blocks);
+				ref.setNodeNoRef(dig[i], MapNode(CONTENT_AIR));
+			}
+			u32 t3 = porting::getTimeUs();
+
+			referenceSunlight(ref, area, ndef);
+			referenceSpread(ref, area, LIGHTBANK_DAY, ndef, false);
+			referenceSpread(ref, area, LIGHTBANK_NIGHT, ndef, false);
+			u32 wrong = 0;
+			v3s16 p;
+			for (p.Z = area.MinEdge.Z; p.Z <= area.MaxEdge.Z; p.Z++)
+			for (p.Y = area.MinEdge.Y; p.Y <= area.MaxEdge.Y; p.Y++)
+			for (p.X = area.MinEdge.X; p.X <= area.MaxEdge.X; p.X++) {
+				MapNode n = map.getNodeNoEx(p);
+				MapNode &n_ref = ref.getNodeRefUnsafe(p);
+				if (n.getLight(LIGHTBANK_DAY, ndef) != n_ref.getLight(LIGHTBANK_DAY, ndef) ||
+						n.getLight(LIGHTBANK_NIGHT, ndef) != n_ref.getLight(LIGHTBANK_NIGHT, ndef))
+					wrong++;
+			}
+			UASSERT(wrong == 0);
+
+			infostream << "TestLightSpread: " << blocks.size()
+				<< " blocks lit in " << (t1 - t0) / 1000.0 << " ms, "
+				<< (t3 - t2) / dig.size() << " us per dug node" << std::endl;
+		}
+	}
+};
+
+struct TestABMThreading: public TestBase
+{
+	// Turns stone next to air into grass and records where. Can place
+	// another stone node on its first trigger.
+	class GrassABM : public ActiveBlockModifier
+	{
+	public:
+		GrassABM(content_t c_stone, content_t c_grass):
+			place(false), m_c_stone(c_stone), m_c_grass(c_grass) {}
+		std::set<std::string> getTriggerContents()
+		{
+			std::set<std::string> s;
+			s.insert("default:stone");
+			return s;
+		}
+		std::set<std::string> getRequiredNeighbors()
+		{
+			std::set<std::string> s;
+			s.insert("air");
+			return s;
+		}
+		float getTriggerInterval() { return 1.0; }
+		u32 getTriggerChance() { return 1; }
+		void trigger(ServerEnvironment *env, v3s16 p, MapNode n)
+		{
+			triggered.push_back(p);
+			MapNode n_grass(m_c_grass);
+			env->getMap().setNode(p, n_grass);
+			if (place) {
+				place = false;
+				MapNode n_stone(m_c_stone);
+				env->getMap().setNode(place_at, n_stone);
+			}
+		}
+
+		std::vector<v3s16> triggered;
+		bool place;
+		v3s16 place_at;
+	private:
+		content_t m_c_stone;
+		content_t m_c_grass;
+	};
+
+	// A server map and environment in a temporary directory
+	struct World
+	{
+		World(INodeDefManager *nodedef, u16 num_abm_threads):
+			gamedef(NULL, nodedef, NULL),
+			emerge(&gamedef),
+			dir(fs::TempPath() + DIR_DELIM "minetest_test_abm")
+		{
+			fs::RecursiveDelete(dir);
+			u16 num_abm_threads_prev = g_settings->getU16("num_abm_threads");
+			g_settings->setU16("num_abm_threads", num_abm_threads);
+			map = new ServerMap(dir, &gamedef, &emerge);
+			env = new ServerEnvironment(map, NULL, &gamedef, dir);
+			g_settings->setU16("num_abm_threads", num_abm_threads_prev);
+		}
+		~World()
+		{
+			// Deletes the map too
+			delete env;
+			fs::RecursiveDelete(dir);
+		}
+
+		TestGameDef gamedef;
+		EmergeManager emerge;
+		std::string dir;
+		ServerMap *map;
+		ServerEnvironment *env;
+	};
+
+	/*
+		Runs the ABM once on a random 3x2x3 block map, on num_threads ABM
+		threads. Returns where it triggered and the resulting nodes.
+	*/
+	std::vector<v3s16> run(INodeDefManager *nodedef, u16 num_threads,
+			std::vector<content_t> *contents)
+	{
+		content_t c_stone = LEGN(nodedef, "CONTENT_STONE");
+		content_t c_grass = LEGN(nodedef, "CONTENT_GRASS");
+		World world(nodedef, num_threads);
+		GrassABM *abm = new GrassABM(c_stone, c_grass);
+		world.env->addActiveBlockModifier(abm);
+
+		std::set<v3s16> blocks;
+		v3s16 bp;
+		for (bp.X = 0; bp.X < 3; bp.X++)
+		for (bp.Y = 0; bp.Y < 2; bp.Y++)
+		for (bp.Z = 0; bp.Z < 3; bp.Z++) {
+			world.map->createBlock(bp);
+			blocks.insert(bp);
+		}
+
+		PseudoRandom pr(99);
+		v3s16 nmax(3 * MAP_BLOCKSIZE - 1, 2 * MAP_BLOCKSIZE - 1,
+				3 * MAP_BLOCKSIZE - 1);
+		v3s16 p;
+		for (p.Z = 0; p.Z <= nmax.Z; p.Z++)
+		for (p.Y = 0; p.Y <= nmax.Y; p.Y++)
+		for (p.X = 0; p.X <= nmax.X; p.X++) {
+			MapNode n(pr.range(0, 3) == 0 ? CONTENT_AIR : c_stone);
+			world.map->setNode(p, n);
+		}
+
+		world.env->applyActiveBlockModifiers(blocks, 1.0);
+
+		for (p.Z = 0; p.Z <= nmax.Z; p.Z++)
+		for (p.Y = 0; p.Y <= nmax.Y; p.Y++)
+		for (p.X = 0; p.X <= nmax.X; p.X++)
+			contents->push_back(world.map->getNodeNoEx(p).getContent());
+		return abm->triggered;
+	}
+
+	void Run(INodeDefManager *nodedef)
+	{
+		// With a chance of 1 nothing is random, so both paths have to
+		// trigger on the same nodes in the same order
+		std::vector<content_t> serial_contents;
+		std::vector<v3s16> serial = run(nodedef, 0, &serial_contents);
+		std::vector<content_t> threaded_contents;
+		std::vector<v3s16> threaded = run(nodedef, 3, &threaded_contents);
+
+		UASSERT(!serial.empty());
+		UASSERT(threaded == serial);
+		UASSERT(threaded_contents == serial_contents);
+
+		/*
+			A candidate that a callback places after the last one in the
+			block is still reached by the serial scan
+		*/
+		content_t c_stone = LEGN(nodedef, "CONTENT_STONE");
+		content_t c_grass = LEGN(nodedef, "CONTENT_GRASS");
+		World world(nodedef, 0);
+		GrassABM *abm = new GrassABM(c_stone, c_grass);
+		abm->place = true;
+		abm->place_at = v3s16(MAP_BLOCKSIZE - 1, MAP_BLOCKSIZE - 1,
+				MAP_BLOCKSIZE - 1);
+		world.env->addActiveBlockModifier(abm);
+		world.map->createBlock(v3s16(0, 0, 0));
+		v3s16 p;
+		for (p.Z = 0; p.Z < MAP_BLOCKSIZE; p.Z++)
+		for (p.Y = 0; p.Y < MAP_BLOCKSIZE; p.Y++)
+		for (p.X = 0; p.X < MAP_BLOCKSIZE; p.X++) {
+			MapNode n(p == v3s16(0, 0, 0) ? c_stone : CONTENT_AIR);
+			world.map->setNode(p, n);
+		}
+		std::set<v3s16> blocks;
+		blocks.insert(v3s16(0, 0, 0));
+		world.env->applyActiveBlockModifiers(blocks, 1.0);
+		UASSERT(abm->triggered.size() == 2);
+		UASSERT(abm->triggered[1] == abm->place_at);
+	}
+};
+
+struct TestLiquidTransform: public TestBase
+{
+	// A Map whose liquids are transformed on the given workers, if any
+	class LiquidMap : public Map
+	{
+	public:
+		LiquidMap(IGameDef *gamedef, WorkerPool *workers):
+			Map(dummyout, gamedef)
+		{
+			m_liquid_workers = workers;
+		}
+	};
+
+	// Steps, a ditch and walls on a stone floor, with a few springs
+	void build(Map &map, IGameDef *gamedef, v3s16 bmax)
+	{
+		PseudoRandom pr(4);
+		v3s16 nmax = (bmax + v3s16(1,1,1)) * MAP_BLOCKSIZE - v3s16(1,1,1);
+		for (s16 x = 0; x <= bmax.X; x++)
+		for (s16 z = 0; z <= bmax.Z; z++) {
+			MapSector *sector = new ServerMapSector(&map, v2s16(x, z), gamedef);
+			(*map.getSectorsPtr())[v2s16(x, z)] = sector;
+			for (s16 y = 0; y <= bmax.Y; y++)
+				sector->createBlankBlock(y);
+		}
+
+		v3s16 p;
+		for (p.Z = 0; p.Z <= nmax.Z; p.Z++)
+		for (p.Y = 0; p.Y <= nmax.Y; p.Y++)
+		for (p.X = 0; p.X <= nmax.X; p.X++) {
+			s16 floor = 2 + p.X / 6;
+			bool wall = (p.Z % 11 == 5 && p.X % 9 != 0 && p.Y <= floor + 2) ||
+					p.X == 0 || p.Z == 0 || p.X == nmax.X || p.Z == nmax.Z;
+			bool ditch = p.X % 13 == 7 && p.Y == floor;
+			MapNode n(CONTENT_AIR);
+			if ((p.Y <= floor && !ditch) || (wall && p.Y <= floor + 4))
+				n = MapNode(CONTENT_STONE);
+			map.setNode(p, n);
+		}
+
+		for (u32 i = 0; i < 12; i++) {
+			p = v3s16(pr.range(1, nmax.X - 1), 0, pr.range(1, nmax.Z - 1));
+			p.Y = 2 + p.X / 6 + pr.range(1, 6);
+			MapNode n(CONTENT_WATERSOURCE);
+			map.setNode(p, n);
+			map.transforming_liquid_add(p);
+		}
+	}
+
+	// Transforms until nothing is queued; returns the number of steps
+	u32 settle(Map &map)
+	{
+		std::map<v3s16, MapBlock*> modified_blocks;
+		u32 steps = 0;
+		while (map.transforming_liquid_size() != 0 && steps < 10000) {
+			map.transformLiquids(modified_blocks);
+			steps++;
+		}
+		return steps;
+	}
+
+	void Run(INodeDefManager *ndef)
+	{
+		TestGameDef gamedef(NULL, ndef, NULL);
+		v3s16 bmax(3, 1, 3);
+
+		LiquidMap serial(&gamedef, NULL);
+		LiquidMap threaded(&gamedef, new WorkerPool(3, "LiquidTestWorker"));
+		build(serial, &gamedef, bmax);
+		build(threaded, &gamedef, bmax);
+
+		u32 t0 = porting::getTimeUs();
+		u32 steps_serial = settle(serial);
+		u32 t1 = porting::getTimeUs();
+		u32 steps_threaded = settle(threaded);
+		u32 t2 = porting::getTimeUs();
+		UASSERT(serial.transforming_liquid_size() == 0);
+		UASSERT(threaded.transforming_liquid_size() == 0);
+
+		// The liquids come to rest the same way
+		v3s16 nmax = (bmax + v3s16(1,1,1)) * MAP_BLOCKSIZE - v3s16(1,1,1);
+		u32 wrong = 0;
+		u32 liquid = 0;
+		v3s16 p;
+		for (p.Z = 0; p.Z <= nmax.Z; p.Z++)
+		for (p.Y = 0; p.Y <= nmax.Y; p.Y++)
+		for (p.X = 0; p.X <= nmax.X; p.X++) {
+			MapNode a = serial.getNodeNoEx(p);
+			MapNode b = threaded.getNodeNoEx(p);
+			if (a.getContent() != b.getContent() ||
+					a.getParam2() != b.getParam2())
+				wrong++;
+			if (a.getContent() == CONTENT_WATERFLOWING)
+				liquid++;
+		}
+		UASSERT(liquid > 0);
+		UASSERT(wrong == 0);
+
+		infostream << "TestLiquidTransform: " << liquid
+			<< " flowing nodes in " << steps_serial << " steps, "
+			<< (t1 - t0) / 1000 << " ms serial, " << steps_threaded
+			<< " steps, " << (t2 - t1) / 1000 << " ms threaded" << std::endl;
+	}
+};
+
+struct TestEmergeQueue: public TestBase
+{
+	void Run(INodeDefManager *ndef)
+	{
+		TestGameDef gamedef(NULL, ndef, NULL);
+		EmergeManager emerge(&gamedef);
+		emerge.qlimit_total = 100;
+		emerge.qlimit_diskonly = 10;
+		v3s16 p;
+		u8 flags;
+
+		/*
+			A block asked for by two peers stays queued for the second
+			one when the first one moves away from it
+		*/
+		emerge.updatePeerView(1, v3s16(0,0,0), v3f(0,0,1), 5);
+		emerge.updatePeerView(2, v3s16(0,0,0), v3f(0,0,1), 5);
+		UASSERT(emerge.enqueueBlockEmerge(1, v3s16(1,0,3), false));
+		UASSERT(emerge.enqueueBlockEmerge(2, v3s16(1,0,3), true));
+		UASSERT(emerge.blocks_enqueued.size() == 1);
+		UASSERT(emerge.getPeerQueueSize(1) == 1);
+		UASSERT(emerge.getPeerQueueSize(2) == 1);
+
+		emerge.updatePeerView(1, v3s16(50,0,0), v3f(0,0,1), 5);
+		UASSERT(emerge.getPeerQueueSize(1) == 0);
+		UASSERT(emerge.getPeerQueueSize(2) == 1);
+		UASSERT(emerge.popBlockEmerge(&p, &flags));
+		UASSERT(p == v3s16(1,0,3) && (flags & BLOCK_EMERGE_ALLOWGEN));
+		UASSERT(emerge.getPeerQueueSize(2) == 0);
+		UASSERT(!emerge.popBlockEmerge(&p, &flags));
+
+		// It is dropped once no peer wants it
+		UASSERT(emerge.enqueueBlockEmerge(1, v3s16(40,0,0), false));
+		UASSERT(emerge.enqueueBlockEmerge(2, v3s16(40,0,0), false));
+		emerge.updatePeerView(2, v3s16(0,0,0), v3f(0,0,1), 5);
+		UASSERT(emerge.blocks_enqueued.size() == 1);
+		emerge.updatePeerView(1, v3s16(0,0,0), v3f(0,0,1), 5);
+		UASSERT(emerge.blocks_enqueued.empty());
+
+		/*
+			Cancelling the requests of a peer keeps those that another
+			peer made too
+		*/
+		UASSERT(emerge.enqueueBlockEmerge(1, v3s16(0,0,1), false));
+		UASSERT(emerge.enqueueBlockEmerge(1, v3s16(0,0,2), false));
+		UASSERT(emerge.enqueueBlockEmerge(2, v3s16(0,0,2), false));
+		emerge.cancelPeerEmerges(1);
+		UASSERT(emerge.blocks_enqueued.size() == 1);
+		UASSERT(emerge.popBlockEmerge(&p, &flags));
+		UASSERT(p == v3s16(0,0,2));
+
+		/*
+			Peers are served in turn, each with its nearest block first
+		*/
+		emerge.updatePeerView(1, v3s16(0,0,0), v3f(0,0,1), 5);
+		UASSERT(emerge.enqueueBlockEmerge(1, v3s16(0,0,3), false));
+		UASSERT(emerge.enqueueBlockEmerge(1, v3s16(0,0,1), false));
+		UASSERT(emerge.enqueueBlockEmerge(1, v3s16(0,0,-1), false));
+		UASSERT(emerge.enqueueBlockEmerge(2, v3s16(0,4,0), false));
+		UASSERT(emerge.enqueueBlockEmerge(PEER_ID_INEXISTENT,
+				v3s16(9,9,9), false));
+		emerge.last_peer_served = PEER_ID_INEXISTENT;
+		std::vector<v3s16> order;
+		while (emerge.popBlockEmerge(&p, &flags))
+			order.push_back(p);
+		UASSERT(order.size() == 5);
+		UASSERT(order[0] == v3s16(0,0,1));
+		UASSERT(order[1] == v3s16(0,4,0));
+		UASSERT(order[2] == v3s16(9,9,9));
+		UASSERT(order[3] == v3s16(0,0,-1));
+		UASSERT(order[4] == v3s16(0,0,3));
+	}
+};
+
+struct TestVoxelManipGetData: public TestBase
+{
+	bool runChunk(lua_State *L, const char *chunk)
+	{
+		if (luaL_loadstring(L, chunk) || lua_pcall(L, 0, 1, 0)) {
+			errorstream << "TestVoxelManipGetData: "
+				<< lua_tostring(L, -1) << std::endl;
+			lua_pop(L, 1);
+			return false;
+		}
+		bool result = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		return result;
+	}
+
+	void Run()
+	{
+		// The size of a default mapgen chunk
+		MMVManip vm(NULL);
+		vm.addArea(VoxelArea(v3s16(0,0,0), v3s16(79,79,79)));
+		s32 volume = vm.m_area.getVolume();
+		for (s32 i = 0; i < volume; i++)
+			vm.m_data[i] = MapNode(i % 7);
+
+		lua_State *L = luaL_newstate();
+		luaL_openlibs(L);
+		LuaVoxelManip::Register(L);
+		*(void **)(lua_newuserdata(L, sizeof(void *))) =
+			new LuaVoxelManip(&vm, true);
+		luaL_getmetatable(L, "VoxelManip");
+		lua_setmetatable(L, -2);
+		lua_setglobal(L, "vm");
+		lua_pushinteger(L, volume);
+		lua_setglobal(L, "volume");
+
+		UASSERT(runChunk(L,
+			"local d = vm:get_data()\n"
+			"return #d == volume and d[1] == 0 and d[volume] == (volume - 1) % 7"));
+		// A reused buffer is filled in place and loses its extra entries
+		UASSERT(runChunk(L,
+			"local buf = {}\n"
+			"for i = 1, volume + 10 do buf[i] = -1 end\n"
+			"local d = vm:get_data(buf)\n"
+			"return d == buf and #buf == volume and buf[volume + 1] == nil\n"
+			"	and buf[8] == 0 and buf[volume] == (volume - 1) % 7"));
+
+		// Both loops include the garbage collection they cause
+		const u32 calls = 10;
+		lua_pushinteger(L, calls);
+		lua_setglobal(L, "calls");
+		u32 t0 = porting::getTimeMs();
+		UASSERT(runChunk(L,
+			"for i = 1, calls do local d = vm:get_data() end\n"
+			"collectgarbage()\n"
+			"return true"));
+		u32 t1 = porting::getTimeMs();
+		UASSERT(runChunk(L,
+			"local buf = {}\n"
+			"for i = 1, calls do vm:get_data(buf) end\n"
+			"collectgarbage()\n"
+			"return true"));
+		u32 t2 = porting::getTimeMs();
+
+		lua_close(L);
+
+		infostream << "TestVoxelManipGetData: " << volume << " nodes, "
+			<< (float)(t1 - t0) / calls << " ms per call with a new table, "
+			<< (float)(t2 - t1) / calls << " ms per call with a reused buffer"
+			<< std::endl;
+	}
+};
+
+#ifndef SERVER
+struct TestMeshInputFill: public TestBase
+{
+	// The area of the mesh input of a block: the block and a border
+	VoxelArea getMeshArea(v3s16 blockpos)
+	{
+		v3s16 blockpos_nodes = blockpos * MAP_BLOCKSIZE;
+		return VoxelArea(blockpos_nodes - v3s16(1,1,1),
+				blockpos_nodes + v3s16(1,1,1) * MAP_BLOCKSIZE);
+	}
+
+	// What MeshMakeData::fill() did before: all of the 27 blocks
+	void fillFull(VoxelManipulator &v, Map &map, v3s16 blockpos)
+	{
+		v3s16 blockpos_nodes = blockpos * MAP_BLOCKSIZE;
+		v.clear();
+		v.addArea(VoxelArea(blockpos_nodes - v3s16(1,1,1) * MAP_BLOCKSIZE,
+				blockpos_nodes + v3s16(1,1,1) * MAP_BLOCKSIZE*2 - v3s16(1,1,1)));
+		map.getBlockNoCreateNoEx(blockpos)->copyTo(v);
+		for (u16 i = 0; i < 26; i++) {
+			MapBlock *b = map.getBlockNoCreateNoEx(blockpos + g_26dirs[i]);
+			if (b)
+				b->copyTo(v);
+		}
+	}
+
+	void fillCompact(VoxelManipulator &v, Map &map, v3s16 blockpos)
+	{
+		VoxelArea area = getMeshArea(blockpos);
+		v.resetArea(area);
+		map.getBlockNoCreateNoEx(blockpos)->copyTo(v);
+		for (u16 i = 0; i < 26; i++) {
+			MapBlock *b = map.getBlockNoCreateNoEx(blockpos + g_26dirs[i]);
+			if (b)
+				b->copyTo(v, area);
+		}
+	}
+
+	// Number of nodes of the mesh area that differ between a and b
+	u32 countDifferences(VoxelManipulator &a, VoxelManipulator &b,
+			v3s16 blockpos)
+	{
+		VoxelArea area = getMeshArea(blockpos);
+		u32 wrong = 0;
+		v3s16 p;
+		for (p.Z = area.MinEdge.Z; p.Z <= area.MaxEdge.Z; p.Z++)
+		for (p.Y = area.MinEdge.Y; p.Y <= area.MaxEdge.Y; p.Y++)
+		for (p.X = area.MinEdge.X; p.X <= area.MaxEdge.X; p.X++) {
+			MapNode na = a.getNodeNoExNoEmerge(p);
+			MapNode nb = b.getNodeNoExNoEmerge(p);
+			if (na.getContent() != nb.getContent() ||
+					na.getParam1() != nb.getParam1() ||
+					na.getParam2() != nb.getParam2())
+				wrong++;
+		}
+		return wrong;
+	}
+
+	void Run(INodeDefManager *ndef)
+	{
+		TestGameDef gamedef(NULL, ndef, NULL);
+		Map map(dummyout, &gamedef);
+		PseudoRandom pr(25);
+
+		// 4x4x4 blocks of random nodes, with some of them missing
+		v3s16 bmax(3, 3, 3);
+		for (s16 x = 0; x <= bmax.X; x++)
+		for (s16 z = 0; z <= bmax.Z; z++) {
+			MapSector *sector = new ServerMapSector(&map, v2s16(x, z), &gamedef);
+			(*map.getSectorsPtr())[v2s16(x, z)] = sector;
+			for (s16 y = 0; y <= bmax.Y; y++) {
+				if (pr.range(0, 5) == 0)
+					continue;
+				MapBlock *block = sector->createBlankBlock(y);
+				MapNode *data = block->getData();
+				for (u32 i = 0; i < MAP_BLOCKSIZE * MAP_BLOCKSIZE
+						* MAP_BLOCKSIZE; i++)
+					data[i] = MapNode(pr.range(0, 1) ? CONTENT_STONE :
+							CONTENT_AIR, pr.range(0, 255), pr.range(0, 255));
+			}
+		}
+
+		/*
+			A partial copy takes the right part of the source
+		*/
+		{
+			VoxelArea src_area(v3s16(0,0,0), v3s16(3,3,3));
+			MapNode src[4 * 4 * 4];
+			for (s32 i = 0; i < src_area.getVolume(); i++)
+				src[i] = MapNode(CONTENT_AIR, i, 0);
+			VoxelManipulator v;
+			VoxelArea area(v3s16(10,10,10), v3s16(12,12,12));
+			v.addArea(area);
+			v.copyFrom(src, src_area, v3s16(1,2,1), v3s16(11,10,10),
+					v3s16(2,1,2));
+			UASSERT(v.getNodeNoExNoEmerge(v3s16(11,10,10)).getParam1()
+					== src_area.index(1,2,1));
+			UASSERT(v.getNodeNoExNoEmerge(v3s16(12,10,11)).getParam1()
+					== src_area.index(2,2,2));
+			UASSERT(v.getNodeNoExNoEmerge(v3s16(10,10,10)).getContent()
+					== CONTENT_IGNORE);
+			UASSERT(v.getNodeNoExNoEmerge(v3s16(11,11,10)).getContent()
+					== CONTENT_IGNORE);
+		}
+
+		/*
+			The compact fill has the same nodes as the full one, and
+			keeps its buffer from one block to the next
+		*/
+		VoxelManipulator full, compact;
+		u32 blocks = 0;
+		u32 time_full = 0;
+		u32 time_compact = 0;
+		MapNode *compact_data = NULL;
+		for (s16 x = 0; x <= bmax.X; x++)
+		for (s16 y = 0; y <= bmax.Y; y++)
+		for (s16 z = 0; z <= bmax.Z; z++) {
+			v3s16 bp(x, y, z);
+			if (map.getBlockNoCreateNoEx(bp) == NULL)
+				continue;
+			u32 t0 = porting::getTimeUs();
+			fillFull(full, map, bp);
+			u32 t1 = porting::getTimeUs();
+			fillCompact(compact, map, bp);
+			u32 t2 = porting::getTimeUs();
+
+			UASSERT(countDifferences(full, compact, bp) == 0);
+			UASSERT(compact.m_area.getVolume() ==
+					(MAP_BLOCKSIZE + 2) * (MAP_BLOCKSIZE + 2) * (MAP_BLOCKSIZE + 2));
+			if (compact_data != NULL)
+				UASSERT(compact.m_data == compact_data);
+			compact_data = compact.m_data;
+
+			MeshMakeBufferPool pool;
+			MeshMakeData data(&gamedef, false, &pool);
+			data.fill(map.getBlockNoCreateNoEx(bp));
+			UASSERT(countDifferences(data.m_vmanip, compact, bp) == 0);
+
+			blocks++;
+			time_full += t1 - t0;
+			time_compact += t2 - t1;
+		}
+
+		infostream << "TestMeshInputFill: " << time_full / blocks
+			<< " us per block full (" << full.m_area.getVolume()
+			* (sizeof(MapNode) + 1) / 1024 << " KiB), "
+			<< time_compact / blocks << " us compact ("
+			<< compact.m_area.getVolume() * (sizeof(MapNode) + 1) / 1024
+			<< " KiB)" << std::endl;
+	}
+};
+
+struct TestSmoothLightCache: public TestBase
+{
+	// Hills of stone with caves, lit from above and darker below
+	void fillBlock(MeshMakeData &data, PseudoRandom &pr)
+	{
+		v3s16 blockpos_nodes = data.m_blockpos * MAP_BLOCKSIZE;
+		VoxelArea area(blockpos_nodes - v3s16(1,1,1) * MAP_BLOCKSIZE,
+				blockpos_nodes + v3s16(1,1,1) * MAP_BLOCKSIZE*2 - v3s16(1,1,1));
+		data.m_vmanip.addArea(area);
+		v3s16 p;
+		for (p.Z = area.MinEdge.Z; p.Z <= area.MaxEdge.Z; p.Z++)
+		for (p.Y = area.MinEdge.Y; p.Y <= area.MaxEdge.Y; p.Y++)
+		for (p.X = area.MinEdge.X; p.X <= area.MaxEdge.X; p.X++) {
+			s16 h = 8 + 6 * noise2d_perlin(0.5 + p.X / 16.0,
+					0.5 + p.Z / 16.0, 99, 3, 0.5);
+			MapNode n(CONTENT_AIR);
+			if (p.Y <= h && noise3d_perlin(0.5 + p.X / 8.0, 0.5 + p.Y / 8.0,
+					0.5 + p.Z / 8.0, 42, 2, 0.5) < 0.2)
+				n = MapNode(CONTENT_STONE);
+			else if (pr.range(0, 200) == 0)
+				n = MapNode(CONTENT_TORCH);
+			u8 day = p.Y > h + 3 ? LIGHT_SUN : pr.range(0, LIGHT_MAX);
+			n.setLight(LIGHTBANK_DAY, day, m_ndef);
+			n.setLight(LIGHTBANK_NIGHT, pr.range(0, 3), m_ndef);
+			data.m_vmanip.setNodeNoRef(p, n);
+		}
+	}
+
+	// The corners of the faces between stone and air, as the mesher sees them
+	void getFaceCorners(MeshMakeData &data,
+			std::vector<std::pair<v3s16, v3s16> > &corners)
+	{
+		v3s16 blockpos_nodes = data.m_blockpos * MAP_BLOCKSIZE;
+		v3s16 p;
+		for (p.Z = 0; p.Z < MAP_BLOCKSIZE; p.Z++)
+		for (p.Y = 0; p.Y < MAP_BLOCKSIZE; p.Y++)
+		for (p.X = 0; p.X < MAP_BLOCKSIZE; p.X++) {
+			v3s16 pn = blockpos_nodes + p;
+			if (data.m_vmanip.getNodeRefUnsafe(pn).getContent() != CONTENT_STONE)
+				continue;
+			for (u16 d = 0; d < 6; d++) {
+				v3s16 dir = g_6dirs[d];
+				if (data.m_vmanip.getNodeRefUnsafe(pn + dir).getContent()
+						== CONTENT_STONE)
+					continue;
+				for (u16 i = 0; i < 4; i++) {
+					v3s16 corner((i & 1) ? 1 : -1, (i & 2) ? 1 : -1, 1);
+					if (dir.X != 0)
+						corner = v3s16(dir.X, corner.X, corner.Y);
+					else if (dir.Y != 0)
+						corner = v3s16(corner.X, dir.Y, corner.Y);
+					else
+						corner = v3s16(corner.X, corner.Y, dir.Z);
+					corners.push_back(std::make_pair(pn, corner));
+				}
+			}
+		}
+	}
+
+	void Run(INodeDefManager *ndef)
+	{
+		m_ndef = ndef;
+		TestGameDef gamedef(NULL, ndef, NULL);
+		PseudoRandom pr(21);
+
+		u32 blocks = 0;
+		u32 lookups = 0;
+		u32 time_plain = 0;
+		u32 time_cached = 0;
+		for (s16 i = 0; i < 16; i++) {
+			MeshMakeData data(&gamedef, false);
+			data.m_blockpos = v3s16(i % 4, -1 + i / 8, i / 4);
+			fillBlock(data, pr);
+			std::vector<std::pair<v3s16, v3s16> > corners;
+			getFaceCorners(data, corners);
+
+			std::vector<u16> plain(corners.size());
+			u32 t0 = porting::getTimeUs();
+			for (u32 j = 0; j < corners.size(); j++)
+				plain[j] = getSmoothLight(corners[j].first,
+						corners[j].second, &data);
+			u32 t1 = porting::getTimeUs();
+			data.m_smooth_light_cache.fill(&data);
+			u32 wrong = 0;
+			for (u32 j = 0; j < corners.size(); j++) {
+				if (getSmoothLight(corners[j].first, corners[j].second,
+						&data) != plain[j])
+					wrong++;
+			}
+			u32 t2 = porting::getTimeUs();
+			UASSERT(wrong == 0);
+
+			// Every corner, including those outside of faces
+			v3s16 blockpos_nodes = data.m_blockpos * MAP_BLOCKSIZE;
+			std::vector<u16> cached;
+			v3s16 c;
+			for (c.Z = 0; c.Z <= MAP_BLOCKSIZE; c.Z++)
+			for (c.Y = 0; c.Y <= MAP_BLOCKSIZE; c.Y++)
+			for (c.X = 0; c.X <= MAP_BLOCKSIZE; c.X++)
+				cached.push_back(getSmoothLight(blockpos_nodes + c,
+						v3s16(-1,-1,-1), &data));
+			data.m_smooth_light_cache.clear();
+			u32 j = 0;
+			for (c.Z = 0; c.Z <= MAP_BLOCKSIZE; c.Z++)
+			for (c.Y = 0; c.Y <= MAP_BLOCKSIZE; c.Y++)
+			for (c.X = 0; c.X <= MAP_BLOCKSIZE; c.X++) {
+				if (getSmoothLight(blockpos_nodes + c, v3s16(-1,-1,-1),
+						&data) != cached[j++])
+					wrong++;
+			}
+			UASSERT(wrong == 0);
+
+			blocks++;
+			lookups += corners.size();
+			time_plain += t1 - t0;
+			time_cached += t2 - t1;
+		}
+
+		infostream << "TestSmoothLightCache: " << lookups / blocks
+			<< " corner lookups per block, " << time_plain / blocks
+			<< " us per block uncached, " << time_cached / blocks
+			<< " us cached" << std::endl;
+	}
+
+	INodeDefManager *m_ndef;
+};
+
+struct TestMeshUpdateQueue: public TestBase
+{
+	void Run()
+	{
+		MeshUpdateQueue queue;
+		v3s16 p(1,2,3), p2(4,5,6);
+
+		queue.addBlock(p, new MeshMakeData(NULL, false), false, false);
+		QueuedMeshUpdate *q1 = queue.pop();
+		UASSERT(q1 != NULL && q1->p == p);
+
+		// A new update of a block that is being meshed is held back
+		MeshMakeData *data2 = new MeshMakeData(NULL, false);
+		queue.addBlock(p, data2, true, false);
+		queue.addBlock(p2, new MeshMakeData(NULL, false), false, false);
+		UASSERT(queue.size() == 2);
+		QueuedMeshUpdate *q2 = queue.pop();
+		UASSERT(q2 != NULL && q2->p == p2);
+		UASSERT(queue.pop() == NULL);
+		queue.done(p2);
+		delete q2;
+
+		// and can be popped once the first one is done
+		queue.done(p);
+		delete q1;
+		QueuedMeshUpdate *q3 = queue.pop();
+		UASSERT(q3 != NULL && q3->p == p);
+		UASSERT(q3->data == data2 && q3->ack_block_to_server);
+		UASSERT(queue.size() == 0);
+
+		// A held update that is released is deleted with the queue
+		queue.addBlock(p, new MeshMakeData(NULL, false), false, false);
+		UASSERT(queue.pop() == NULL);
+		queue.done(p);
+		delete q3;
+	}
+};
+#endif
+
+#if 0
+struct TestMapBlock: public TestBase
+{
+	class TC : public NodeContainer
+	{
+	public:
+
+		MapNode node;
+		bool position_valid;
+		core::list<v3s16> validity_exceptions;
+
+		TC()
+		{
+			position_valid = true;
+		}
+
+		virtual bool isValidPosition(v3s16 p)
+		{
+			//return position_valid ^ (p==position_valid_exception);
+			bool exception = false;
+			for(core::list<v3s16>::Iterator i=validity_exceptions.begin();
+					i != validity_exceptions.end(); i++)
+			{
+				if(p == *i)
+				{
+					exception = true;
+					break;
+				}
+			}
+			return exception ? !position_valid : position_valid;
+		}
+
+		virtual MapNode getNode(v3s16 p)
+		{
+			if(isValidPosition(p) == false)
+				throw InvalidPositionException();
+			return node;
+		}
+
+		virtual void setNode(v3s16 p, MapNode & n)
+		{
+			if(isValidPosition(p) == false)
+				throw InvalidPositionException();
+		};
+
+		virtual u16 nodeContainerId() const
+		{
+			return 666;
+		}
+	};
+
+	void Run()
+	{
+		TC parent;
+
+		MapBlock b(&parent, v3s16(1,1,1));
+		v3s16 relpos(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+
+		UASSERT(b.getPosRelative() == relpos);
+
+		UASSERT(b.getBox().MinEdge.X == MAP_BLOCKSIZE);
+		UASSERT(b.getBox().MaxEdge.X == MAP_BLOCKSIZE*2-1);
+		UASSERT(b.getBox().MinEdge.Y == MAP_BLOCKSIZE);
+		UASSERT(b.getBox().MaxEdge.Y == MAP_BLOCKSIZE*2-1);
+		UASSERT(b.getBox().MinEdge.Z == MAP_BLOCKSIZE);
+		UASSERT(b.getBox().MaxEdge.Z == MAP_BLOCKSIZE*2-1);
+
+		UASSERT(b.isValidPosition(v3s16(0,0,0)) == true);
+		UASSERT(b.isValidPosition(v3s16(-1,0,0)) == false);
+		UASSERT(b.isValidPosition(v3s16(-1,-142,-2341)) == false);
+		UASSERT(b.isValidPosition(v3s16(-124,142,2341)) == false);
+		UASSERT(b.isValidPosition(v3s16(MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1)) == true);
+		UASSERT(b.isValidPosition(v3s16(MAP_BLOCKSIZE-1,MAP_BLOCKSIZE,MAP_BLOCKSIZE-1)) == false);
+
+		/*
+			TODO: this method should probably be removed
+			if the block size isn't going to be set variable
+		*/
+		/*UASSERT(b.getSizeNodes() == v3s16(MAP_BLOCKSIZE,
+				MAP_BLOCKSIZE, MAP_BLOCKSIZE));*/
+
+		// Changed flag should be initially set
+		UASSERT(b.getModified() == MOD_STATE_WRITE_NEEDED);
+		b.resetModified();
+		UASSERT(b.getModified() == MOD_STATE_CLEAN);
+
+		// All nodes should have been set to
+		// .d=CONTENT_IGNORE and .getLight() = 0
+		for(u16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(u16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(u16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			//UASSERT(b.getNode(v3s16(x,y,z)).getContent() == CONTENT_AIR);
+			UASSERT(b.getNode(v3s16(x,y,z)).getContent() == CONTENT_IGNORE);
+			UASSERT(b.getNode(v3s16(x,y,z)).getLight(LIGHTBANK_DAY) == 0);
+			UASSERT(b.getNode(v3s16(x,y,z)).getLight(LIGHTBANK_NIGHT) == 0);
+		}
+
+		{
+			MapNode n(CONTENT_AIR);
+			for(u16 z=0; z<MAP_BLOCKSIZE; z++)
+			for(u16 y=0; y<MAP_BLOCKSIZE; y++)
+			for(u16 x=0; x<MAP_BLOCKSIZE; x++)
+			{
+				b.setNode(v3s16(x,y,z), n);
+			}
+		}
+
+		/*
+			Parent fetch functions
+		*/
+		parent.position_valid = false;
+		parent.node.setContent(5);
+
+		MapNode n;
+
+		// Positions in the block should still be valid
+		UASSERT(b.isValidPositionParent(v3s16(0,0,0)) == true);
+		UASSERT(b.isValidPositionParent(v3s16(MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1)) == true);
+		n = b.getNodeParent(v3s16(0,MAP_BLOCKSIZE-1,0));
+		UASSERT(n.getContent() == CONTENT_AIR);
+
+		// ...but outside the block they should be invalid
+		UASSERT(b.isValidPositionParent(v3s16(-121,2341,0)) == false);
+		UASSERT(b.isValidPositionParent(v3s16(-1,0,0)) == false);
+		UASSERT(b.isValidPositionParent(v3s16(MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1,MAP_BLOCKSIZE)) == false);
+
+		{
+			bool exception_thrown = false;
+			try{
+				// This should throw an exception
+				MapNode n = b.getNodeParent(v3s16(0,0,-1));
+			}
+			catch(InvalidPositionException &e)
+			{
+				exception_thrown = true;
+			}
+			UASSERT(exception_thrown);
+		}
+
+		parent.position_valid = true;
+		// Now the positions outside should be valid
+		UASSERT(b.isValidPositionParent(v3s16(-121,2341,0)) == true);
+		UASSERT(b.isValidPositionParent(v3s16(-1,0,0)) == true);
+		UASSERT(b.isValidPositionParent(v3s16(MAP_BLOCKSIZE-1,MAP_BLOCKSIZE-1,MAP_BLOCKSIZE)) == true);
+		n = b.getNodeParent(v3s16(0,0,MAP_BLOCKSIZE));
+		UASSERT(n.getContent() == 5);
+
+		/*
+			Set a node
+		*/
+		v3s16 p(1,2,0);
+		n.setContent(4);
+		b.setNode(p, n);
+		UASSERT(b.getNode(p).getContent() == 4);
+		//TODO: Update to new system
+		/*UASSERT(b.getNodeTile(p) == 4);
+		UASSERT(b.getNodeTile(v3s16(-1,-1,0)) == 5);*/
+
+		/*
+			propagateSunlight()
+		*/
+		// Set lighting of all nodes to 0
+		for(u16 z=0; z<MAP_BLOCKSIZE; z++){
+			for(u16 y=0; y<MAP_BLOCKSIZE; y++){
+				for(u16 x=0; x<MAP_BLOCKSIZE; x++){
+					MapNode n = b.getNode(v3s16(x,y,z));
+					n.setLight(LIGHTBANK_DAY, 0);
 					n.setLight(LIGHTBANK_NIGHT, 0);
 					b.setNode(v3s16(x,y,z), n);
 				}
@@ -1695,6 +3467,121 @@ struct TestCollision: public TestBase
 	}
 };
 
+class TestCollisionEnvironment : public Environment
+{
+public:
+	TestCollisionEnvironment(IGameDef *gamedef):
+		m_map(dummyout, gamedef)
+	{}
+	virtual void step(f32 dtime) {}
+	virtual Map & getMap() { return m_map; }
+
+private:
+	Map m_map;
+};
+
+struct TestCollisionMove: public TestBase
+{
+	void Run()
+	{
+		IWritableNodeDefManager *ndef = createNodeDefManager();
+		TestGameDef gamedef(NULL, ndef, NULL);
+
+		ContentFeatures f;
+		f.name = "test:stone";
+		content_t c_stone = ndef->set(f.name, f);
+
+		f = ContentFeatures();
+		f.name = "test:slab";
+		f.drawtype = NDT_NODEBOX;
+		f.param_type_2 = CPT2_FACEDIR;
+		f.node_box.type = NODEBOX_FIXED;
+		f.node_box.fixed.push_back(aabb3f(-BS/2, -BS/2, -BS/2, BS/2, 0, BS/2));
+		f.node_box.fixed.push_back(aabb3f(-BS/2, 0, 0, BS/2, BS/4, BS/2));
+		content_t c_slab = ndef->set(f.name, f);
+
+		f = ContentFeatures();
+		f.name = "test:trampoline";
+		f.groups["bouncy"] = 70;
+		content_t c_trampoline = ndef->set(f.name, f);
+
+		// The cached boxes match the ones computed from the node
+		const ContentFeatures &slab = ndef->get(c_slab);
+		for (u32 param2 = 0; param2 < 256; param2++) {
+			std::vector<aabb3f> boxes =
+					MapNode(c_slab, 0, param2).getCollisionBoxes(ndef);
+			const std::vector<aabb3f> &cached = slab.getCollisionBoxes(param2);
+			UASSERT(cached.size() == boxes.size());
+			for (size_t i = 0; i < boxes.size(); i++) {
+				UASSERT(cached[i].MinEdge == boxes[i].MinEdge);
+				UASSERT(cached[i].MaxEdge == boxes[i].MaxEdge);
+			}
+		}
+		UASSERT(ndef->get(c_trampoline).bouncy == 70);
+		UASSERT(ndef->get(c_stone).bouncy == 0);
+
+		/*
+			A 32x16x32 node area with a stone floor at y=0 and random
+			slabs and trampolines on it.  Around it everything is
+			unloaded, which collides like solid nodes.
+		*/
+		TestCollisionEnvironment env(&gamedef);
+		Map &map = env.getMap();
+		PseudoRandom pr(17);
+		for (s16 x = 0; x < 2; x++)
+		for (s16 z = 0; z < 2; z++) {
+			MapSector *sector = new ServerMapSector(&map, v2s16(x, z), &gamedef);
+			(*map.getSectorsPtr())[v2s16(x, z)] = sector;
+			MapBlock *block = sector->createBlankBlock(0);
+			v3s16 p;
+			for (p.X = 0; p.X < MAP_BLOCKSIZE; p.X++)
+			for (p.Y = 0; p.Y < MAP_BLOCKSIZE; p.Y++)
+			for (p.Z = 0; p.Z < MAP_BLOCKSIZE; p.Z++) {
+				MapNode n(CONTENT_AIR);
+				if (p.Y == 0)
+					n = MapNode(c_stone);
+				else if (p.Y == 1 && pr.range(0, 9) == 0)
+					n = MapNode(c_slab, 0, pr.range(0, 23));
+				else if (p.Y == 1 && pr.range(0, 29) == 0)
+					n = MapNode(c_trampoline);
+				block->setNodeNoCheck(p, n);
+			}
+		}
+
+		const u32 count = 300;
+		const u32 steps = 100;
+		const f32 dtime = 0.02;
+		aabb3f box(-BS*0.3, -BS*0.5, -BS*0.3, BS*0.3, BS*0.5, BS*0.3);
+		std::vector<v3f> pos(count), speed(count);
+		for (u32 i = 0; i < count; i++) {
+			pos[i] = v3f(pr.range(1, 30), pr.range(3, 6), pr.range(1, 30)) * BS;
+			speed[i] = v3f(pr.range(-30, 30), 0, pr.range(-30, 30)) * BS / 10;
+		}
+
+		u32 t0 = porting::getTimeUs();
+		for (u32 step = 0; step < steps; step++)
+		for (u32 i = 0; i < count; i++) {
+			v3f accel(0, -9.81 * BS, 0);
+			collisionMoveSimple(&env, &gamedef, BS * 0.25, box, BS * 0.6,
+					dtime, pos[i], speed[i], accel, NULL, false);
+		}
+		u32 t1 = porting::getTimeUs();
+
+		// Everything ended up above the floor and inside the area
+		for (u32 i = 0; i < count; i++) {
+			UASSERT(pos[i].Y + box.MinEdge.Y >= BS/2 - 0.01 * BS);
+			UASSERT(pos[i].X > -BS/2 && pos[i].X < 31.5 * BS);
+			UASSERT(pos[i].Z > -BS/2 && pos[i].Z < 31.5 * BS);
+		}
+
+		infostream << "TestCollisionMove: "
+			<< (t1 - t0) * 1000.0 / (count * steps)
+			<< " ns per collisionMoveSimple call" << std::endl;
+
+		delete ndef;
+	}
+};
+
 struct TestSocket: public TestBase
 {
 	void Run()
@@ -1797,6 +3684,33 @@ struct TestSocket: public TestBase
 				UASSERT(sender.getAddress().sin_addr.s_addr ==
 						Address(127, 0, 0, 1, 0).getAddress().sin_addr.s_addr);
 			}
+
+			// Batched send and receive
+			Address destination = sender;
+			destination.setPort(port);
+			u8 sendbuffers[3][4];
+			UDPDatagram out[3];
+			for (int i = 0; i < 3; i++) {
+				memset(sendbuffers[i], 'a' + i, sizeof(sendbuffers[i]));
+				out[i].address = destination;
+				out[i].data = sendbuffers[i];
+				out[i].size = i + 1;
+			}
+			UASSERT(socket.SendBatch(out, 3) == 3);
+
+			sleep_ms(50);
+
+			u8 rcvbuffers[UDP_BATCH_MAX][16];
+			UDPDatagram in[UDP_BATCH_MAX];
+			for (int i = 0; i < UDP_BATCH_MAX; i++)
+				in[i].data = rcvbuffers[i];
+			UASSERT(socket.WaitData(50));
+			UASSERT(socket.ReceiveBatch(in, UDP_BATCH_MAX, 16) == 3);
+			for (int i = 0; i < 3; i++) {
+				UASSERT(in[i].size == i + 1);
+				UASSERT(in[i].data[0] == 'a' + i);
+				UASSERT(in[i].address.getPort() == port);
+			}
 		}
 	}
 };
@@ -2115,6 +4029,153 @@ struct TestConnection: public TestBase
 	}
 };
 
+struct TestReliablePacketBuffer : public TestBase
+{
+	con::BufferedPacket makeReliable(u16 seqnum)
+	{
+		Address address(127, 0, 0, 1, 30000);
+		u8 data[4] = { TYPE_RELIABLE, 0, 0, 42 };
+		writeU16(&data[1], seqnum);
+		return con::makePacket(address, data, sizeof(data), 0x4f457403, 2, 0);
+	}
+
+	u16 seqnumOf(con::BufferedPacket &p)
+	{
+		return readU16(&p.data[BASE_HEADER_SIZE + 1]);
+	}
+
+	/*
+		Sending side: a full window of packets in flight, acknowledged
+		in random order after a random delay. One in ten is lost and only
+		acknowledged after it has been resent.
+	*/
+	void runSender(u32 count)
+	{
+		const u16 window = 512;
+		const float resend_timeout = 0.5;
+		PseudoRandom pr(7);
+		con::ReliablePacketBuffer buf;
+		// Acknowledgement time of each packet in flight; -1 if lost
+		std::map<u16, float> inflight;
+		float now = 0;
+		u16 next = SEQNUM_INITIAL;
+		u32 sent = 0, acked = 0;
+
+		while (acked < count) {
+			while (sent < count && buf.size() < window) {
+				con::BufferedPacket p = makeReliable(next);
+				// Same window the send thread passes
+				buf.insert(p, next + 1 - 0x8000);
+				inflight[next] = pr.range(0, 9) == 0 ? -1 :
+						now + pr.range(20, 100) / 1000.0;
+				next++;
+				sent++;
+			}
+
+			now += 0.01;
+			buf.incrementTimeouts(0.01);
+
+			std::list<con::BufferedPacket> timed_outs =
+					buf.getTimedOuts(resend_timeout, 1000);
+			for (std::list<con::BufferedPacket>::iterator
+					i = timed_outs.begin(); i != timed_outs.end(); ++i) {
+				UASSERT(i->time >= resend_timeout);
+				float &ack_at = inflight[seqnumOf(*i)];
+				if (ack_at < 0)
+					ack_at = now + 0.05;
+			}
+
+			std::vector<u16> to_ack;
+			for (std::map<u16, float>::iterator
+					i = inflight.begin(); i != inflight.end(); ++i) {
+				if (i->second >= 0 && i->second <= now)
+					to_ack.push_back(i->first);
+			}
+			for (size_t i = 0; i < to_ack.size(); i++) {
+				con::BufferedPacket p = buf.popSeqnum(to_ack[i]);
+				UASSERT(seqnumOf(p) == to_ack[i]);
+				inflight.erase(to_ack[i]);
+				acked++;
+			}
+
+			UASSERT(buf.size() == inflight.size());
+			u16 first;
+			if (buf.getFirstSeqnum(first)) {
+				// Oldest seqnum still in flight
+				u16 expected = next - 1;
+				for (std::map<u16, float>::iterator
+						i = inflight.begin(); i != inflight.end(); ++i) {
+					if (con::seqnum_higher(expected, i->first))
+						expected = i->first;
+				}
+				UASSERT(first == expected);
+			}
+		}
+		UASSERT(buf.empty());
+	}
+
+	/*
+		Receiving side: packets arrive reordered within groups of 64,
+		some of them twice, and are popped in order.
+	*/
+	void runReceiver(u32 count)
+	{
+		PseudoRandom pr(11);
+		con::ReliablePacketBuffer buf;
+		u16 expected = SEQNUM_INITIAL;
+		u16 next = SEQNUM_INITIAL;
+		u32 received = 0;
+
+		while (received < count) {
+			std::vector<u16> group;
+			for (u32 i = 0; i < 64 && received + group.size() < count; i++)
+				group.push_back(next++);
+			for (size_t i = group.size(); i > 1; i--)
+				std::swap(group[i - 1], group[pr.range(0, i - 1)]);
+
+			for (size_t i = 0; i < group.size(); i++) {
+				if (group[i] == expected) {
+					// In order; handled without buffering
+					expected++;
+					received++;
+				} else if (con::seqnum_higher(group[i], expected)) {
+					con::BufferedPacket p = makeReliable(group[i]);
+					buf.insert(p, expected);
+					if (pr.range(0, 19) == 0)
+						buf.insert(p, expected);
+				}
+
+				u16 first;
+				while (buf.getFirstSeqnum(first) && first == expected) {
+					con::BufferedPacket p = buf.popFirst();
+					UASSERT(seqnumOf(p) == expected);
+					expected++;
+					received++;
+				}
+			}
+		}
+		UASSERT(buf.empty());
+		UASSERT(expected == (u16)(SEQNUM_INITIAL + count));
+	}
+
+	void Run()
+	{
+		runSender(5000);
+		runReceiver(5000);
+
+		// Not a test; tells how long a packet takes on this machine
+		u32 t0 = porting::getTimeUs();
+		runSender(50000);
+		u32 t1 = porting::getTimeUs();
+		runReceiver(50000);
+		u32 t2 = porting::getTimeUs();
+		infostream << "TestReliablePacketBuffer: "
+			<< (t1 - t0) * 1000.0 / 50000 << " ns per sent packet, "
+			<< (t2 - t1) * 1000.0 / 50000 << " ns per received packet"
+			<< std::endl;
+	}
+};
+
 struct TestProfiler : public TestBase
 {
 	void Run()
@@ -2149,6 +4210,275 @@ struct TestProfiler : public TestBase
 	}
 };
 
+struct TestActiveObjectGrid : public TestBase
+{
+	class GridObject : public ServerActiveObject
+	{
+	public:
+		GridObject(u16 id, v3f pos):
+			ServerActiveObject(NULL, pos)
+		{
+			setId(id);
+		}
+		ActiveObjectType getType() const
+		{ return ACTIVEOBJECT_TYPE_TEST; }
+		bool getCollisionBox(aabb3f *toset)
+		{ return false; }
+		bool collideWithObjects()
+		{ return false; }
+	};
+
+	// Compares the grid against checking every object
+	void checkQuery(ActiveObjectGrid &grid,
+			std::vector<GridObject*> &objects, v3f pos, float radius)
+	{
+		std::set<u16> expected;
+		for (size_t i = 0; i < objects.size(); i++) {
+			if (objects[i] == NULL)
+				continue;
+			if (objects[i]->getBasePosition().getDistanceFrom(pos) <= radius)
+				expected.insert(objects[i]->getId());
+		}
+
+		std::vector<ServerActiveObject*> nearby;
+		grid.getObjectsNear(pos, radius, nearby);
+		std::set<u16> found;
+		for (size_t i = 0; i < nearby.size(); i++) {
+			if (nearby[i]->getBasePosition().getDistanceFrom(pos) <= radius)
+				found.insert(nearby[i]->getId());
+		}
+		UASSERT(found == expected);
+	}
+
+	void Run()
+	{
+		PseudoRandom pr(13);
+		ActiveObjectGrid grid;
+		std::vector<GridObject*> objects;
+
+		for (u16 id = 1; id <= 300; id++) {
+			v3f pos(pr.range(-1500, 1500), pr.range(-500, 500),
+					pr.range(-1500, 1500));
+			objects.push_back(new GridObject(id, pos));
+			grid.insert(objects.back());
+		}
+
+		float radii[] = {0, 10, 80, 300, 5000};
+		for (size_t r = 0; r < ARRLEN(radii); r++)
+		for (int i = 0; i < 20; i++) {
+			v3f pos(pr.range(-1500, 1500), pr.range(-500, 500),
+					pr.range(-1500, 1500));
+			checkQuery(grid, objects, pos, radii[r]);
+		}
+		checkQuery(grid, objects, objects[0]->getBasePosition(), 0);
+
+		// Move some objects, remove others
+		for (size_t i = 0; i < objects.size(); i++) {
+			if (i % 3 == 0) {
+				v3f pos = objects[i]->getBasePosition()
+						+ v3f(pr.range(-100, 100), 0, pr.range(-100, 100));
+				objects[i]->setBasePosition(pos);
+				grid.update(objects[i]);
+			} else if (i % 3 == 1) {
+				// The environment deletes objects before removing them
+				u16 id = objects[i]->getId();
+				delete objects[i];
+				objects[i] = NULL;
+				grid.remove(id);
+			}
+		}
+
+		for (size_t r = 0; r < ARRLEN(radii); r++)
+		for (int i = 0; i < 20; i++) {
+			v3f pos(pr.range(-1500, 1500), pr.range(-500, 500),
+					pr.range(-1500, 1500));
+			checkQuery(grid, objects, pos, radii[r]);
+		}
+
+		grid.clear();
+		std::vector<ServerActiveObject*> nearby;
+		UASSERT(grid.getObjectsNear(v3f(0, 0, 0), 5000, nearby) == 0);
+
+		for (size_t i = 0; i < objects.size(); i++)
+			delete objects[i];
+	}
+};
+
+struct TestActiveObjectMessageFrame : public TestBase
+{
+	/*
+		What the server used to build for a client, one message at a
+		time, leaving out skippable ones not divisible by divisor
+	*/
+	void encodeReference(const std::vector<ActiveObjectMessage> &messages,
+			const std::set<u16> &known_objects, const std::set<u16> &far,
+			u16 divisor, std::string &reliable, std::string &unreliable)
+	{
+		std::map<u16, std::vector<ActiveObjectMessage> > by_object;
+		for (size_t i = 0; i < messages.size(); i++)
+			by_object[messages[i].id].push_back(messages[i]);
+
+		for (std::map<u16, std::vector<ActiveObjectMessage> >::iterator
+				i = by_object.begin(); i != by_object.end(); ++i) {
+			if (known_objects.find(i->first) == known_objects.end())
+				continue;
+			for (size_t j = 0; j < i->second.size(); j++) {
+				const ActiveObjectMessage &aom = i->second[j];
+				if (aom.skippable && far.count(aom.id) &&
+						aom.skip_seq % divisor != 0)
+					continue;
+				char buf[2];
+				writeU16((u8*)&buf[0], aom.id);
+				std::string new_data(buf, 2);
+				new_data += serializeString(aom.datastring);
+				if (aom.reliable)
+					reliable += new_data;
+				else
+					unreliable += new_data;
+			}
+		}
+	}
+
+	void Run()
+	{
+		PseudoRandom pr(7);
+		ActiveObjectMessageFrame frame;
+		// Only the far tier thins out updates here
+		frame.setTier(1, 100 * BS, 1);
+		frame.setTier(2, 200 * BS, 3);
+
+		std::map<u16, u32> skip_seqs;
+		for (int step = 0; step < 3; step++) {
+			std::vector<ActiveObjectMessage> messages;
+			std::set<u16> far;
+			frame.clear();
+			for (int i = 0; i < 400; i++) {
+				std::string data(pr.range(0, 40), 'a' + pr.range(0, 25));
+				u16 id = pr.range(1, 60);
+				messages.push_back(ActiveObjectMessage(id,
+						pr.range(0, 1), data));
+				ActiveObjectMessage &aom = messages.back();
+				// Objects above 30 move and are far from the client
+				if (!aom.reliable && id > 30) {
+					aom.skippable = true;
+					aom.skip_seq = skip_seqs[id]++;
+					far.insert(id);
+				}
+				frame.add(aom, v3f(id * 10 * BS, 0, 0));
+			}
+			frame.encode();
+			UASSERT(!frame.empty());
+
+			// Clients knowing few, some and most of the objects
+			int known_counts[] = {0, 1, 20, 150, 1000};
+			for (size_t k = 0; k < ARRLEN(known_counts); k++) {
+				std::set<u16> known_objects;
+				for (int i = 0; i < known_counts[k]; i++)
+					known_objects.insert(pr.range(1, 90));
+
+				std::string reliable, unreliable;
+				frame.gather(known_objects, reliable, unreliable);
+				std::string ref_reliable, ref_unreliable;
+				encodeReference(messages, known_objects, far, 1,
+						ref_reliable, ref_unreliable);
+				UASSERT(reliable == ref_reliable);
+				UASSERT(unreliable == ref_unreliable);
+
+				reliable.clear();
+				unreliable.clear();
+				frame.gather(known_objects, v3f(0, 0, 0),
+						reliable, unreliable);
+				ref_reliable.clear();
+				ref_unreliable.clear();
+				encodeReference(messages, known_objects, far, 3,
+						ref_reliable, ref_unreliable);
+				UASSERT(reliable == ref_reliable);
+				UASSERT(unreliable == ref_unreliable);
+			}
+
+			u32 sent, skipped, bytes;
+			frame.getTierStats(1, sent, skipped, bytes);
+			UASSERT(sent == 0 && skipped == 0 && bytes == 0);
+			frame.getTierStats(2, sent, skipped, bytes);
+			UASSERT(skipped > 0 && sent > 0);
+		}
+
+		frame.clear();
+		frame.encode();
+		UASSERT(frame.empty());
+	}
+};
+
+struct TestNoise : public TestBase
+{
+	// perlinMap2D/3D with and without the SSE2 kernels
+	void compareMaps(NoiseParams *np, int sx, int sy, int sz)
+	{
+		Noise a(np, 1337, sx, sy, sz);
+		Noise b(np, 1337, sx, sy, sz);
+		size_t bufsize = sx * sy * sz;
+
+		noise_set_sse2_enabled(true);
+		if (sz > 1)
+			a.perlinMap3D(-103.5, 17.25, 250.75);
+		else
+			a.perlinMap2D(-103.5, 250.75);
+
+		noise_set_sse2_enabled(false);
+		if (sz > 1)
+			b.perlinMap3D(-103.5, 17.25, 250.75);
+		else
+			b.perlinMap2D(-103.5, 250.75);
+		noise_set_sse2_enabled(true);
+
+		UASSERT(memcmp(a.result, b.result, bufsize * sizeof(float)) == 0);
+	}
+
+	void Run()
+	{
+		// On lattice points the maps give the raw lattice noise
+		NoiseParams np_lattice(0, 1, v3f(1, 1, 1), 5, 1, 0.5, 2.0);
+		Noise n2d(&np_lattice, 100, 9, 7);
+		n2d.perlinMap2D(-4, 30);
+		for (int y = 0; y != 7; y++)
+		for (int x = 0; x != 9; x++)
+			UASSERT(n2d.result[y * 9 + x] == noise2d(x - 4, y + 30, 105));
+
+		Noise n3d(&np_lattice, 100, 9, 7, 5);
+		n3d.perlinMap3D(-4, 30, -2);
+		for (int z = 0; z != 5; z++)
+		for (int y = 0; y != 7; y++)
+		for (int x = 0; x != 9; x++)
+			UASSERT(n3d.result[(z * 7 + y) * 9 + x] ==
+				noise3d(x - 4, y + 30, z - 2, 105));
+
+		// Odd sizes, to get partly filled vectors at the row ends
+		NoiseParams np(0.5, 2, v3f(13.7, 9.3, 21.1), 42, 3, 0.6, 2.0);
+		compareMaps(&np, 37, 23, 1);
+		compareMaps(&np, 19, 17, 15);
+		np.flags = NOISE_FLAG_EASED | NOISE_FLAG_ABSVALUE;
+		compareMaps(&np, 37, 23, 1);
+		compareMaps(&np, 19, 17, 15);
+		np.flags = 0;
+		compareMaps(&np, 37, 23, 1);
+
+		// Not a test; tells how long a sample takes on this machine
+		NoiseParams np_bench(0, 1, v3f(100, 100, 100), 5, 3, 0.6, 2.0);
+		Noise bench(&np_bench, 1, 80, 80, 80);
+		for (int i = 0; i != 2; i++) {
+			noise_set_sse2_enabled(i == 0);
+			u32 t0 = porting::getTimeUs();
+			bench.perlinMap3D(0, 0, 0);
+			u32 t1 = porting::getTimeUs();
+			infostream << "TestNoise: perlinMap3D, 3 octaves, "
+				<< (i == 0 ? "SSE2" : "scalar") << ": "
+				<< (t1 - t0) * 1000.0 / (80 * 80 * 80) << " ns per sample"
+				<< std::endl;
+		}
+		noise_set_sse2_enabled(true);
+	}
+};
+
 #define TEST(X) do {\
 	X x;\
 	infostream<<"Running " #X <<std::endl;\
@@ -2187,17 +4517,38 @@ void run_tests()
 	TEST(TestSerialization);
 	TEST(TestNodedefSerialization);
 	TEST(TestProfiler);
+	TEST(TestNoise);
+	TEST(TestActiveObjectGrid);
+	TEST(TestActiveObjectMessageFrame);
 	TESTPARAMS(TestMapNode, ndef);
 	TESTPARAMS(TestVoxelManipulator, ndef);
 	TESTPARAMS(TestVoxelAlgorithms, ndef);
 	TESTPARAMS(TestInventory, idef);
+	TEST(TestCraftDef);
+	TESTPARAMS(TestMapBlockContentCounts, ndef);
+	TESTPARAMS(TestMapBlockNetworkCache, ndef);
+	TESTPARAMS(TestMapSaver, ndef);
+	TEST(TestDatabase);
+	TESTPARAMS(TestMapBlockIndex, ndef);
+	TESTPARAMS(TestLightSpread, ndef);
+	TESTPARAMS(TestABMThreading, ndef);
+	TESTPARAMS(TestLiquidTransform, ndef);
+	TESTPARAMS(TestEmergeQueue, ndef);
+	TEST(TestVoxelManipGetData);
+#ifndef SERVER
+	TESTPARAMS(TestMeshInputFill, ndef);
+	TESTPARAMS(TestSmoothLightCache, ndef);
+	TEST(TestMeshUpdateQueue);
+#endif
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
 	TEST(TestCollision);
+	TEST(TestCollisionMove);
 	if(INTERNET_SIMULATOR == false){
 		TEST(TestSocket);
 		dout_con << "=== BEGIN RUNNING UNIT TESTS FOR CONNECTION ===" << std::endl;
 		TEST(TestConnection);
+		TEST(TestReliablePacketBuffer);
 		dout_con << "=== END RUNNING UNIT TESTS FOR CONNECTION ===" << std::endl;
 	}
 
@@ -0,0 +1,98 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "thread.h"
+
+#include "../debug.h"
+#include "../log.h"
+
+class WorkerThread : public JThread
+{
+public:
+	WorkerThread(MutexedQueue<WorkerJob *> *jobs, JSemaphore *done,
+			const std::string &name):
+		m_jobs(jobs),
+		m_done(done),
+		m_name(name)
+	{
+	}
+
+	void *Thread()
+	{
+		ThreadStarted();
+		log_register_thread(m_name);
+		DSTACK(__FUNCTION_NAME);
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		porting::setThreadName(m_name.c_str());
+
+		while(!StopRequested()) {
+			// NULL is pushed to wake the thread up for stopping
+			WorkerJob *job = m_jobs->pop_frontNoEx();
+			if(job == NULL)
+				continue;
+			job->run();
+			m_done->Post();
+		}
+
+		END_DEBUG_EXCEPTION_HANDLER(errorstream)
+		log_deregister_thread();
+		return NULL;
+	}
+
+private:
+	MutexedQueue<WorkerJob *> *m_jobs;
+	JSemaphore *m_done;
+	std::string m_name;
+};
+
+WorkerPool::WorkerPool(u16 num_threads, const std::string &name)
+{
+	for(u16 i = 0; i < num_threads; i++) {
+		WorkerThread *thread = new WorkerThread(&m_jobs, &m_done, name);
+		thread->Start();
+		m_threads.push_back(thread);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	// Stop all threads before waking them up, so that each of them
+	// exits on the first NULL it gets
+	for(size_t i = 0; i < m_threads.size(); i++)
+		m_threads[i]->Stop();
+	for(size_t i = 0; i < m_threads.size(); i++)
+		m_jobs.push_back(NULL);
+	for(size_t i = 0; i < m_threads.size(); i++) {
+		m_threads[i]->Wait();
+		delete m_threads[i];
+	}
+}
+
+void WorkerPool::waitQueued(size_t count)
+{
+	// Help out instead of just waiting
+	while(WorkerJob *job = m_jobs.pop_frontNoEx(0)) {
+		job->run();
+		m_done.Post();
+	}
+
+	for(size_t i = 0; i < count; i++)
+		m_done.Wait();
+}
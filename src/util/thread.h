@@ -24,7 +24,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "../jthread/jthread.h"
 #include "../jthread/jmutex.h"
 #include "../jthread/jmutexautolock.h"
+#include "../jthread/jsemaphore.h"
 #include "porting.h"
+#include "container.h"
+#include <string>
+#include <vector>
 
 template<typename T>
 class MutexedVariable
@@ -208,5 +212,45 @@ class RequestQueue
 	MutexedQueue< GetRequest<Key, T, Caller, CallerData> > m_queue;
 };
 
-#endif
+/*
+	A unit of work for WorkerPool
+*/
+class WorkerJob
+{
+public:
+	virtual ~WorkerJob() {}
 
+	// Called from a worker thread or from the thread calling WorkerPool::run()
+	virtual void run() = 0;
+};
+
+class WorkerThread;
+
+/*
+	A fixed set of threads that run batches of independent jobs.
+	run() returns once every job of the batch is done. The calling thread
+	works on the batch too instead of just waiting.
+*/
+class WorkerPool
+{
+public:
+	WorkerPool(u16 num_threads, const std::string &name);
+	~WorkerPool();
+
+	template<typename Job>
+	void run(const std::vector<Job *> &jobs)
+	{
+		for(size_t i = 0; i < jobs.size(); i++)
+			m_jobs.push_back(jobs[i]);
+		waitQueued(jobs.size());
+	}
+
+private:
+	void waitQueued(size_t count);
+
+	std::vector<WorkerThread *> m_threads;
+	MutexedQueue<WorkerJob *> m_jobs;
+	JSemaphore m_done;
+};
+
+#endif
@@ -21,8 +21,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "map.h"
 #include "gettime.h"
 #include "nodedef.h"
+#include "voxelalgorithms.h"
 #include "util/timetaker.h"
 #include <string.h>  // memcpy, memset
+#include <algorithm>  // std::swap
 
 /*
 	Debug stuff
@@ -213,6 +215,26 @@ void VoxelManipulator::addArea(const VoxelArea &area)
 	//dstream<<"addArea done"<<std::endl;
 }
 
+void VoxelManipulator::resetArea(const VoxelArea &area)
+{
+	s32 new_size = area.getVolume();
+	if (m_data == NULL || m_area.getVolume() != new_size) {
+		clear();
+		addArea(area);
+		return;
+	}
+
+	m_area = area;
+	memset(m_flags, VOXELFLAG_NO_DATA, new_size);
+}
+
+void VoxelManipulator::swap(VoxelManipulator &other)
+{
+	std::swap(m_area, other.m_area);
+	std::swap(m_data, other.m_data);
+	std::swap(m_flags, other.m_flags);
+}
+
 void VoxelManipulator::copyFrom(MapNode *src, const VoxelArea& src_area,
 		v3s16 from_pos, v3s16 to_pos, v3s16 size)
 {
@@ -225,8 +247,7 @@ void VoxelManipulator::copyFrom(MapNode *src, const VoxelArea& src_area,
 	 *
 	 * src_step and dest_step is the amount required to be added to our index
 	 * every time y increments. Because the destination area may be larger
-	 * than the source area we need one additional variable (otherwise we could
-	 * just continue adding dest_step as is done for the source data): dest_mod.
+	 * than the copied box we need one additional variable: dest_mod.
 	 * dest_mod is the difference in size between a "row" in the source data
 	 * and a "row" in the destination data (I am using the term row loosely
 	 * and for illustrative purposes). E.g.
@@ -235,7 +256,8 @@ void VoxelManipulator::copyFrom(MapNode *src, const VoxelArea& src_area,
 	 * dest      <--------------------------------------------->
 	 *
 	 * dest_mod (it's essentially a modulus) is added to the destination index
-	 * after every full iteration of the y span.
+	 * after every full iteration of the y span. src_mod is the same for the
+	 * source, for when only a part of src_area is copied.
 	 *
 	 * This method falls under the category "linear array and incrementing
 	 * index".
@@ -246,6 +268,9 @@ void VoxelManipulator::copyFrom(MapNode *src, const VoxelArea& src_area,
 	s32 dest_mod = m_area.index(to_pos.X, to_pos.Y, to_pos.Z + 1)
 			- m_area.index(to_pos.X, to_pos.Y, to_pos.Z)
 			- dest_step * size.Y;
+	s32 src_mod = src_area.index(from_pos.X, from_pos.Y, from_pos.Z + 1)
+			- src_area.index(from_pos.X, from_pos.Y, from_pos.Z)
+			- src_step * size.Y;
 
 	s32 i_src = src_area.index(from_pos.X, from_pos.Y, from_pos.Z);
 	s32 i_local = m_area.index(to_pos.X, to_pos.Y, to_pos.Z);
@@ -257,6 +282,7 @@ void VoxelManipulator::copyFrom(MapNode *src, const VoxelArea& src_area,
 			i_src += src_step;
 			i_local += dest_step;
 		}
+		i_src += src_mod;
 		i_local += dest_mod;
 	}
 }
@@ -325,86 +351,10 @@ void VoxelManipulator::clearFlag(u8 flags)
 			<<volume<<" nodes"<<std::endl;*/
 }
 
-void VoxelManipulator::unspreadLight(enum LightBank bank, v3s16 p, u8 oldlight,
-		std::set<v3s16> & light_sources, INodeDefManager *nodemgr)
-{
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	VoxelArea voxel_area(p - v3s16(1,1,1), p + v3s16(1,1,1));
-	addArea(voxel_area);
-
-	// Loop through 6 neighbors
-	for(u16 i=0; i<6; i++)
-	{
-		// Get the position of the neighbor node
-		v3s16 n2pos = p + dirs[i];
-
-		u32 n2i = m_area.index(n2pos);
-
-		if(m_flags[n2i] & VOXELFLAG_NO_DATA)
-			continue;
-
-		MapNode &n2 = m_data[n2i];
-
-		/*
-			If the neighbor is dimmer than what was specified
-			as oldlight (the light of the previous node)
-		*/
-		u8 light2 = n2.getLight(bank, nodemgr);
-		if(light2 < oldlight)
-		{
-			/*
-				And the neighbor is transparent and it has some light
-			*/
-			if(nodemgr->get(n2).light_propagates && light2 != 0)
-			{
-				/*
-					Set light to 0 and add to queue
-				*/
-
-				n2.setLight(bank, 0, nodemgr);
-
-				unspreadLight(bank, n2pos, light2, light_sources, nodemgr);
-
-				/*
-					Remove from light_sources if it is there
-					NOTE: This doesn't happen nearly at all
-				*/
-				/*if(light_sources.find(n2pos))
-				{
-					std::cout<<"Removed from light_sources"<<std::endl;
-					light_sources.remove(n2pos);
-				}*/
-			}
-		}
-		else{
-			light_sources.insert(n2pos);
-		}
-	}
-}
-
-#if 1
 /*
-	Goes recursively through the neighbours of the node.
-
-	Alters only transparent nodes.
-
-	If the lighting of the neighbour is lower than the lighting of
-	the node was (before changing it to 0 at the step before), the
-	lighting of the neighbour is set to 0 and then the same stuff
-	repeats for the neighbour.
-
-	The ending nodes of the routine are stored in light_sources.
-	This is useful when a light is removed. In such case, this
-	routine can be called for the light node and then again for
-	light_sources to re-light the area without the removed light.
+	Sets dark the nodes that were lit from from_nodes; see
+	voxalgo::unspreadLight(). The nodes at the edge of the darkened area
+	are put in light_sources, to spread light back into it.
 
 	values of from_nodes are lighting values.
 */
@@ -415,307 +365,52 @@ void VoxelManipulator::unspreadLight(enum LightBank bank,
 	if(from_nodes.empty())
 		return;
 
+	voxalgo::VoxelLightNodes nodes(*this, m_area, VOXELFLAG_NO_DATA);
+	voxalgo::LightQueue<u32> unlight_from;
+	voxalgo::LightQueue<u32> relight;
+
 	for(std::map<v3s16, u8>::iterator j = from_nodes.begin();
 		j != from_nodes.end(); ++j)
 	{
-		unspreadLight(bank, j->first, j->second, light_sources, nodemgr);
-	}
-}
-#endif
-
-#if 0
-/*
-	Goes recursively through the neighbours of the node.
-
-	Alters only transparent nodes.
-
-	If the lighting of the neighbour is lower than the lighting of
-	the node was (before changing it to 0 at the step before), the
-	lighting of the neighbour is set to 0 and then the same stuff
-	repeats for the neighbour.
-
-	The ending nodes of the routine are stored in light_sources.
-	This is useful when a light is removed. In such case, this
-	routine can be called for the light node and then again for
-	light_sources to re-light the area without the removed light.
-
-	values of from_nodes are lighting values.
-*/
-void VoxelManipulator::unspreadLight(enum LightBank bank,
-		core::map<v3s16, u8> & from_nodes,
-		core::map<v3s16, bool> & light_sources)
-{
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	if(from_nodes.size() == 0)
-		return;
-
-	core::map<v3s16, u8> unlighted_nodes;
-	core::map<v3s16, u8>::Iterator j;
-	j = from_nodes.getIterator();
-
-	for(; j.atEnd() == false; j++)
-	{
-		v3s16 pos = j.getNode()->getKey();
-
-		addArea(VoxelArea(pos - v3s16(1,1,1), pos + v3s16(1,1,1)));
-
-		//MapNode &n = m_data[m_area.index(pos)];
-
-		u8 oldlight = j.getNode()->getValue();
-
-		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++)
-		{
-			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-
-			u32 n2i = m_area.index(n2pos);
-
-			if(m_flags[n2i] & VOXELFLAG_NO_DATA)
-				continue;
-
-			MapNode &n2 = m_data[n2i];
-
-			/*
-				If the neighbor is dimmer than what was specified
-				as oldlight (the light of the previous node)
-			*/
-			if(n2.getLight(bank, nodemgr) < oldlight)
-			{
-				/*
-					And the neighbor is transparent and it has some light
-				*/
-				if(nodemgr->get(n2).light_propagates && n2.getLight(bank, nodemgr) != 0)
-				{
-					/*
-						Set light to 0 and add to queue
-					*/
-
-					u8 current_light = n2.getLight(bank, nodemgr);
-					n2.setLight(bank, 0);
-
-					unlighted_nodes.insert(n2pos, current_light);
-
-					/*
-						Remove from light_sources if it is there
-						NOTE: This doesn't happen nearly at all
-					*/
-					/*if(light_sources.find(n2pos))
-					{
-						std::cout<<"Removed from light_sources"<<std::endl;
-						light_sources.remove(n2pos);
-					}*/
-				}
-			}
-			else{
-				light_sources.insert(n2pos, true);
-			}
-		}
-	}
-
-	/*dstream<<"unspreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(unlighted_nodes.size() > 0)
-		unspreadLight(bank, unlighted_nodes, light_sources);
-}
-#endif
-
-void VoxelManipulator::spreadLight(enum LightBank bank, v3s16 p,
-		INodeDefManager *nodemgr)
-{
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	VoxelArea voxel_area(p - v3s16(1,1,1), p + v3s16(1,1,1));
-	addArea(voxel_area);
-
-	u32 i = m_area.index(p);
-
-	if(m_flags[i] & VOXELFLAG_NO_DATA)
-		return;
-
-	MapNode &n = m_data[i];
-
-	u8 oldlight = n.getLight(bank, nodemgr);
-	u8 newlight = diminish_light(oldlight);
-
-	// Loop through 6 neighbors
-	for(u16 i=0; i<6; i++)
-	{
-		// Get the position of the neighbor node
-		v3s16 n2pos = p + dirs[i];
-
-		u32 n2i = m_area.index(n2pos);
-
-		if(m_flags[n2i] & VOXELFLAG_NO_DATA)
-			continue;
-
-		MapNode &n2 = m_data[n2i];
-
-		u8 light2 = n2.getLight(bank, nodemgr);
-
-		/*
-			If the neighbor is brighter than the current node,
-			add to list (it will light up this node on its turn)
-		*/
-		if(light2 > undiminish_light(oldlight))
-		{
-			spreadLight(bank, n2pos, nodemgr);
-		}
-		/*
-			If the neighbor is dimmer than how much light this node
-			would spread on it, add to list
-		*/
-		if(light2 < newlight)
-		{
-			if(nodemgr->get(n2).light_propagates)
-			{
-				n2.setLight(bank, newlight, nodemgr);
-				spreadLight(bank, n2pos, nodemgr);
-			}
-		}
+		u32 i;
+		if(nodes.getRef(j->first, i))
+			unlight_from.push(j->second, i);
 	}
-}
-
-#if 0
-/*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
 
-	NOTE: This is faster on small areas but will overflow the
-	      stack on large areas. Thus it is not used.
-*/
-void VoxelManipulator::spreadLight(enum LightBank bank,
-		core::map<v3s16, bool> & from_nodes)
-{
-	if(from_nodes.size() == 0)
-		return;
+	voxalgo::unspreadLight(nodes, bank, nodemgr, unlight_from, relight);
 
-	core::map<v3s16, bool> lighted_nodes;
-	core::map<v3s16, bool>::Iterator j;
-	j = from_nodes.getIterator();
-
-	for(; j.atEnd() == false; j++)
+	for(u8 light = 0; light <= LIGHT_SUN; light++)
 	{
-		v3s16 pos = j.getNode()->getKey();
-
-		spreadLight(bank, pos);
+		const std::vector<u32> &bucket = relight.getBucket(light);
+		for(u32 k = 0; k < bucket.size(); k++)
+			light_sources.insert(nodes.getPosition(bucket[k]));
 	}
 }
-#endif
 
 const MapNode VoxelManipulator::ContentIgnoreNode = MapNode(CONTENT_IGNORE);
 
-#if 1
 /*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
+	Spreads the light of from_nodes to their surroundings; see
+	voxalgo::spreadLight().
 */
 void VoxelManipulator::spreadLight(enum LightBank bank,
 		std::set<v3s16> & from_nodes, INodeDefManager *nodemgr)
 {
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
 	if(from_nodes.empty())
 		return;
 
-	std::set<v3s16> lighted_nodes;
+	voxalgo::VoxelLightNodes nodes(*this, m_area, VOXELFLAG_NO_DATA);
+	voxalgo::LightQueue<u32> light_sources;
 
 	for(std::set<v3s16>::iterator j = from_nodes.begin();
 		j != from_nodes.end(); ++j)
 	{
-		v3s16 pos = *j;
-
-		VoxelArea voxel_area(pos - v3s16(1,1,1), pos + v3s16(1,1,1));
-		addArea(voxel_area);
-
-		u32 i = m_area.index(pos);
-
-		if(m_flags[i] & VOXELFLAG_NO_DATA)
-			continue;
-
-		MapNode &n = m_data[i];
-
-		u8 oldlight = n.getLight(bank, nodemgr);
-		u8 newlight = diminish_light(oldlight);
-
-		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++)
-		{
-			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-
-			try
-			{
-				u32 n2i = m_area.index(n2pos);
-
-				if(m_flags[n2i] & VOXELFLAG_NO_DATA)
-					continue;
-
-				MapNode &n2 = m_data[n2i];
-
-				u8 light2 = n2.getLight(bank, nodemgr);
-
-				/*
-					If the neighbor is brighter than the current node,
-					add to list (it will light up this node on its turn)
-				*/
-				if(light2 > undiminish_light(oldlight))
-				{
-					lighted_nodes.insert(n2pos);
-				}
-				/*
-					If the neighbor is dimmer than how much light this node
-					would spread on it, add to list
-				*/
-				if(light2 < newlight)
-				{
-					if(nodemgr->get(n2).light_propagates)
-					{
-						n2.setLight(bank, newlight, nodemgr);
-						lighted_nodes.insert(n2pos);
-					}
-				}
-			}
-			catch(InvalidPositionException &e)
-			{
-				continue;
-			}
-		}
+		u32 i;
+		if(nodes.getRef(*j, i))
+			light_sources.push(m_data[i].getLight(bank, nodemgr), i);
 	}
 
-	/*dstream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(!lighted_nodes.empty())
-		spreadLight(bank, lighted_nodes, nodemgr);
+	voxalgo::spreadLight(nodes, bank, nodemgr, light_sources);
 }
-#endif
 
 //END
@@ -525,6 +525,15 @@ class VoxelManipulator /*: public NodeContainer*/
 
 	void addArea(const VoxelArea &area);
 
+	/*
+		Makes area the whole area, with no data in it. The node and
+		flag arrays are kept if they are of the right size.
+	*/
+	void resetArea(const VoxelArea &area);
+
+	// Exchanges the area, data and flags with those of other
+	void swap(VoxelManipulator &other);
+
 	/*
 		Copy data and set flags to 0
 		dst_area.getExtent() <= src_area.getExtent()
@@ -542,15 +551,12 @@ class VoxelManipulator /*: public NodeContainer*/
 
 	void clearFlag(u8 flag);
 
-	// TODO: Move to voxelalgorithms.h
+	// Position based wrappers of the ones in voxelalgorithms.h
 
-	void unspreadLight(enum LightBank bank, v3s16 p, u8 oldlight,
-			std::set<v3s16> & light_sources, INodeDefManager *nodemgr);
 	void unspreadLight(enum LightBank bank,
 			std::map<v3s16, u8> & from_nodes,
 			std::set<v3s16> & light_sources, INodeDefManager *nodemgr);
 
-	void spreadLight(enum LightBank bank, v3s16 p, INodeDefManager *nodemgr);
 	void spreadLight(enum LightBank bank,
 			std::set<v3s16> & from_nodes, INodeDefManager *nodemgr);
 
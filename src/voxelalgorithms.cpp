@@ -153,5 +153,82 @@ SunlightPropagateResult propagateSunlight(VoxelManipulator &v, VoxelArea a,
 	return SunlightPropagateResult(bottom_sunlight_valid);
 }
 
-} // namespace voxalgo
+VoxelLightNodes::VoxelLightNodes(VoxelManipulator &v, const VoxelArea &limit,
+		u8 skip_flags):
+	m_data(v.m_data),
+	m_flags(v.m_flags),
+	m_area(v.m_area),
+	m_limit(limit),
+	m_skip_flags(skip_flags)
+{
+	v3s16 em = m_area.getExtent();
+	m_stride_y = em.X;
+	m_stride_z = (u32)em.X * em.Y;
+}
+
+u32 VoxelLightNodes::getNeighbors(Ref i, Ref *neighbors)
+{
+	v3s16 p = getPosition(i);
+	u32 count = 0;
+
+	// In the order of g_6dirs
+	if(p.Z < m_limit.MaxEdge.Z && !isSkipped(i + m_stride_z))
+		neighbors[count++] = i + m_stride_z;
+	if(p.Y < m_limit.MaxEdge.Y && !isSkipped(i + m_stride_y))
+		neighbors[count++] = i + m_stride_y;
+	if(p.X < m_limit.MaxEdge.X && !isSkipped(i + 1))
+		neighbors[count++] = i + 1;
+	if(p.Z > m_limit.MinEdge.Z && !isSkipped(i - m_stride_z))
+		neighbors[count++] = i - m_stride_z;
+	if(p.Y > m_limit.MinEdge.Y && !isSkipped(i - m_stride_y))
+		neighbors[count++] = i - m_stride_y;
+	if(p.X > m_limit.MinEdge.X && !isSkipped(i - 1))
+		neighbors[count++] = i - 1;
+
+	return count;
+}
+
+bool VoxelLightNodes::getRef(v3s16 p, Ref &i)
+{
+	if(!m_limit.contains(p))
+		return false;
+	i = m_area.index(p);
+	return !isSkipped(i);
+}
+
+v3s16 VoxelLightNodes::getPosition(Ref i)
+{
+	s16 z = i / m_stride_z;
+	i -= z * m_stride_z;
+	s16 y = i / m_stride_y;
+	s16 x = i - y * m_stride_y;
+	return m_area.MinEdge + v3s16(x, y, z);
+}
 
+void spreadLight(VoxelManipulator &v, VoxelArea a, enum LightBank bank,
+		INodeDefManager *ndef, enum LightFalloff falloff)
+{
+	VoxelLightNodes nodes(v, a, 0);
+	LightQueue<u32> light_sources;
+
+	for(s32 z=a.MinEdge.Z; z<=a.MaxEdge.Z; z++)
+	for(s32 y=a.MinEdge.Y; y<=a.MaxEdge.Y; y++)
+	{
+		u32 i = v.m_area.index(a.MinEdge.X, y, z);
+		for(s32 x=a.MinEdge.X; x<=a.MaxEdge.X; x++, i++)
+		{
+			const MapNode &n = v.m_data[i];
+			const ContentFeatures &f = ndef->get(n);
+			// Light left in solid nodes doesn't go anywhere
+			if(!f.light_propagates && f.light_source == 0)
+				continue;
+			u8 light = n.getLight(bank, ndef);
+			if(light > 1)
+				light_sources.push(light, i);
+		}
+	}
+
+	spreadLight(nodes, bank, ndef, light_sources, falloff);
+}
+
+} // namespace voxalgo
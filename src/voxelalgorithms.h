@@ -22,14 +22,15 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "voxel.h"
 #include "mapnode.h"
+#include "nodedef.h"
+#include "light.h"
 #include <set>
 #include <map>
+#include <vector>
 
 namespace voxalgo
 {
 
-// TODO: Move unspreadLight and spreadLight from VoxelManipulator to here
-
 void setLight(VoxelManipulator &v, VoxelArea a, u8 light,
 		INodeDefManager *ndef);
 
@@ -52,6 +53,238 @@ SunlightPropagateResult propagateSunlight(VoxelManipulator &v, VoxelArea a,
 		std::set<v3s16> & light_sources,
 		INodeDefManager *ndef);
 
+/*
+	Light propagation
+
+	unspreadLight() and spreadLight() below are breadth-first searches
+	whose frontier is kept in a LightQueue, one bucket per light level.
+	The buckets are emptied brightest first, so a node has its final
+	light the first time it is set and is expanded once.
+
+	Nodes are reached through a Nodes type, which knows where the nodes
+	are stored and which of them may be touched:
+
+		typedef ... Ref;
+		MapNode & get(const Ref &r);
+		// Fills in the neighbours that exist; returns how many there are
+		u32 getNeighbors(const Ref &r, Ref *neighbors);
+		// Called after the light of a node has been changed
+		void setChanged(const Ref &r);
+
+	VoxelLightNodes does this for a VoxelManipulator; Map has its own for
+	nodes in MapBlocks.
+*/
+
+template <typename Ref>
+class LightQueue
+{
+public:
+	LightQueue():
+		m_top(0),
+		m_count(0)
+	{}
+
+	void push(u8 light, const Ref &r)
+	{
+		if (light > LIGHT_SUN)
+			light = LIGHT_SUN;
+		m_buckets[light].push_back(r);
+		if (light > m_top)
+			m_top = light;
+		m_count++;
+	}
+
+	// Takes a node out of the brightest bucket that has any
+	bool pop(u8 &light, Ref &r)
+	{
+		if (m_count == 0)
+			return false;
+		while (m_buckets[m_top].empty())
+			m_top--;
+		light = m_top;
+		r = m_buckets[m_top].back();
+		m_buckets[m_top].pop_back();
+		m_count--;
+		return true;
+	}
+
+	bool empty() const
+	{
+		return m_count == 0;
+	}
+
+	u32 size() const
+	{
+		return m_count;
+	}
+
+	const std::vector<Ref> & getBucket(u8 light) const
+	{
+		return m_buckets[light];
+	}
+
+private:
+	std::vector<Ref> m_buckets[LIGHT_SUN + 1];
+	u8 m_top;
+	u32 m_count;
+};
+
+/*
+	How much light is lost from one node to the next. The map loses one
+	level per node, except that sunlight drops straight to LIGHT_MAX - 1
+	(see diminish_light()). The mapgens take one level off anything.
+*/
+enum LightFalloff
+{
+	LIGHTFALLOFF_MAP,
+	LIGHTFALLOFF_MAPGEN
+};
+
+inline u8 diminishLight(u8 light, enum LightFalloff falloff)
+{
+	if (falloff == LIGHTFALLOFF_MAP)
+		return diminish_light(light);
+	return light > 0 ? light - 1 : 0;
+}
+
+/*
+	Removes the light that came out of the nodes in from_nodes, which are
+	queued at the light they had.
+
+	Neighbours that are dimmer than the light they border on are set
+	dark and unspread in turn. Neighbours that are at least as bright are
+	lit from somewhere else; they are queued into light_sources, as are
+	light sources that were set dark, so that spreadLight() can fill the
+	dark area again.
+*/
+template <typename Nodes>
+void unspreadLight(Nodes &nodes, enum LightBank bank, INodeDefManager *ndef,
+		LightQueue<typename Nodes::Ref> &from_nodes,
+		LightQueue<typename Nodes::Ref> &light_sources)
+{
+	typename Nodes::Ref r;
+	typename Nodes::Ref neighbors[6];
+	u8 oldlight;
+
+	while (from_nodes.pop(oldlight, r)) {
+		u32 count = nodes.getNeighbors(r, neighbors);
+		for (u32 i = 0; i < count; i++) {
+			MapNode &n2 = nodes.get(neighbors[i]);
+			const ContentFeatures &f2 = ndef->get(n2);
+			u8 light2 = n2.getLight(bank, ndef);
+			if (light2 == 0)
+				continue;
+
+			if (light2 >= oldlight || light2 <= f2.light_source) {
+				light_sources.push(light2, neighbors[i]);
+				continue;
+			}
+
+			if (!f2.light_propagates)
+				continue;
+
+			n2.setLight(bank, 0, ndef);
+			nodes.setChanged(neighbors[i]);
+			from_nodes.push(light2, neighbors[i]);
+			if (f2.light_source != 0)
+				light_sources.push(f2.light_source, neighbors[i]);
+		}
+	}
+}
+
+/*
+	Spreads light out of the nodes in light_sources, which are queued at
+	the light they have. A queued node whose light has changed since is
+	skipped; it has been queued again if it got brighter.
+*/
+template <typename Nodes>
+void spreadLight(Nodes &nodes, enum LightBank bank, INodeDefManager *ndef,
+		LightQueue<typename Nodes::Ref> &light_sources,
+		enum LightFalloff falloff = LIGHTFALLOFF_MAP)
+{
+	typename Nodes::Ref r;
+	typename Nodes::Ref neighbors[6];
+	u8 light;
+
+	while (light_sources.pop(light, r)) {
+		u8 current = nodes.get(r).getLight(bank, ndef);
+		if (current != light && !(current > LIGHT_SUN && light == LIGHT_SUN))
+			continue;
+
+		u8 newlight = diminishLight(light, falloff);
+
+		u32 count = nodes.getNeighbors(r, neighbors);
+		for (u32 i = 0; i < count; i++) {
+			MapNode &n2 = nodes.get(neighbors[i]);
+			u8 light2 = n2.getLight(bank, ndef);
+
+			/*
+				If the neighbor would make this node brighter, it has
+				not been spread from; queue it
+			*/
+			if (diminishLight(light2, falloff) > light) {
+				light_sources.push(light2, neighbors[i]);
+				continue;
+			}
+
+			if (light2 < newlight && ndef->get(n2).light_propagates) {
+				n2.setLight(bank, newlight, ndef);
+				nodes.setChanged(neighbors[i]);
+				light_sources.push(newlight, neighbors[i]);
+			}
+		}
+	}
+}
+
+/*
+	The nodes of a VoxelManipulator that are inside limit, addressed by
+	their index in m_data. Nodes with any of skip_flags set are left out.
+*/
+class VoxelLightNodes
+{
+public:
+	typedef u32 Ref;
+
+	VoxelLightNodes(VoxelManipulator &v, const VoxelArea &limit,
+			u8 skip_flags);
+
+	MapNode & get(Ref i)
+	{
+		return m_data[i];
+	}
+
+	u32 getNeighbors(Ref i, Ref *neighbors);
+
+	void setChanged(Ref i)
+	{}
+
+	// Returns false if p is outside the limit or skipped
+	bool getRef(v3s16 p, Ref &i);
+	v3s16 getPosition(Ref i);
+
+private:
+	bool isSkipped(Ref i)
+	{
+		return (m_flags[i] & m_skip_flags) != 0;
+	}
+
+	MapNode *m_data;
+	u8 *m_flags;
+	VoxelArea m_area;
+	VoxelArea m_limit;
+	u8 m_skip_flags;
+	// Index steps in Y and Z
+	u32 m_stride_y;
+	u32 m_stride_z;
+};
+
+/*
+	Spreads the light of every lit node in a, as the mapgens do once the
+	sunlight is in. Light does not go outside a.
+*/
+void spreadLight(VoxelManipulator &v, VoxelArea a, enum LightBank bank,
+		INodeDefManager *ndef, enum LightFalloff falloff);
+
 } // namespace voxalgo
 
 #endif